@@ -0,0 +1,579 @@
+#ifndef ANALYZE_CPP
+
+#include "cpu.cpp"
+#include <stdio.h>
+#include <string.h>
+
+/* How a basic block hands over */
+enum BlockEnd : Byte
+{
+  END_FALL,     // Into the next block, which something else enters too
+  END_BRANCH,   // Conditional branch: taken to Target, else to Next
+  END_JUMP,     // JMP to Target
+  END_CALL,     // JSR to Target, returning to Next
+  END_RETURN,   // RTS or RTI
+  END_INDIRECT, // JMP (ind), target unknown
+  END_INVALID,  // An opcode the core does not execute
+};
+
+/* Static analysis of 6502 code, ahead of running it.
+ *
+ * Decodes by recursive descent from the given entry points with the
+ * variant's opcode table, following branches, jumps and calls, never
+ * data. Every address something branches, jumps or falls into from two
+ * ways starts a basic block. Blocks cost:
+ *
+ * - MinCycles: the base cycles of their instructions, a branch not taken.
+ * - Penalty: what indexed accesses may add, by the rule Execute applies:
+ *   abs,X, abs,Y and (zp),Y take a cycle more when adding the index
+ *   crosses a page. Constant X and Y loaded in the block decide it
+ *   exactly; otherwise abs,I may cross unless the base is page aligned
+ *   and (zp),Y may unless Y is 0. The 65C02's decimal mode cycle counts
+ *   here too.
+ * - Taken: what taking the closing branch adds, 2 when it lands on
+ *   another page than the next instruction.
+ *
+ * Entry points and JSR targets are routines. Their costs run from the
+ * entry to a return, with each callee's own costs at its JSR; a loop body
+ * is counted once, so the longest path is one pass through every loop. A
+ * path ending in JMP (ind), an unknown opcode or recursion is Open: its
+ * costs stop there.
+ *
+ * Everything is in fixed tables over the 64K address space; a whole
+ * image decodes in a few milliseconds. Large: allocate it, not on the
+ * stack.
+ */
+struct CodeAnalysis
+{
+  static constexpr Uint32 NONE = 0xFFFFFFFF;
+  static constexpr Uint32 NEVER = 0xFFFFFFFF; // No path reaches a return
+
+  struct Block
+  {
+    Word Start;
+    Word Last;          // Address of the last instruction
+    Uint32 Instructions;
+    Uint32 MinCycles;   // Every penalty avoided, branch not taken
+    Uint32 Penalty;     // Page crossings and decimal mode may add this
+    Uint32 Taken;       // Taking the closing branch adds this
+    Uint32 Crossings;   // Indexed accesses that may cross a page
+    Uint32 Next;        // Block falling through or returned to, or NONE
+    Uint32 Target;      // Block branched, jumped or called to, or NONE
+    BlockEnd End;
+
+    Uint32 MaxCycles () const { return MinCycles + Penalty + Taken; }
+  };
+
+  struct Routine
+  {
+    Word Entry;
+    Uint32 Block;
+    Uint32 MinCycles; // Shortest path to a return, or NEVER
+    Uint32 MaxCycles; // Longest, each loop once
+    bool Loops;       // It has a loop: MaxCycles is per pass
+    bool Open;        // Some path leaves the analysis
+    bool Settled;
+  };
+
+  Block Blocks[0x10000];
+  Uint32 BlockCount = 0;
+  Routine Routines[0x10000];
+  Uint32 RoutineCount = 0;
+  Uint32 BlockAt[0x10000];   // Block starting at an address, or NONE
+  Uint32 RoutineAt[0x10000]; // Routine entered at an address, or NONE
+
+  /** Analyzes the code reachable from Entries in memory as it is now */
+  template <typename Variant = MOS6510>
+  void
+  Analyze (const Memory &memory, const Word *Entries, Uint32 Count)
+  {
+    static constexpr OpcodeTable Table = MakeOpcodeTable<Variant> ();
+    Ops = &Table;
+    Mem = &memory;
+    memset (Mark, 0, sizeof (Mark));
+    memset (BlockAt, 0xFF, sizeof (BlockAt));
+    memset (RoutineAt, 0xFF, sizeof (RoutineAt));
+    BlockCount = RoutineCount = 0;
+    Pending = 0;
+
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        AddRoutine (Entries[i]);
+      }
+    while (Pending > 0)
+      {
+        Decode (Work[--Pending]);
+      }
+
+    // Number the blocks in address order, then build them
+    for (Uint32 Address = 0; Address < 0x10000; Address++)
+      {
+        if (Mark[Address] & MARK_LEADER)
+          {
+            BlockAt[Address] = BlockCount++;
+          }
+      }
+    for (Uint32 Address = 0; Address < 0x10000; Address++)
+      {
+        if (Mark[Address] & MARK_LEADER)
+          {
+            Build (Blocks[BlockAt[Address]], Address);
+          }
+      }
+    for (Uint32 r = 0; r < RoutineCount; r++)
+      {
+        Routines[r].Block = BlockAt[Routines[r].Entry];
+      }
+    MeasureRoutines ();
+  }
+
+  /** Routines with their costs, each followed by its blocks */
+  void
+  Print (FILE *Out) const
+  {
+    for (Uint32 r = 0; r < RoutineCount; r++)
+      {
+        const Routine &R = Routines[r];
+        if (R.MinCycles == NEVER)
+          {
+            fprintf (Out, "routine $%04X: never returns", R.Entry);
+          }
+        else
+          {
+            fprintf (Out, "routine $%04X: %u..%u cycles", R.Entry,
+                     R.MinCycles, R.MaxCycles);
+          }
+        fprintf (Out, "%s%s\n", R.Loops ? ", loops (longest is one pass)" : "",
+                 R.Open ? ", open" : "");
+      }
+    static const char *ENDS[]
+        = { "falls", "branches", "jumps", "calls", "returns", "indirect",
+            "invalid" };
+    for (Uint32 b = 0; b < BlockCount; b++)
+      {
+        const Block &B = Blocks[b];
+        fprintf (Out, "  $%04X-$%04X %3u ins %4u..%-4u cycles %-8s",
+                 B.Start, B.Last, B.Instructions, B.MinCycles,
+                 B.MaxCycles (), ENDS[B.End]);
+        if (B.Target != NONE)
+          {
+            fprintf (Out, " $%04X", Blocks[B.Target].Start);
+          }
+        if (B.Crossings)
+          {
+            fprintf (Out, ", %u indexed may cross", B.Crossings);
+          }
+        if (B.End == END_BRANCH && B.Taken == 2)
+          {
+            fprintf (Out, ", branch crosses a page");
+          }
+        fprintf (Out, "\n");
+      }
+  }
+
+private:
+  static constexpr Byte MARK_CODE = 0x01;   // An instruction starts here
+  static constexpr Byte MARK_LEADER = 0x02; // A block starts here
+
+  static constexpr Byte PHASE_OPEN = 1; // On the search stack
+  static constexpr Byte PHASE_DONE = 2;
+
+  const OpcodeTable *Ops = nullptr;
+  const Memory *Mem = nullptr;
+  Byte Mark[0x10000];
+  Word Work[0x10000]; // Leaders waiting to be decoded
+  Uint32 Pending = 0;
+
+  // Path search, per block; Seen holds the stamp of the last search
+  Uint32 Seen[0x10000];
+  Byte Phase[0x10000];
+  Byte Edge[0x10000]; // Successors visited so far
+  Uint32 ToMin[0x10000];
+  Uint32 ToMax[0x10000];
+  Uint32 Stack[0x10000];
+  Uint32 Stamp = 0;
+
+  // Routines being settled, callers first
+  Uint32 Calls[0x10000];
+  bool Calling[0x10000];
+  Uint32 Blocker = 0;
+
+  Word
+  OperandWord (Word Address) const
+  {
+    return Mem->Fetch (Address + 1) | (Mem->Fetch ((Word)(Address + 2)) << 8);
+  }
+
+  void
+  AddLeader (Word Address)
+  {
+    if (!(Mark[Address] & MARK_LEADER))
+      {
+        Mark[Address] |= MARK_LEADER;
+        Work[Pending++] = Address;
+      }
+  }
+
+  void
+  AddRoutine (Word Entry)
+  {
+    if (RoutineAt[Entry] == NONE)
+      {
+        RoutineAt[Entry] = RoutineCount;
+        Routines[RoutineCount++] = { Entry, NONE, 0, 0, false, false, false };
+      }
+    AddLeader (Entry);
+  }
+
+  /** Marks instructions from a leader up to the end of its flow */
+  void
+  Decode (Word At)
+  {
+    if (Mark[At] & MARK_CODE)
+      {
+        return;
+      }
+    for (;;)
+      {
+        Mark[At] |= MARK_CODE;
+        Byte Opcode = Mem->Fetch (At);
+        const OpcodeInfo &Info = (*Ops)[Opcode];
+        if (Info.Bytes == 0)
+          {
+            return;
+          }
+        Word Next = At + Info.Bytes;
+        if (Info.Mode == AM_REL)
+          {
+            AddLeader (Next + (Sint8)Mem->Fetch (At + 1));
+            AddLeader (Next);
+            return;
+          }
+        if (Opcode == INS_JSR)
+          {
+            AddRoutine (OperandWord (At));
+            AddLeader (Next);
+            return;
+          }
+        if (Opcode == INS_JMP_ABS)
+          {
+            AddLeader (OperandWord (At));
+            return;
+          }
+        if (Info.Flags & OP_FLOW)
+          {
+            return;
+          }
+        if (Mark[Next] & MARK_CODE)
+          {
+            // Joins code decoded before: two ways in
+            Mark[Next] |= MARK_LEADER;
+            return;
+          }
+        At = Next;
+      }
+  }
+
+  /** May adding the index to the base cross a page? */
+  static bool
+  MayCross (Word Base, bool Known, Byte Index)
+  {
+    if (Known)
+      {
+        return ((Base + Index) ^ Base) & 0xFF00;
+      }
+    return (Base & 0xFF) != 0;
+  }
+
+  void
+  Build (Block &B, Word Start)
+  {
+    B = { Start, Start, 0, 0, 0, 0, 0, NONE, NONE, END_INVALID };
+    bool KnownX = false, KnownY = false;
+    Byte X = 0, Y = 0;
+    Word At = Start;
+    for (;;)
+      {
+        Byte Opcode = Mem->Fetch (At);
+        const OpcodeInfo &Info = (*Ops)[Opcode];
+        if (Info.Bytes == 0)
+          {
+            B.End = END_INVALID;
+            return;
+          }
+        B.Last = At;
+        B.Instructions++;
+        B.MinCycles += Info.Cycles;
+        Word Next = At + Info.Bytes;
+
+        if (Info.Flags & OP_DECIMAL)
+          {
+            B.Penalty++;
+          }
+        if (Info.Flags & OP_PAGE_CROSS && Info.Mode != AM_REL)
+          {
+            Word Base = OperandWord (At);
+            bool Cross = Info.Mode == AM_ABX   ? MayCross (Base, KnownX, X)
+                         : Info.Mode == AM_ABY ? MayCross (Base, KnownY, Y)
+                                               : !KnownY || Y != 0;
+            B.Penalty += Cross;
+            B.Crossings += Cross;
+          }
+
+        // Track constant indexes through the block
+        switch (Opcode)
+          {
+          case INS_LDX_IM:
+            KnownX = true;
+            X = Mem->Fetch (At + 1);
+            break;
+          case INS_LDY_IM:
+            KnownY = true;
+            Y = Mem->Fetch (At + 1);
+            break;
+          case INS_INX:
+            X++;
+            break;
+          case INS_DEX:
+            X--;
+            break;
+          case INS_INY:
+            Y++;
+            break;
+          case INS_DEY:
+            Y--;
+            break;
+          case INS_LDX_ZP:
+          case INS_LDX_ZPY:
+          case INS_LDX_ABS:
+          case INS_LDX_ABY:
+            KnownX = false;
+            break;
+          case INS_LAX_ZP:
+          case INS_LAX_ABS:
+            if (Info.Flags & OP_UNDOCUMENTED) // NOPs on CMOS
+              {
+                KnownX = false;
+              }
+            break;
+          case INS_LDY_ZP:
+          case INS_LDY_ZPX:
+          case INS_LDY_ABS:
+          case INS_LDY_ABX:
+            KnownY = false;
+            break;
+          }
+
+        if (Info.Mode == AM_REL)
+          {
+            Word To = Next + (Sint8)Mem->Fetch (At + 1);
+            B.End = END_BRANCH;
+            B.Taken = ((To ^ Next) & 0xFF00) ? 2 : 1;
+            B.Target = BlockAt[To];
+            B.Next = BlockAt[Next];
+            return;
+          }
+        if (Opcode == INS_JSR || Opcode == INS_JMP_ABS)
+          {
+            B.End = Opcode == INS_JSR ? END_CALL : END_JUMP;
+            B.Target = BlockAt[OperandWord (At)];
+            B.Next = Opcode == INS_JSR ? BlockAt[Next] : NONE;
+            return;
+          }
+        if (Info.Flags & OP_FLOW)
+          {
+            bool Return = Opcode == INS_RTS || Opcode == INS_RTI;
+            B.End = Return ? END_RETURN : END_INDIRECT;
+            return;
+          }
+        if (Mark[Next] & MARK_LEADER)
+          {
+            B.End = END_FALL;
+            B.Next = BlockAt[Next];
+            return;
+          }
+        At = Next;
+      }
+  }
+
+  /** Settles every routine after its callees, walking the call graph
+   * depth first; a call back into a routine still being settled is
+   * recursion, and makes the caller open */
+  void
+  MeasureRoutines ()
+  {
+    memset (Seen, 0, sizeof (Seen));
+    memset (Calling, 0, sizeof (Calling));
+    Stamp = 0;
+    for (Uint32 r = 0; r < RoutineCount; r++)
+      {
+        Uint32 Depth = 0;
+        if (!Routines[r].Settled)
+          {
+            Calls[Depth++] = r;
+            Calling[r] = true;
+          }
+        while (Depth > 0)
+          {
+            Uint32 t = Calls[Depth - 1];
+            if (Measure (Routines[t]))
+              {
+                Routines[t].Settled = true;
+                Calling[t] = false;
+                Depth--;
+              }
+            else
+              {
+                Calls[Depth++] = Blocker;
+                Calling[Blocker] = true;
+              }
+          }
+      }
+  }
+
+  /** Successor i of block b with the cycles from entering b to entering
+   * it; false past the last */
+  bool
+  Successor (Uint32 b, Uint32 i, Uint32 &To, Uint32 &Min, Uint32 &Max)
+  {
+    const Block &B = Blocks[b];
+    Min = B.MinCycles;
+    Max = B.MinCycles + B.Penalty;
+    switch (B.End)
+      {
+      case END_BRANCH:
+        To = i == 0 ? B.Next : B.Target;
+        if (i == 1)
+          {
+            Min += B.Taken;
+            Max += B.Taken;
+          }
+        return i < 2;
+      case END_FALL:
+      case END_CALL:
+        To = B.Next;
+        return i == 0;
+      case END_JUMP:
+        To = B.Target;
+        return i == 0;
+      default:
+        return false;
+      }
+  }
+
+  /** Shortest and longest path from the routine's entry to a return,
+   * back edges left out. Gives up on meeting a callee to settle first,
+   * leaving it in Blocker. */
+  bool
+  Measure (Routine &R)
+  {
+    Stamp++;
+    R.Loops = R.Open = false;
+    Uint32 Depth = 0;
+    Push (R.Block, Depth);
+    while (Depth > 0)
+      {
+        Uint32 b = Stack[Depth - 1];
+        Uint32 To, Min, Max;
+        if (Successor (b, Edge[b], To, Min, Max))
+          {
+            Edge[b]++;
+            if (To == NONE)
+              {
+                continue;
+              }
+            if (Seen[To] != Stamp)
+              {
+                Push (To, Depth);
+              }
+            else if (Phase[To] == PHASE_OPEN)
+              {
+                R.Loops = true;
+              }
+            continue;
+          }
+        if (!Finish (R, b))
+          {
+            return false;
+          }
+        Phase[b] = PHASE_DONE;
+        Depth--;
+      }
+    R.MinCycles = ToMin[R.Block];
+    R.MaxCycles = ToMin[R.Block] == NEVER ? 0 : ToMax[R.Block];
+    return true;
+  }
+
+  void
+  Push (Uint32 b, Uint32 &Depth)
+  {
+    Seen[b] = Stamp;
+    Phase[b] = PHASE_OPEN;
+    Edge[b] = 0;
+    Stack[Depth++] = b;
+  }
+
+  /** Costs from block b to a return, from its finished successors */
+  bool
+  Finish (Routine &R, Uint32 b)
+  {
+    const Block &B = Blocks[b];
+    Uint32 CallMin = 0, CallMax = 0;
+    if (B.End == END_CALL)
+      {
+        Uint32 c = RoutineAt[Blocks[B.Target].Start];
+        const Routine *Callee = &Routines[c];
+        if (Calling[c])
+          {
+            R.Open = true; // Recursion: the call costs its JSR only
+          }
+        else if (!Callee->Settled)
+          {
+            Blocker = c;
+            return false;
+          }
+        else if (Callee->MinCycles == NEVER)
+          {
+            ToMin[b] = NEVER;
+            ToMax[b] = 0;
+            return true;
+          }
+        else
+          {
+            CallMin = Callee->MinCycles;
+            CallMax = Callee->MaxCycles;
+            R.Loops |= Callee->Loops;
+            R.Open |= Callee->Open;
+          }
+      }
+    if (B.End == END_RETURN || B.End == END_INDIRECT || B.End == END_INVALID)
+      {
+        R.Open |= B.End != END_RETURN;
+        ToMin[b] = B.MinCycles;
+        ToMax[b] = B.MinCycles + B.Penalty;
+        return true;
+      }
+    ToMin[b] = NEVER;
+    ToMax[b] = 0;
+    Uint32 To, Min, Max;
+    for (Uint32 i = 0; Successor (b, i, To, Min, Max); i++)
+      {
+        if (To == NONE || Phase[To] != PHASE_DONE || ToMin[To] == NEVER)
+          {
+            continue; // A back edge, or no way out
+          }
+        if (CallMin + Min + ToMin[To] < ToMin[b])
+          {
+            ToMin[b] = CallMin + Min + ToMin[To];
+          }
+        if (CallMax + Max + ToMax[To] > ToMax[b])
+          {
+            ToMax[b] = CallMax + Max + ToMax[To];
+          }
+      }
+    return true;
+  }
+};
+
+#define ANALYZE_CPP
+#endif // !ANALYZE_CPP
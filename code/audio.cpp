@@ -0,0 +1,129 @@
+#ifndef AUDIO_CPP
+
+#include "cpu.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Receives audio in blocks of samples in [-1, 1] */
+typedef void (*AudioSink) (void *Context, const float *Samples, Uint32 Count);
+
+/* 16-bit mono PCM WAV file. The sizes in the header are filled in when
+ * the file is closed. */
+struct WavWriter
+{
+  FILE *File = nullptr;
+  Uint32 Rate = 0;
+  Uint32 Samples = 0; // Written so far
+
+  ~WavWriter () { Close (); }
+
+  bool
+  Open (const char *Path, Uint32 SampleRate)
+  {
+    Close ();
+    File = fopen (Path, "wb");
+    if (!File)
+      {
+        return false;
+      }
+    Rate = SampleRate;
+    Samples = 0;
+    return WriteHeader ();
+  }
+
+  bool
+  Write (const Sint16 *Data, Uint32 Count)
+  {
+    // WAV is little endian, like every host this runs on
+    if (!File || fwrite (Data, sizeof (Sint16), Count, File) != Count)
+      {
+        return false;
+      }
+    Samples += Count;
+    return true;
+  }
+
+  /** Converts to 16 bits, clipping */
+  bool
+  Write (const float *Data, Uint32 Count)
+  {
+    Sint16 Converted[256];
+    while (Count)
+      {
+        Uint32 Chunk = Count < 256 ? Count : 256;
+        for (Uint32 i = 0; i < Chunk; i++)
+          {
+            float Value = Data[i] > 1.0f    ? 1.0f
+                          : Data[i] < -1.0f ? -1.0f
+                                            : Data[i];
+            Converted[i] = (Sint16)lrintf (Value * 32767.0f);
+          }
+        if (!Write (Converted, Chunk))
+          {
+            return false;
+          }
+        Data += Chunk;
+        Count -= Chunk;
+      }
+    return true;
+  }
+
+  /** AudioSink; Context is the writer */
+  static void
+  Sink (void *Context, const float *Samples, Uint32 Count)
+  {
+    ((WavWriter *)Context)->Write (Samples, Count);
+  }
+
+  bool
+  Close ()
+  {
+    if (!File)
+      {
+        return true;
+      }
+    bool Ok = fseek (File, 0, SEEK_SET) == 0 && WriteHeader ();
+    Ok = fclose (File) == 0 && Ok;
+    File = nullptr;
+    return Ok;
+  }
+
+private:
+  static void
+  Put16 (Byte *At, Uint32 Value)
+  {
+    At[0] = Value & 0xFF;
+    At[1] = (Value >> 8) & 0xFF;
+  }
+
+  static void
+  Put32 (Byte *At, Uint32 Value)
+  {
+    Put16 (At, Value & 0xFFFF);
+    Put16 (At + 2, Value >> 16);
+  }
+
+  bool
+  WriteHeader ()
+  {
+    Uint32 DataBytes = Samples * sizeof (Sint16);
+    Byte Header[44];
+    memcpy (Header, "RIFF", 4);
+    Put32 (Header + 4, 36 + DataBytes);
+    memcpy (Header + 8, "WAVEfmt ", 8);
+    Put32 (Header + 16, 16);      // Format chunk size
+    Put16 (Header + 20, 1);       // PCM
+    Put16 (Header + 22, 1);       // Channels
+    Put32 (Header + 24, Rate);
+    Put32 (Header + 28, Rate * 2); // Bytes per second
+    Put16 (Header + 32, 2);       // Bytes per frame
+    Put16 (Header + 34, 16);      // Bits per sample
+    memcpy (Header + 36, "data", 4);
+    Put32 (Header + 40, DataBytes);
+    return fwrite (Header, 1, sizeof (Header), File) == sizeof (Header);
+  }
+};
+
+#define AUDIO_CPP
+#endif // !AUDIO_CPP
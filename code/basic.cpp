@@ -0,0 +1,270 @@
+#ifndef BASIC_CPP
+
+#include "cpu.cpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* BASIC V2 programs and keystrokes, straight into memory.
+ *
+ * InjectBasic tokenizes program text on the host as the editor's CRUNCH
+ * routine would and stores it at $0801 with the pointers a LOAD and CLR
+ * leave; TypeKeys queues keystrokes in the KERNAL keyboard buffer. Both
+ * replace typing through the keyboard matrix, which takes the emulated
+ * machine seconds.
+ *
+ * Text is ASCII. Letters of either case become the unshifted PETSCII
+ * letters, which read as upper case after power on, and '\n' is RETURN.
+ */
+static constexpr Word BASIC_START = 0x0801;
+static constexpr Word BASIC_TXTTAB = 0x2B; // Start of the program
+static constexpr Word BASIC_VARTAB = 0x2D; // Start of variables, its end
+static constexpr Word BASIC_ARYTAB = 0x2F; // Start of arrays
+static constexpr Word BASIC_STREND = 0x31; // End of arrays
+static constexpr Word BASIC_END = 0xA000;  // First byte past BASIC RAM
+static constexpr Word KEYBOARD_BUFFER = 0x0277;
+static constexpr Word KEYBOARD_COUNT = 0xC6;
+static constexpr Uint32 KEYBOARD_SIZE = 10; // What the KERNAL sets XMAX to
+
+static constexpr Byte TOKEN_DATA = 0x83;
+static constexpr Byte TOKEN_REM = 0x8F;
+static constexpr Byte TOKEN_PRINT = 0x99;
+
+/* Keywords from token $80 on, in the ROM's order: CRUNCH takes the first
+ * that matches, which is why INPUT# comes before INPUT and GO after GOTO */
+static const char *const BASIC_KEYWORDS[] = {
+  "END",  "FOR",   "NEXT",   "DATA", "INPUT#", "INPUT", "DIM",  "READ",
+  "LET",  "GOTO",  "RUN",    "IF",   "RESTORE", "GOSUB", "RETURN", "REM",
+  "STOP", "ON",    "WAIT",   "LOAD", "SAVE",  "VERIFY", "DEF",  "POKE",
+  "PRINT#", "PRINT", "CONT", "LIST", "CLR",   "CMD",   "SYS",  "OPEN",
+  "CLOSE", "GET",  "NEW",    "TAB(", "TO",    "FN",    "SPC(", "THEN",
+  "NOT",  "STEP",  "+",      "-",    "*",     "/",     "^",    "AND",
+  "OR",   ">",     "=",      "<",    "SGN",   "INT",   "ABS",  "USR",
+  "FRE",  "POS",   "SQR",    "RND",  "LOG",   "EXP",   "COS",  "SIN",
+  "TAN",  "ATN",   "PEEK",   "LEN",  "STR$",  "VAL",   "ASC",  "CHR$",
+  "LEFT$", "RIGHT$", "MID$", "GO",
+};
+
+/** One ASCII character as typed: letters unshifted, '\n' RETURN */
+static Byte
+AsciiToPetscii (char Character)
+{
+  if (Character >= 'a' && Character <= 'z')
+    {
+      return Character - 'a' + 'A';
+    }
+  if (Character == '\n')
+    {
+      return 0x0D;
+    }
+  return (Byte)Character;
+}
+
+/** The token of the keyword Line starts with, and its length; 0 if none */
+static Byte
+MatchKeyword (const char *Line, Uint32 &Length)
+{
+  for (Uint32 k = 0; k < sizeof (BASIC_KEYWORDS) / sizeof (char *); k++)
+    {
+      const char *Keyword = BASIC_KEYWORDS[k];
+      Uint32 i = 0;
+      while (Keyword[i] && AsciiToPetscii (Line[i]) == (Byte)Keyword[i])
+        {
+          i++;
+        }
+      if (Keyword[i] == 0)
+        {
+          Length = i;
+          return 0x80 + k;
+        }
+    }
+  return 0;
+}
+
+/** Tokenizes program text, one numbered line per text line, into Out as
+ * the linked lines BASIC keeps from Start on, with the closing null
+ * link. Lines must be numbered 0 to 63999 in increasing order; blank
+ * lines are skipped. Sets Length to the bytes written. */
+static bool
+TokenizeBasic (const char *Text, Word Start, Byte *Out, Uint32 Capacity,
+               Uint32 &Length)
+{
+  Uint32 At = 0;
+  long Previous = -1;
+  while (*Text)
+    {
+      const char *End = strchr (Text, '\n');
+      if (!End)
+        {
+          End = Text + strlen (Text);
+        }
+      while (Text < End && *Text == ' ')
+        {
+          Text++;
+        }
+      if (Text == End)
+        {
+          Text = *End ? End + 1 : End;
+          continue;
+        }
+      char *Digits;
+      long Number = strtol (Text, &Digits, 10);
+      if (Digits == Text || Number <= Previous || Number > 63999)
+        {
+          return false;
+        }
+      Previous = Number;
+      Text = Digits;
+      while (Text < End && *Text == ' ')
+        {
+          Text++;
+        }
+
+      // Link (filled in below), line number, then the tokens
+      Uint32 Line = At;
+      if (At + 4 > Capacity)
+        {
+          return false;
+        }
+      Out[At + 2] = Number & 0xFF;
+      Out[At + 3] = Number >> 8;
+      At += 4;
+      bool Quoted = false;
+      bool Data = false;
+      bool Remark = false;
+      while (Text < End)
+        {
+          if (At + 1 > Capacity)
+            {
+              return false;
+            }
+          if (*Text == '\r')
+            {
+              Text++; // Of a CR LF line end
+              continue;
+            }
+          Byte Character = AsciiToPetscii (*Text);
+          Uint32 Matched = 0;
+          Byte Token = 0;
+          if (Character == '"')
+            {
+              Quoted = !Quoted;
+            }
+          else if (Character == ':' && !Quoted)
+            {
+              Data = false;
+            }
+          else if (Character == '?' && !Quoted && !Data && !Remark)
+            {
+              Token = TOKEN_PRINT;
+              Matched = 1;
+            }
+          else if (!Quoted && !Data && !Remark
+                   && (Character < '0' || Character > ';'))
+            {
+              Token = MatchKeyword (Text, Matched);
+            }
+          if (Token)
+            {
+              Out[At++] = Token;
+              Text += Matched;
+              Data = Token == TOKEN_DATA;
+              Remark = Token == TOKEN_REM;
+              continue;
+            }
+          Out[At++] = Character;
+          Text++;
+        }
+      if (At + 1 > Capacity)
+        {
+          return false;
+        }
+      Out[At++] = 0;
+      Word Next = Start + At;
+      Out[Line] = Next & 0xFF;
+      Out[Line + 1] = Next >> 8;
+      Text = *End ? End + 1 : End;
+    }
+  if (At + 2 > Capacity)
+    {
+      return false;
+    }
+  Out[At++] = 0;
+  Out[At++] = 0;
+  Length = At;
+  return true;
+}
+
+/** Stores a tokenized program at $0801 and points TXTTAB there and
+ * VARTAB, ARYTAB and STREND past it, as LOAD then CLR would. End is set
+ * to where the program ends. */
+static bool
+InjectBasic (Memory &memory, const char *Text, Word &End)
+{
+  const Uint32 Capacity = BASIC_END - BASIC_START;
+  Byte *Program = new Byte[Capacity];
+  Uint32 Length;
+  bool Ok = TokenizeBasic (Text, BASIC_START, Program, Capacity, Length);
+  if (Ok)
+    {
+      memory.Copy (BASIC_START, Program, Length);
+    }
+  delete[] Program;
+  if (!Ok)
+    {
+      return false;
+    }
+  End = BASIC_START + Length;
+  const Word Pointers[] = { BASIC_TXTTAB, BASIC_VARTAB, BASIC_ARYTAB,
+                            BASIC_STREND };
+  for (Word Pointer : Pointers)
+    {
+      Word Value = Pointer == BASIC_TXTTAB ? BASIC_START : End;
+      memory.Poke (Pointer, Value & 0xFF);
+      memory.Poke (Pointer + 1, Value >> 8);
+    }
+  return true;
+}
+
+/** InjectBasic with the program text read from a file */
+static bool
+LoadBasic (Memory &memory, const char *Path, Word &End)
+{
+  static constexpr Uint32 MAX_TEXT = 256 * 1024;
+  FILE *File = fopen (Path, "r");
+  if (!File)
+    {
+      return false;
+    }
+  char *Text = new char[MAX_TEXT + 1];
+  size_t Length = fread (Text, 1, MAX_TEXT + 1, File);
+  fclose (File);
+  bool Ok = Length <= MAX_TEXT;
+  if (Ok)
+    {
+      Text[Length] = 0;
+      Ok = InjectBasic (memory, Text, End);
+    }
+  delete[] Text;
+  return Ok;
+}
+
+/** Queues keystrokes behind those already in the KERNAL keyboard
+ * buffer, as many as it has room for. Returns how many were queued; the
+ * rest can follow once the KERNAL has taken some. */
+static Uint32
+TypeKeys (Memory &memory, const char *Text)
+{
+  Uint32 Count = memory[KEYBOARD_COUNT];
+  Uint32 Queued = 0;
+  while (Count < KEYBOARD_SIZE && Text[Queued])
+    {
+      memory.Poke (KEYBOARD_BUFFER + Count++, AsciiToPetscii (Text[Queued]));
+      Queued++;
+    }
+  memory.Poke (KEYBOARD_COUNT, Count);
+  return Queued;
+}
+
+#define BASIC_CPP
+#endif // !BASIC_CPP
@@ -0,0 +1,360 @@
+#ifndef CAPTURE_CPP
+
+#include "ring.cpp"
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+
+/* Frame hashes and video capture, for runs without a display.
+ *
+ * FrameHash is XXH64: 32 bytes at a time go to four independent 64-bit
+ * lanes, so a frame hashes at several bytes per cycle with no table
+ * lookups, and the result matches other XXH64 implementations. Tests
+ * compare one hash per frame instead of images.
+ *
+ * Y4mWriter captures frames to a YUV4MPEG2 file on a thread of its own.
+ * The emulation thread copies each frame into a free slot of a small
+ * queue and goes on; the writer converts and writes the slots in order
+ * and hands them back. With no slot free the frame is dropped and
+ * counted, so a slow disk costs frames, never emulation time.
+ */
+struct FrameHash
+{
+  FrameHash () { Reset (); }
+
+  void
+  Reset (Uint64 Seed = 0)
+  {
+    Lanes[0] = Seed + PRIME1 + PRIME2;
+    Lanes[1] = Seed + PRIME2;
+    Lanes[2] = Seed;
+    Lanes[3] = Seed - PRIME1;
+    this->Seed = Seed;
+    Length = 0;
+    Buffered = 0;
+  }
+
+  void
+  Update (const void *Data, size_t Size)
+  {
+    const Byte *In = (const Byte *)Data;
+    Length += Size;
+    if (Buffered + Size < STRIPE)
+      {
+        memcpy (Buffer + Buffered, In, Size);
+        Buffered += Size;
+        return;
+      }
+    if (Buffered)
+      {
+        Uint32 Fill = STRIPE - Buffered;
+        memcpy (Buffer + Buffered, In, Fill);
+        Stripe (Buffer);
+        In += Fill;
+        Size -= Fill;
+        Buffered = 0;
+      }
+    for (; Size >= STRIPE; In += STRIPE, Size -= STRIPE)
+      {
+        Stripe (In);
+      }
+    memcpy (Buffer, In, Size);
+    Buffered = Size;
+  }
+
+  /** The hash of everything since Reset; more can follow */
+  Uint64
+  Digest () const
+  {
+    Uint64 H;
+    if (Length >= STRIPE)
+      {
+        H = Rotate (Lanes[0], 1) + Rotate (Lanes[1], 7)
+            + Rotate (Lanes[2], 12) + Rotate (Lanes[3], 18);
+        for (Uint32 i = 0; i < 4; i++)
+          {
+            H = (H ^ Round (0, Lanes[i])) * PRIME1 + PRIME4;
+          }
+      }
+    else
+      {
+        H = Seed + PRIME5;
+      }
+    H += Length;
+
+    const Byte *In = Buffer;
+    Uint32 Left = Buffered;
+    for (; Left >= 8; In += 8, Left -= 8)
+      {
+        H ^= Round (0, Load64 (In));
+        H = Rotate (H, 27) * PRIME1 + PRIME4;
+      }
+    if (Left >= 4)
+      {
+        H ^= Load32 (In) * PRIME1;
+        H = Rotate (H, 23) * PRIME2 + PRIME3;
+        In += 4;
+        Left -= 4;
+      }
+    for (; Left > 0; In++, Left--)
+      {
+        H ^= *In * PRIME5;
+        H = Rotate (H, 11) * PRIME1;
+      }
+
+    H ^= H >> 33;
+    H *= PRIME2;
+    H ^= H >> 29;
+    H *= PRIME3;
+    H ^= H >> 32;
+    return H;
+  }
+
+  static Uint64
+  Of (const void *Data, size_t Size, Uint64 Seed = 0)
+  {
+    FrameHash Hash;
+    Hash.Reset (Seed);
+    Hash.Update (Data, Size);
+    return Hash.Digest ();
+  }
+
+private:
+  static constexpr Uint64 PRIME1 = 0x9E3779B185EBCA87ull;
+  static constexpr Uint64 PRIME2 = 0xC2B2AE3D27D4EB4Full;
+  static constexpr Uint64 PRIME3 = 0x165667B19E3779F9ull;
+  static constexpr Uint64 PRIME4 = 0x85EBCA77C2B2AE63ull;
+  static constexpr Uint64 PRIME5 = 0x27D4EB2F165667C5ull;
+  static constexpr Uint32 STRIPE = 32;
+
+  Uint64 Lanes[4];
+  Uint64 Seed;
+  Uint64 Length;
+  Byte Buffer[STRIPE];
+  Uint32 Buffered;
+
+  static Uint64
+  Rotate (Uint64 Value, Uint32 Bits)
+  {
+    return (Value << Bits) | (Value >> (64 - Bits));
+  }
+
+  static Uint64
+  Round (Uint64 Lane, Uint64 Input)
+  {
+    return Rotate (Lane + Input * PRIME2, 31) * PRIME1;
+  }
+
+  // Little endian, like every host this runs on
+  static Uint64
+  Load64 (const Byte *In)
+  {
+    Uint64 Value;
+    memcpy (&Value, In, 8);
+    return Value;
+  }
+
+  static Uint64
+  Load32 (const Byte *In)
+  {
+    Uint32 Value;
+    memcpy (&Value, In, 4);
+    return Value;
+  }
+
+  void
+  Stripe (const Byte *In)
+  {
+    for (Uint32 i = 0; i < 4; i++)
+      {
+        Lanes[i] = Round (Lanes[i], Load64 (In + 8 * i));
+      }
+  }
+};
+
+/* One line per frame: its number and hash in hex */
+struct FrameHashLog
+{
+  FILE *File = nullptr;
+
+  ~FrameHashLog () { Close (); }
+
+  bool
+  Open (const char *Path)
+  {
+    Close ();
+    File = fopen (Path, "w");
+    return File != nullptr;
+  }
+
+  void
+  Write (Uint64 Frame, Uint64 Hash)
+  {
+    fprintf (File, "%llu %016llx\n", (unsigned long long)Frame,
+             (unsigned long long)Hash);
+  }
+
+  bool
+  Close ()
+  {
+    if (!File)
+      {
+        return true;
+      }
+    bool Ok = fclose (File) == 0;
+    File = nullptr;
+    return Ok;
+  }
+};
+
+/* 4:4:4 YUV4MPEG2 of 0xAARRGGBB frames, written on its own thread */
+struct Y4mWriter
+{
+  static constexpr Uint32 QUEUE_FRAMES = 8; // Must be a power of two
+
+  Uint64 Dropped = 0; // Frames the queue had no room for
+
+  ~Y4mWriter () { Close (); }
+
+  /** Writes the header and starts the writer thread. The frame rate is
+   * Rate / Per, e.g. the clock over the cycles per frame. */
+  bool
+  Open (const char *Path, Uint32 FrameWidth, Uint32 FrameHeight, Uint32 Rate,
+        Uint32 Per)
+  {
+    Close ();
+    File = fopen (Path, "wb");
+    if (!File)
+      {
+        return false;
+      }
+    Uint32 A = Rate, B = Per;
+    while (B)
+      {
+        Uint32 R = A % B;
+        A = B;
+        B = R;
+      }
+    if (fprintf (File, "YUV4MPEG2 W%u H%u F%u:%u Ip A1:1 C444\n",
+                 FrameWidth, FrameHeight, Rate / A, Per / A)
+        < 0)
+      {
+        fclose (File);
+        File = nullptr;
+        return false;
+      }
+    Width = FrameWidth;
+    Height = FrameHeight;
+    Slots = new Uint32[QUEUE_FRAMES * Width * Height];
+    for (Uint32 i = 0; i < QUEUE_FRAMES; i++)
+      {
+        Free.Push (i);
+      }
+    Dropped = 0;
+    Failed = false;
+    Running = true;
+    Thread = std::thread (&Y4mWriter::Serve, this);
+    return true;
+  }
+
+  /** Emulation side: queues a copy of a frame. Returns false when it
+   * was dropped. */
+  bool
+  Push (const Uint32 *Pixels)
+  {
+    Uint32 Slot;
+    if (!Free.Pop (Slot))
+      {
+        Dropped++;
+        return false;
+      }
+    memcpy (Slots + Slot * Width * Height, Pixels,
+            Width * Height * sizeof (Uint32));
+    Full.Push (Slot);
+    return true;
+  }
+
+  /** Writes the frames still queued and closes the file. Returns false
+   * if any write failed. */
+  bool
+  Close ()
+  {
+    if (!File)
+      {
+        return true;
+      }
+    Running = false;
+    Thread.join ();
+    bool Ok = fclose (File) == 0 && !Failed;
+    File = nullptr;
+    delete[] Slots;
+    Slots = nullptr;
+    Uint32 Slot;
+    while (Free.Pop (Slot))
+      {
+      }
+    return Ok;
+  }
+
+  /** BT.601 studio range, as players expect of Y4M */
+  static void
+  ToYuv (const Uint32 *Pixels, Uint32 Count, Byte *Y, Byte *U, Byte *V)
+  {
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        int R = (Pixels[i] >> 16) & 0xFF;
+        int G = (Pixels[i] >> 8) & 0xFF;
+        int B = Pixels[i] & 0xFF;
+        Y[i] = 16 + ((66 * R + 129 * G + 25 * B + 128) >> 8);
+        U[i] = 128 + ((-38 * R - 74 * G + 112 * B + 128) >> 8);
+        V[i] = 128 + ((112 * R - 94 * G - 18 * B + 128) >> 8);
+      }
+  }
+
+private:
+  FILE *File = nullptr;
+  Uint32 Width = 0;
+  Uint32 Height = 0;
+  Uint32 *Slots = nullptr;
+  SpscRing<Uint32, QUEUE_FRAMES> Full; // Emulation -> writer
+  SpscRing<Uint32, QUEUE_FRAMES> Free; // Writer -> emulation
+  std::atomic<bool> Running{ false };
+  std::atomic<bool> Failed{ false };
+  std::thread Thread;
+
+  void
+  Serve ()
+  {
+    Uint32 Count = Width * Height;
+    Byte *Planes = new Byte[3 * Count];
+    for (;;)
+      {
+        // Checked first, so frames queued before Close are all written
+        bool Stopping = !Running.load (std::memory_order_acquire);
+        Uint32 Slot;
+        if (!Full.Pop (Slot))
+          {
+            if (Stopping)
+              {
+                break;
+              }
+            usleep (1000);
+            continue;
+          }
+        ToYuv (Slots + Slot * Count, Count, Planes, Planes + Count,
+               Planes + 2 * Count);
+        Free.Push (Slot);
+        if (fputs ("FRAME\n", File) < 0
+            || fwrite (Planes, 1, 3 * Count, File) != 3 * Count)
+          {
+            Failed = true;
+          }
+      }
+    delete[] Planes;
+  }
+};
+
+#define CAPTURE_CPP
+#endif // !CAPTURE_CPP
@@ -0,0 +1,334 @@
+#ifndef CART_CPP
+
+#include "cpu.cpp"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Expansion port cartridge, from a CRT image
+ *
+ * The image is mapped, not read, and its ROM banks are never copied:
+ * the ROM pages of memory point into the mapping. Switching banks
+ * repoints the 64 page entries of the two 8K windows, whatever the size
+ * of the image.
+ *
+ * The EXROM and GAME lines select the windows: EXROM alone maps the low
+ * bank at $8000, both map the high bank at $A000 too, and GAME alone is
+ * the Ultimax mode, with the high bank at $E000. The C64's own ROMs are
+ * not emulated, so nothing else is banked.
+ *
+ * Banking hardware:
+ * - Ocean: $DE00 selects one of 64 8K banks, seen in both windows.
+ * - Magic Desk: $DE00 selects one of 128 8K banks; bit 7 switches the
+ *   cartridge off.
+ * - EasyFlash: $DE00 selects one of 64 pairs of 8K banks and $DE02 sets
+ *   the lines; $DF00-$DFFF is 256 bytes of RAM. Flash writes are not
+ *   emulated.
+ */
+struct Cartridge
+{
+  static constexpr Word TYPE_NORMAL = 0;
+  static constexpr Word TYPE_OCEAN = 5;
+  static constexpr Word TYPE_MAGIC_DESK = 19;
+  static constexpr Word TYPE_EASYFLASH = 32;
+
+  static constexpr Uint32 MAX_BANKS = 128;
+  static constexpr Uint32 BANK_SIZE = 0x2000;
+
+  static constexpr Byte MAGIC_DESK_OFF = 0x80;
+  static constexpr Byte EASYFLASH_GAME = 0x01; // Asserted when set
+  static constexpr Byte EASYFLASH_EXROM = 0x02;
+  static constexpr Byte EASYFLASH_MODE = 0x04; // GAME from bit 0, not the
+                                               // boot jumper
+
+  Word Type = TYPE_NORMAL;
+  char Name[33] = {};
+
+  const Byte *Lo[MAX_BANKS] = {}; // $8000 window, per bank
+  const Byte *Hi[MAX_BANKS] = {}; // $A000 or $E000 window
+  Uint32 Banks = 0;
+
+  bool Exrom = false; // Lines as asserted, pulled low
+  bool Game = false;
+  Byte Bank = 0;
+  Uint64 Switches = 0; // Bank and mode changes since Reset
+
+  const IOHandler Handler = { ReadRegister, WriteRegister, this };
+
+  ~Cartridge () { Close (); }
+
+  /** Maps a CRT image of a supported type */
+  bool
+  Open (const char *Path)
+  {
+    Close ();
+    int Fd = open (Path, O_RDONLY);
+    if (Fd < 0)
+      {
+        return false;
+      }
+    struct stat Info;
+    if (fstat (Fd, &Info) != 0 || Info.st_size < (off_t)HEADER_SIZE)
+      {
+        close (Fd);
+        return false;
+      }
+    Size = Info.st_size;
+    void *Mapped = mmap (nullptr, Size, PROT_READ, MAP_PRIVATE, Fd, 0);
+    close (Fd); // The mapping keeps the file
+    if (Mapped == MAP_FAILED)
+      {
+        Size = 0;
+        return false;
+      }
+    Image = (const Byte *)Mapped;
+    if (!Parse ())
+      {
+        Close ();
+        return false;
+      }
+    return true;
+  }
+
+  /** Unmaps the image, detaching the cartridge from memory first; so
+   * the memory must outlive it */
+  void
+  Close ()
+  {
+    if (Mem)
+      {
+        Mem->MapRom (0x80, 0xBF, nullptr);
+        Mem->MapRom (0xE0, 0xFF, nullptr);
+        Mem->MapIO (0xDE, 0xDF, nullptr);
+        Mem = nullptr;
+      }
+    if (Image)
+      {
+        munmap ((void *)Image, Size);
+      }
+    Image = nullptr;
+    Size = 0;
+    Banks = 0;
+    memset (Lo, 0, sizeof (Lo));
+    memset (Hi, 0, sizeof (Hi));
+  }
+
+  /** Switches to bank 0 in the power-on mode and attaches the cartridge
+   * to memory: its ROM windows and the I/O pages at $DE00-$DFFF */
+  void
+  Reset (Memory &memory)
+  {
+    Mem = &memory;
+    Bank = 0;
+    Switches = 0;
+    memset (Ram, 0, sizeof (Ram));
+    Exrom = !HeaderExrom;
+    Game = !HeaderGame;
+    memory.MapIO (0xDE, 0xDF, &Handler);
+    Map ();
+  }
+
+  /** Where the KERNAL's reset routine would hand over: the Ultimax reset
+   * vector, or the cold start vector at $8000 behind "CBM80" */
+  bool
+  ColdStart (const Memory &memory, Word &Start) const
+  {
+    static const Byte CBM80[] = { 0xC3, 0xC2, 0xCD, 0x38, 0x30 };
+    if (Game && !Exrom && memory.Rom[0xFF])
+      {
+        Start = memory.Fetch (0xFFFC) | (memory.Fetch (0xFFFD) << 8);
+        return true;
+      }
+    if (!memory.Rom[0x80])
+      {
+        return false;
+      }
+    for (Uint32 i = 0; i < sizeof (CBM80); i++)
+      {
+        if (memory.Fetch (0x8004 + i) != CBM80[i])
+          {
+            return false;
+          }
+      }
+    Start = memory.Fetch (0x8000) | (memory.Fetch (0x8001) << 8);
+    return true;
+  }
+
+  Byte
+  Read (Word Address)
+  {
+    if (Type == TYPE_EASYFLASH && Address >= 0xDF00)
+      {
+        return Ram[Address & 0xFF];
+      }
+    return 0xFF; // Nothing drives the bus
+  }
+
+  void
+  Write (Word Address, Byte Value)
+  {
+    if (Type == TYPE_EASYFLASH && Address >= 0xDF00)
+      {
+        Ram[Address & 0xFF] = Value;
+        return;
+      }
+    switch (Type)
+      {
+      case TYPE_OCEAN:
+        if (Address == 0xDE00)
+          {
+            Switch (Value & 0x3F);
+          }
+        break;
+      case TYPE_MAGIC_DESK:
+        if (Address == 0xDE00)
+          {
+            Exrom = !(Value & MAGIC_DESK_OFF);
+            Switch (Value & 0x7F);
+          }
+        break;
+      case TYPE_EASYFLASH:
+        if (Address == 0xDE00)
+          {
+            Switch (Value & 0x3F);
+          }
+        else if (Address == 0xDE02)
+          {
+            Exrom = Value & EASYFLASH_EXROM;
+            // The boot jumper holds GAME until the mode bit hands it over
+            Game = (Value & EASYFLASH_MODE) ? Value & EASYFLASH_GAME : true;
+            Switch (Bank);
+          }
+        break;
+      }
+  }
+
+private:
+  static constexpr Uint32 HEADER_SIZE = 0x40;
+  static constexpr Uint32 CHIP_HEADER_SIZE = 0x10;
+
+  const Byte *Image = nullptr;
+  size_t Size = 0;
+  bool HeaderExrom = false; // Header values: 0 asserts the line
+  bool HeaderGame = false;
+  Memory *Mem = nullptr; // Attached to, since Reset
+  Byte Ram[256];
+
+  static Byte
+  ReadRegister (void *Context, Word Address)
+  {
+    return ((Cartridge *)Context)->Read (Address);
+  }
+
+  static void
+  WriteRegister (void *Context, Word Address, Byte Value)
+  {
+    ((Cartridge *)Context)->Write (Address, Value);
+  }
+
+  static Uint32
+  Big16 (const Byte *At)
+  {
+    return (At[0] << 8) | At[1];
+  }
+
+  static Uint32
+  Big32 (const Byte *At)
+  {
+    return ((Uint32)At[0] << 24) | (At[1] << 16) | (At[2] << 8) | At[3];
+  }
+
+  /** Reads the header and points the banks at the CHIP packets */
+  bool
+  Parse ()
+  {
+    if (memcmp (Image, "C64 CARTRIDGE   ", 16) != 0)
+      {
+        return false;
+      }
+    Type = Big16 (Image + 0x16);
+    if (Type != TYPE_NORMAL && Type != TYPE_OCEAN && Type != TYPE_MAGIC_DESK
+        && Type != TYPE_EASYFLASH)
+      {
+        return false;
+      }
+    HeaderExrom = Image[0x18];
+    HeaderGame = Image[0x19];
+    memcpy (Name, Image + 0x20, 32);
+    Name[32] = 0;
+
+    size_t At = Big32 (Image + 0x10);
+    if (At < HEADER_SIZE)
+      {
+        At = HEADER_SIZE;
+      }
+    while (At + CHIP_HEADER_SIZE <= Size)
+      {
+        const Byte *Chip = Image + At;
+        Uint32 Length = Big32 (Chip + 4);
+        Uint32 Number = Big16 (Chip + 0x0A);
+        Uint32 Load = Big16 (Chip + 0x0C);
+        Uint32 RomSize = Big16 (Chip + 0x0E);
+        if (memcmp (Chip, "CHIP", 4) != 0 || Length < CHIP_HEADER_SIZE
+            || At + CHIP_HEADER_SIZE + RomSize > Size)
+          {
+            return false;
+          }
+        const Byte *Rom = Chip + CHIP_HEADER_SIZE;
+        if (Number < MAX_BANKS && RomSize >= BANK_SIZE)
+          {
+            if (Load == 0x8000)
+              {
+                Lo[Number] = Rom;
+                if (RomSize >= 2 * BANK_SIZE)
+                  {
+                    Hi[Number] = Rom + BANK_SIZE;
+                  }
+              }
+            else if (Load == 0xA000 || Load == 0xE000)
+              {
+                Hi[Number] = Rom;
+              }
+            if (Number >= Banks)
+              {
+                Banks = Number + 1;
+              }
+          }
+        At += Length;
+      }
+    return Banks > 0;
+  }
+
+  /** Selects a bank and repoints the windows the lines enable */
+  void
+  Switch (Byte Number)
+  {
+    Bank = Number;
+    Switches++;
+    Map ();
+  }
+
+  void
+  Map ()
+  {
+    if (!Mem)
+      {
+        return;
+      }
+    const Byte *Low = Bank < Banks ? Lo[Bank] : nullptr;
+    const Byte *High = Bank < Banks ? Hi[Bank] : nullptr;
+    if (Type == TYPE_OCEAN && !High)
+      {
+        High = Low;
+      }
+    bool Ultimax = Game && !Exrom;
+    Mem->MapRom (0x80, 0x9F, Exrom || Ultimax ? Low : nullptr);
+    Mem->MapRom (0xA0, 0xBF, Exrom && Game ? High : nullptr);
+    Mem->MapRom (0xE0, 0xFF, Ultimax ? High : nullptr);
+  }
+};
+
+#define CART_CPP
+#endif // !CART_CPP
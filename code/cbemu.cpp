@@ -1,34 +1,556 @@
-#include "cpu.cpp"
+#include "analyze.cpp"
+#include "audio.cpp"
+#include "basic.cpp"
+#include "capture.cpp"
+#include "machine.cpp"
+#include "pacer.cpp"
+#include "prg.cpp"
+#include "resample.cpp"
+#include "share.cpp"
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+static constexpr Uint32 WAV_RATE = 44100;
+
+static volatile sig_atomic_t ToggleWarp = 0;
+static volatile sig_atomic_t Quit = 0;
+
+static void
+OnToggleWarp (int)
+{
+  ToggleWarp = 1;
+}
+
+static void
+OnQuit (int)
+{
+  Quit = 1;
+}
+
+/* What frames and resampled audio go to; any may be null */
+struct HostOutputs
+{
+  FrameHashLog *Hashes;
+  Y4mWriter *Capture;
+  WavWriter *Wav;
+  SharedExport *Share;
+};
+
+static void
+OnFrame (void *Context, const Uint32 *Pixels, Uint64 Frame)
+{
+  HostOutputs *Out = (HostOutputs *)Context;
+  if (Out->Hashes)
+    {
+      Out->Hashes->Write (
+          Frame, FrameHash::Of (Pixels, VIC::WIDTH * VIC::HEIGHT * 4));
+    }
+  if (Out->Capture)
+    {
+      Out->Capture->Push (Pixels);
+    }
+  if (Out->Share)
+    {
+      Out->Share->Publish (Pixels, Frame);
+    }
+}
+
+static void
+OnAudio (void *Context, const float *Samples, Uint32 Count)
+{
+  HostOutputs *Out = (HostOutputs *)Context;
+  if (Out->Wav)
+    {
+      Out->Wav->Write (Samples, Count);
+    }
+  if (Out->Share)
+    {
+      Out->Share->PushAudio (Samples, Count);
+    }
+}
+
+static bool
+ParseQuality (const char *Name, ResampleQuality &Quality)
+{
+  for (Byte q = RESAMPLE_FAST; q <= RESAMPLE_BEST; q++)
+    {
+      if (strcmp (Name, RESAMPLE_TIERS[q].Name) == 0)
+        {
+          Quality = (ResampleQuality)q;
+          return true;
+        }
+    }
+  return false;
+}
+
+/** An REU size in K: 128 (1700), 256 (1764) or 512 (1750) */
+static bool
+ParseReuSize (const char *Kilobytes, Uint32 &Size)
+{
+  Uint32 K = strtoul (Kilobytes, nullptr, 10);
+  if (K != 128 && K != 256 && K != 512)
+    {
+      return false;
+    }
+  Size = K * 1024;
+  return true;
+}
+
+/** An address in hex, with or without a leading $ */
+static bool
+ParseAddress (const char *Text, Word &Address)
+{
+  char *End;
+  if (*Text == '$')
+    {
+      Text++;
+    }
+  unsigned long Value = strtoul (Text, &End, 16);
+  if (*Text == 0 || *End != 0 || Value > 0xFFFF)
+    {
+      return false;
+    }
+  Address = Value;
+  return true;
+}
+
+static void
+Usage (const char *Name)
+{
+  printf ("Usage: %s [-pal | -ntsc] [-warp] [-frames N] [-monitor SOCKET]"
+          " [-metrics FILE] [-wav FILE]\n"
+          "          [-resample fast | medium | best] [-drive ROM]"
+          " [-drive-inline] [-disk D64]\n"
+          "          [-hostdir DIR] [-no-traps] [-cart CRT] [-prg FILE]\n"
+          "          [-reu 128 | 256 | 512] [-analyze ADDR]..."
+          " [-profile FILE] [-labels FILE]\n"
+          "          [-basic FILE] [-type TEXT] [-frame-hashes FILE]"
+          " [-capture Y4M]\n"
+          "          [-share NAME]\n"
+          "  LOAD and SAVE skip the serial bus for -disk and -hostdir"
+          " unless -no-traps\n"
+          "  is given. They are always off with -drive: the true drive"
+          " serves device 8.\n"
+          "  -analyze prints the cycle costs of the code at each ADDR, as"
+          " loaded, and exits.\n"
+          "  -profile writes collapsed call stacks with their cycles to"
+          " FILE at exit.\n"
+          "  -basic tokenizes the BASIC program in FILE into memory;"
+          " -type queues TEXT\n"
+          "  and RETURN in the keyboard buffer, as -type RUN would.\n"
+          "  -frame-hashes logs a hash of every frame; -capture records"
+          " them, dropping\n"
+          "  frames rather than waiting when the disk falls behind.\n"
+          "  -share publishes frames and audio in the POSIX shared memory"
+          " segment NAME.\n"
+          "  SIGUSR1 toggles warp mode, SIGINT stops.\n",
+          Name);
+}
 
 int
 main (int argc, char *argv[])
 {
-  Memory mem;
-  CPU cpu;
-  Sint32 Cycles;
+  // Large; keep them off the stack
+  static Machine machine;
+  static Monitor monitor;
+  static WavWriter Wav;
+  static Resampler Resample;
+  static Drive1541 Drive;
+  static D64Image Disk;
+  static Cartridge Cart;
+  static REU Reu;
+  static CodeAnalysis Analysis;
+  static Profiler Prof;
+  static FrameHashLog Hashes;
+  static Y4mWriter Capture;
+  static SharedExport Share;
+
+  bool Warp = false;
+  Uint64 Frames = 0; // 0 runs until interrupted
+  const char *MonitorPath = nullptr;
+  const char *MetricsPath = nullptr;
+  const char *WavPath = nullptr;
+  ResampleQuality Quality = RESAMPLE_MEDIUM;
+  const char *DriveRom = nullptr;
+  const char *DiskPath = nullptr;
+  const char *HostDir = nullptr;
+  bool Traps = true; // LOAD and SAVE skip the serial bus when they can
+  const char *CartPath = nullptr;
+  const char *PrgPath = nullptr;
+  const char *BasicPath = nullptr;
+  const char *Typed = nullptr;
+  const char *HashesPath = nullptr;
+  const char *CapturePath = nullptr;
+  const char *ShareName = nullptr;
+  static constexpr Uint32 MAX_ENTRIES = 16;
+  Word Entries[MAX_ENTRIES];
+  Uint32 EntryCount = 0;
+  const char *ProfilePath = nullptr;
+  const char *LabelsPath = nullptr;
+  // Two threads only pay off with a core for each
+  bool DriveThread = std::thread::hardware_concurrency () > 1;
+
+  for (int i = 1; i < argc; i++)
+    {
+      if (strcmp (argv[i], "-pal") == 0)
+        {
+          machine.Video = VIDEO_PAL;
+        }
+      else if (strcmp (argv[i], "-ntsc") == 0)
+        {
+          machine.Video = VIDEO_NTSC;
+        }
+      else if (strcmp (argv[i], "-warp") == 0)
+        {
+          Warp = true;
+        }
+      else if (strcmp (argv[i], "-frames") == 0 && i + 1 < argc)
+        {
+          Frames = strtoull (argv[++i], nullptr, 10);
+        }
+      else if (strcmp (argv[i], "-monitor") == 0 && i + 1 < argc)
+        {
+          MonitorPath = argv[++i];
+        }
+      else if (strcmp (argv[i], "-metrics") == 0 && i + 1 < argc)
+        {
+          MetricsPath = argv[++i];
+        }
+      else if (strcmp (argv[i], "-wav") == 0 && i + 1 < argc)
+        {
+          WavPath = argv[++i];
+        }
+      else if (strcmp (argv[i], "-resample") == 0 && i + 1 < argc
+               && ParseQuality (argv[i + 1], Quality))
+        {
+          i++;
+        }
+      else if (strcmp (argv[i], "-drive") == 0 && i + 1 < argc)
+        {
+          DriveRom = argv[++i];
+        }
+      else if (strcmp (argv[i], "-disk") == 0 && i + 1 < argc)
+        {
+          DiskPath = argv[++i];
+        }
+      else if (strcmp (argv[i], "-drive-inline") == 0)
+        {
+          DriveThread = false;
+        }
+      else if (strcmp (argv[i], "-hostdir") == 0 && i + 1 < argc)
+        {
+          HostDir = argv[++i];
+        }
+      else if (strcmp (argv[i], "-no-traps") == 0)
+        {
+          Traps = false;
+        }
+      else if (strcmp (argv[i], "-cart") == 0 && i + 1 < argc)
+        {
+          CartPath = argv[++i];
+        }
+      else if (strcmp (argv[i], "-prg") == 0 && i + 1 < argc)
+        {
+          PrgPath = argv[++i];
+        }
+      else if (strcmp (argv[i], "-basic") == 0 && i + 1 < argc)
+        {
+          BasicPath = argv[++i];
+        }
+      else if (strcmp (argv[i], "-type") == 0 && i + 1 < argc)
+        {
+          Typed = argv[++i];
+        }
+      else if (strcmp (argv[i], "-frame-hashes") == 0 && i + 1 < argc)
+        {
+          HashesPath = argv[++i];
+        }
+      else if (strcmp (argv[i], "-capture") == 0 && i + 1 < argc)
+        {
+          CapturePath = argv[++i];
+        }
+      else if (strcmp (argv[i], "-share") == 0 && i + 1 < argc)
+        {
+          ShareName = argv[++i];
+        }
+      else if (strcmp (argv[i], "-analyze") == 0 && i + 1 < argc
+               && EntryCount < MAX_ENTRIES
+               && ParseAddress (argv[i + 1], Entries[EntryCount]))
+        {
+          EntryCount++;
+          i++;
+        }
+      else if (strcmp (argv[i], "-profile") == 0 && i + 1 < argc)
+        {
+          ProfilePath = argv[++i];
+        }
+      else if (strcmp (argv[i], "-labels") == 0 && i + 1 < argc)
+        {
+          LabelsPath = argv[++i];
+        }
+      else if (strcmp (argv[i], "-reu") == 0 && i + 1 < argc
+               && ParseReuSize (argv[i + 1], Reu.Size))
+        {
+          machine.Reu = &Reu;
+          i++;
+        }
+      else
+        {
+          Usage (argv[0]);
+          return 1;
+        }
+    }
 
-  cpu.Reset (mem);
+  if (DriveRom)
+    {
+      if (!Drive.LoadRom (DriveRom))
+        {
+          fprintf (stderr, "Cannot read a 16K drive ROM from %s\n", DriveRom);
+          return 1;
+        }
+      machine.Drive = &Drive;
+    }
+  if (DiskPath)
+    {
+      if (!Disk.Open (DiskPath, true) && !Disk.Open (DiskPath, false))
+        {
+          fprintf (stderr, "Cannot open disk image %s\n", DiskPath);
+          return 1;
+        }
+      Drive.Disk = &Disk;
+      machine.Traps.Disk = &Disk;
+    }
+  machine.Traps.Directory = HostDir;
+  if (DriveRom)
+    {
+      // The drive is device 8 and owns the image, on its own thread
+      Traps = false;
+    }
+  if (CartPath)
+    {
+      if (!Cart.Open (CartPath))
+        {
+          fprintf (stderr, "Cannot open cartridge %s\n", CartPath);
+          return 1;
+        }
+      machine.Cart = &Cart;
+    }
+
+  machine.Reset ();
+  machine.SetTraps (Traps && (DiskPath || HostDir));
+  if (DriveRom && DriveThread)
+    {
+      Drive.Start ();
+    }
 
   // Inline a little program
-  cpu.A = 0x0;
-  mem[0xFFFC] = INS_JMP_ABS;
-  mem[0xFFFD] = 0x80;
-  mem[0xFFFE] = 0x44;
-  mem[0x4480] = INS_LDA_ABS;
-  mem[0x4481] = 0x44;
-  mem[0x4482] = 0x80;
-  mem[0x8044] = 0x77;
-
-
-  // when:
-  Sint32 CyclesUsed = cpu.Execute (mem);
-  CyclesUsed += cpu.Execute (mem);
+  machine.Cpu.A = 0x0;
+  machine.Mem[0xFFFC] = INS_JMP_ABS;
+  machine.Mem[0xFFFD] = 0x80;
+  machine.Mem[0xFFFE] = 0x44;
+  machine.Mem[0x4480] = INS_LDA_ABS;
+  machine.Mem[0x4481] = 0x44;
+  machine.Mem[0x4482] = 0x80;
+  machine.Mem[0x4483] = INS_JMP_ABS;
+  machine.Mem[0x4484] = 0x80;
+  machine.Mem[0x4485] = 0x44;
+  machine.Mem[0x8044] = 0x77;
   // End - inline program
 
-  Cycles = cpu.Execute (mem);
+  if (PrgPath)
+    {
+      Word Start, End;
+      if (!LoadPrg (machine.Mem, PrgPath, Start, End))
+        {
+          fprintf (stderr, "Cannot load %s\n", PrgPath);
+          return 1;
+        }
+      printf ("Loaded %s at $%04X-$%04X\n", PrgPath, Start, End);
+    }
+  if (BasicPath)
+    {
+      Word End;
+      if (!LoadBasic (machine.Mem, BasicPath, End))
+        {
+          fprintf (stderr, "Cannot tokenize %s\n", BasicPath);
+          return 1;
+        }
+      printf ("Tokenized %s to $%04X-$%04X\n", BasicPath, BASIC_START, End);
+    }
+  if (Typed)
+    {
+      // The line and its RETURN must fit the buffer together
+      char Line[KEYBOARD_SIZE + 1];
+      if (strlen (Typed) >= KEYBOARD_SIZE)
+        {
+          fprintf (stderr, "Cannot type more than %u keys\n",
+                   KEYBOARD_SIZE - 1);
+          return 1;
+        }
+      snprintf (Line, sizeof (Line), "%s\n", Typed);
+      TypeKeys (machine.Mem, Line);
+    }
+
+  if (EntryCount > 0)
+    {
+      Uint64 Began = HostNanoseconds ();
+      Analysis.Analyze (machine.Mem, Entries, EntryCount);
+      Uint64 Took = HostNanoseconds () - Began;
+      Analysis.Print (stdout);
+      printf ("%u blocks in %u routines, analyzed in %.3f ms\n",
+              Analysis.BlockCount, Analysis.RoutineCount, Took / 1e6);
+      Drive.Stop ();
+      return 0;
+    }
+
+  if (LabelsPath && !Prof.LoadLabels (LabelsPath))
+    {
+      fprintf (stderr, "Cannot read labels from %s\n", LabelsPath);
+      return 1;
+    }
+  if (ProfilePath)
+    {
+      // Only profiled runs take the instrumented interpreter for it
+      machine.Cpu.Hooks.Prof = &Prof;
+    }
+
+  if (MonitorPath)
+    {
+      if (!monitor.Start (MonitorPath))
+        {
+          fprintf (stderr, "Cannot listen on %s\n", MonitorPath);
+          return 1;
+        }
+      machine.Mon = &monitor;
+    }
+
+  HostOutputs Outputs = { nullptr, nullptr, nullptr, nullptr };
+  if (WavPath)
+    {
+      if (!Wav.Open (WavPath, WAV_RATE))
+        {
+          fprintf (stderr, "Cannot write %s\n", WavPath);
+          return 1;
+        }
+      Outputs.Wav = &Wav;
+    }
+  if (HashesPath)
+    {
+      if (!Hashes.Open (HashesPath))
+        {
+          fprintf (stderr, "Cannot write %s\n", HashesPath);
+          return 1;
+        }
+      Outputs.Hashes = &Hashes;
+    }
+  if (CapturePath)
+    {
+      if (!Capture.Open (CapturePath, VIC::WIDTH, VIC::HEIGHT,
+                         machine.Video.ClockHz,
+                         machine.Video.CyclesPerFrame ()))
+        {
+          fprintf (stderr, "Cannot write %s\n", CapturePath);
+          return 1;
+        }
+      Outputs.Capture = &Capture;
+    }
+  if (ShareName)
+    {
+      if (!Share.Open (ShareName, VIC::WIDTH, VIC::HEIGHT, WAV_RATE))
+        {
+          fprintf (stderr, "Cannot create shared memory %s\n", ShareName);
+          return 1;
+        }
+      Outputs.Share = &Share;
+    }
+  if (WavPath || ShareName)
+    {
+      Resample.Configure (machine.Video.ClockHz, WAV_RATE, Quality);
+      Resample.Out = OnAudio;
+      Resample.OutContext = &Outputs;
+      machine.Sid.Sink = Resampler::Sink;
+      machine.Sid.SinkContext = &Resample;
+    }
+  if (HashesPath || CapturePath || ShareName)
+    {
+      machine.VideoSink = OnFrame;
+      machine.VideoSinkContext = &Outputs;
+    }
+
+  signal (SIGUSR1, OnToggleWarp);
+  signal (SIGINT, OnQuit);
+  signal (SIGTERM, OnQuit);
+
+  Pacer pacer;
+  pacer.Start (machine.Video.ClockHz, machine.Video.CyclesPerFrame ());
+  pacer.SetWarp (Warp);
+  machine.Warp = Warp;
+
+  while (!Quit && (Frames == 0 || machine.Frame < Frames))
+    {
+      bool Completed = machine.RunFrame ();
+
+      // Mode changes only take effect between frames
+      if (ToggleWarp)
+        {
+          ToggleWarp = 0;
+          machine.Warp = !machine.Warp;
+          pacer.SetWarp (machine.Warp);
+        }
+
+      if (Completed && MetricsPath && machine.Frame % 50 == 0)
+        {
+          machine.Perf.WritePrometheus (MetricsPath, "cbemu",
+                                        machine.Video.ClockHz);
+        }
+
+      // Only whole frames are paced: a frame a breakpoint cut short
+      // resumes on the next call and is charged once it completes
+      if (Completed)
+        {
+          pacer.FrameDone ();
+        }
+      else if (machine.Paused)
+        {
+          // Nothing to run; don't spin while the monitor has us stopped
+          usleep (10000);
+        }
+    }
+
+  monitor.Stop ();
+  Drive.Stop ();
+  if (!Disk.Flush ())
+    {
+      fprintf (stderr, "Disk changes were not saved\n");
+    }
+  Wav.Close ();
+  Share.Close ();
+  if (!Hashes.Close ())
+    {
+      fprintf (stderr, "Cannot write %s\n", HashesPath);
+    }
+  if (!Capture.Close ())
+    {
+      fprintf (stderr, "Cannot write %s\n", CapturePath);
+    }
+  if (Capture.Dropped)
+    {
+      fprintf (stderr, "Capture dropped %llu frames\n",
+               (unsigned long long)Capture.Dropped);
+    }
+  if (ProfilePath)
+    {
+      Prof.WriteReport (stdout, 20);
+      if (!Prof.WriteCollapsed (ProfilePath))
+        {
+          fprintf (stderr, "Cannot write %s\n", ProfilePath);
+        }
+    }
 
-  printf ("Registers \n\tA: %X \n\tX: %X \n\tY: %X\nCycles Used: %d\n", cpu.A,
-          cpu.X, cpu.Y, Cycles);
+  CPU &cpu = machine.Cpu;
+  printf ("Registers \n\tA: %X \n\tX: %X \n\tY: %X\nCycles Used: %llu\n",
+          cpu.A, cpu.X, cpu.Y, (unsigned long long)machine.Clock);
   printf ("Flags:\n\tN\tV\tB\tD\tI\tZ\tC\n\t%x\t%x\t%x\t%x\t%x\t%x\t%x\n", cpu.N, cpu.V, cpu.B, cpu.D, cpu.I, cpu.Z, cpu.C);
   return 0;
 }
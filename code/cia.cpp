@@ -0,0 +1,525 @@
+#ifndef CIA_CPP
+
+#include "cpu.cpp"
+#include "scheduler.cpp"
+#include <string.h>
+
+/* MOS 6526 CIA
+ *
+ * Nothing here is clocked per cycle. A timer counting cycles keeps the
+ * value it had at a base cycle, and its value at a later cycle is
+ * worked out when a register is read. Its next underflow is an event on
+ * the global clock, whose handler raises the interrupt flag and reloads
+ * or stops the timer. Timer B counting timer A underflows is decremented
+ * by those events. The time of day is kept as tenths of a second at a
+ * base cycle, and its alarm is an event at the cycle it next matches.
+ *
+ * The run loop dispatches events between slices, so an instruction can
+ * run a few cycles past one. Register accesses therefore first settle
+ * whatever fell due at or before the access cycle, taken from Now.
+ */
+struct CIA
+{
+  static constexpr Byte REG_PRA = 0x00;
+  static constexpr Byte REG_PRB = 0x01;
+  static constexpr Byte REG_DDRA = 0x02;
+  static constexpr Byte REG_DDRB = 0x03;
+  static constexpr Byte REG_TA_LO = 0x04;
+  static constexpr Byte REG_TA_HI = 0x05;
+  static constexpr Byte REG_TB_LO = 0x06;
+  static constexpr Byte REG_TB_HI = 0x07;
+  static constexpr Byte REG_TOD_TENTHS = 0x08;
+  static constexpr Byte REG_TOD_SECONDS = 0x09;
+  static constexpr Byte REG_TOD_MINUTES = 0x0A;
+  static constexpr Byte REG_TOD_HOURS = 0x0B; // Bit 7 is PM
+  static constexpr Byte REG_SDR = 0x0C;
+  static constexpr Byte REG_ICR = 0x0D;
+  static constexpr Byte REG_CRA = 0x0E;
+  static constexpr Byte REG_CRB = 0x0F;
+
+  static constexpr Byte ICR_TA = 0x01;
+  static constexpr Byte ICR_TB = 0x02;
+  static constexpr Byte ICR_ALARM = 0x04;
+  static constexpr Byte ICR_SET = 0x80; // Written: set, else clear mask bits
+
+  static constexpr Byte CR_START = 0x01;
+  static constexpr Byte CR_ONE_SHOT = 0x08;
+  static constexpr Byte CR_LOAD = 0x10;       // Strobe, reads as 0
+  static constexpr Byte CRA_COUNT_CNT = 0x20; // Count CNT edges
+  static constexpr Byte CRA_TOD_50HZ = 0x80;
+  static constexpr Byte CRB_MODE = 0x60;      // What timer B counts
+  static constexpr Byte CRB_CASCADE = 0x40;   // Timer A underflows
+  static constexpr Byte CRB_ALARM = 0x80;     // TOD writes set the alarm
+
+  static constexpr Uint32 TOD_DAY = 24 * 60 * 60 * 10; // In tenths
+
+  struct Timer
+  {
+    CIA *Owner;
+    Word Latch;
+    Word Count;  // Value at Base
+    Uint64 Base;
+    Uint64 Next; // Cycle of the next underflow, NEVER unless counting
+    Byte Control;
+  };
+
+  Timer A, B;
+  Byte Port[4]; // PRA, PRB, DDRA, DDRB
+  Byte Input[2] = { 0xFF, 0xFF }; // Pins as driven from outside, per port
+  Byte Sdr;
+  Byte Flags; // Interrupt sources that fired
+  Byte Mask;  // Interrupt sources enabled
+
+  Uint32 TodTenths;  // Time of day at TodBase, or while stopped
+  Uint64 TodBase;
+  bool TodStopped;   // From an hours write to the next tenths write
+  bool TodLatched;   // From an hours read to the next tenths read
+  Byte TodLatch[4];  // Registers as of the hours read
+  Uint32 Alarm;      // In tenths
+  Uint64 AlarmAt;    // Cycle the clock next reaches Alarm
+
+  Uint32 ClockHz = 985248;
+  Uint32 MainsHz = 50; // Drives TOD
+
+  Scheduler *Events = nullptr;
+  Uint64 (*Now) (void *Context) = nullptr;
+  void *NowContext = nullptr;
+
+  // Called with the port A output lines when they may have changed
+  void (*PortA) (void *Context, Byte Lines) = nullptr;
+  void *PortContext = nullptr;
+
+  const IOHandler Handler = { ReadRegister, WriteRegister, this };
+
+  /** Stops the timers and attaches the chip at one page of memory. The
+   * clock, inputs and port connections are kept. */
+  void
+  Reset (Memory &memory, Byte Page, Uint32 Clock, Uint32 Mains,
+         Scheduler &Queue)
+  {
+    if (Events)
+      {
+        Events->Cancel (OnTimer, &A);
+        Events->Cancel (OnTimer, &B);
+        Events->Cancel (OnAlarm, this);
+      }
+    Events = &Queue;
+    ClockHz = Clock;
+    MainsHz = Mains;
+
+    A = { this, 0xFFFF, 0xFFFF, 0, Scheduler::NEVER, 0 };
+    B = A;
+    memset (Port, 0, sizeof (Port));
+    Sdr = Flags = Mask = 0;
+
+    // 1:00:00.0 AM, running
+    TodTenths = 60 * 60 * 10;
+    TodBase = 0;
+    TodStopped = TodLatched = false;
+    Alarm = 0;
+    AlarmAt = Scheduler::NEVER;
+    RescheduleAlarm (0);
+
+    memory.MapIO (Page, Page, &Handler);
+  }
+
+  /** The interrupt output: CIA 1 drives IRQ, CIA 2 NMI */
+  bool
+  Interrupt () const
+  {
+    return Flags & Mask;
+  }
+
+  Byte
+  Read (Word Address)
+  {
+    Uint64 T = Time ();
+    Settle (T);
+    Byte R = Address & 0x0F;
+    switch (R)
+      {
+      case REG_PRA:
+      case REG_PRB:
+        // Inputs float high unless pulled low from outside
+        return (Port[R] | ~Port[R + 2]) & Input[R];
+      case REG_DDRA:
+      case REG_DDRB:
+        return Port[R];
+      case REG_TA_LO:
+        return Counter (A, T) & 0xFF;
+      case REG_TA_HI:
+        return Counter (A, T) >> 8;
+      case REG_TB_LO:
+        return Counter (B, T) & 0xFF;
+      case REG_TB_HI:
+        return Counter (B, T) >> 8;
+      case REG_TOD_TENTHS:
+      case REG_TOD_SECONDS:
+      case REG_TOD_MINUTES:
+      case REG_TOD_HOURS:
+        return ReadTod (R - REG_TOD_TENTHS, T);
+      case REG_SDR:
+        return Sdr;
+      case REG_ICR:
+        {
+          // Cleared by reading
+          Byte Value = Flags | (Interrupt () ? 0x80 : 0);
+          Flags = 0;
+          return Value;
+        }
+      case REG_CRA:
+        return A.Control;
+      default:
+        return B.Control;
+      }
+  }
+
+  void
+  Write (Word Address, Byte Value)
+  {
+    Uint64 T = Time ();
+    Settle (T);
+    Byte R = Address & 0x0F;
+    switch (R)
+      {
+      case REG_PRA:
+      case REG_DDRA:
+        Port[R] = Value;
+        if (PortA)
+          {
+            PortA (PortContext, Port[REG_PRA] | ~Port[REG_DDRA]);
+          }
+        break;
+      case REG_PRB:
+      case REG_DDRB:
+        Port[R] = Value;
+        break;
+      case REG_TA_LO:
+      case REG_TB_LO:
+        {
+          Timer &Which = R == REG_TA_LO ? A : B;
+          Which.Latch = (Which.Latch & 0xFF00) | Value;
+        }
+        break;
+      case REG_TA_HI:
+      case REG_TB_HI:
+        {
+          // A stopped timer loads the latch with its high byte
+          Timer &Which = R == REG_TA_HI ? A : B;
+          Which.Latch = (Which.Latch & 0x00FF) | (Value << 8);
+          if (!(Which.Control & CR_START))
+            {
+              Which.Count = Which.Latch;
+              Restart (Which, T);
+            }
+        }
+        break;
+      case REG_TOD_TENTHS:
+      case REG_TOD_SECONDS:
+      case REG_TOD_MINUTES:
+      case REG_TOD_HOURS:
+        WriteTod (R - REG_TOD_TENTHS, Value, T);
+        break;
+      case REG_SDR:
+        Sdr = Value;
+        break;
+      case REG_ICR:
+        if (Value & ICR_SET)
+          {
+            Mask |= Value & 0x1F;
+          }
+        else
+          {
+            Mask &= ~Value;
+          }
+        break;
+      case REG_CRA:
+      case REG_CRB:
+        {
+          Timer &Which = R == REG_CRA ? A : B;
+          if (R == REG_CRA && ((Value ^ A.Control) & CRA_TOD_50HZ))
+            {
+              TodRebase (T);
+            }
+          Which.Count = Counter (Which, T);
+          Which.Control = Value & ~CR_LOAD;
+          if (Value & CR_LOAD)
+            {
+              Which.Count = Which.Latch;
+            }
+          Restart (Which, T);
+          RescheduleAlarm (T);
+        }
+        break;
+      }
+  }
+
+  /** Handles every underflow and alarm due at or before cycle T */
+  void
+  Settle (Uint64 T)
+  {
+    for (;;)
+      {
+        Uint64 Due = A.Next < B.Next ? A.Next : B.Next;
+        if (AlarmAt < Due)
+          {
+            Due = AlarmAt;
+          }
+        if (Due > T)
+          {
+            return;
+          }
+        if (Due == AlarmAt)
+          {
+            Flags |= ICR_ALARM;
+            RescheduleAlarm (Due);
+          }
+        else
+          {
+            Underflow (Due == A.Next ? A : B, Due);
+          }
+      }
+  }
+
+  /** Time of day in tenths of a second since midnight at cycle T */
+  Uint32
+  TodNow (Uint64 T) const
+  {
+    if (TodStopped)
+      {
+        return TodTenths;
+      }
+    return (TodTenths + TodTicks (T)) % TOD_DAY;
+  }
+
+private:
+  static Byte
+  ReadRegister (void *Context, Word Address)
+  {
+    return ((CIA *)Context)->Read (Address);
+  }
+
+  static void
+  WriteRegister (void *Context, Word Address, Byte Value)
+  {
+    ((CIA *)Context)->Write (Address, Value);
+  }
+
+  static void
+  OnTimer (void *Context, Uint64 Time)
+  {
+    ((Timer *)Context)->Owner->Settle (Time);
+  }
+
+  static void
+  OnAlarm (void *Context, Uint64 Time)
+  {
+    ((CIA *)Context)->Settle (Time);
+  }
+
+  Uint64
+  Time () const
+  {
+    return Now ? Now (NowContext) : 0;
+  }
+
+  bool
+  CountsCycles (const Timer &Which) const
+  {
+    if (!(Which.Control & CR_START))
+      {
+        return false;
+      }
+    return &Which == &A ? !(Which.Control & CRA_COUNT_CNT)
+                        : !(Which.Control & CRB_MODE);
+  }
+
+  /** The counter at cycle T, which must not be past an unhandled
+   * underflow */
+  Word
+  Counter (const Timer &Which, Uint64 T) const
+  {
+    if (Which.Next == Scheduler::NEVER)
+      {
+        return Which.Count;
+      }
+    return Which.Count - (Word)(T - Which.Base);
+  }
+
+  /** Counts on from Count at cycle T */
+  void
+  Restart (Timer &Which, Uint64 T)
+  {
+    Which.Base = T;
+    Which.Next = CountsCycles (Which) ? T + Which.Count + 1 : Scheduler::NEVER;
+    Events->Cancel (OnTimer, &Which);
+    if (Which.Next != Scheduler::NEVER)
+      {
+        Events->Schedule (Which.Next, OnTimer, &Which);
+      }
+  }
+
+  /** The counter passed 0 at cycle At: reload, and stop in one-shot
+   * mode */
+  void
+  Underflow (Timer &Which, Uint64 At)
+  {
+    Flags |= &Which == &A ? ICR_TA : ICR_TB;
+    if (Which.Control & CR_ONE_SHOT)
+      {
+        Which.Control &= ~CR_START;
+      }
+    Which.Count = Which.Latch;
+    Restart (Which, At);
+
+    if (&Which == &A && (B.Control & CR_START)
+        && (B.Control & CRB_CASCADE))
+      {
+        if (B.Count-- == 0)
+          {
+            Underflow (B, At);
+          }
+      }
+  }
+
+  Uint32
+  TodDivider () const
+  {
+    return (A.Control & CRA_TOD_50HZ) ? 5 : 6;
+  }
+
+  /** Tenths counted since TodBase */
+  Uint64
+  TodTicks (Uint64 T) const
+  {
+    return (T - TodBase) * MainsHz / ((Uint64)ClockHz * TodDivider ());
+  }
+
+  void
+  TodRebase (Uint64 T)
+  {
+    TodTenths = TodNow (T);
+    TodBase = T;
+  }
+
+  static Byte
+  ToBcd (Uint32 Value)
+  {
+    return ((Value / 10) << 4) | (Value % 10);
+  }
+
+  static Uint32
+  FromBcd (Byte Value)
+  {
+    return (Value >> 4) * 10 + (Value & 0x0F);
+  }
+
+  /** Tenths since midnight as the four TOD registers */
+  static void
+  TodFields (Uint32 Tenths, Byte Fields[4])
+  {
+    Uint32 Seconds = Tenths / 10;
+    Uint32 Hours = Seconds / 3600;
+    Fields[0] = Tenths % 10;
+    Fields[1] = ToBcd (Seconds % 60);
+    Fields[2] = ToBcd (Seconds / 60 % 60);
+    Fields[3] = ToBcd (Hours % 12 ? Hours % 12 : 12) | (Hours >= 12 ? 0x80 : 0);
+  }
+
+  /** The four TOD registers as tenths since midnight. Digits out of BCD
+   * range still count by their weight. */
+  static Uint32
+  TodLinear (const Byte Fields[4])
+  {
+    Uint32 Hours = FromBcd (Fields[3] & 0x1F) % 12 + (Fields[3] & 0x80 ? 12 : 0);
+    Uint32 Minutes = Hours * 60 + FromBcd (Fields[2] & 0x7F);
+    Uint32 Seconds = Minutes * 60 + FromBcd (Fields[1] & 0x7F);
+    return (Seconds * 10 + (Fields[0] & 0x0F)) % TOD_DAY;
+  }
+
+  Byte
+  ReadTod (Uint32 Field, Uint64 T)
+  {
+    Byte Fields[4];
+    TodFields (TodNow (T), Fields);
+    if (Field == 3 && !TodLatched)
+      {
+        memcpy (TodLatch, Fields, sizeof (Fields));
+        TodLatched = true;
+      }
+    Byte Value = TodLatched ? TodLatch[Field] : Fields[Field];
+    if (Field == 0)
+      {
+        TodLatched = false;
+      }
+    return Value;
+  }
+
+  /** Writing the hours stops the clock until the tenths are written.
+   * With CRB_ALARM set the writes go to the alarm instead. */
+  void
+  WriteTod (Uint32 Field, Byte Value, Uint64 T)
+  {
+    static constexpr Byte FIELD_MASKS[4] = { 0x0F, 0x7F, 0x7F, 0x9F };
+    Byte Fields[4];
+    if (B.Control & CRB_ALARM)
+      {
+        TodFields (Alarm, Fields);
+        Fields[Field] = Value & FIELD_MASKS[Field];
+        Alarm = TodLinear (Fields);
+        RescheduleAlarm (T);
+        return;
+      }
+
+    Uint32 Current = TodNow (T);
+    TodFields (Current, Fields);
+    Fields[Field] = Value & FIELD_MASKS[Field];
+    Uint32 Set = TodLinear (Fields);
+    if (Field == 3)
+      {
+        TodStopped = true;
+        TodTenths = Set;
+      }
+    else if (Field == 0)
+      {
+        TodStopped = false;
+        TodTenths = Set;
+        TodBase = T;
+      }
+    else if (TodStopped)
+      {
+        TodTenths = Set;
+      }
+    else
+      {
+        // Keep the running clock's phase within the tenth
+        TodTenths = (TodTenths + Set + TOD_DAY - Current) % TOD_DAY;
+      }
+    RescheduleAlarm (T);
+  }
+
+  /** Schedules the alarm for the first cycle after T at which the clock
+   * shows Alarm */
+  void
+  RescheduleAlarm (Uint64 T)
+  {
+    Events->Cancel (OnAlarm, this);
+    AlarmAt = Scheduler::NEVER;
+    if (TodStopped)
+      {
+        return;
+      }
+    Uint32 Wait = (Alarm + TOD_DAY - TodNow (T)) % TOD_DAY;
+    if (Wait == 0)
+      {
+        Wait = TOD_DAY; // Only a change to the alarm time counts
+      }
+    Uint64 Ticks = TodTicks (T) + Wait;
+    Uint64 PerTick = (Uint64)ClockHz * TodDivider ();
+    AlarmAt = TodBase + (Ticks * PerTick + MainsHz - 1) / MainsHz;
+    Events->Schedule (AlarmAt, OnAlarm, this);
+  }
+};
+
+#define CIA_CPP
+#endif // !CIA_CPP
@@ -0,0 +1,136 @@
+#ifndef COVERAGE_CPP
+
+#include "cpu.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Memory access coverage.
+ *
+ * Three 64K-bit maps, one bit per address: fetched as an opcode, read as
+ * data, and written. Marking is a shift and an OR with no branches, so an
+ * attached Coverage costs a few instructions per access. The CPU only
+ * calls into it from the instrumented Execute path (see CPUHooks), so a
+ * CPU without coverage attached pays nothing.
+ */
+struct Coverage
+{
+  static constexpr Uint32 MAP_WORDS = (1024 * 64) / 64;
+  static constexpr Uint32 MAP_BYTES = MAP_WORDS * 8;
+
+  Uint64 Executed[MAP_WORDS];
+  Uint64 Read[MAP_WORDS];
+  Uint64 Written[MAP_WORDS];
+
+  void
+  Clear ()
+  {
+    memset (Executed, 0, sizeof (Executed));
+    memset (Read, 0, sizeof (Read));
+    memset (Written, 0, sizeof (Written));
+  }
+
+  static void
+  Mark (Uint64 *Map, Word Address)
+  {
+    Map[Address >> 6] |= (Uint64)1 << (Address & 63);
+  }
+
+  static bool
+  Test (const Uint64 *Map, Word Address)
+  {
+    return (Map[Address >> 6] >> (Address & 63)) & 1;
+  }
+
+  void MarkExecuted (Word Address) { Mark (Executed, Address); }
+  void MarkRead (Word Address) { Mark (Read, Address); }
+  void MarkWritten (Word Address) { Mark (Written, Address); }
+
+  bool WasExecuted (Word Address) const { return Test (Executed, Address); }
+  bool WasRead (Word Address) const { return Test (Read, Address); }
+  bool WasWritten (Word Address) const { return Test (Written, Address); }
+
+  /** Compact binary export
+   *
+   * "CBCV", a version byte, then the executed, read and written maps at
+   * 8 KiB each. Bit (Address & 7) of byte (Address >> 3) is set when the
+   * address was touched, independent of host byte order.
+   */
+  bool
+  WriteBinary (const char *Path) const
+  {
+    FILE *File = fopen (Path, "wb");
+    if (!File)
+      {
+        return false;
+      }
+
+    static constexpr Byte Header[5] = { 'C', 'B', 'C', 'V', 1 };
+    fwrite (Header, 1, sizeof (Header), File);
+
+    const Uint64 *Maps[3] = { Executed, Read, Written };
+    Byte Buffer[MAP_BYTES];
+    for (const Uint64 *Map : Maps)
+      {
+        for (Uint32 i = 0; i < MAP_BYTES; i++)
+          {
+            Buffer[i] = (Byte)(Map[i >> 3] >> ((i & 7) * 8));
+          }
+        fwrite (Buffer, 1, MAP_BYTES, File);
+      }
+
+    return fclose (File) == 0;
+  }
+
+  /** Address range listing
+   *
+   * One line per contiguous run, e.g. "X 0801-0830", with X for executed,
+   * R for read and W for written.
+   */
+  void
+  WriteRanges (FILE *File) const
+  {
+    const Uint64 *Maps[3] = { Executed, Read, Written };
+    const char Kinds[3] = { 'X', 'R', 'W' };
+
+    for (int m = 0; m < 3; m++)
+      {
+        Uint32 Address = 0;
+        while (Address < MAP_WORDS * 64)
+          {
+            // Skip untouched addresses a map word at a time
+            if (Maps[m][Address >> 6] == 0)
+              {
+                Address = (Address | 63) + 1;
+                continue;
+              }
+            if (!Test (Maps[m], Address))
+              {
+                Address++;
+                continue;
+              }
+
+            Uint32 Start = Address;
+            while (Address < MAP_WORDS * 64 && Test (Maps[m], Address))
+              {
+                Address++;
+              }
+            fprintf (File, "%c %04X-%04X\n", Kinds[m], Start, Address - 1);
+          }
+      }
+  }
+
+  bool
+  WriteRanges (const char *Path) const
+  {
+    FILE *File = fopen (Path, "w");
+    if (!File)
+      {
+        return false;
+      }
+    WriteRanges (File);
+    return fclose (File) == 0;
+  }
+};
+
+#define COVERAGE_CPP
+#endif // !COVERAGE_CPP
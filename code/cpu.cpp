@@ -1,12 +1,42 @@
+#ifndef CPU_CPP
+
 #include "cpu.h"
+#include "coverage.cpp"
+#include "profile.cpp"
+#include "statehash.cpp"
+#include "watch.cpp"
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+
+/* Register window of a memory mapped device. Context is passed back to
+ * both callbacks. */
+struct IOHandler
+{
+  Byte (*Read) (void *Context, Word Address);
+  void (*Write) (void *Context, Word Address, Byte Value);
+  void *Context;
+};
 
 struct Memory
 {
   static constexpr Uint32 MAX_MEM = 1024 * 64;
   Byte Data[MAX_MEM];
 
+  // Per page device mapping; null pages are plain RAM. CPU data accesses
+  // go through Read/Write and honour it, Data and operator[] bypass it.
+  // Mappings are configuration and survive Initialize.
+  const IOHandler *IO[256] = {};
+
+  // Per page ROM overlay: CPU reads and fetches of a page with an entry
+  // see the 256 bytes it points to, while writes still reach the RAM
+  // below, as on the C64. Null pages read RAM. Also configuration.
+  const Byte *Rom[256] = {};
+
+  // Optional incremental state hash, kept up to date by Write, Poke, Copy
+  // and Fill. Null by default, which costs Write one untaken branch.
+  StateHash *Hash = nullptr;
+
   /* Initializes memory to 0 */
   void
   Initialize ()
@@ -15,8 +45,22 @@ struct Memory
       {
         Data[i] = 0;
       }
-    Data[0x00] = 0xFF;
-    Data[0x01] = 0x07;
+    if (Hash)
+      {
+        Hash->Rehash (Data);
+      }
+  }
+
+  /** Attaches a state hash, or detaches with null, hashing memory as it
+   * is now */
+  void
+  AttachHash (StateHash *Attached)
+  {
+    Hash = Attached;
+    if (Hash)
+      {
+        Hash->Rehash (Data);
+      }
   }
 
   /** Read one byte */
@@ -35,6 +79,100 @@ struct Memory
     return Data[Address];
   }
 
+  /** Maps pages First..Last to a device */
+  void
+  MapIO (Byte First, Byte Last, const IOHandler *Handler)
+  {
+    for (Uint32 Page = First; Page <= Last; Page++)
+      {
+        IO[Page] = Handler;
+      }
+  }
+
+  /** Maps pages First..Last to the ROM at Image, or back to RAM if
+   * null. The image is used in place, not copied. */
+  void
+  MapRom (Byte First, Byte Last, const Byte *Image)
+  {
+    for (Uint32 Page = First; Page <= Last; Page++)
+      {
+        Rom[Page] = Image ? Image + ((Page - First) << 8) : nullptr;
+      }
+  }
+
+  /** Opcode or operand fetch of one byte: ROM or RAM, never a device */
+  Byte
+  Fetch (Word Address) const
+  {
+    const Byte *Page = Rom[Address >> 8];
+    return Page ? Page[Address & 0xFF] : Data[Address];
+  }
+
+  /** CPU read of one byte */
+  Byte
+  Read (Word Address)
+  {
+    const IOHandler *Handler = IO[Address >> 8];
+    if (Handler)
+      {
+        return Handler->Read (Handler->Context, Address);
+      }
+    return Fetch (Address);
+  }
+
+  /** CPU write of one byte */
+  void
+  Write (Word Address, Byte Value)
+  {
+    const IOHandler *Handler = IO[Address >> 8];
+    if (Handler)
+      {
+        Handler->Write (Handler->Context, Address, Value);
+        return;
+      }
+    Poke (Address, Value);
+  }
+
+  /** Writes one byte of RAM, whatever is mapped over it */
+  void
+  Poke (Word Address, Byte Value)
+  {
+    if (Hash)
+      {
+        Hash->Update (Address, Data[Address], Value);
+      }
+    Data[Address] = Value;
+  }
+
+  /** Copies Count bytes into RAM at To; no wrapping, and From must not
+   * overlap the destination */
+  void
+  Copy (Word To, const Byte *From, Uint32 Count)
+  {
+    if (Hash)
+      {
+        for (Uint32 i = 0; i < Count; i++)
+          {
+            Hash->Update (To + i, Data[To + i], From[i]);
+          }
+      }
+    memcpy (Data + To, From, Count);
+  }
+
+  /** Fills Count bytes of RAM at To with Value; no wrapping */
+  void
+  Fill (Word To, Byte Value, Uint32 Count)
+  {
+    if (Hash)
+      {
+        for (Uint32 i = 0; i < Count; i++)
+          {
+            Hash->Update (To + i, Data[To + i], Value);
+          }
+      }
+    memset (Data + To, Value, Count);
+  }
+
   /** Write two bytes (one Word) */
   void
   WriteWord (Word Value, Byte Address, Sint32 &Cycles)
@@ -45,8 +183,28 @@ struct Memory
   }
 };
 
-struct CPU
+/* Instrumentation attached to a CPU. Every member is optional; while all
+ * of them are null Execute runs the uninstrumented interpreter. */
+struct CPUHooks
+{
+  Coverage *Cov = nullptr;
+  Watchpoints *Watch = nullptr;
+  Profiler *Prof = nullptr;
+
+  bool
+  Active () const
+  {
+    return Cov != nullptr || Watch != nullptr || Prof != nullptr;
+  }
+};
+
+/* 6502 family core, specialized per variant (see cpu.h). CPU is the
+ * MOS 6510 instantiation. */
+template <typename Variant>
+struct CPUCore
 {
+  static constexpr OpcodeTable Opcodes = MakeOpcodeTable<Variant> ();
+
   Word PC; // Program Counter
   Byte SP; // Stack Pointer - Starts at 0x01FF, grows downard to 0x0100
 
@@ -56,6 +214,27 @@ struct CPU
   Byte Y; // Y Index Register
   Byte X; // X Index Register
 
+  CPUHooks Hooks; // Optional instrumentation, off by default
+  StopReason Stop = STOP_NONE; // Set when a watchpoint or breakpoint hits
+  Word StopPC = 0; // PC at the last breakpoint or trap stop
+
+  // Addresses Run stops at for the host to serve the routine there,
+  // hooked or not (see AddTrap)
+  static constexpr Uint32 MAX_TRAPS = 4;
+  Word Traps[MAX_TRAPS];
+  Uint32 TrapCount = 0;
+  Byte TrapPages[256] = {}; // Traps per page, a cheap first test of PC
+
+  Uint64 Instructions = 0;    // Instructions retired
+  Uint64 RetiredCycles = 0;   // Their cycles, since Reset
+  Uint64 PageCrossCycles = 0; // Cycles added for page crossings
+
+  // Cycles a recognized copy or fill loop may take natively in one go.
+  // Run sets it for the uninstrumented interpreter; everywhere else it
+  // is 0 and such loops are interpreted.
+  Sint32 BulkBudget = 0;
+  Uint64 BulkLoops = 0; // Loops run natively
+
   Byte N : 1; // Negative flag
   Byte V : 1; // Overflow flag
   Byte B : 1; // Break flag
@@ -96,12 +275,31 @@ struct CPU
 
     A = X = Y = 0;
     N = V = B = D = I = Z = C = 0;
+    RetiredCycles = 0;
     memory.Initialize ();
+
+    if constexpr (Variant::HasIOPort)
+      {
+        // 6510 processor port: data direction and data registers
+        memory.Poke (0x00, 0xFF);
+        memory.Poke (0x01, 0x07);
+      }
+  }
+  template <bool Hooked>
+  Byte
+  FetchOpcode (Memory &memory, Sint32 &Cycles)
+  {
+    if (Hooked && Hooks.Cov)
+      {
+        Hooks.Cov->MarkExecuted (PC);
+      }
+    return FetchByte (memory, Cycles);
   }
+
   Byte
   FetchByte (Memory &memory, Sint32 &Cycles)
   {
-    Byte Data = memory[PC];
+    Byte Data = memory.Fetch (PC);
     PC++;
     Cycles++;
     return (Data);
@@ -112,11 +310,11 @@ struct CPU
   {
 
     // 6502 is little endian
-    Word Data = memory[PC];
+    Word Data = memory.Fetch (PC);
     PC++;
 
     Cycles++;
-    Data |= (memory[PC] << 8);
+    Data |= (memory.Fetch (PC) << 8);
     PC++;
 
     Cycles++;
@@ -125,18 +323,38 @@ struct CPU
     return Data;
   }
 
+  template <bool Hooked = false>
   Byte
   ReadByte (Memory &memory, Byte Address, Sint32 &Cycles)
   {
+    if (Hooked && Hooks.Cov)
+      {
+        Hooks.Cov->MarkRead (Address);
+      }
+    if (Hooked && Hooks.Watch
+        && Hooks.Watch->Check (Address, Watchpoints::WATCH_READ))
+      {
+        Stop = STOP_READ_WATCH;
+      }
     Byte Data = memory[Address];
     Cycles++;
     return (Data);
   }
 
+  template <bool Hooked = false>
   Byte
   ReadByte (Memory &memory, Word Address, Sint32 &Cycles)
   {
-    Byte Data = memory[Address];
+    if (Hooked && Hooks.Cov)
+      {
+        Hooks.Cov->MarkRead (Address);
+      }
+    if (Hooked && Hooks.Watch
+        && Hooks.Watch->Check (Address, Watchpoints::WATCH_READ))
+      {
+        Stop = STOP_READ_WATCH;
+      }
+    Byte Data = memory.Read (Address);
     Cycles++;
     return (Data);
   }
@@ -151,6 +369,44 @@ struct CPU
     return (Data);
   }
 
+  template <bool Hooked = false>
+  void
+  WriteByte (Memory &memory, Word Address, Byte Value, Sint32 &Cycles)
+  {
+    if (Hooked && Hooks.Cov)
+      {
+        Hooks.Cov->MarkWritten (Address);
+      }
+    if (Hooked && Hooks.Watch
+        && Hooks.Watch->Check (Address, Watchpoints::WATCH_WRITE))
+      {
+        Stop = STOP_WRITE_WATCH;
+      }
+    memory.Write (Address, Value);
+    Cycles++;
+  }
+
+  /** Status register as pushed to the stack: NV-BDIZC */
+  Byte
+  GetStatus () const
+  {
+    return (N << 7) | (V << 6) | 0x20 | (B << 4) | (D << 3) | (I << 2)
+           | (Z << 1) | C;
+  }
+
+  /** Loads the flags from a pulled status byte; B and bit 5 are not
+   * flags in the register */
+  void
+  SetStatus (Byte Status)
+  {
+    N = Status >> 7;
+    V = Status >> 6;
+    D = Status >> 3;
+    I = Status >> 2;
+    Z = Status >> 1;
+    C = Status;
+  }
+
   void
   SetStatusFlag (Byte &Value)
   {
@@ -158,6 +414,91 @@ struct CPU
     N = (Value & 0b10000000) > 0;
   }
 
+  /** ADC with the variant's decimal mode behaviour. SBC is the same
+   * operation on the inverted operand in binary mode. */
+  void
+  AddWithCarry (Byte Value, Sint32 &Cycles)
+  {
+    Word Sum = A + Value + C;
+    if (!D)
+      {
+        V = ((~(A ^ Value) & (A ^ Sum)) & 0x80) != 0;
+        C = Sum > 0xFF;
+        A = (Byte)Sum;
+        SetStatusFlag (A);
+        return;
+      }
+
+    Byte Binary = (Byte)Sum;
+    Word Lo = (A & 0x0F) + (Value & 0x0F) + C;
+    if (Lo > 0x09)
+      {
+        Lo += 0x06;
+      }
+    Word Hi = (A >> 4) + (Value >> 4) + (Lo > 0x0F);
+    V = ((~(A ^ Value) & (A ^ (Hi << 4))) & 0x80) != 0;
+    Byte IntermediateN = (Hi & 0x08) != 0;
+    if (Hi > 0x09)
+      {
+        Hi += 0x06;
+      }
+    C = Hi > 0x0F;
+    A = (Byte)((Hi << 4) | (Lo & 0x0F));
+
+    if constexpr (Variant::DecimalFlagsValid)
+      {
+        SetStatusFlag (A);
+        Cycles++;
+      }
+    else
+      {
+        // NMOS: Z from the binary sum, N from the uncorrected high digit
+        Z = Binary == 0;
+        N = IntermediateN;
+      }
+  }
+
+  void
+  SubtractWithBorrow (Byte Value, Sint32 &Cycles)
+  {
+    if (!D)
+      {
+        AddWithCarry (Value ^ 0xFF, Cycles);
+        return;
+      }
+
+    // Carry and overflow follow the binary subtraction on every variant
+    Word Difference = A - Value - (1 - C);
+    Byte Binary = (Byte)Difference;
+    Byte Overflow = (((A ^ Value) & (A ^ Binary)) & 0x80) != 0;
+
+    Sint32 Lo = (A & 0x0F) - (Value & 0x0F) - (1 - C);
+    Sint32 Hi = (A >> 4) - (Value >> 4);
+    if (Lo < 0)
+      {
+        Lo -= 0x06;
+        Hi--;
+      }
+    if (Hi < 0)
+      {
+        Hi -= 0x06;
+      }
+
+    C = Difference < 0x100;
+    V = Overflow;
+    A = (Byte)(((Hi & 0x0F) << 4) | (Lo & 0x0F));
+
+    if constexpr (Variant::DecimalFlagsValid)
+      {
+        SetStatusFlag (A);
+        Cycles++;
+      }
+    else
+      {
+        SetStatusFlag (Binary);
+      }
+  }
+
   Word
   GetWordAddress (Byte LoByte, Byte HiByte)
   {
@@ -166,12 +507,392 @@ struct CPU
     return Address;
   }
 
+  /** Executes one instruction
+   *
+   * Dispatches to the instrumented variant of Step only when a hook is
+   * attached, so the plain interpreter carries no per-access checks.
+   * A watchpoint hit still completes the instruction and leaves the
+   * reason in Stop. PC breakpoints are only honoured by Run.
+   */
   Sint32
   Execute (Memory &memory)
+  {
+    if (Hooks.Active ())
+      {
+        return Step<true> (memory);
+      }
+    return Step<false> (memory);
+  }
+
+  /** Makes Run stop with STOP_TRAP on reaching Address. Unlike a
+   * breakpoint, a trap does not attach hooks: the uninstrumented
+   * interpreter tests PC against a page filter before each instruction
+   * and only compares addresses on a trapped page. Returns false when
+   * MAX_TRAPS are set. */
+  bool
+  AddTrap (Word Address)
+  {
+    if (TrapAt (Address))
+      {
+        return true;
+      }
+    if (TrapCount == MAX_TRAPS)
+      {
+        return false;
+      }
+    Traps[TrapCount++] = Address;
+    TrapPages[Address >> 8]++;
+    return true;
+  }
+
+  void
+  RemoveTrap (Word Address)
+  {
+    for (Uint32 i = 0; i < TrapCount; i++)
+      {
+        if (Traps[i] == Address)
+          {
+            Traps[i] = Traps[--TrapCount];
+            TrapPages[Address >> 8]--;
+            return;
+          }
+      }
+  }
+
+  bool
+  TrapAt (Word Address) const
+  {
+    if (!TrapPages[Address >> 8])
+      {
+        return false;
+      }
+    for (Uint32 i = 0; i < TrapCount; i++)
+      {
+        if (Traps[i] == Address)
+          {
+            return true;
+          }
+      }
+    return false;
+  }
+
+  bool
+  AnyTrapIn (Word First, Word Last) const
+  {
+    for (Uint32 i = 0; i < TrapCount; i++)
+      {
+        if (Traps[i] >= First && Traps[i] <= Last)
+          {
+            return true;
+          }
+      }
+    return false;
+  }
+
+  /** Runs instructions until at least Budget cycles have been used or a
+   * breakpoint, watchpoint or trap stops the CPU. Returns the cycles
+   * used and leaves the reason in Stop.
+   *
+   * Breakpoints are resolved once per basic block: on entry to a block
+   * the whole range is checked against the watch list, and only blocks
+   * that contain a breakpoint compare PC before each instruction. Only
+   * a Run resuming from a breakpoint or trap stop, at the PC it stopped
+   * at, steps over the breakpoint there. Every other start checks it: a
+   * first Run, a run split into slices, and one after a watchpoint,
+   * which stops with PC already on the next instruction. Traps behave
+   * the same, and are checked before breakpoints at the same address.
+   */
+  Sint32
+  Run (Memory &memory, Sint32 Budget)
+  {
+    Sint32 Cycles = 0;
+    bool Resuming
+        = (Stop == STOP_BREAKPOINT || Stop == STOP_TRAP) && PC == StopPC;
+
+    if (!Hooks.Active () && !TrapCount)
+      {
+        while (Cycles < Budget)
+          {
+            BulkBudget = Budget - Cycles;
+            Cycles += Step<false> (memory);
+          }
+        BulkBudget = 0;
+        Stop = STOP_BUDGET;
+        return Cycles;
+      }
+
+    if (!Hooks.Active ())
+      {
+        while (Cycles < Budget)
+          {
+            if (!Resuming && TrapAt (PC))
+              {
+                BulkBudget = 0;
+                Stop = STOP_TRAP;
+                StopPC = PC;
+                return Cycles;
+              }
+            Resuming = false;
+            BulkBudget = Budget - Cycles;
+            Cycles += Step<false> (memory);
+          }
+        BulkBudget = 0;
+        Stop = STOP_BUDGET;
+        return Cycles;
+      }
+
+    if (!Hooks.Watch || !Hooks.Watch->HasBreakpoints ())
+      {
+        while (Cycles < Budget)
+          {
+            if (TrapCount && !Resuming && TrapAt (PC))
+              {
+                Stop = STOP_TRAP;
+                StopPC = PC;
+                return Cycles;
+              }
+            Resuming = false;
+            Cycles += Step<true> (memory);
+            if (Stop != STOP_NONE)
+              {
+                return Cycles;
+              }
+          }
+        Stop = STOP_BUDGET;
+        return Cycles;
+      }
+
+    while (Cycles < Budget)
+      {
+        Word Start = PC;
+        Word Last = LastInBlock (memory, Start);
+        bool CheckPC = Hooks.Watch->AnyBreakpointIn (Start, Last)
+                       || AnyTrapIn (Start, Last);
+
+        for (;;)
+          {
+            if (CheckPC && !Resuming && TrapAt (PC))
+              {
+                Stop = STOP_TRAP;
+                StopPC = PC;
+                return Cycles;
+              }
+            if (CheckPC && !Resuming
+                && Hooks.Watch->Check (PC, Watchpoints::WATCH_EXEC))
+              {
+                Stop = STOP_BREAKPOINT;
+                StopPC = PC;
+                return Cycles;
+              }
+            Resuming = false;
+
+            Word At = PC;
+            Cycles += Step<true> (memory);
+            if (Stop != STOP_NONE)
+              {
+                return Cycles;
+              }
+            if (At == Last || PC <= At || PC > Last || Cycles >= Budget)
+              {
+                break;
+              }
+          }
+      }
+    Stop = STOP_BUDGET;
+    return Cycles;
+  }
+
+  /** Address of the last instruction of the basic block at Start. A
+   * block ends at a flow instruction, an opcode the core does not handle
+   * or the top of memory. */
+  Word
+  LastInBlock (const Memory &memory, Word Start)
+  {
+    Uint32 Address = Start;
+    for (;;)
+      {
+        const OpcodeInfo &Info = Opcodes[memory.Fetch (Address)];
+        if (Info.Bytes == 0 || (Info.Flags & OP_FLOW)
+            || Address + Info.Bytes > 0xFFFF)
+          {
+            return Address;
+          }
+        Address += Info.Bytes;
+      }
+  }
+
+  static constexpr Uint32 MAX_LOOP_STORES = 4;
+
+  /** Runs the rest of a copy or fill loop natively, from the top of the
+   * loop that the BNE at Branch just went back to.
+   *
+   * The body must be an optional LDA abs,I, one to four STA abs,I, then
+   * INI or DEI, all with the same index register I: a copy like
+   * LDA src,X / STA dst,X / DEX / BNE, or a fill like a screen clear.
+   * Everything it touches must be plain RAM (no device, no ROM overlay)
+   * without wrapping at $FFFF, stores must miss the loop's own code and,
+   * in a copy, the source and each other. Then each store is one memcpy
+   * or memset.
+   *
+   * Runs as many whole iterations as fit in Allowed cycles, leaving the
+   * registers, flags, PC and counters as interpreting them would have.
+   * Returns their cycles; 0 when the loop is not one of these, and it is
+   * then interpreted.
+   */
+  Sint32
+  RunLoop (Memory &memory, Word Branch, Sint32 Allowed)
+  {
+    Word Top = PC;
+    Word At = Top;
+    Byte Op = memory.Fetch (At);
+    bool Load = Op == INS_LDA_ABX || Op == INS_LDA_ABY;
+    bool UseY = Op == INS_LDA_ABY || Op == INS_STA_ABY;
+    Word Source = 0;
+    if (Load)
+      {
+        Source = OperandAt (memory, At);
+        At += 3;
+      }
+    Byte Store = UseY ? INS_STA_ABY : INS_STA_ABX;
+    Word Stores[MAX_LOOP_STORES];
+    Uint32 Count = 0;
+    while (Count < MAX_LOOP_STORES && memory.Fetch (At) == Store)
+      {
+        Stores[Count++] = OperandAt (memory, At);
+        At += 3;
+      }
+    Op = memory.Fetch (At);
+    bool Down = Op == (UseY ? INS_DEY : INS_DEX);
+    if (Count == 0 || (Word)(At + 1) != Branch
+        || (!Down && Op != (UseY ? INS_INY : INS_INX))
+        || AnyTrapIn (Top, Branch))
+      {
+        return 0;
+      }
+
+    // The iterations left take the index down to 0, or up through $FF
+    Byte Index = UseY ? Y : X;
+    Uint32 Left = Down ? Index : 0x100 - Index;
+    Uint32 BranchCross = (((Branch + 2) ^ Top) & 0xFF00) ? 1 : 0;
+    Sint32 Longest = (Load ? 5 : 0) + 5 * Count + 2 + 3 + BranchCross;
+    Uint32 Runs = Allowed / Longest;
+    if (Runs > Left)
+      {
+        Runs = Left;
+      }
+    if (Runs == 0)
+      {
+        return 0;
+      }
+    Byte Low = Down ? Index - (Runs - 1) : Index;
+    Byte High = Down ? Index : Index + (Runs - 1);
+
+    if (Load && !PlainRange (memory, Source, Low, High))
+      {
+        return 0;
+      }
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        Uint32 First = Stores[i] + Low;
+        Uint32 Last = Stores[i] + High;
+        if (!PlainRange (memory, Stores[i], Low, High)
+            || Overlaps (First, Last, Top, Branch + 1)
+            || (Load && Overlaps (First, Last, Source + Low, Source + High)))
+          {
+            return 0;
+          }
+        for (Uint32 j = 0; Load && j < i; j++)
+          {
+            if (Overlaps (First, Last, Stores[j] + Low, Stores[j] + High))
+              {
+                return 0;
+              }
+          }
+      }
+
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        if (Load)
+          {
+            memory.Copy (Stores[i] + Low, memory.Data + Source + Low, Runs);
+          }
+        else
+          {
+            memory.Fill (Stores[i] + Low, A, Runs);
+          }
+      }
+    if (Load)
+      {
+        A = memory.Data[Source + (Down ? Low : High)];
+      }
+
+    // LDA abs,I crosses a page from the index that takes it past $FF
+    Uint32 Crossing = 0;
+    Uint32 FirstCrossing = 0x100 - (Source & 0xFF);
+    if (Load && High >= FirstCrossing)
+      {
+        Crossing = High - (Low > FirstCrossing ? Low : FirstCrossing) + 1;
+      }
+    bool Done = Runs == Left;
+    Uint32 Taken = Done ? Runs - 1 : Runs;
+    Sint32 Cycles = Runs * ((Load ? 4 : 0) + 5 * Count + 2 + 2)
+                    + Taken * (1 + BranchCross) + Crossing;
+    PageCrossCycles += Crossing + Taken * BranchCross;
+    Instructions += Runs * (Load + Count + 2);
+
+    Index = Down ? Index - Runs : Index + Runs;
+    (UseY ? Y : X) = Index;
+    SetStatusFlag (Index);
+    PC = Done ? Branch + 2 : Top;
+    BulkLoops++;
+    return Cycles;
+  }
+
+  /** The absolute operand of the instruction at Address */
+  static Word
+  OperandAt (const Memory &memory, Word Address)
+  {
+    return memory.Fetch (Address + 1) | (memory.Fetch (Address + 2) << 8);
+  }
+
+  /** Whether Base+Low..Base+High is plain RAM, short of $FFFF */
+  static bool
+  PlainRange (const Memory &memory, Word Base, Byte Low, Byte High)
+  {
+    Uint32 First = Base + Low;
+    Uint32 Last = Base + High;
+    if (Last > 0xFFFF)
+      {
+        return false;
+      }
+    for (Uint32 Page = First >> 8; Page <= Last >> 8; Page++)
+      {
+        if (memory.IO[Page] || memory.Rom[Page])
+          {
+            return false;
+          }
+      }
+    return true;
+  }
+
+  static bool
+  Overlaps (Uint32 FirstA, Uint32 LastA, Uint32 FirstB, Uint32 LastB)
+  {
+    return FirstA <= LastB && FirstB <= LastA;
+  }
+
+  template <bool Hooked>
+  Sint32
+  Step (Memory &memory)
   {
     Sint32 Cycles = 0;
+    if (Hooked)
+      {
+        Stop = STOP_NONE;
+      }
+    Instructions++;
 
-    Byte instruction = FetchByte (memory, Cycles); // One cycle
+    Byte instruction = FetchOpcode<Hooked> (memory, Cycles); // One cycle
     switch (instruction)
       {
       /****************************************
@@ -204,6 +925,18 @@ struct CPU
           SetStatusFlag (Y);
         }
         break;
+      case INS_ADC_IM:
+        {
+          Byte Value = FetchByte (memory, Cycles);
+          AddWithCarry (Value, Cycles);
+        }
+        break;
+      case INS_SBC_IM:
+        {
+          Byte Value = FetchByte (memory, Cycles);
+          SubtractWithBorrow (Value, Cycles);
+        }
+        break;
 
       /****************************************
        * Absolute Addressing
@@ -256,7 +989,7 @@ struct CPU
 
           Word Address = GetWordAddress (LoByte, HiByte);
 
-          A = ReadByte (memory, Address, Cycles);
+          A = ReadByte<Hooked> (memory, Address, Cycles);
 
           SetStatusFlag (A);
         }
@@ -267,7 +1000,7 @@ struct CPU
           Byte HiByte = FetchByte (memory, Cycles);
 
           Word Address = GetWordAddress (LoByte, HiByte);
-          X = ReadByte (memory, Address, Cycles);
+          X = ReadByte<Hooked> (memory, Address, Cycles);
           SetStatusFlag (X);
         }
         break;
@@ -277,10 +1010,69 @@ struct CPU
           Byte HiByte = FetchByte (memory, Cycles);
 
           Word Address = GetWordAddress (LoByte, HiByte);
-          Y = ReadByte (memory, Address, Cycles);
+          Y = ReadByte<Hooked> (memory, Address, Cycles);
           SetStatusFlag (Y);
         }
         break;
+      case INS_ADC_ABS:
+        {
+          Byte LoByte = FetchByte (memory, Cycles);
+          Byte HiByte = FetchByte (memory, Cycles);
+
+          Word Address = GetWordAddress (LoByte, HiByte);
+          AddWithCarry (ReadByte<Hooked> (memory, Address, Cycles), Cycles);
+        }
+        break;
+      case INS_SBC_ABS:
+        {
+          Byte LoByte = FetchByte (memory, Cycles);
+          Byte HiByte = FetchByte (memory, Cycles);
+
+          Word Address = GetWordAddress (LoByte, HiByte);
+          SubtractWithBorrow (ReadByte<Hooked> (memory, Address, Cycles),
+                              Cycles);
+        }
+        break;
+      case INS_LAX_ABS:
+        {
+          if constexpr (Variant::Undocumented)
+            {
+              Byte LoByte = FetchByte (memory, Cycles);
+              Byte HiByte = FetchByte (memory, Cycles);
+
+              Word Address = GetWordAddress (LoByte, HiByte);
+              A = X = ReadByte<Hooked> (memory, Address, Cycles);
+              SetStatusFlag (A);
+            }
+        }
+        break;
+      case INS_STA_ABS:
+        {
+          Byte LoByte = FetchByte (memory, Cycles);
+          Byte HiByte = FetchByte (memory, Cycles);
+
+          Word Address = GetWordAddress (LoByte, HiByte);
+          WriteByte<Hooked> (memory, Address, A, Cycles);
+        }
+        break;
+      case INS_STX_ABS:
+        {
+          Byte LoByte = FetchByte (memory, Cycles);
+          Byte HiByte = FetchByte (memory, Cycles);
+
+          Word Address = GetWordAddress (LoByte, HiByte);
+          WriteByte<Hooked> (memory, Address, X, Cycles);
+        }
+        break;
+      case INS_STY_ABS:
+        {
+          Byte LoByte = FetchByte (memory, Cycles);
+          Byte HiByte = FetchByte (memory, Cycles);
+
+          Word Address = GetWordAddress (LoByte, HiByte);
+          WriteByte<Hooked> (memory, Address, Y, Cycles);
+        }
+        break;
 /*
         #  address R/W description
        --- ------- --- -------------------------------------------------
@@ -295,7 +1087,6 @@ struct CPU
           Byte HiByte = FetchByte (memory, Cycles);
 
           PC = GetWordAddress(LoByte, HiByte);
-          printf("PC = %x\n", PC);
           Cycles ++;
           
         }
@@ -376,11 +1167,12 @@ struct CPU
           Address += X;
           Byte AddrAfterHiByte = Address >> 8;
 
-          A = ReadByte (memory, Address, Cycles);
+          A = ReadByte<Hooked> (memory, Address, Cycles);
           SetStatusFlag (A);
           if (AddrHiByte != AddrAfterHiByte)
             {
               Cycles++;
+              PageCrossCycles++;
             }
         }
         break;
@@ -396,11 +1188,12 @@ struct CPU
           Address += Y;
           Byte AddrAfterHiByte = Address >> 8;
 
-          A = ReadByte (memory, Address, Cycles);
+          A = ReadByte<Hooked> (memory, Address, Cycles);
           SetStatusFlag (A);
           if (AddrHiByte != AddrAfterHiByte)
             {
               Cycles++;
+              PageCrossCycles++;
             }
         }
         break;
@@ -416,11 +1209,12 @@ struct CPU
           Address += Y;
           Byte AddrAfterHiByte = Address >> 8;
 
-          X = ReadByte (memory, Address, Cycles);
+          X = ReadByte<Hooked> (memory, Address, Cycles);
           SetStatusFlag (X);
           if (AddrHiByte != AddrAfterHiByte)
             {
               Cycles++;
+              PageCrossCycles++;
             }
         }
         break;
@@ -435,14 +1229,41 @@ struct CPU
           Address += X;
           Byte AddrAfterHiByte = Address >> 8;
 
-          Y = ReadByte (memory, Address, Cycles);
+          Y = ReadByte<Hooked> (memory, Address, Cycles);
           SetStatusFlag (Y);
           if (AddrHiByte != AddrAfterHiByte)
             {
               Cycles++;
+              PageCrossCycles++;
             }
         }
         break;
+      case INS_STA_ABX:
+        {
+          Byte LoByte = FetchByte (memory, Cycles);
+          Byte HiByte = FetchByte (memory, Cycles);
+
+          Word Address = GetWordAddress (LoByte, HiByte);
+          Address += X;
+
+          // The dummy read of cycle 4 happens whether or not a page was
+          // crossed
+          Cycles++;
+          WriteByte<Hooked> (memory, Address, A, Cycles);
+        }
+        break;
+      case INS_STA_ABY:
+        {
+          Byte LoByte = FetchByte (memory, Cycles);
+          Byte HiByte = FetchByte (memory, Cycles);
+
+          Word Address = GetWordAddress (LoByte, HiByte);
+          Address += Y;
+
+          Cycles++;
+          WriteByte<Hooked> (memory, Address, A, Cycles);
+        }
+        break;
 
       /****************************************
        * Zero Page Addressing
@@ -480,24 +1301,66 @@ struct CPU
       case INS_LDA_ZP:
         {
           Byte Address = FetchByte (memory, Cycles);
-          A = ReadByte (memory, Address, Cycles);
+          A = ReadByte<Hooked> (memory, Address, Cycles);
           SetStatusFlag (A);
         }
         break;
       case INS_LDX_ZP:
         {
           Byte Address = FetchByte (memory, Cycles);
-          X = ReadByte (memory, Address, Cycles);
+          X = ReadByte<Hooked> (memory, Address, Cycles);
           SetStatusFlag (X);
         }
         break;
       case INS_LDY_ZP:
         {
           Byte Address = FetchByte (memory, Cycles);
-          Y = ReadByte (memory, Address, Cycles);
+          Y = ReadByte<Hooked> (memory, Address, Cycles);
           SetStatusFlag (Y);
         }
         break;
+      case INS_ADC_ZP:
+        {
+          Byte Address = FetchByte (memory, Cycles);
+          AddWithCarry (ReadByte<Hooked> (memory, Address, Cycles), Cycles);
+        }
+        break;
+      case INS_SBC_ZP:
+        {
+          Byte Address = FetchByte (memory, Cycles);
+          SubtractWithBorrow (ReadByte<Hooked> (memory, Address, Cycles),
+                              Cycles);
+        }
+        break;
+      case INS_LAX_ZP:
+        {
+          // A single-cycle NOP on the 65C02
+          if constexpr (Variant::Undocumented)
+            {
+              Byte Address = FetchByte (memory, Cycles);
+              A = X = ReadByte<Hooked> (memory, Address, Cycles);
+              SetStatusFlag (A);
+            }
+        }
+        break;
+      case INS_STA_ZP:
+        {
+          Byte Address = FetchByte (memory, Cycles);
+          WriteByte<Hooked> (memory, Address, A, Cycles);
+        }
+        break;
+      case INS_STX_ZP:
+        {
+          Byte Address = FetchByte (memory, Cycles);
+          WriteByte<Hooked> (memory, Address, X, Cycles);
+        }
+        break;
+      case INS_STY_ZP:
+        {
+          Byte Address = FetchByte (memory, Cycles);
+          WriteByte<Hooked> (memory, Address, Y, Cycles);
+        }
+        break;
 
         /****************************************
          * Zero Page Indexed Addressing
@@ -553,7 +1416,7 @@ struct CPU
           Byte Address = FetchByte (memory, Cycles);
           Address = (Address + X) & 0x00FF;
           Cycles++;
-          A = ReadByte (memory, Address, Cycles);
+          A = ReadByte<Hooked> (memory, Address, Cycles);
           SetStatusFlag (A);
         }
         break;
@@ -562,7 +1425,7 @@ struct CPU
           Byte Address = FetchByte (memory, Cycles);
           Address += Y;
           Cycles++;
-          X = ReadByte (memory, Address, Cycles);
+          X = ReadByte<Hooked> (memory, Address, Cycles);
           SetStatusFlag (X);
         }
         break;
@@ -571,10 +1434,34 @@ struct CPU
           Byte Address = FetchByte (memory, Cycles);
           Address += X;
           Cycles++;
-          Y = ReadByte (memory, Address, Cycles);
+          Y = ReadByte<Hooked> (memory, Address, Cycles);
           SetStatusFlag (Y);
         }
         break;
+      case INS_STA_ZPX:
+        {
+          Byte Address = FetchByte (memory, Cycles);
+          Address += X;
+          Cycles++;
+          WriteByte<Hooked> (memory, Address, A, Cycles);
+        }
+        break;
+      case INS_STX_ZPY:
+        {
+          Byte Address = FetchByte (memory, Cycles);
+          Address += Y;
+          Cycles++;
+          WriteByte<Hooked> (memory, Address, X, Cycles);
+        }
+        break;
+      case INS_STY_ZPX:
+        {
+          Byte Address = FetchByte (memory, Cycles);
+          Address += X;
+          Cycles++;
+          WriteByte<Hooked> (memory, Address, Y, Cycles);
+        }
+        break;
 
         /*************************************************************
          *Relative addressing (BCC, BCS, BNE, BEQ, BPL, BMI, BVC, BVS)
@@ -658,16 +1545,30 @@ struct CPU
           Byte Address = FetchByte (memory, Cycles);
           Address += X;
 
-          Byte LoByte = ReadByte (memory, Address, Cycles);
+          Byte LoByte = ReadByte<Hooked> (memory, Address, Cycles);
           Address += 1;
-          Byte HiByte = ReadByte (memory, Address, Cycles);
+          Byte HiByte = ReadByte<Hooked> (memory, Address, Cycles);
 
           Word TargetAddress = GetWordAddress (LoByte, HiByte);
           Cycles += 1;
-          A = ReadByte (memory, TargetAddress, Cycles);
+          A = ReadByte<Hooked> (memory, TargetAddress, Cycles);
           SetStatusFlag (A);
         }
         break;
+      case INS_STA_IDX:
+        {
+          Byte Address = FetchByte (memory, Cycles);
+          Address += X;
+
+          Byte LoByte = ReadByte<Hooked> (memory, Address, Cycles);
+          Address += 1;
+          Byte HiByte = ReadByte<Hooked> (memory, Address, Cycles);
+
+          Word TargetAddress = GetWordAddress (LoByte, HiByte);
+          Cycles += 1;
+          WriteByte<Hooked> (memory, TargetAddress, A, Cycles);
+        }
+        break;
 
         /****************************************
          * Indirect Indexed Addressing
@@ -741,23 +1642,39 @@ struct CPU
         {
           Byte Address = FetchByte (memory, Cycles);
 
-          Byte LoByte = ReadByte (memory, Address, Cycles);
+          Byte LoByte = ReadByte<Hooked> (memory, Address, Cycles);
           Address += 1;
-          Byte HiByte = ReadByte (memory, Address, Cycles);
+          Byte HiByte = ReadByte<Hooked> (memory, Address, Cycles);
 
           Word TargetAddress = GetWordAddress (LoByte, HiByte);
           TargetAddress += Y;
 
           Byte AddrAfterHiByte = TargetAddress >> 8;
 
-          A = ReadByte (memory, TargetAddress, Cycles);
+          A = ReadByte<Hooked> (memory, TargetAddress, Cycles);
           SetStatusFlag (A);
           if (AddrAfterHiByte != HiByte)
             {
               Cycles++;
+              PageCrossCycles++;
             }
         }
         break;
+      case INS_STA_IDY:
+        {
+          Byte Address = FetchByte (memory, Cycles);
+
+          Byte LoByte = ReadByte<Hooked> (memory, Address, Cycles);
+          Address += 1;
+          Byte HiByte = ReadByte<Hooked> (memory, Address, Cycles);
+
+          Word TargetAddress = GetWordAddress (LoByte, HiByte);
+          TargetAddress += Y;
+
+          Cycles++;
+          WriteByte<Hooked> (memory, TargetAddress, A, Cycles);
+        }
+        break;
 
       /**************************************************
        * Program flow / Stack Instructions
@@ -767,11 +1684,59 @@ struct CPU
           Byte LoByte = FetchByte (memory, Cycles);
           Byte HiByte = FetchByte (memory, Cycles);
 
+          // The return address minus one, high byte first
           Word Address = GetWordAddress (LoByte, HiByte);
-          memory.WriteWord (PC - 1, SP, Cycles);
-          SP -= 1;
+          Word Return = PC - 1;
+          WriteByte<Hooked> (memory, 0x0100 | SP, Return >> 8, Cycles);
+          SP--;
+          WriteByte<Hooked> (memory, 0x0100 | SP, Return & 0xFF, Cycles);
+          SP--;
           PC = Address;
           Cycles++;
+          if (Hooked && Hooks.Prof)
+            {
+              Hooks.Prof->Call (Address, SP);
+            }
+        }
+        break;
+
+      /* RTS: a dummy read and the stack pointer increment, two pulls,
+       * then PC is incremented past the JSR's last byte */
+      case INS_RTS:
+        {
+          Cycles += 2;
+          SP++;
+          Byte LoByte
+              = ReadByte<Hooked> (memory, (Word)(0x0100 | SP), Cycles);
+          SP++;
+          Byte HiByte
+              = ReadByte<Hooked> (memory, (Word)(0x0100 | SP), Cycles);
+          PC = GetWordAddress (LoByte, HiByte) + 1;
+          Cycles++;
+          if (Hooked && Hooks.Prof)
+            {
+              Hooks.Prof->Return (SP);
+            }
+        }
+        break;
+
+      /* RTI: as RTS, but pulling the status first and PC as it is */
+      case INS_RTI:
+        {
+          Cycles += 2;
+          SP++;
+          SetStatus (ReadByte<Hooked> (memory, (Word)(0x0100 | SP), Cycles));
+          SP++;
+          Byte LoByte
+              = ReadByte<Hooked> (memory, (Word)(0x0100 | SP), Cycles);
+          SP++;
+          Byte HiByte
+              = ReadByte<Hooked> (memory, (Word)(0x0100 | SP), Cycles);
+          PC = GetWordAddress (LoByte, HiByte);
+          if (Hooked && Hooks.Prof)
+            {
+              Hooks.Prof->Return (SP);
+            }
         }
         break;
 
@@ -789,9 +1754,79 @@ struct CPU
 
          Note: * The PCH will always be fetched from the same page
                than PCL, i.e. page boundary crossing is not handled.
+
+         The 65C02 fixes this and spends an extra cycle doing so.
       */
       case INS_JMP_IND:
         {
+          Byte LoByte = FetchByte (memory, Cycles);
+          Byte HiByte = FetchByte (memory, Cycles);
+          Word Pointer = GetWordAddress (LoByte, HiByte);
+
+          Word HiPointer = Pointer + 1;
+          if constexpr (Variant::JmpIndirectWraps)
+            {
+              HiPointer = (Pointer & 0xFF00) | (HiPointer & 0x00FF);
+            }
+          else
+            {
+              Cycles++;
+            }
+
+          Byte TargetLo = ReadByte<Hooked> (memory, Pointer, Cycles);
+          Byte TargetHi = ReadByte<Hooked> (memory, HiPointer, Cycles);
+          PC = GetWordAddress (TargetLo, TargetHi);
+        }
+        break;
+      /****************************************
+       * Implied Addressing
+       ****************************************/
+      case INS_INX:
+        X++;
+        SetStatusFlag (X);
+        Cycles++;
+        break;
+      case INS_INY:
+        Y++;
+        SetStatusFlag (Y);
+        Cycles++;
+        break;
+      case INS_DEX:
+        X--;
+        SetStatusFlag (X);
+        Cycles++;
+        break;
+      case INS_DEY:
+        Y--;
+        SetStatusFlag (Y);
+        Cycles++;
+        break;
+
+      /****************************************
+       * Relative Addressing
+       ****************************************
+       A taken branch adds a cycle, and one more when the target is on
+       another page than the next instruction. A BNE back to the top of
+       a copy or fill loop may finish the loop natively (see RunLoop).
+       */
+      case INS_BNE:
+        {
+          Sint8 Offset = (Sint8)FetchByte (memory, Cycles);
+          if (!Z)
+            {
+              Word From = PC;
+              PC = From + Offset;
+              Cycles++;
+              if ((PC ^ From) & 0xFF00)
+                {
+                  Cycles++;
+                  PageCrossCycles++;
+                }
+              if (!Hooked && PC < From && BulkBudget > Cycles)
+                {
+                  Cycles += RunLoop (memory, From - 2, BulkBudget - Cycles);
+                }
+            }
         }
         break;
       default:
@@ -800,6 +1835,14 @@ struct CPU
         };
       }
 
+    RetiredCycles += Cycles;
+    if (Hooked && Hooks.Prof)
+      {
+        Hooks.Prof->Retire (Cycles);
+      }
     return Cycles;
   }
 };
+
+#define CPU_CPP
+#endif // !CPU_CPP
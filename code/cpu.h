@@ -5,11 +5,20 @@
 typedef unsigned char Byte;
 typedef unsigned short Word;
 
+typedef int8_t Sint8;
+typedef int16_t Sint16;
 typedef uint32_t Uint32;
 typedef int32_t Sint32;
+typedef uint64_t Uint64;
 
-typedef struct CPU CPU;
+template <typename Variant> struct CPUCore;
+struct MOS6510;
+typedef CPUCore<MOS6510> CPU;
 typedef struct Memory Memory;
+typedef struct Coverage Coverage;
+typedef struct Profiler Profiler;
+typedef struct StateHash StateHash;
+typedef struct Watchpoints Watchpoints;
 
 /* Instructions */
 
@@ -48,10 +57,198 @@ static constexpr Byte INS_STY_ZP = 0x84;
 static constexpr Byte INS_STY_ZPX = 0x94;
 static constexpr Byte INS_STY_ABS = 0x8C;
 
+/* Arithmetic */
+static constexpr Byte INS_ADC_IM = 0x69;
+static constexpr Byte INS_ADC_ZP = 0x65;
+static constexpr Byte INS_ADC_ABS = 0x6D;
+static constexpr Byte INS_SBC_IM = 0xE9;
+static constexpr Byte INS_SBC_ZP = 0xE5;
+static constexpr Byte INS_SBC_ABS = 0xED;
+
+/* Register increments and decrements */
+static constexpr Byte INS_INX = 0xE8;
+static constexpr Byte INS_INY = 0xC8;
+static constexpr Byte INS_DEX = 0xCA;
+static constexpr Byte INS_DEY = 0x88;
+
 /* Program Flow */
 static constexpr Byte INS_JSR = 0x20;
 static constexpr Byte INS_JMP_ABS = 0x4C;
 static constexpr Byte INS_JMP_IND = 0x6C;
+static constexpr Byte INS_RTS = 0x60;
+static constexpr Byte INS_RTI = 0x40;
+static constexpr Byte INS_BNE = 0xD0;
+
+/* Undocumented (NMOS only; single-cycle NOPs on the 65C02) */
+static constexpr Byte INS_LAX_ZP = 0xA7;
+static constexpr Byte INS_LAX_ABS = 0xAF;
+
+/* CPU variants
+ *
+ * Everything that differs between the chips the core can drive. CPUCore
+ * is instantiated per variant and tests these with if constexpr, so an
+ * instantiation carries no runtime checks for the others.
+ */
+struct NMOS6502
+{
+  static constexpr const char *Name = "NMOS 6502";
+  static constexpr bool HasIOPort = false;    // $00/$01 processor port
+  static constexpr bool Undocumented = true;  // LAX and friends
+  static constexpr bool JmpIndirectWraps = true; // JMP ($xxFF) bug
+  static constexpr bool DecimalFlagsValid = false; // N/Z/V from BCD result
+};
+
+struct MOS6510 : NMOS6502
+{
+  static constexpr const char *Name = "MOS 6510";
+  static constexpr bool HasIOPort = true;
+};
+
+/* The original CMOS part, without the Rockwell/WDC bit instructions */
+struct CMOS65C02
+{
+  static constexpr const char *Name = "CMOS 65C02";
+  static constexpr bool HasIOPort = false;
+  static constexpr bool Undocumented = false;
+  static constexpr bool JmpIndirectWraps = false;
+  static constexpr bool DecimalFlagsValid = true;
+};
+
+/* Opcode table
+ *
+ * Static facts about each opcode the core executes: mnemonic, addressing
+ * mode, length in bytes and base cycle count. Opcodes the core does not
+ * handle have Bytes == 0.
+ */
+enum AddressingMode : Byte
+{
+  AM_NONE,
+  AM_IMP, // Implied
+  AM_IMM, // #$nn
+  AM_ZP,  // $nn
+  AM_ZPX, // $nn,X
+  AM_ZPY, // $nn,Y
+  AM_ABS, // $nnnn
+  AM_ABX, // $nnnn,X
+  AM_ABY, // $nnnn,Y
+  AM_IND, // ($nnnn)
+  AM_IDX, // ($nn,X)
+  AM_IDY, // ($nn),Y
+  AM_REL, // Branch offset
+};
+
+static constexpr Byte OP_FLOW = 0x01;      // Changes PC, ends a basic block
+static constexpr Byte OP_PAGE_CROSS = 0x02; // +1 cycle on page crossing
+static constexpr Byte OP_DECIMAL = 0x04;    // +1 cycle in decimal mode
+static constexpr Byte OP_UNDOCUMENTED = 0x08;
+
+struct OpcodeInfo
+{
+  const char *Mnemonic;
+  Byte Mode;
+  Byte Bytes;
+  Byte Cycles;
+  Byte Flags;
+};
+
+struct OpcodeTable
+{
+  OpcodeInfo Ops[256];
+
+  constexpr const OpcodeInfo &
+  operator[] (Byte Opcode) const
+  {
+    return Ops[Opcode];
+  }
+};
+
+template <typename Variant>
+static constexpr OpcodeTable
+MakeOpcodeTable ()
+{
+  OpcodeTable T = {};
+
+  T.Ops[INS_LDA_IM] = { "LDA", AM_IMM, 2, 2, 0 };
+  T.Ops[INS_LDA_ZP] = { "LDA", AM_ZP, 2, 3, 0 };
+  T.Ops[INS_LDA_ZPX] = { "LDA", AM_ZPX, 2, 4, 0 };
+  T.Ops[INS_LDA_ABS] = { "LDA", AM_ABS, 3, 4, 0 };
+  T.Ops[INS_LDA_ABX] = { "LDA", AM_ABX, 3, 4, OP_PAGE_CROSS };
+  T.Ops[INS_LDA_ABY] = { "LDA", AM_ABY, 3, 4, OP_PAGE_CROSS };
+  T.Ops[INS_LDA_IDX] = { "LDA", AM_IDX, 2, 6, 0 };
+  T.Ops[INS_LDA_IDY] = { "LDA", AM_IDY, 2, 5, OP_PAGE_CROSS };
+  T.Ops[INS_LDX_IM] = { "LDX", AM_IMM, 2, 2, 0 };
+  T.Ops[INS_LDX_ZP] = { "LDX", AM_ZP, 2, 3, 0 };
+  T.Ops[INS_LDX_ZPY] = { "LDX", AM_ZPY, 2, 4, 0 };
+  T.Ops[INS_LDX_ABS] = { "LDX", AM_ABS, 3, 4, 0 };
+  T.Ops[INS_LDX_ABY] = { "LDX", AM_ABY, 3, 4, OP_PAGE_CROSS };
+  T.Ops[INS_LDY_IM] = { "LDY", AM_IMM, 2, 2, 0 };
+  T.Ops[INS_LDY_ZP] = { "LDY", AM_ZP, 2, 3, 0 };
+  T.Ops[INS_LDY_ZPX] = { "LDY", AM_ZPX, 2, 4, 0 };
+  T.Ops[INS_LDY_ABS] = { "LDY", AM_ABS, 3, 4, 0 };
+  T.Ops[INS_LDY_ABX] = { "LDY", AM_ABX, 3, 4, OP_PAGE_CROSS };
+
+  T.Ops[INS_STA_ZP] = { "STA", AM_ZP, 2, 3, 0 };
+  T.Ops[INS_STA_ZPX] = { "STA", AM_ZPX, 2, 4, 0 };
+  T.Ops[INS_STA_ABS] = { "STA", AM_ABS, 3, 4, 0 };
+  T.Ops[INS_STA_ABX] = { "STA", AM_ABX, 3, 5, 0 };
+  T.Ops[INS_STA_ABY] = { "STA", AM_ABY, 3, 5, 0 };
+  T.Ops[INS_STA_IDX] = { "STA", AM_IDX, 2, 6, 0 };
+  T.Ops[INS_STA_IDY] = { "STA", AM_IDY, 2, 6, 0 };
+  T.Ops[INS_STX_ZP] = { "STX", AM_ZP, 2, 3, 0 };
+  T.Ops[INS_STX_ZPY] = { "STX", AM_ZPY, 2, 4, 0 };
+  T.Ops[INS_STX_ABS] = { "STX", AM_ABS, 3, 4, 0 };
+  T.Ops[INS_STY_ZP] = { "STY", AM_ZP, 2, 3, 0 };
+  T.Ops[INS_STY_ZPX] = { "STY", AM_ZPX, 2, 4, 0 };
+  T.Ops[INS_STY_ABS] = { "STY", AM_ABS, 3, 4, 0 };
+
+  // The 65C02 spends an extra cycle fixing up flags in decimal mode
+  constexpr Byte Decimal = Variant::DecimalFlagsValid ? OP_DECIMAL : 0;
+  T.Ops[INS_ADC_IM] = { "ADC", AM_IMM, 2, 2, Decimal };
+  T.Ops[INS_ADC_ZP] = { "ADC", AM_ZP, 2, 3, Decimal };
+  T.Ops[INS_ADC_ABS] = { "ADC", AM_ABS, 3, 4, Decimal };
+  T.Ops[INS_SBC_IM] = { "SBC", AM_IMM, 2, 2, Decimal };
+  T.Ops[INS_SBC_ZP] = { "SBC", AM_ZP, 2, 3, Decimal };
+  T.Ops[INS_SBC_ABS] = { "SBC", AM_ABS, 3, 4, Decimal };
+
+  T.Ops[INS_INX] = { "INX", AM_IMP, 1, 2, 0 };
+  T.Ops[INS_INY] = { "INY", AM_IMP, 1, 2, 0 };
+  T.Ops[INS_DEX] = { "DEX", AM_IMP, 1, 2, 0 };
+  T.Ops[INS_DEY] = { "DEY", AM_IMP, 1, 2, 0 };
+
+  // Branches take a cycle more when taken, and another to a new page
+  T.Ops[INS_BNE] = { "BNE", AM_REL, 2, 2, OP_FLOW | OP_PAGE_CROSS };
+  T.Ops[INS_JSR] = { "JSR", AM_ABS, 3, 6, OP_FLOW };
+  T.Ops[INS_JMP_ABS] = { "JMP", AM_ABS, 3, 3, OP_FLOW };
+  T.Ops[INS_RTS] = { "RTS", AM_IMP, 1, 6, OP_FLOW };
+  T.Ops[INS_RTI] = { "RTI", AM_IMP, 1, 6, OP_FLOW };
+  // The 65C02 fixed the page wrap at the cost of a cycle
+  T.Ops[INS_JMP_IND]
+      = { "JMP", AM_IND, 3, Variant::JmpIndirectWraps ? 5 : 6, OP_FLOW };
+
+  if (Variant::Undocumented)
+    {
+      T.Ops[INS_LAX_ZP] = { "LAX", AM_ZP, 2, 3, OP_UNDOCUMENTED };
+      T.Ops[INS_LAX_ABS] = { "LAX", AM_ABS, 3, 4, OP_UNDOCUMENTED };
+    }
+  else
+    {
+      T.Ops[INS_LAX_ZP] = { "NOP", AM_IMP, 1, 1, 0 };
+      T.Ops[INS_LAX_ABS] = { "NOP", AM_IMP, 1, 1, 0 };
+    }
+
+  return T;
+}
+
+/* Why CPU::Run returned */
+enum StopReason : Byte
+{
+  STOP_NONE,
+  STOP_BUDGET,      // Cycle budget used up
+  STOP_BREAKPOINT,  // PC reached a breakpoint
+  STOP_READ_WATCH,  // A read hit a watchpoint
+  STOP_WRITE_WATCH, // A write hit a watchpoint
+  STOP_TRAP,        // PC reached a trap, for the host to serve
+};
 
 #define CPU_H
 #endif // !CPU_H
@@ -0,0 +1,508 @@
+#ifndef DISK_CPP
+
+#include "cpu.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* D64 disk image
+ *
+ * The image file is mapped, not read, so opening one costs the same
+ * whatever its size. Sectors are read straight from the mapping.
+ *
+ * The drive's head sees a track as the GCR bitstream the 1541 writes:
+ * for each sector a sync mark, the header block, a gap, another sync,
+ * the data block and a gap. A track is encoded the first time the head
+ * reads it and kept until one of its sectors changes.
+ *
+ * Changes never touch the mapping directly. A sector write lands in a
+ * copy of its track's sectors and drops the track's encoding. A head
+ * write changes the encoding, and its sectors are decoded back from it
+ * the next time one of them is read. Flush decodes whatever is still
+ * pending, writes changed sectors to the file (which the mapping then
+ * shows) and drops the copies. Images opened read-only keep their
+ * changes in memory.
+ */
+struct D64Image
+{
+  static constexpr Uint32 SECTOR_SIZE = 256;
+  static constexpr Uint32 MAX_TRACKS = 40;
+  static constexpr Uint32 MAX_SECTORS = 21;
+  static constexpr Uint32 MAX_TRACK_BYTES = 7692;
+  static constexpr Uint32 SYNC_BYTES = 5;
+  static constexpr Uint32 HEADER_GAP = 9;
+  static constexpr Uint32 SECTOR_GAP = 8;
+  static constexpr Uint32 HEADER_GCR = 10;  // 8 bytes encoded
+  static constexpr Uint32 DATA_GCR = 325;   // 260 bytes encoded
+  static constexpr Byte GAP = 0x55;
+  static constexpr Byte HEADER_ID = 0x08;
+  static constexpr Byte DATA_ID = 0x07;
+
+  ~D64Image () { Close (); }
+
+  /** Maps an image of 35 or 40 tracks, with or without error info */
+  bool
+  Open (const char *Path, bool Writable)
+  {
+    Close ();
+    Fd = open (Path, Writable ? O_RDWR : O_RDONLY);
+    if (Fd < 0)
+      {
+        return false;
+      }
+    struct stat Info;
+    if (fstat (Fd, &Info) != 0)
+      {
+        Close ();
+        return false;
+      }
+    switch (Info.st_size)
+      {
+      case 174848:
+      case 175531:
+        TrackCount = 35;
+        break;
+      case 196608:
+      case 197376:
+        TrackCount = 40;
+        break;
+      default:
+        Close ();
+        return false;
+      }
+    Size = Info.st_size;
+    void *Mapped = mmap (nullptr, Size, PROT_READ, MAP_SHARED, Fd, 0);
+    if (Mapped == MAP_FAILED)
+      {
+        Close ();
+        return false;
+      }
+    Image = (const Byte *)Mapped;
+    CanWrite = Writable;
+    return true;
+  }
+
+  /** Flushes and unmaps */
+  void
+  Close ()
+  {
+    if (Image)
+      {
+        Flush ();
+        munmap ((void *)Image, Size);
+      }
+    for (Uint32 t = 0; t <= MAX_TRACKS; t++)
+      {
+        delete[] Cache[t].Gcr;
+        delete[] Cache[t].Sectors;
+        Cache[t] = {};
+      }
+    if (Fd >= 0)
+      {
+        close (Fd);
+      }
+    Image = nullptr;
+    Fd = -1;
+    TrackCount = 0;
+  }
+
+  Uint32
+  Tracks () const
+  {
+    return TrackCount;
+  }
+
+  static Uint32
+  SectorsIn (Uint32 Track)
+  {
+    return Track <= 17 ? 21 : Track <= 24 ? 19 : Track <= 30 ? 18 : 17;
+  }
+
+  /** Speed zone, 3 at the outer edge down to 0 */
+  static Uint32
+  Zone (Uint32 Track)
+  {
+    return Track <= 17 ? 3 : Track <= 24 ? 2 : Track <= 30 ? 1 : 0;
+  }
+
+  /** GCR bytes on a track at its zone's bit rate */
+  static Uint32
+  TrackBytes (Uint32 Track)
+  {
+    static constexpr Uint32 BYTES[4] = { 6250, 6666, 7142, 7692 };
+    return BYTES[Zone (Track)];
+  }
+
+  bool
+  Valid (Uint32 Track, Uint32 Sector) const
+  {
+    return Track >= 1 && Track <= TrackCount && Sector < SectorsIn (Track);
+  }
+
+  /** A sector's 256 bytes, or null outside the disk */
+  const Byte *
+  ReadSector (Uint32 Track, Uint32 Sector)
+  {
+    if (!Valid (Track, Sector))
+      {
+        return nullptr;
+      }
+    TrackCache &C = Cache[Track];
+    if (C.Stale)
+      {
+        Decode (Track);
+      }
+    if (C.Sectors)
+      {
+        return C.Sectors + Sector * SECTOR_SIZE;
+      }
+    return Image + Offset (Track, Sector);
+  }
+
+  bool
+  WriteSector (Uint32 Track, Uint32 Sector, const Byte *Data)
+  {
+    if (!Valid (Track, Sector))
+      {
+        return false;
+      }
+    TrackCache &C = Cache[Track];
+    if (C.Stale)
+      {
+        Decode (Track);
+      }
+    Own (Track);
+    memcpy (C.Sectors + Sector * SECTOR_SIZE, Data, SECTOR_SIZE);
+    C.Dirty |= 1u << Sector;
+    C.Encoded = false;
+    return true;
+  }
+
+  /** The GCR bitstream of a track, encoded on first access. Length is
+   * set to its size in bytes. Null outside the disk. */
+  const Byte *
+  ReadTrack (Uint32 Track, Uint32 &Length)
+  {
+    if (Track < 1 || Track > TrackCount)
+      {
+        return nullptr;
+      }
+    TrackCache &C = Cache[Track];
+    Length = TrackBytes (Track);
+    if (!C.Encoded)
+      {
+        Encode (Track);
+      }
+    return C.Gcr;
+  }
+
+  /** The bitstream for the head to write. Its sectors are decoded from
+   * it the next time one is needed. */
+  Byte *
+  WriteTrack (Uint32 Track, Uint32 &Length)
+  {
+    Byte *Gcr = (Byte *)ReadTrack (Track, Length);
+    if (Gcr)
+      {
+        Cache[Track].Stale = true;
+      }
+    return Gcr;
+  }
+
+  /** Whether a track's encoding is cached */
+  bool
+  Encoded (Uint32 Track) const
+  {
+    return Track <= MAX_TRACKS && Cache[Track].Encoded;
+  }
+
+  /** Writes changed sectors back to the file. False if there were
+   * changes that could not be written. */
+  bool
+  Flush ()
+  {
+    bool Ok = true;
+    for (Uint32 t = 1; t <= TrackCount; t++)
+      {
+        TrackCache &C = Cache[t];
+        if (C.Stale)
+          {
+            Decode (t);
+          }
+        if (!C.Dirty)
+          {
+            continue;
+          }
+        if (!CanWrite)
+          {
+            Ok = false;
+            continue;
+          }
+        bool Written = true;
+        for (Uint32 s = 0; s < SectorsIn (t); s++)
+          {
+            if ((C.Dirty & (1u << s))
+                && pwrite (Fd, C.Sectors + s * SECTOR_SIZE, SECTOR_SIZE,
+                           Offset (t, s))
+                       != (ssize_t)SECTOR_SIZE)
+              {
+                Written = false;
+              }
+          }
+        Ok = Ok && Written;
+        if (Written)
+          {
+            // The mapping shows the file again
+            C.Dirty = 0;
+            delete[] C.Sectors;
+            C.Sectors = nullptr;
+          }
+      }
+    return Ok;
+  }
+
+  /** Four bytes to five of GCR */
+  static void
+  EncodeGcr (const Byte *In, Byte *Out)
+  {
+    Uint64 Bits = 0;
+    for (Uint32 i = 0; i < 4; i++)
+      {
+        Bits = (Bits << 10) | (GCR_CODES[In[i] >> 4] << 5)
+               | GCR_CODES[In[i] & 0x0F];
+      }
+    for (Uint32 i = 0; i < 5; i++)
+      {
+        Out[i] = (Byte)(Bits >> (32 - 8 * i));
+      }
+  }
+
+  /** Five GCR bytes to four. False on a code that is not GCR. */
+  static bool
+  DecodeGcr (const Byte *In, Byte *Out)
+  {
+    Uint64 Bits = 0;
+    for (Uint32 i = 0; i < 5; i++)
+      {
+        Bits = (Bits << 8) | In[i];
+      }
+    for (Uint32 i = 0; i < 8; i++)
+      {
+        Byte Nibble = GCR_NIBBLES[(Bits >> (35 - 5 * i)) & 0x1F];
+        if (Nibble > 0x0F)
+          {
+            return false;
+          }
+        Out[i / 2] = (i & 1) ? (Out[i / 2] | Nibble) : (Byte)(Nibble << 4);
+      }
+    return true;
+  }
+
+  /** Encodes Count bytes (a multiple of four) as GCR */
+  static void
+  EncodeBlock (const Byte *In, Uint32 Count, Byte *Out)
+  {
+    for (Uint32 i = 0; i < Count; i += 4)
+      {
+        EncodeGcr (In + i, Out + i / 4 * 5);
+      }
+  }
+
+private:
+  static constexpr Byte GCR_CODES[16]
+      = { 0x0A, 0x0B, 0x12, 0x13, 0x0E, 0x0F, 0x16, 0x17,
+          0x09, 0x19, 0x1A, 0x1B, 0x0D, 0x1D, 0x1E, 0x15 };
+  static constexpr Byte GCR_NIBBLES[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, //
+    0xFF, 0x08, 0x00, 0x01, 0xFF, 0x0C, 0x04, 0x05, //
+    0xFF, 0xFF, 0x02, 0x03, 0xFF, 0x0F, 0x06, 0x07, //
+    0xFF, 0x09, 0x0A, 0x0B, 0xFF, 0x0D, 0x0E, 0xFF, //
+  };
+
+  struct TrackCache
+  {
+    Byte *Gcr;      // MAX_TRACK_BYTES, once first encoded
+    Byte *Sectors;  // Copy of the track's sectors, once one changes
+    Uint32 Dirty;   // Sectors that differ from the file
+    bool Encoded;   // Gcr matches the sectors
+    bool Stale;     // The sectors lag behind a head write to Gcr
+  };
+
+  int Fd = -1;
+  const Byte *Image = nullptr;
+  size_t Size = 0;
+  Uint32 TrackCount = 0;
+  bool CanWrite = false;
+  TrackCache Cache[MAX_TRACKS + 1] = {}; // By track, from 1
+
+  static Uint32
+  Offset (Uint32 Track, Uint32 Sector)
+  {
+    Uint32 Before = 0;
+    for (Uint32 t = 1; t < Track; t++)
+      {
+        Before += SectorsIn (t);
+      }
+    return (Before + Sector) * SECTOR_SIZE;
+  }
+
+  /** Gives a track its own copy of its sectors */
+  void
+  Own (Uint32 Track)
+  {
+    TrackCache &C = Cache[Track];
+    if (!C.Sectors)
+      {
+        C.Sectors = new Byte[MAX_SECTORS * SECTOR_SIZE];
+        memcpy (C.Sectors, Image + Offset (Track, 0),
+                SectorsIn (Track) * SECTOR_SIZE);
+      }
+  }
+
+  void
+  Encode (Uint32 Track)
+  {
+    TrackCache &C = Cache[Track];
+    if (!C.Gcr)
+      {
+        C.Gcr = new Byte[MAX_TRACK_BYTES];
+      }
+    // The disk ID is in the BAM, which is never stale while encoding
+    const Byte *Bam = ReadSector (18, 0);
+    Byte Id1 = Bam ? Bam[0xA2] : 0x30;
+    Byte Id2 = Bam ? Bam[0xA3] : 0x30;
+
+    Byte *Out = C.Gcr;
+    for (Uint32 s = 0; s < SectorsIn (Track); s++)
+      {
+        const Byte *Data = ReadSector (Track, s);
+
+        memset (Out, 0xFF, SYNC_BYTES);
+        Out += SYNC_BYTES;
+        Byte Header[8] = { HEADER_ID,
+                           (Byte)(s ^ Track ^ Id2 ^ Id1),
+                           (Byte)s,
+                           (Byte)Track,
+                           Id2,
+                           Id1,
+                           0x0F,
+                           0x0F };
+        EncodeBlock (Header, sizeof (Header), Out);
+        Out += HEADER_GCR;
+        memset (Out, GAP, HEADER_GAP);
+        Out += HEADER_GAP;
+
+        memset (Out, 0xFF, SYNC_BYTES);
+        Out += SYNC_BYTES;
+        Byte Block[260];
+        Block[0] = DATA_ID;
+        memcpy (Block + 1, Data, SECTOR_SIZE);
+        Byte Sum = 0;
+        for (Uint32 i = 0; i < SECTOR_SIZE; i++)
+          {
+            Sum ^= Data[i];
+          }
+        Block[257] = Sum;
+        Block[258] = Block[259] = 0;
+        EncodeBlock (Block, sizeof (Block), Out);
+        Out += DATA_GCR;
+        memset (Out, GAP, SECTOR_GAP);
+        Out += SECTOR_GAP;
+      }
+    memset (Out, GAP, C.Gcr + TrackBytes (Track) - Out);
+    C.Encoded = true;
+  }
+
+  /** GCR byte at Position, wrapping around the track */
+  static Byte
+  At (const Byte *Gcr, Uint32 Length, Uint32 Position)
+  {
+    return Gcr[Position % Length];
+  }
+
+  /** Reads Count bytes after a sync mark ending before Position */
+  static void
+  Copy (const Byte *Gcr, Uint32 Length, Uint32 Position, Byte *Out,
+        Uint32 Count)
+  {
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        Out[i] = At (Gcr, Length, Position + i);
+      }
+  }
+
+  /** Updates a track's sectors from its bitstream. Blocks that do not
+   * decode or fail their checksum leave their sector as it was. */
+  void
+  Decode (Uint32 Track)
+  {
+    TrackCache &C = Cache[Track];
+    C.Stale = false;
+    Uint32 Length = TrackBytes (Track);
+    const Byte *Gcr = C.Gcr;
+    Sint32 Sector = -1; // From the last header seen
+
+    // Every sync mark, once around from the first gap
+    Uint32 Start = 0;
+    while (Start < Length && Gcr[Start] == 0xFF)
+      {
+        Start++;
+      }
+    for (Uint32 i = Start; i < Start + Length; i++)
+      {
+        // i is the last byte of a sync mark: two 0xFF bytes are more
+        // one bits in a row than GCR data ever has
+        if (At (Gcr, Length, i) != 0xFF || At (Gcr, Length, i + 1) == 0xFF
+            || At (Gcr, Length, i + Length - 1) != 0xFF)
+          {
+            continue;
+          }
+        Byte Raw[DATA_GCR];
+        Byte Block[260];
+        Copy (Gcr, Length, i + 1, Raw, HEADER_GCR);
+        if (!DecodeGcr (Raw, Block) || !DecodeGcr (Raw + 5, Block + 4))
+          {
+            Sector = -1;
+            continue;
+          }
+        if (Block[0] == HEADER_ID)
+          {
+            Sector = Block[3] == Track && Block[2] < SectorsIn (Track)
+                         ? Block[2]
+                         : -1;
+            continue;
+          }
+        if (Block[0] != DATA_ID || Sector < 0)
+          {
+            continue;
+          }
+        Copy (Gcr, Length, i + 1, Raw, DATA_GCR);
+        bool Ok = true;
+        for (Uint32 j = 0; j < DATA_GCR / 5 && Ok; j++)
+          {
+            Ok = DecodeGcr (Raw + 5 * j, Block + 4 * j);
+          }
+        Byte Sum = 0;
+        for (Uint32 j = 1; j <= SECTOR_SIZE; j++)
+          {
+            Sum ^= Block[j];
+          }
+        const Byte *Old = C.Sectors ? C.Sectors + Sector * SECTOR_SIZE
+                                    : Image + Offset (Track, Sector);
+        if (Ok && Sum == Block[257]
+            && memcmp (Old, Block + 1, SECTOR_SIZE) != 0)
+          {
+            Own (Track);
+            memcpy (C.Sectors + Sector * SECTOR_SIZE, Block + 1,
+                    SECTOR_SIZE);
+            C.Dirty |= 1u << Sector;
+          }
+        Sector = -1;
+      }
+  }
+};
+
+#define DISK_CPP
+#endif // !DISK_CPP
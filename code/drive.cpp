@@ -0,0 +1,436 @@
+#ifndef DRIVE_CPP
+
+#include "cpu.cpp"
+#include "disk.cpp"
+#include "via.cpp"
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+
+/* Serial (IEC) bus lines. Every line is open collector: it is low while
+ * any side pulls it. Bus states are sets of lines pulled low. */
+static constexpr Byte IEC_ATN = 0x01;
+static constexpr Byte IEC_CLK = 0x02;
+static constexpr Byte IEC_DATA = 0x04;
+
+/* Commodore 1541 disk drive: a 6502 at 1 MHz, 2K of RAM, the DOS ROM at
+ * $C000 and two VIAs. VIA 1 at $1800 drives the serial bus, VIA 2 at
+ * $1C00 the disk mechanism.
+ *
+ * Disk
+ *
+ * VIA 2 port B steps the head, runs the motor and reads SYNC; port A
+ * reads and writes the GCR byte under the head. The disk turns at the
+ * track's bit rate from cycle 0, so that byte is worked out from the
+ * drive's clock when it is read, and the track is only encoded when
+ * the head first reads it (see D64Image). A write in write mode goes to
+ * the byte under the head. Byte ready is not signalled: the core has no
+ * SO input, so code polls instead.
+ *
+ * Lockstep
+ *
+ * The drive and the host run in windows of Window host cycles. During
+ * window k each side sees the lines the other pulled at the end of
+ * window k - 1, plus its own as they change, so a bus change reaches the
+ * other side at the next window boundary: bus latency is at most one
+ * window. Neither side looks at anything else of the other's, so what
+ * each does in a window depends only on the other's bus state one
+ * window back. That makes the result independent of how the two are
+ * scheduled: interleaved on one thread (the host runs window k, then the
+ * drive does) or on two, it is the same.
+ *
+ * On its own thread the drive runs window k as soon as the host has
+ * ended window k - 1, in parallel with the host's window k. The host
+ * waits at the end of a window only while the drive has not finished
+ * the same window, the last one in which it might still change a line
+ * the host is about to see; the drive likewise waits only for the
+ * host's previous window. So neither side is ever more than one window
+ * ahead, and while both keep up neither waits at all.
+ *
+ * The window trades bus latency against synchronization: the default is
+ * close to the serial routines' own reaction time. Cycle-exact fast
+ * loaders want a window of a few cycles.
+ */
+struct Drive1541
+{
+  static constexpr Uint32 CLOCK_HZ = 1000000;
+  static constexpr Word ROM_START = 0xC000;
+  static constexpr Uint32 ROM_SIZE = 0x4000;
+  static constexpr Uint32 RING = 4;          // Windows of bus state kept
+  static constexpr Uint32 SPIN_LIMIT = 1000; // Polls before yielding
+  static constexpr Uint32 YIELD_LIMIT = 100; // Yields before sleeping
+
+  // VIA 1 port B
+  static constexpr Byte PB_DATA_IN = 0x01;
+  static constexpr Byte PB_DATA_OUT = 0x02;
+  static constexpr Byte PB_CLK_IN = 0x04;
+  static constexpr Byte PB_CLK_OUT = 0x08;
+  static constexpr Byte PB_ATN_ACK = 0x10; // Pulls DATA unless it matches ATN
+  static constexpr Byte PB_DEVICE = 0x60;  // Address jumpers, device - 8
+  static constexpr Byte PB_ATN_IN = 0x80;
+
+  // VIA 2 port B
+  static constexpr Byte PB_STEPPER = 0x03; // Phase; +1 steps in, -1 out
+  static constexpr Byte PB_MOTOR = 0x04;
+  static constexpr Byte PB_LED = 0x08;
+  static constexpr Byte PB_WRITE_ENABLE = 0x10; // 0: write protected
+  static constexpr Byte PB_SYNC = 0x80;         // 0: over a sync mark
+
+  // VIA 2 PCR, CB2 control: manual output low selects write mode
+  static constexpr Byte PCR_CB2_MODE = 0xE0;
+  static constexpr Byte PCR_CB2_LOW = 0xC0;
+
+  Memory Mem;
+  CPUCore<NMOS6502> Cpu;
+  VIA Via1; // Serial bus
+  VIA Via2; // Disk controller
+
+  D64Image *Disk = nullptr; // Inserted disk, if any
+  Uint32 HalfTrack = 36;    // Head position; survives Reset like the head
+
+  Byte Device = 8;
+  Uint32 Window = 16;     // Host cycles per lockstep window
+  Uint32 HostHz = 985248;
+
+  ~Drive1541 () { Stop (); }
+
+  /** Reads the 16K DOS ROM, which Reset maps in */
+  bool
+  LoadRom (const char *Path)
+  {
+    FILE *File = fopen (Path, "rb");
+    if (!File)
+      {
+        return false;
+      }
+    HasRom = fread (Rom, 1, ROM_SIZE, File) == ROM_SIZE;
+    fclose (File);
+    return HasRom;
+  }
+
+  /** Powers the drive on, in step with a host running at Host cycles
+   * per second from its cycle 0. A running drive thread is restarted. */
+  void
+  Reset (Uint32 Host)
+  {
+    bool Threaded = Running;
+    Stop ();
+
+    Cpu.Reset (Mem);
+    Via1.Now = Via2.Now = Now;
+    Via1.NowContext = Via2.NowContext = this;
+    Via1.Reset (Mem, 0x18, 0x1B);
+    Via2.Reset (Mem, 0x1C, 0x1F);
+    Via1.PortB = OnSerialPort;
+    Via1.PortContext = this;
+    Via2.Pins = DiskPins;
+    Via2.PortA = OnDiskData;
+    Via2.PortB = OnDiskControl;
+    Via2.PortContext = this;
+    Mechanism = 0xFF;
+    if (HasRom)
+      {
+        memcpy (Mem.Data + ROM_START, Rom, ROM_SIZE);
+        Cpu.PC = Mem[0xFFFC] | (Mem[0xFFFD] << 8);
+      }
+
+    HostHz = Host;
+    HostWindows.store (0, std::memory_order_relaxed);
+    DriveWindows.store (0, std::memory_order_relaxed);
+    HostView = 0;
+    Lines = 0xFF; // Port B floats high until its direction is set
+    UpdateBus ();
+    ResetPulls = Pulls;
+
+    if (Threaded)
+      {
+        Start ();
+      }
+  }
+
+  /** Moves the drive onto its own thread */
+  void
+  Start ()
+  {
+    if (Running)
+      {
+        return;
+      }
+    // Spinning only helps while the other side has a core of its own
+    Spins = std::thread::hardware_concurrency () > 1 ? SPIN_LIMIT : 0;
+    Running = true;
+    Thread = std::thread (&Drive1541::Serve, this);
+  }
+
+  /** Brings the drive back onto the host's thread. It has then run at
+   * least every window the host has ended, and at most one more. */
+  void
+  Stop ()
+  {
+    if (!Running)
+      {
+        return;
+      }
+    Running = false;
+    Thread.join ();
+  }
+
+  bool
+  Threaded () const
+  {
+    return Running;
+  }
+
+  /** Host side: ends the host's current window with the lines it pulls
+   * and returns those the drive pulls for the next one. Waits for the
+   * drive to finish the same window if it runs on its own thread, and
+   * runs it here if not. */
+  Byte
+  EndWindow (Byte HostPulls)
+  {
+    Uint64 k = HostWindows.load (std::memory_order_relaxed);
+    HostBus[k % RING] = HostPulls;
+    HostWindows.store (k + 1, std::memory_order_release);
+    if (Running)
+      {
+        Await (DriveWindows, k + 1);
+      }
+    else
+      {
+        while (Windows () <= k)
+          {
+            RunWindow ();
+          }
+      }
+    return DriveBus[k % RING];
+  }
+
+  /** Windows the drive has completed */
+  Uint64
+  Windows () const
+  {
+    return DriveWindows.load (std::memory_order_acquire);
+  }
+
+  /** Runs the drive's next window, once the host has ended the one
+   * before it. Returns false if it has not. Only for a stopped drive. */
+  bool
+  RunWindow ()
+  {
+    Uint64 k = DriveWindows.load (std::memory_order_relaxed);
+    if (HostWindows.load (std::memory_order_acquire) < k)
+      {
+        return false;
+      }
+    Byte View = k ? HostBus[(k - 1) % RING] : 0;
+    if (View != HostView)
+      {
+        HostView = View;
+        // CA1 sees ATN through an inverter
+        Via1.SetCa1 (HostView & IEC_ATN);
+        UpdateBus ();
+      }
+
+    // Drive cycles due by the end of the window, without drift
+    Uint64 Target = (k + 1) * Window * (Uint64)CLOCK_HZ / HostHz;
+    if (Target > Cpu.RetiredCycles)
+      {
+        Cpu.Run (Mem, (Sint32)(Target - Cpu.RetiredCycles));
+      }
+
+    DriveBus[k % RING] = Pulls;
+    DriveWindows.store (k + 1, std::memory_order_release);
+    return true;
+  }
+
+  /** Lines the drive pulls at power on, which the host sees in its
+   * first window */
+  Byte
+  InitialPulls () const
+  {
+    return ResetPulls;
+  }
+
+private:
+  Byte Rom[ROM_SIZE];
+  bool HasRom = false;
+
+  std::thread Thread;
+  std::atomic<bool> Running{ false };
+  Uint32 Spins = SPIN_LIMIT;
+
+  // Bus state at the end of each window, by window number
+  Byte HostBus[RING];
+  Byte DriveBus[RING];
+  std::atomic<Uint64> HostWindows{ 0 };  // Ended by the host
+  std::atomic<Uint64> DriveWindows{ 0 }; // Run by the drive
+
+  Byte HostView = 0;    // Lines the host pulls, as of the window before
+  Byte Lines = 0xFF;    // VIA 1 port B outputs
+  Byte Mechanism = 0xFF; // VIA 2 port B outputs
+  Byte Pulls = 0;    // Lines the drive pulls
+  Byte ResetPulls = 0;
+
+  static Uint64
+  Now (void *Context)
+  {
+    return ((Drive1541 *)Context)->Cpu.RetiredCycles;
+  }
+
+  static void
+  OnSerialPort (void *Context, Byte Lines)
+  {
+    Drive1541 *D = (Drive1541 *)Context;
+    D->Lines = Lines;
+    D->UpdateBus ();
+  }
+
+  /** Track under the head, with Length and Position set to its size and
+   * the byte under the head at cycle T. Null without a disk, with the
+   * motor off or off the disk's tracks. */
+  Byte *
+  UnderHead (Uint64 T, bool Writing, Uint32 &Length, Uint32 &Position)
+  {
+    Uint32 Track = HalfTrack / 2;
+    if (!Disk || !(Mechanism & PB_MOTOR) || Track < 1
+        || Track > Disk->Tracks ())
+      {
+        return nullptr;
+      }
+    Byte *Gcr = Writing ? Disk->WriteTrack (Track, Length)
+                        : (Byte *)Disk->ReadTrack (Track, Length);
+    // 26 to 32 cycles a byte, from the outer zone in
+    Position = T / (32 - 2 * D64Image::Zone (Track)) % Length;
+    return Gcr;
+  }
+
+  static Byte
+  DiskPins (void *Context, Byte Which)
+  {
+    Drive1541 *D = (Drive1541 *)Context;
+    Uint32 Length, Position;
+    const Byte *Gcr
+        = D->UnderHead (D->Cpu.RetiredCycles, false, Length, Position);
+    if (Which == VIA::PORT_A)
+      {
+        return Gcr ? Gcr[Position] : 0xFF;
+      }
+    Byte Pins = 0xFF;
+    if (!D->Disk)
+      {
+        Pins &= ~PB_WRITE_ENABLE;
+      }
+    // Two 0xFF bytes in a row: more one bits than GCR data has
+    if (Gcr && Gcr[Position] == 0xFF
+        && (Gcr[(Position + 1) % Length] == 0xFF
+            || Gcr[(Position + Length - 1) % Length] == 0xFF))
+      {
+        Pins &= ~PB_SYNC;
+      }
+    return Pins;
+  }
+
+  static void
+  OnDiskData (void *Context, Byte Lines)
+  {
+    Drive1541 *D = (Drive1541 *)Context;
+    if ((D->Via2.Pcr & PCR_CB2_MODE) != PCR_CB2_LOW)
+      {
+        return;
+      }
+    Uint32 Length, Position;
+    Byte *Gcr = D->UnderHead (D->Cpu.RetiredCycles, true, Length, Position);
+    if (Gcr)
+      {
+        Gcr[Position] = Lines;
+      }
+  }
+
+  /** Steps the head by half tracks as the stepper phase turns */
+  static void
+  OnDiskControl (void *Context, Byte Lines)
+  {
+    Drive1541 *D = (Drive1541 *)Context;
+    Byte Was = D->Mechanism & PB_STEPPER;
+    Byte Phase = Lines & PB_STEPPER;
+    if (Phase == ((Was + 1) & PB_STEPPER)
+        && D->HalfTrack < 2 * D64Image::MAX_TRACKS + 1)
+      {
+        D->HalfTrack++;
+      }
+    else if (Phase == ((Was - 1) & PB_STEPPER) && D->HalfTrack > 2)
+      {
+        D->HalfTrack--;
+      }
+    D->Mechanism = Lines;
+  }
+
+  /** Works out the lines the drive pulls and what port B reads back.
+   * Outputs go through inverters, and so do the inputs. */
+  void
+  UpdateBus ()
+  {
+    bool Atn = HostView & IEC_ATN;
+    Pulls = 0;
+    if ((Lines & PB_DATA_OUT) || (bool)(Lines & PB_ATN_ACK) != Atn)
+      {
+        Pulls |= IEC_DATA;
+      }
+    if (Lines & PB_CLK_OUT)
+      {
+        Pulls |= IEC_CLK;
+      }
+
+    Byte Bus = Pulls | HostView;
+    Byte In = ~(PB_DATA_IN | PB_CLK_IN | PB_DEVICE | PB_ATN_IN)
+              | (((Device - 8) << 5) & PB_DEVICE);
+    In |= (Bus & IEC_DATA) ? PB_DATA_IN : 0;
+    In |= (Bus & IEC_CLK) ? PB_CLK_IN : 0;
+    In |= (Bus & IEC_ATN) ? PB_ATN_IN : 0;
+    Via1.Input[VIA::PORT_B] = In;
+  }
+
+  /** Waits for Count to reach Target: spins briefly, then yields, then
+   * sleeps, so a paused host does not keep a core busy. Returns false
+   * if the drive is stopped meanwhile. */
+  bool
+  Await (const std::atomic<Uint64> &Count, Uint64 Target)
+  {
+    for (Uint32 Tries = 0;; Tries++)
+      {
+        if (Count.load (std::memory_order_acquire) >= Target)
+          {
+            return true;
+          }
+        if (!Running.load (std::memory_order_relaxed))
+          {
+            return false;
+          }
+        if (Tries >= Spins + YIELD_LIMIT)
+          {
+            std::this_thread::sleep_for (std::chrono::microseconds (50));
+          }
+        else if (Tries >= Spins)
+          {
+            std::this_thread::yield ();
+          }
+      }
+  }
+
+  /* Drive thread */
+
+  void
+  Serve ()
+  {
+    while (Await (HostWindows,
+                  DriveWindows.load (std::memory_order_relaxed)))
+      {
+        RunWindow ();
+      }
+  }
+};
+
+#define DRIVE_CPP
+#endif // !DRIVE_CPP
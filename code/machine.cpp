@@ -0,0 +1,380 @@
+#ifndef MACHINE_CPP
+
+#include "cart.cpp"
+#include "cia.cpp"
+#include "cpu.cpp"
+#include "drive.cpp"
+#include "monitor.cpp"
+#include "perf.cpp"
+#include "reu.cpp"
+#include "scheduler.cpp"
+#include "sid.cpp"
+#include "traps.cpp"
+#include "vic.cpp"
+
+/* A complete emulated machine: CPU, memory, video, sound, debugger state
+ * and the frame based run loop that ties them to the global cycle clock. */
+struct Machine
+{
+  static constexpr Uint32 PAL_CLOCK_HZ = VIDEO_PAL.ClockHz;
+  static constexpr Uint32 PAL_CYCLES_PER_LINE = VIDEO_PAL.CyclesPerLine;
+  static constexpr Uint32 PAL_LINES = VIDEO_PAL.Lines;
+  static constexpr Uint32 PAL_CYCLES_PER_FRAME = VIDEO_PAL.CyclesPerFrame ();
+
+  Memory Mem;
+  CPU Cpu;
+  Watchpoints Watch;
+  VIC Vic;
+  SID Sid;
+  CIA Cia1; // Keyboard, joysticks, IRQ
+  CIA Cia2; // Serial bus, VIC bank, NMI
+  Scheduler Events;
+  VideoStandard Video = VIDEO_PAL;
+
+  // Output stages skip their host-side work (rendering, audio output)
+  // while set. Emulated state advances exactly as it does otherwise.
+  bool Warp = false;
+
+  // Gets every completed frame; frames are rendered in warp mode too
+  // while it is set
+  FrameSink VideoSink = nullptr;
+  void *VideoSinkContext = nullptr;
+
+  Uint64 Clock = 0;    // Cycles since Reset
+  Uint64 FrameEnd = 0; // Clock value of the next frame boundary
+  Uint64 Frame = 0;    // Completed frames
+  bool Paused = false;
+
+  Monitor *Mon = nullptr;     // Optional binary monitor
+  Drive1541 *Drive = nullptr; // Optional true drive on the serial bus
+  Cartridge *Cart = nullptr;  // Optional, on the expansion port
+  REU *Reu = nullptr;         // Optional RAM expansion, at $DF00
+  KernalTraps Traps;          // Fast LOAD/SAVE, once SetTraps is on
+  PerfCounters Perf;      // Published at every frame boundary
+
+  void
+  Reset ()
+  {
+    Cpu.Reset (Mem);
+    Vic.Reset (Mem, Video);
+    Sid.Reset (Mem, Video.ClockHz);
+    Sid.Now = Now;
+    Sid.NowContext = this;
+    Clock = 0;
+    FrameEnd = Video.CyclesPerFrame ();
+    Events.Clear ();
+    StartLine (0);
+    Cia1.Now = Cia2.Now = Now;
+    Cia1.NowContext = Cia2.NowContext = this;
+    Cia1.Reset (Mem, 0xDC, Video.ClockHz, Video.MainsHz, Events);
+    Cia2.Reset (Mem, 0xDD, Video.ClockHz, Video.MainsHz, Events);
+    Cia2.PortA = OnCia2PortA;
+    Cia2.PortContext = this;
+    if (Cart)
+      {
+        // Where the KERNAL's reset routine would start it
+        Word Start;
+        Cart->Reset (Mem);
+        if (Cart->ColdStart (Mem, Start))
+          {
+            Cpu.PC = Start;
+          }
+      }
+    if (Reu)
+      {
+        Reu->Now = Now;
+        Reu->NowContext = this;
+        Reu->Reset (Mem, Events);
+      }
+    SerialPulls = SerialLines (0xFF);
+    DrivePulls = 0;
+    if (Drive)
+      {
+        Drive->Reset (Video.ClockHz);
+        DrivePulls = Drive->InitialPulls ();
+        Events.Schedule (Drive->Window, OnDriveWindow, this);
+      }
+    UpdateSerialInputs ();
+    Frame = 0;
+    Paused = false;
+    FrameStartClock = 0;
+    FrameHostNs = 0;
+    LastFrameWallEnd = 0;
+  }
+
+  /** Runs the CPU up to the next frame boundary, from one scheduled
+   * event to the next. Raster line ends are events, and render the line
+   * that completed.
+   *
+   * The SID catches up to the frame boundary once the frame completes.
+   *
+   * Returns true when the frame completed. A breakpoint or watchpoint
+   * hit pauses the machine and returns false; later calls pick up where
+   * the frame left off once it is resumed. Monitor commands are applied
+   * on entry and the monitor gets its frame boundary on every call, so
+   * it stays responsive while paused.
+   */
+  bool
+  RunFrame ()
+  {
+    Uint64 HostStart = HostNanoseconds ();
+    ServiceMonitor ();
+    Sid.Quiet = Warp;
+
+    Clock = Events.Dispatch (Clock);
+    while (!Paused && Clock < FrameEnd)
+      {
+        Uint64 Until = Events.NextTime ();
+        if (Until > FrameEnd)
+          {
+            Until = FrameEnd;
+          }
+        Clock += Cpu.Run (Mem, (Sint32)(Until - Clock));
+        if (Cpu.Stop == STOP_TRAP)
+          {
+            // Served, the caller's breakpoints stay live; left to the
+            // KERNAL, the next Run resumes past the trap
+            if (Traps.Run (Cpu, Mem))
+              {
+                Cpu.Stop = STOP_BUDGET;
+              }
+          }
+        else if (Cpu.Stop != STOP_BUDGET)
+          {
+            Pause ();
+          }
+        Clock = Events.Dispatch (Clock);
+      }
+
+    bool Completed = Clock >= FrameEnd;
+    if (Completed)
+      {
+        Sid.Synthesize (Clock);
+        if (VideoSink)
+          {
+            VideoSink (VideoSinkContext, Vic.Frame, Frame);
+          }
+        Frame++;
+        FrameEnd += Video.CyclesPerFrame ();
+        PublishPerf (HostStart);
+      }
+    else
+      {
+        FrameHostNs += HostNanoseconds () - HostStart;
+      }
+    if (Mon)
+      {
+        Mon->FrameBoundary (Cpu, Mem);
+      }
+    return Completed;
+  }
+
+  /** Executes Count instructions regardless of the frame boundary, as
+   * RunFrame would: events and bus stalls that fall due are dispatched
+   * after each one, and a trapped routine is served, counting as one
+   * instruction, rather than stepped into. */
+  void
+  Step (Uint32 Count)
+  {
+    Clock = Events.Dispatch (Clock);
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        if (!(TrapsOn && Cpu.TrapAt (Cpu.PC) && Traps.Run (Cpu, Mem)))
+          {
+            Clock += Cpu.Execute (Mem);
+          }
+        Clock = Events.Dispatch (Clock);
+      }
+  }
+
+  void
+  Pause ()
+  {
+    Paused = true;
+    if (Mon)
+      {
+        Mon->PostEvent (MON_RESPONSE_STOPPED, Cpu.PC);
+      }
+  }
+
+  void
+  Resume ()
+  {
+    Paused = false;
+    if (Mon)
+      {
+        Mon->PostEvent (MON_RESPONSE_RESUMED, Cpu.PC);
+      }
+  }
+
+  /** Points the CPU at the watch list only while it has entries, so an
+   * idle debugger leaves the uninstrumented interpreter in use. */
+  void
+  SyncHooks ()
+  {
+    Cpu.Hooks.Watch = Watch.Count ? &Watch : nullptr;
+  }
+
+  /** Traps the KERNAL LOAD and SAVE routines while On. Off, they run
+   * as they are, over the serial bus. Never on with a true drive
+   * attached: it serves the device itself, and may use the disk image
+   * on its own thread while a trap would use it on this one. */
+  void
+  SetTraps (bool On)
+  {
+    On = On && !Drive;
+    if (On == TrapsOn)
+      {
+        return;
+      }
+    if (On)
+      {
+        Cpu.AddTrap (KernalTraps::LOAD);
+        Cpu.AddTrap (KernalTraps::SAVE);
+      }
+    else
+      {
+        Cpu.RemoveTrap (KernalTraps::LOAD);
+        Cpu.RemoveTrap (KernalTraps::SAVE);
+      }
+    TrapsOn = On;
+  }
+
+private:
+  bool TrapsOn = false;
+
+  /** The cycle an access is made in: the CPU's own cycles plus those the
+   * VIC took. Mid instruction that is the instruction's first cycle;
+   * between instructions it is Clock. */
+  static Uint64
+  Now (void *Context)
+  {
+    Machine *M = (Machine *)Context;
+    return M->Cpu.RetiredCycles + M->Events.BlockedCycles;
+  }
+
+  Byte SerialPulls = 0; // Serial bus lines the machine pulls
+  Byte DrivePulls = 0;  // And the drive, as of the last window boundary
+
+  /** CIA 2 port A bits 0-1 select the VIC's 16K bank, inverted. Bits 3-5
+   * pull ATN, CLK and DATA through inverters. */
+  static void
+  OnCia2PortA (void *Context, Byte Lines)
+  {
+    Machine *M = (Machine *)Context;
+    M->Vic.Bank = ~Lines & 0x03;
+    M->SerialPulls = SerialLines (Lines);
+    M->UpdateSerialInputs ();
+  }
+
+  static Byte
+  SerialLines (Byte Lines)
+  {
+    return ((Lines & 0x08) ? IEC_ATN : 0) | ((Lines & 0x10) ? IEC_CLK : 0)
+           | ((Lines & 0x20) ? IEC_DATA : 0);
+  }
+
+  /** CIA 2 port A bits 6-7 read CLK and DATA */
+  void
+  UpdateSerialInputs ()
+  {
+    Byte Bus = SerialPulls | DrivePulls;
+    Cia2.Input[0] = ~(((Bus & IEC_CLK) ? 0x40 : 0)
+                      | ((Bus & IEC_DATA) ? 0x80 : 0));
+  }
+
+  /** The end of a lockstep window with the drive */
+  static void
+  OnDriveWindow (void *Context, Uint64 Time)
+  {
+    Machine *M = (Machine *)Context;
+    M->DrivePulls = M->Drive->EndWindow (M->SerialPulls);
+    M->UpdateSerialInputs ();
+    M->Events.Schedule (Time + M->Drive->Window, OnDriveWindow, M);
+  }
+
+  /** Schedules the end of the raster line starting at Start and the
+   * cycles the VIC steals from it */
+  void
+  StartLine (Uint64 Start)
+  {
+    const VIC::LineStalls &Stalls = Vic.Stalls (Vic.Raster);
+    for (Uint32 i = 0; i < Stalls.Count; i++)
+      {
+        Events.Block (Start + Stalls.Windows[i].Start,
+                      Stalls.Windows[i].Length);
+      }
+    Events.Schedule (Start + Video.CyclesPerLine, OnLineEnd, this);
+  }
+
+  static void
+  OnLineEnd (void *Context, Uint64 Time)
+  {
+    Machine *M = (Machine *)Context;
+    M->Vic.EndLine (!M->Warp || M->VideoSink);
+    M->StartLine (Time);
+  }
+
+  Uint64 FrameStartClock = 0;  // Clock at the start of the current frame
+  Uint64 FrameHostNs = 0;      // Host time spent in the current frame
+  Uint64 LastFrameWallEnd = 0; // Host time the previous frame completed
+
+  void
+  PublishPerf (Uint64 HostStart)
+  {
+    Uint64 Now = HostNanoseconds ();
+    FrameHostNs += Now - HostStart;
+
+    PerfSnapshot S;
+    S.Instructions = Cpu.Instructions;
+    S.Cycles = Clock;
+    S.PageCrossCycles = Cpu.PageCrossCycles;
+    S.Frames = Frame;
+    S.FrameCycles = Clock - FrameStartClock;
+    S.FrameHostNs = FrameHostNs;
+    S.FrameWallNs = LastFrameWallEnd ? Now - LastFrameWallEnd : FrameHostNs;
+    Perf.Publish (S);
+
+    FrameStartClock = Clock;
+    FrameHostNs = 0;
+    LastFrameWallEnd = Now;
+  }
+
+  void
+  ServiceMonitor ()
+  {
+    if (!Mon)
+      {
+        return;
+      }
+
+    MonitorCommand Command;
+    while (Mon->PopCommand (Command))
+      {
+        switch (Command.Type)
+          {
+          case MON_PAUSE:
+            Pause ();
+            break;
+          case MON_RESUME:
+            Resume ();
+            break;
+          case MON_STEP:
+            Step (Command.Count);
+            Pause ();
+            break;
+          case MON_ADD_WATCH:
+            Watch.Add (Command.First, Command.Last, Command.Kinds);
+            SyncHooks ();
+            break;
+          case MON_REMOVE_WATCH:
+            Watch.Remove (Command.First, Command.Last, Command.Kinds);
+            SyncHooks ();
+            break;
+          }
+      }
+  }
+};
+
+#define MACHINE_CPP
+#endif // !MACHINE_CPP
@@ -0,0 +1,573 @@
+#ifndef MONITOR_CPP
+
+#include "cpu.cpp"
+#include "ring.cpp"
+#include <atomic>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+/* Binary monitor
+ *
+ * Serves a subset of the VICE binary monitor protocol (API version 2) on
+ * a local Unix domain socket from its own thread. Frames look like VICE's:
+ *
+ *   request:  STX, version, body length (4), request id (4), command, body
+ *   response: STX, version, body length (4), response type, error code,
+ *             request id (4), body
+ *
+ * Supported: memory get (0x01), checkpoint set/delete (0x12/0x13),
+ * registers get (0x31), advance instructions (0x71), ping (0x81) and
+ * exit (0xaa, resume). 0xd0 is an extension that pauses the machine;
+ * unlike VICE, connecting and reading never pause it.
+ *
+ * The emulation thread never blocks on the monitor. Memory and register
+ * reads are answered from a snapshot the run loop copies at a frame
+ * boundary, only when one has been asked for. Control commands go to the
+ * run loop through a lock-free ring and are applied between frames.
+ */
+
+static constexpr Byte MON_STX = 0x02;
+static constexpr Byte MON_API_VERSION = 0x02;
+static constexpr Uint32 MON_EVENT_ID = 0xFFFFFFFF;
+
+/* Commands */
+static constexpr Byte MON_CMD_MEMORY_GET = 0x01;
+static constexpr Byte MON_CMD_CHECKPOINT_SET = 0x12;
+static constexpr Byte MON_CMD_CHECKPOINT_DELETE = 0x13;
+static constexpr Byte MON_CMD_REGISTERS_GET = 0x31;
+static constexpr Byte MON_CMD_ADVANCE_INSTRUCTIONS = 0x71;
+static constexpr Byte MON_CMD_PING = 0x81;
+static constexpr Byte MON_CMD_EXIT = 0xAA;
+static constexpr Byte MON_CMD_PAUSE = 0xD0; // Extension
+
+/* Responses and events */
+static constexpr Byte MON_RESPONSE_CHECKPOINT_INFO = 0x11;
+static constexpr Byte MON_RESPONSE_STOPPED = 0x62;
+static constexpr Byte MON_RESPONSE_RESUMED = 0x63;
+
+/* Error codes */
+static constexpr Byte MON_OK = 0x00;
+static constexpr Byte MON_ERR_NOT_FOUND = 0x01;
+static constexpr Byte MON_ERR_LENGTH = 0x80;
+static constexpr Byte MON_ERR_PARAMETER = 0x81;
+static constexpr Byte MON_ERR_VERSION = 0x82;
+static constexpr Byte MON_ERR_COMMAND = 0x83;
+static constexpr Byte MON_ERR_FAILURE = 0x8F;
+
+/* VICE register ids */
+static constexpr Byte MON_REG_A = 0x00;
+static constexpr Byte MON_REG_X = 0x01;
+static constexpr Byte MON_REG_Y = 0x02;
+static constexpr Byte MON_REG_PC = 0x03;
+static constexpr Byte MON_REG_SP = 0x04;
+static constexpr Byte MON_REG_FLAGS = 0x05;
+
+/* VICE checkpoint operations */
+static constexpr Byte MON_OP_LOAD = 0x01;
+static constexpr Byte MON_OP_STORE = 0x02;
+static constexpr Byte MON_OP_EXEC = 0x04;
+
+/* Control handed from the monitor thread to the run loop */
+enum MonitorCommandType : Byte
+{
+  MON_PAUSE,
+  MON_RESUME,
+  MON_STEP,
+  MON_ADD_WATCH,
+  MON_REMOVE_WATCH,
+};
+
+struct MonitorCommand
+{
+  Byte Type;
+  Byte Kinds; // Watchpoints::WATCH_* for MON_ADD/REMOVE_WATCH
+  Word First;
+  Word Last;
+  Uint32 Count; // Instructions for MON_STEP
+};
+
+/* Notifications from the run loop, forwarded as VICE events */
+struct MonitorEvent
+{
+  Byte Type; // MON_RESPONSE_STOPPED or MON_RESPONSE_RESUMED
+  Word PC;
+};
+
+struct MonitorSnapshot
+{
+  Byte Data[Memory::MAX_MEM];
+  Word PC;
+  Byte SP;
+  Byte A;
+  Byte X;
+  Byte Y;
+  Byte P;
+};
+
+struct Monitor
+{
+  static constexpr Uint32 MAX_CHECKPOINTS = Watchpoints::MAX_WATCHES;
+  static constexpr Uint32 MAX_REQUEST = 256;
+  static constexpr int SNAPSHOT_TIMEOUT_MS = 1000;
+
+  SpscRing<MonitorCommand, 64> Commands; // Monitor thread -> run loop
+  SpscRing<MonitorEvent, 64> Events;     // Run loop -> monitor thread
+
+  /** Run loop side: called at every frame boundary, paused or not.
+   * Copies memory and registers only when the monitor asked for it. */
+  void
+  FrameBoundary (const CPU &cpu, const Memory &memory)
+  {
+    if (!SnapshotWanted.load (std::memory_order_acquire))
+      {
+        return;
+      }
+    memcpy (Snapshot.Data, memory.Data, sizeof (Snapshot.Data));
+    Snapshot.PC = cpu.PC;
+    Snapshot.SP = cpu.SP;
+    Snapshot.A = cpu.A;
+    Snapshot.X = cpu.X;
+    Snapshot.Y = cpu.Y;
+    Snapshot.P = cpu.GetStatus ();
+    SnapshotWanted.store (false, std::memory_order_relaxed);
+    SnapshotReady.store (true, std::memory_order_release);
+  }
+
+  bool PopCommand (MonitorCommand &Command) { return Commands.Pop (Command); }
+
+  void
+  PostEvent (Byte Type, Word PC)
+  {
+    // Dropping an event when nobody drains the ring is fine; the client
+    // can always ask for registers.
+    Events.Push ({ Type, PC });
+  }
+
+  /** Listens on Path and starts the monitor thread */
+  bool
+  Start (const char *Path)
+  {
+    sockaddr_un Addr = {};
+    if (strlen (Path) >= sizeof (Addr.sun_path))
+      {
+        return false;
+      }
+    Addr.sun_family = AF_UNIX;
+    strcpy (Addr.sun_path, Path);
+
+    ListenFd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (ListenFd < 0)
+      {
+        return false;
+      }
+    unlink (Path);
+    if (bind (ListenFd, (sockaddr *)&Addr, sizeof (Addr)) < 0
+        || listen (ListenFd, 1) < 0)
+      {
+        close (ListenFd);
+        ListenFd = -1;
+        return false;
+      }
+
+    strcpy (SocketPath, Path);
+    Running.store (true);
+    Thread = std::thread (&Monitor::Serve, this);
+    return true;
+  }
+
+  void
+  Stop ()
+  {
+    if (!Running.exchange (false))
+      {
+        return;
+      }
+    Thread.join ();
+    if (ClientFd >= 0)
+      {
+        close (ClientFd);
+        ClientFd = -1;
+      }
+    close (ListenFd);
+    ListenFd = -1;
+    unlink (SocketPath);
+  }
+
+  ~Monitor () { Stop (); }
+
+private:
+  struct Checkpoint
+  {
+    Uint32 Id;
+    Word First;
+    Word Last;
+    Byte Kinds;
+  };
+
+  MonitorSnapshot Snapshot;
+  std::atomic<bool> SnapshotWanted{ false };
+  std::atomic<bool> SnapshotReady{ false };
+
+  std::thread Thread;
+  std::atomic<bool> Running{ false };
+  int ListenFd = -1;
+  int ClientFd = -1;
+  char SocketPath[sizeof (sockaddr_un::sun_path)];
+
+  Byte Request[MAX_REQUEST];
+  Uint32 RequestLength = 0;
+
+  Checkpoint Checkpoints[MAX_CHECKPOINTS];
+  Uint32 CheckpointCount = 0;
+  Uint32 NextCheckpointId = 1;
+
+  /* Monitor thread */
+
+  void
+  Serve ()
+  {
+    while (Running.load ())
+      {
+        pollfd Fd = { ClientFd >= 0 ? ClientFd : ListenFd, POLLIN, 0 };
+        int Ready = poll (&Fd, 1, 10);
+
+        if (Ready > 0 && ClientFd < 0)
+          {
+            ClientFd = accept (ListenFd, nullptr, nullptr);
+            RequestLength = 0;
+          }
+        else if (Ready > 0 && !ReadClient ())
+          {
+            close (ClientFd);
+            ClientFd = -1;
+          }
+
+        MonitorEvent Event;
+        while (Events.Pop (Event))
+          {
+            if (ClientFd >= 0)
+              {
+                Byte Body[2] = { (Byte)Event.PC, (Byte)(Event.PC >> 8) };
+                Respond (Event.Type, MON_OK, MON_EVENT_ID, Body, 2);
+              }
+          }
+      }
+  }
+
+  /** Reads what the client sent and handles every complete request.
+   * Returns false when the connection should be dropped. */
+  bool
+  ReadClient ()
+  {
+    ssize_t Got = recv (ClientFd, Request + RequestLength,
+                        MAX_REQUEST - RequestLength, 0);
+    if (Got <= 0)
+      {
+        return false;
+      }
+    RequestLength += Got;
+
+    for (;;)
+      {
+        static constexpr Uint32 HEADER = 11;
+        if (RequestLength < HEADER)
+          {
+            return true;
+          }
+        if (Request[0] != MON_STX)
+          {
+            return false;
+          }
+
+        Uint32 BodyLength = GetLong (Request + 2);
+        Uint32 Id = GetLong (Request + 6);
+        if (BodyLength > MAX_REQUEST - HEADER)
+          {
+            Respond (Request[10], MON_ERR_LENGTH, Id, nullptr, 0);
+            return false;
+          }
+        if (RequestLength < HEADER + BodyLength)
+          {
+            return true;
+          }
+
+        if (Request[1] != MON_API_VERSION)
+          {
+            Respond (Request[10], MON_ERR_VERSION, Id, nullptr, 0);
+          }
+        else
+          {
+            Handle (Request[10], Id, Request + HEADER, BodyLength);
+          }
+
+        Uint32 Used = HEADER + BodyLength;
+        memmove (Request, Request + Used, RequestLength - Used);
+        RequestLength -= Used;
+      }
+  }
+
+  void
+  Handle (Byte Command, Uint32 Id, const Byte *Body, Uint32 Length)
+  {
+    switch (Command)
+      {
+      case MON_CMD_PING:
+        Respond (Command, MON_OK, Id, nullptr, 0);
+        break;
+
+      case MON_CMD_MEMORY_GET:
+        {
+          // side effects (1), start (2), end (2), memspace (1), bank (2)
+          if (Length < 8)
+            {
+              Respond (Command, MON_ERR_LENGTH, Id, nullptr, 0);
+              break;
+            }
+          Word First = GetWord (Body + 1);
+          Word Last = GetWord (Body + 3);
+          if (Last < First)
+            {
+              Respond (Command, MON_ERR_PARAMETER, Id, nullptr, 0);
+              break;
+            }
+          if (!TakeSnapshot ())
+            {
+              Respond (Command, MON_ERR_FAILURE, Id, nullptr, 0);
+              break;
+            }
+          Uint32 Count = Last - First + 1;
+          Byte Head[2] = { (Byte)Count, (Byte)(Count >> 8) };
+          Respond (Command, MON_OK, Id, Head, 2, Snapshot.Data + First,
+                   Count);
+        }
+        break;
+
+      case MON_CMD_REGISTERS_GET:
+        {
+          if (!TakeSnapshot ())
+            {
+              Respond (Command, MON_ERR_FAILURE, Id, nullptr, 0);
+              break;
+            }
+          const Byte Ids[6] = { MON_REG_A,  MON_REG_X,  MON_REG_Y,
+                                MON_REG_PC, MON_REG_SP, MON_REG_FLAGS };
+          const Word Values[6] = { Snapshot.A,  Snapshot.X,  Snapshot.Y,
+                                   Snapshot.PC, Snapshot.SP, Snapshot.P };
+          Byte Out[2 + 6 * 4] = { 6, 0 };
+          for (int i = 0; i < 6; i++)
+            {
+              Byte *Item = Out + 2 + i * 4;
+              Item[0] = 3;
+              Item[1] = Ids[i];
+              PutWord (Item + 2, Values[i]);
+            }
+          Respond (Command, MON_OK, Id, Out, sizeof (Out));
+        }
+        break;
+
+      case MON_CMD_CHECKPOINT_SET:
+        {
+          // start (2), end (2), stop when hit (1), enabled (1), op (1),
+          // temporary (1)
+          if (Length < 8)
+            {
+              Respond (Command, MON_ERR_LENGTH, Id, nullptr, 0);
+              break;
+            }
+          Checkpoint New = { NextCheckpointId, GetWord (Body),
+                             GetWord (Body + 2), WatchKinds (Body[6]) };
+          if (New.Last < New.First || New.Kinds == 0)
+            {
+              Respond (Command, MON_ERR_PARAMETER, Id, nullptr, 0);
+              break;
+            }
+          if (CheckpointCount == MAX_CHECKPOINTS
+              || !Commands.Push ({ MON_ADD_WATCH, New.Kinds, New.First,
+                                   New.Last, 0 }))
+            {
+              Respond (Command, MON_ERR_FAILURE, Id, nullptr, 0);
+              break;
+            }
+          NextCheckpointId++;
+          Checkpoints[CheckpointCount++] = New;
+
+          Byte Info[23] = {};
+          PutLong (Info, New.Id);
+          PutWord (Info + 5, New.First);
+          PutWord (Info + 7, New.Last);
+          Info[9] = 1;  // stop when hit
+          Info[10] = 1; // enabled
+          Info[11] = Body[6];
+          Respond (MON_RESPONSE_CHECKPOINT_INFO, MON_OK, Id, Info,
+                   sizeof (Info));
+        }
+        break;
+
+      case MON_CMD_CHECKPOINT_DELETE:
+        {
+          if (Length < 4)
+            {
+              Respond (Command, MON_ERR_LENGTH, Id, nullptr, 0);
+              break;
+            }
+          Uint32 Number = GetLong (Body);
+          Uint32 i = 0;
+          while (i < CheckpointCount && Checkpoints[i].Id != Number)
+            {
+              i++;
+            }
+          if (i == CheckpointCount)
+            {
+              Respond (Command, MON_ERR_NOT_FOUND, Id, nullptr, 0);
+              break;
+            }
+          const Checkpoint &Old = Checkpoints[i];
+          if (!Commands.Push ({ MON_REMOVE_WATCH, Old.Kinds, Old.First,
+                                Old.Last, 0 }))
+            {
+              Respond (Command, MON_ERR_FAILURE, Id, nullptr, 0);
+              break;
+            }
+          Checkpoints[i] = Checkpoints[--CheckpointCount];
+          Respond (Command, MON_OK, Id, nullptr, 0);
+        }
+        break;
+
+      case MON_CMD_ADVANCE_INSTRUCTIONS:
+        {
+          // step over subroutines (1), count (2)
+          if (Length < 3)
+            {
+              Respond (Command, MON_ERR_LENGTH, Id, nullptr, 0);
+              break;
+            }
+          Uint32 Count = GetWord (Body + 1);
+          bool Queued = Commands.Push (
+              { MON_STEP, 0, 0, 0, Count ? Count : 1 });
+          Respond (Command, Queued ? MON_OK : MON_ERR_FAILURE, Id, nullptr,
+                   0);
+        }
+        break;
+
+      case MON_CMD_EXIT:
+      case MON_CMD_PAUSE:
+        {
+          Byte Type = Command == MON_CMD_EXIT ? MON_RESUME : MON_PAUSE;
+          bool Queued = Commands.Push ({ Type, 0, 0, 0, 0 });
+          Respond (Command, Queued ? MON_OK : MON_ERR_FAILURE, Id, nullptr,
+                   0);
+        }
+        break;
+
+      default:
+        Respond (Command, MON_ERR_COMMAND, Id, nullptr, 0);
+      }
+  }
+
+  /** Asks the run loop for a snapshot and waits for the next frame
+   * boundary. Only the monitor thread waits; the run loop never does. */
+  bool
+  TakeSnapshot ()
+  {
+    SnapshotReady.store (false, std::memory_order_relaxed);
+    SnapshotWanted.store (true, std::memory_order_release);
+    for (int Waited = 0; Waited < SNAPSHOT_TIMEOUT_MS; Waited++)
+      {
+        if (SnapshotReady.load (std::memory_order_acquire))
+          {
+            return true;
+          }
+        usleep (1000);
+      }
+    SnapshotWanted.store (false, std::memory_order_relaxed);
+    return false;
+  }
+
+  static Byte
+  WatchKinds (Byte Operation)
+  {
+    Byte Kinds = 0;
+    if (Operation & MON_OP_LOAD)
+      {
+        Kinds |= Watchpoints::WATCH_READ;
+      }
+    if (Operation & MON_OP_STORE)
+      {
+        Kinds |= Watchpoints::WATCH_WRITE;
+      }
+    if (Operation & MON_OP_EXEC)
+      {
+        Kinds |= Watchpoints::WATCH_EXEC;
+      }
+    return Kinds;
+  }
+
+  void
+  Respond (Byte Type, Byte Error, Uint32 Id, const Byte *Body,
+           Uint32 Length, const Byte *Tail = nullptr, Uint32 TailLength = 0)
+  {
+    Byte Header[12];
+    Header[0] = MON_STX;
+    Header[1] = MON_API_VERSION;
+    PutLong (Header + 2, Length + TailLength);
+    Header[6] = Type;
+    Header[7] = Error;
+    PutLong (Header + 8, Id);
+
+    Send (Header, sizeof (Header));
+    Send (Body, Length);
+    Send (Tail, TailLength);
+  }
+
+  void
+  Send (const Byte *Data, Uint32 Length)
+  {
+    while (Length > 0 && ClientFd >= 0)
+      {
+        ssize_t Sent = send (ClientFd, Data, Length, MSG_NOSIGNAL);
+        if (Sent < 0 && errno == EINTR)
+          {
+            continue;
+          }
+        if (Sent <= 0)
+          {
+            return;
+          }
+        Data += Sent;
+        Length -= Sent;
+      }
+  }
+
+  static Word GetWord (const Byte *P) { return P[0] | (P[1] << 8); }
+
+  static Uint32
+  GetLong (const Byte *P)
+  {
+    return P[0] | (P[1] << 8) | (P[2] << 16) | ((Uint32)P[3] << 24);
+  }
+
+  static void
+  PutWord (Byte *P, Word Value)
+  {
+    P[0] = (Byte)Value;
+    P[1] = (Byte)(Value >> 8);
+  }
+
+  static void
+  PutLong (Byte *P, Uint32 Value)
+  {
+    for (int i = 0; i < 4; i++)
+      {
+        P[i] = (Byte)(Value >> (i * 8));
+      }
+  }
+};
+
+#define MONITOR_CPP
+#endif // !MONITOR_CPP
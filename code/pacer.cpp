@@ -0,0 +1,108 @@
+#ifndef PACER_CPP
+
+#include "cpu.h"
+#include "perf.cpp"
+#include <errno.h>
+#include <time.h>
+
+/* Real-time frame pacing.
+ *
+ * Every frame has an absolute deadline on CLOCK_MONOTONIC computed from a
+ * fixed origin, so sleep overshoot never accumulates into drift. The
+ * pacer sleeps with clock_nanosleep(TIMER_ABSTIME) until shortly before
+ * the deadline and spins the rest of the way, which keeps frame jitter
+ * well under a millisecond.
+ *
+ * Pacing only moves host time. Warp mode skips the waiting, and leaving
+ * warp re-anchors the origin at the current frame, so switching never
+ * stretches, squeezes or replays emulated time.
+ */
+struct Pacer
+{
+  static constexpr Uint64 SPIN_NS = 200000;     // Spin the last 0.2 ms
+  static constexpr Uint64 MAX_LAG_NS = 100000000; // Give up catching up
+
+  Uint32 ClockHz = 0;
+  Uint32 CyclesPerFrame = 0;
+  bool Warp = false;
+
+  Uint64 Origin = 0; // Host time of frame 0 since the last anchor
+  Uint64 Frames = 0; // Frames paced since the last anchor
+  Uint64 Resyncs = 0; // Times the pacer fell too far behind and re-anchored
+
+  void
+  Start (Uint32 Hz, Uint32 Cycles)
+  {
+    ClockHz = Hz;
+    CyclesPerFrame = Cycles;
+    Anchor ();
+  }
+
+  void
+  SetWarp (bool Enabled)
+  {
+    if (Warp && !Enabled)
+      {
+        Anchor ();
+      }
+    Warp = Enabled;
+  }
+
+  /** Host nanoseconds from the anchor to the end of frame Count. Exact
+   * integer arithmetic, so the frame rate carries no rounding drift. */
+  Uint64
+  FrameOffset (Uint64 Count) const
+  {
+    Uint64 Cycles = Count * CyclesPerFrame;
+    return (Cycles / ClockHz) * 1000000000ull
+           + (Cycles % ClockHz) * 1000000000ull / ClockHz;
+  }
+
+  /** Called after each emulated frame; waits for its deadline */
+  void
+  FrameDone ()
+  {
+    if (Warp)
+      {
+        return;
+      }
+
+    Frames++;
+    Uint64 Deadline = Origin + FrameOffset (Frames);
+    Uint64 Now = HostNanoseconds ();
+
+    if (Now > Deadline + MAX_LAG_NS)
+      {
+        // Too far behind to catch up without a visible burst; start over
+        Resyncs++;
+        Anchor ();
+        return;
+      }
+
+    if (Deadline > Now + SPIN_NS)
+      {
+        Uint64 Wake = Deadline - SPIN_NS;
+        timespec Until = { (time_t)(Wake / 1000000000ull),
+                           (long)(Wake % 1000000000ull) };
+        while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &Until,
+                                nullptr)
+               == EINTR)
+          {
+          }
+      }
+    while (HostNanoseconds () < Deadline)
+      {
+      }
+  }
+
+private:
+  void
+  Anchor ()
+  {
+    Origin = HostNanoseconds ();
+    Frames = 0;
+  }
+};
+
+#define PACER_CPP
+#endif // !PACER_CPP
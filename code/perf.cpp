@@ -0,0 +1,172 @@
+#ifndef PERF_CPP
+
+#include "cpu.h"
+#include <atomic>
+#include <stdio.h>
+#include <time.h>
+
+static Uint64
+HostNanoseconds ()
+{
+  timespec Now;
+  clock_gettime (CLOCK_MONOTONIC, &Now);
+  return (Uint64)Now.tv_sec * 1000000000ull + Now.tv_nsec;
+}
+
+/* One consistent set of runtime metrics */
+struct PerfSnapshot
+{
+  Uint64 Instructions;    // Instructions retired
+  Uint64 Cycles;          // Emulated cycles
+  Uint64 PageCrossCycles; // Cycles spent on page-crossing penalties
+  Uint64 Frames;          // Completed frames
+  Uint64 FrameCycles;     // Emulated cycles in the last frame
+  Uint64 FrameHostNs;     // Host time spent emulating the last frame
+  Uint64 FrameWallNs;     // Wall time between the last two frame ends
+
+  double
+  EmulatedMHz () const
+  {
+    return FrameHostNs ? FrameCycles * 1000.0 / FrameHostNs : 0.0;
+  }
+
+  /** Instructions per emulated cycle */
+  double
+  Ipc () const
+  {
+    return Cycles ? (double)Instructions / Cycles : 0.0;
+  }
+
+  /** Emulated time over wall time for the last frame; below 1.0 means the
+   * instance is falling behind the given clock */
+  double
+  SpeedRatio (Uint32 ClockHz) const
+  {
+    return FrameWallNs ? FrameCycles * 1e9 / ClockHz / FrameWallNs : 0.0;
+  }
+};
+
+/* Runtime metrics shared with other threads.
+ *
+ * The run loop publishes once per frame; nothing here is touched per
+ * instruction. Every field is a relaxed atomic, so a dashboard may read
+ * single values directly. Read() wraps them in a seqlock for a snapshot
+ * in which all fields belong to the same frame.
+ */
+struct PerfCounters
+{
+  std::atomic<Uint32> Sequence{ 0 };
+  std::atomic<Uint64> Instructions{ 0 };
+  std::atomic<Uint64> Cycles{ 0 };
+  std::atomic<Uint64> PageCrossCycles{ 0 };
+  std::atomic<Uint64> Frames{ 0 };
+  std::atomic<Uint64> FrameCycles{ 0 };
+  std::atomic<Uint64> FrameHostNs{ 0 };
+  std::atomic<Uint64> FrameWallNs{ 0 };
+
+  /** Writer side; only the run loop calls this */
+  void
+  Publish (const PerfSnapshot &S)
+  {
+    Uint32 Seq = Sequence.load (std::memory_order_relaxed);
+    Sequence.store (Seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence (std::memory_order_release);
+
+    Instructions.store (S.Instructions, std::memory_order_relaxed);
+    Cycles.store (S.Cycles, std::memory_order_relaxed);
+    PageCrossCycles.store (S.PageCrossCycles, std::memory_order_relaxed);
+    Frames.store (S.Frames, std::memory_order_relaxed);
+    FrameCycles.store (S.FrameCycles, std::memory_order_relaxed);
+    FrameHostNs.store (S.FrameHostNs, std::memory_order_relaxed);
+    FrameWallNs.store (S.FrameWallNs, std::memory_order_relaxed);
+
+    Sequence.store (Seq + 2, std::memory_order_release);
+  }
+
+  /** Reader side; safe from any thread */
+  PerfSnapshot
+  Read () const
+  {
+    PerfSnapshot S;
+    for (;;)
+      {
+        Uint32 Before = Sequence.load (std::memory_order_acquire);
+        S.Instructions = Instructions.load (std::memory_order_relaxed);
+        S.Cycles = Cycles.load (std::memory_order_relaxed);
+        S.PageCrossCycles = PageCrossCycles.load (std::memory_order_relaxed);
+        S.Frames = Frames.load (std::memory_order_relaxed);
+        S.FrameCycles = FrameCycles.load (std::memory_order_relaxed);
+        S.FrameHostNs = FrameHostNs.load (std::memory_order_relaxed);
+        S.FrameWallNs = FrameWallNs.load (std::memory_order_relaxed);
+        std::atomic_thread_fence (std::memory_order_acquire);
+        Uint32 After = Sequence.load (std::memory_order_relaxed);
+        if (Before == After && !(Before & 1))
+          {
+            return S;
+          }
+      }
+  }
+
+  /** Writes the metrics in Prometheus text exposition format. The file is
+   * written beside Path and renamed over it, so a collector never sees a
+   * partial file. */
+  bool
+  WritePrometheus (const char *Path, const char *Instance,
+                   Uint32 ClockHz) const
+  {
+    char TempPath[4096];
+    if (snprintf (TempPath, sizeof (TempPath), "%s.tmp", Path)
+        >= (int)sizeof (TempPath))
+      {
+        return false;
+      }
+    FILE *File = fopen (TempPath, "w");
+    if (!File)
+      {
+        return false;
+      }
+
+    PerfSnapshot S = Read ();
+    struct Metric
+    {
+      const char *Name;
+      const char *Type;
+      const char *Help;
+      double Value;
+    };
+    const Metric Metrics[] = {
+      { "cbemu_instructions_total", "counter", "Instructions retired.",
+        (double)S.Instructions },
+      { "cbemu_cycles_total", "counter", "Emulated CPU cycles.",
+        (double)S.Cycles },
+      { "cbemu_page_cross_cycles_total", "counter",
+        "Cycles spent on page-crossing penalties.",
+        (double)S.PageCrossCycles },
+      { "cbemu_frames_total", "counter", "Completed emulated frames.",
+        (double)S.Frames },
+      { "cbemu_frame_host_seconds", "gauge",
+        "Host time spent emulating the last frame.", S.FrameHostNs / 1e9 },
+      { "cbemu_emulated_mhz", "gauge",
+        "Emulated clock rate while running the last frame.",
+        S.EmulatedMHz () },
+      { "cbemu_ipc", "gauge", "Instructions per emulated cycle.", S.Ipc () },
+      { "cbemu_speed_ratio", "gauge",
+        "Emulated time over wall time for the last frame.",
+        S.SpeedRatio (ClockHz) },
+    };
+    for (const Metric &M : Metrics)
+      {
+        fprintf (File, "# HELP %s %s\n# TYPE %s %s\n%s{instance=\"%s\"} %.17g\n",
+                 M.Name, M.Help, M.Name, M.Type, M.Name, Instance, M.Value);
+      }
+
+    if (fclose (File) != 0)
+      {
+        return false;
+      }
+    return rename (TempPath, Path) == 0;
+  }
+};
+
+#define PERF_CPP
+#endif // !PERF_CPP
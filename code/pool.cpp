@@ -0,0 +1,191 @@
+#ifndef POOL_CPP
+
+#include "cpu.cpp"
+#include <new>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Pool of CPU and memory instances for batch jobs running thousands of
+ * machines.
+ *
+ * Instances are carved out of 2 MiB arenas, so each instance's 64K of
+ * memory spans a handful of huge page TLB entries at most instead of
+ * sixteen small ones per instance. An arena is a MAP_HUGETLB mapping
+ * when the system has huge pages reserved; otherwise an ordinary mapping
+ * aligned to 2 MiB and advised for transparent huge pages.
+ *
+ * A pool is not shared: each worker thread owns one. Arenas are mapped
+ * without being touched and an instance is constructed and reset by the
+ * thread that acquires it, so the pages are first touched, and on a NUMA
+ * system placed, by the thread that will run them. Released instances
+ * go on a free list and are reused by the next Acquire; arenas are only
+ * unmapped with the pool.
+ */
+struct InstancePool
+{
+  static constexpr size_t ARENA_SIZE = 2 * 1024 * 1024;
+
+  struct Instance
+  {
+    Memory Mem;
+    CPU Cpu;
+    Instance *Next; // Free list link, while released
+  };
+
+  struct Stats
+  {
+    Uint64 Arenas = 0;
+    Uint64 HugeArenas = 0;    // Of them, on reserved huge pages
+    Uint64 Live = 0;          // Instances acquired and not released
+    Uint64 Idle = 0;          // Released, waiting for reuse
+    Uint64 ResidentBytes = 0; // Arena pages in RAM
+  };
+
+  ~InstancePool ()
+  {
+    while (Arenas)
+      {
+        Arena *Next = Arenas->Next;
+        munmap (Arenas, ARENA_SIZE);
+        Arenas = Next;
+      }
+  }
+
+  /** A freshly reset instance: memory cleared and unmapped, registers at
+   * power on. Null when no arena can be mapped. */
+  Instance *
+  Acquire ()
+  {
+    Instance *Slot = Free;
+    if (Slot)
+      {
+        Free = Slot->Next;
+        Idle--;
+      }
+    else
+      {
+        Slot = Carve ();
+        if (!Slot)
+          {
+            return nullptr;
+          }
+      }
+    Instance *Fresh = new (Slot) Instance;
+    Fresh->Cpu.Reset (Fresh->Mem);
+    Live++;
+    return Fresh;
+  }
+
+  /** Returns an instance to the pool; its memory stays mapped */
+  void
+  Release (Instance *Used)
+  {
+    Used->Next = Free;
+    Free = Used;
+    Live--;
+    Idle++;
+  }
+
+  Stats
+  GetStats () const
+  {
+    Stats S;
+    S.Live = Live;
+    S.Idle = Idle;
+    long PageSize = sysconf (_SC_PAGESIZE);
+    for (const Arena *A = Arenas; A; A = A->Next)
+      {
+        S.Arenas++;
+        if (A->Huge)
+          {
+            // Counted whole: the huge page is reserved for it
+            S.HugeArenas++;
+            S.ResidentBytes += ARENA_SIZE;
+            continue;
+          }
+        unsigned char Pages[ARENA_SIZE / 4096];
+        if (mincore ((void *)A, ARENA_SIZE, Pages) == 0)
+          {
+            for (size_t i = 0; i < ARENA_SIZE / PageSize; i++)
+              {
+                S.ResidentBytes += (Pages[i] & 1) ? PageSize : 0;
+              }
+          }
+      }
+    return S;
+  }
+
+private:
+  /* Header at the start of each arena; instances follow it */
+  struct Arena
+  {
+    Arena *Next;
+    bool Huge;
+  };
+
+  static constexpr size_t SLOT_SIZE = (sizeof (Instance) + 63) & ~(size_t)63;
+  static constexpr size_t FIRST_SLOT = 64;
+  static constexpr size_t SLOTS_PER_ARENA
+      = (ARENA_SIZE - FIRST_SLOT) / SLOT_SIZE;
+
+  Arena *Arenas = nullptr; // Newest first
+  Uint64 Carved = 0;       // Slots handed out of the newest arena
+  Instance *Free = nullptr;
+  Uint64 Live = 0;
+  Uint64 Idle = 0;
+
+  Instance *
+  Carve ()
+  {
+    if (!Arenas || Carved == SLOTS_PER_ARENA)
+      {
+        if (!MapArena ())
+          {
+            return nullptr;
+          }
+      }
+    Byte *At = (Byte *)Arenas + FIRST_SLOT + Carved++ * SLOT_SIZE;
+    return (Instance *)At;
+  }
+
+  bool
+  MapArena ()
+  {
+    int Flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *Mapped = mmap (nullptr, ARENA_SIZE, PROT_READ | PROT_WRITE,
+                         Flags | MAP_HUGETLB, -1, 0);
+    bool Huge = Mapped != MAP_FAILED;
+    if (!Huge)
+      {
+        // Twice the size, then trim to a 2 MiB aligned arena
+        Mapped = mmap (nullptr, 2 * ARENA_SIZE, PROT_READ | PROT_WRITE, Flags,
+                       -1, 0);
+        if (Mapped == MAP_FAILED)
+          {
+            return false;
+          }
+        uintptr_t Start = (uintptr_t)Mapped;
+        uintptr_t Aligned = (Start + ARENA_SIZE - 1) & ~(ARENA_SIZE - 1);
+        if (Aligned > Start)
+          {
+            munmap (Mapped, Aligned - Start);
+          }
+        munmap ((void *)(Aligned + ARENA_SIZE), Start + ARENA_SIZE - Aligned);
+        Mapped = (void *)Aligned;
+#ifdef MADV_HUGEPAGE
+        madvise (Mapped, ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+      }
+    // Only the header is touched here, by the acquiring thread too
+    Arena *New = (Arena *)Mapped;
+    New->Next = Arenas;
+    New->Huge = Huge;
+    Arenas = New;
+    Carved = 0;
+    return true;
+  }
+};
+
+#define POOL_CPP
+#endif // !POOL_CPP
@@ -0,0 +1,49 @@
+#ifndef PRG_CPP
+
+#include "cpu.cpp"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Loads a PRG file (a load address, then the bytes to load there) into
+ * RAM, straight from a mapping of the file. Bytes past $FFFF are
+ * dropped. Sets Start and End, one past the last byte loaded, as the
+ * KERNAL's LOAD would. */
+static bool
+LoadPrg (Memory &memory, const char *Path, Word &Start, Word &End)
+{
+  int Fd = open (Path, O_RDONLY);
+  if (Fd < 0)
+    {
+      return false;
+    }
+  struct stat Info;
+  if (fstat (Fd, &Info) != 0 || Info.st_size < 2)
+    {
+      close (Fd);
+      return false;
+    }
+  size_t Size = Info.st_size;
+  void *Mapped = mmap (nullptr, Size, PROT_READ, MAP_PRIVATE, Fd, 0);
+  close (Fd);
+  if (Mapped == MAP_FAILED)
+    {
+      return false;
+    }
+  const Byte *File = (const Byte *)Mapped;
+  Start = File[0] | (File[1] << 8);
+  size_t Length = Size - 2;
+  if (Length > Memory::MAX_MEM - Start)
+    {
+      Length = Memory::MAX_MEM - Start;
+    }
+  memory.Copy (Start, File + 2, Length);
+  End = (Word)(Start + Length);
+  munmap (Mapped, Size);
+  return true;
+}
+
+#define PRG_CPP
+#endif // !PRG_CPP
@@ -0,0 +1,344 @@
+#ifndef PROFILE_CPP
+
+#include "cpu.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Routine profiler with call stack attribution.
+ *
+ * The instrumented interpreter reports every JSR and RTS/RTI and the
+ * cycles of every instruction (see CPUHooks); a CPU without a profiler
+ * attached never calls in. A shadow stack mirrors the emulated one: a
+ * JSR pushes a frame recording the stack pointer after its push, and a
+ * return pops the frames whose return address it released. So code
+ * that pushes an address and RTSes to it, or drops a return address to
+ * bail out of nested calls, keeps the shadow stack in step.
+ *
+ * An instruction's cycles go to the routine running it: a JSR's to the
+ * caller, an RTS's to the callee. Per routine, by entry address, there
+ * are calls, exclusive cycles (its own instructions) and inclusive ones
+ * (from its JSR to its return), counted at the outermost frame only
+ * when it recurses. Cycles are also kept per call path, in a tree of
+ * paths, for collapsed stacks as flame graph tools read them.
+ *
+ * Names come from VICE label files ("al C:e5cd .name"); routines without
+ * one are named by address. Code outside any call is "[top]".
+ */
+struct Profiler
+{
+  static constexpr Uint32 MAX_DEPTH = 128; // Return addresses a stack holds
+  static constexpr Uint32 MAX_PATHS = 1 << 16;
+  static constexpr Uint32 MAX_NAME_BYTES = 256 * 1024;
+
+  Uint64 Calls[0x10000] = {};     // Per routine entry address
+  Uint64 Exclusive[0x10000] = {};
+  Uint64 Inclusive[0x10000] = {};
+  Uint64 Total = 0;      // Cycles retired while attached
+  Uint64 Truncated = 0;  // Calls past MAX_DEPTH or MAX_PATHS, not tracked
+
+  /** Reads a VICE label file; the first label for an address names it */
+  bool
+  LoadLabels (const char *Path)
+  {
+    FILE *File = fopen (Path, "r");
+    if (!File)
+      {
+        return false;
+      }
+    char Line[256];
+    while (fgets (Line, sizeof (Line), File))
+      {
+        unsigned Address;
+        char Name[128];
+        if (sscanf (Line, "al C:%x .%127s", &Address, Name) != 2
+            && sscanf (Line, "al %x .%127s", &Address, Name) != 2)
+          {
+            continue;
+          }
+        Uint32 Length = strlen (Name) + 1;
+        if (Address > 0xFFFF || NameAt[Address] != 0
+            || NameBytes + Length > MAX_NAME_BYTES)
+          {
+            continue;
+          }
+        memcpy (Names + NameBytes, Name, Length);
+        NameAt[Address] = NameBytes + 1;
+        NameBytes += Length;
+      }
+    fclose (File);
+    return true;
+  }
+
+  /** The label of a routine, or its address formatted into Buffer */
+  const char *
+  Name (Word Address, char (&Buffer)[8]) const
+  {
+    if (NameAt[Address])
+      {
+        return Names + NameAt[Address] - 1;
+      }
+    snprintf (Buffer, sizeof (Buffer), "$%04X", Address);
+    return Buffer;
+  }
+
+  /* Called from the core. Call and Return take effect once the
+   * instruction retires. */
+
+  void
+  Call (Word Target, Byte SP)
+  {
+    Pending = PENDING_CALL;
+    PendingTarget = Target;
+    PendingSP = SP;
+  }
+
+  void
+  Return (Byte SP)
+  {
+    Pending = PENDING_RETURN;
+    PendingSP = SP;
+  }
+
+  void
+  Retire (Sint32 Cycles)
+  {
+    Paths[Owner].Cycles += Cycles;
+    if (Owner != TOP)
+      {
+        Exclusive[Paths[Owner].Routine] += Cycles;
+      }
+    Total += Cycles;
+    if (Pending == PENDING_CALL)
+      {
+        Enter ();
+      }
+    else if (Pending == PENDING_RETURN)
+      {
+        Leave ();
+      }
+    Pending = PENDING_NONE;
+    Owner = Depth ? Frames[Depth - 1].Path : TOP;
+  }
+
+  /** Forgets all counts and the shadow stack, keeping the labels */
+  void
+  Clear ()
+  {
+    memset (Calls, 0, sizeof (Calls));
+    memset (Exclusive, 0, sizeof (Exclusive));
+    memset (Inclusive, 0, sizeof (Inclusive));
+    memset (Active, 0, sizeof (Active));
+    memset (Index, 0, sizeof (Index));
+    Paths[TOP] = { TOP, 0, 0 };
+    PathCount = 1;
+    Depth = 0;
+    Owner = TOP;
+    Pending = PENDING_NONE;
+    Total = Truncated = 0;
+  }
+
+  /** One line per call path with cycles of its own: the names from the
+   * outermost routine in, separated by ';', then the cycles */
+  void
+  WriteCollapsed (FILE *Out) const
+  {
+    for (Uint32 p = 0; p < PathCount; p++)
+      {
+        if (Paths[p].Cycles == 0)
+          {
+            continue;
+          }
+        Uint32 Chain[MAX_DEPTH];
+        Uint32 Length = 0;
+        for (Uint32 At = p; At != TOP; At = Paths[At].Parent)
+          {
+            Chain[Length++] = At;
+          }
+        if (Length == 0)
+          {
+            fputs ("[top]", Out);
+          }
+        for (Uint32 i = Length; i-- > 0;)
+          {
+            char Buffer[8];
+            fputs (Name (Paths[Chain[i]].Routine, Buffer), Out);
+            if (i > 0)
+              {
+                fputc (';', Out);
+              }
+          }
+        fprintf (Out, " %llu\n", (unsigned long long)Paths[p].Cycles);
+      }
+  }
+
+  bool
+  WriteCollapsed (const char *Path) const
+  {
+    FILE *File = fopen (Path, "w");
+    if (!File)
+      {
+        return false;
+      }
+    WriteCollapsed (File);
+    return fclose (File) == 0;
+  }
+
+  /** Inclusive cycles of a routine, including a call still running */
+  Uint64
+  InclusiveOf (Word Address) const
+  {
+    for (Uint32 d = 0; d < Depth; d++)
+      {
+        if (Frames[d].Routine == Address)
+          {
+            return Inclusive[Address] + Total - Frames[d].Entered;
+          }
+      }
+    return Inclusive[Address];
+  }
+
+  /** The Count routines with the most inclusive cycles */
+  void
+  WriteReport (FILE *Out, Uint32 Count) const
+  {
+    static constexpr Uint32 MAX_REPORT = 64;
+    Word Best[MAX_REPORT];
+    Uint64 Spent[MAX_REPORT];
+    Uint32 Found = 0;
+    if (Count > MAX_REPORT)
+      {
+        Count = MAX_REPORT;
+      }
+    for (Uint32 Address = 0; Address < 0x10000; Address++)
+      {
+        if (Calls[Address] == 0)
+          {
+            continue;
+          }
+        // Insert in order, dropping the least past Count
+        Uint64 Cycles = InclusiveOf (Address);
+        Uint32 i = Found < Count ? Found++ : Count;
+        for (; i > 0 && Spent[i - 1] < Cycles; i--)
+          {
+            if (i < Count)
+              {
+                Best[i] = Best[i - 1];
+                Spent[i] = Spent[i - 1];
+              }
+          }
+        if (i < Count)
+          {
+            Best[i] = Address;
+            Spent[i] = Cycles;
+          }
+      }
+    fprintf (Out, "%-24s %10s %14s %14s %6s\n", "routine", "calls",
+             "inclusive", "exclusive", "%");
+    for (Uint32 i = 0; i < Found; i++)
+      {
+        char Buffer[8];
+        Word A = Best[i];
+        fprintf (Out, "%-24s %10llu %14llu %14llu %6.2f\n", Name (A, Buffer),
+                 (unsigned long long)Calls[A], (unsigned long long)Spent[i],
+                 (unsigned long long)Exclusive[A],
+                 Total ? 100.0 * Spent[i] / Total : 0.0);
+      }
+  }
+
+private:
+  static constexpr Uint32 TOP = 0; // Path of code outside any call
+  static constexpr Byte PENDING_NONE = 0;
+  static constexpr Byte PENDING_CALL = 1;
+  static constexpr Byte PENDING_RETURN = 2;
+
+  struct CallPath
+  {
+    Uint32 Parent;
+    Word Routine;
+    Uint64 Cycles; // Exclusive, on this path
+  };
+
+  struct Frame
+  {
+    Uint32 Path;
+    Word Routine;
+    Byte SP;     // After the JSR pushed its return address
+    Uint64 Entered;
+  };
+
+  CallPath Paths[MAX_PATHS] = { { TOP, 0, 0 } };
+  Uint32 PathCount = 1;
+  Uint32 Index[2 * MAX_PATHS] = {}; // Hash of (parent, routine) to path
+
+  Frame Frames[MAX_DEPTH];
+  Uint32 Depth = 0;
+  Uint32 Owner = TOP; // Path the running instruction is charged to
+  Word Active[0x10000] = {}; // Frames per routine on the shadow stack
+
+  Byte Pending = PENDING_NONE;
+  Word PendingTarget = 0;
+  Byte PendingSP = 0;
+
+  char Names[MAX_NAME_BYTES];
+  Uint32 NameBytes = 0;
+  Uint32 NameAt[0x10000] = {}; // Offset + 1 into Names, 0 for none
+
+  /** The path Parent takes calling Routine, added if new; MAX_PATHS when
+   * the tree is full */
+  Uint32
+  Child (Uint32 Parent, Word Routine)
+  {
+    Uint64 Key = ((Uint64)Parent << 16) | Routine;
+    Uint32 Mask = 2 * MAX_PATHS - 1;
+    Uint32 i = (Uint32)((Key * 0x9E3779B97F4A7C15ull) >> 40) & Mask;
+    for (; Index[i] != 0; i = (i + 1) & Mask)
+      {
+        const CallPath &P = Paths[Index[i]];
+        if (P.Parent == Parent && P.Routine == Routine)
+          {
+            return Index[i];
+          }
+      }
+    if (PathCount == MAX_PATHS)
+      {
+        return MAX_PATHS;
+      }
+    Paths[PathCount] = { Parent, Routine, 0 };
+    Index[i] = PathCount;
+    return PathCount++;
+  }
+
+  void
+  Enter ()
+  {
+    Uint32 Parent = Depth ? Frames[Depth - 1].Path : TOP;
+    Uint32 Path = Depth < MAX_DEPTH ? Child (Parent, PendingTarget)
+                                    : MAX_PATHS;
+    if (Path == MAX_PATHS)
+      {
+        Truncated++;
+        return;
+      }
+    Frames[Depth++] = { Path, PendingTarget, PendingSP, Total };
+    Calls[PendingTarget]++;
+    Active[PendingTarget]++;
+  }
+
+  /** Pops the frames whose return addresses are at or below the stack
+   * pointer the return left */
+  void
+  Leave ()
+  {
+    while (Depth > 0 && Frames[Depth - 1].SP < PendingSP)
+      {
+        const Frame &F = Frames[--Depth];
+        if (--Active[F.Routine] == 0)
+          {
+            Inclusive[F.Routine] += Total - F.Entered;
+          }
+      }
+  }
+};
+
+#define PROFILE_CPP
+#endif // !PROFILE_CPP
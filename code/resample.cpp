@@ -0,0 +1,317 @@
+#ifndef RESAMPLE_CPP
+
+#include "audio.cpp"
+#include <math.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+enum ResampleQuality : Byte
+{
+  RESAMPLE_FAST,
+  RESAMPLE_MEDIUM,
+  RESAMPLE_BEST,
+};
+
+/* Windowed-sinc design of a quality tier */
+struct ResampleTier
+{
+  const char *Name;
+  Uint32 ZeroCrossings; // Per side, at the output rate
+  Uint32 Phases;        // Filters per input sample
+  float Passband;       // Cutoff, as a fraction of the output Nyquist rate
+  float Beta;           // Kaiser window; about 60, 80 and 100 dB stopband
+};
+
+static constexpr ResampleTier RESAMPLE_TIERS[3] = {
+  { "fast", 8, 64, 0.70f, 6.0f },
+  { "medium", 16, 256, 0.80f, 8.0f },
+  { "best", 32, 512, 0.90f, 10.0f },
+};
+
+/* Polyphase windowed-sinc downsampler
+ *
+ * Output sample n sits at input position n * InRate / OutRate. That
+ * position is kept as an exact whole part and remainder, so it never
+ * drifts. The fraction picks the nearest of Phases precomputed filters,
+ * and the output is one dot product of that filter with the input
+ * around it. Only outputs are computed, so the cost is Taps per output
+ * sample. Filtering at the input rate and dropping samples would cost
+ * Taps per input sample, some 22 times more from the SID clock.
+ *
+ * Input streams through Push in blocks of any size. An output is made
+ * as soon as the input covers its filter and goes to Out before Push
+ * returns, so latency is fixed at Latency () input samples (under a
+ * millisecond for every tier from the SID clock).
+ */
+struct Resampler
+{
+  static constexpr Uint32 TAP_ALIGN = 16;     // Taps are padded to this
+  static constexpr Uint32 INPUT_BLOCK = 4096; // Buffered beyond one filter
+  static constexpr Uint32 OUT_BLOCK = 256;    // Samples per call to Out
+
+  Uint32 InRate = 0;
+  Uint32 OutRate = 0;
+  Uint32 Taps = 0;   // Per phase, padded
+  Uint32 Phases = 0;
+
+  AudioSink Out = nullptr;
+  void *OutContext = nullptr;
+
+  ~Resampler ()
+  {
+    delete[] Table;
+    delete[] Buffer;
+  }
+
+  /** Designs the filters for From to To (downsampling only) and starts
+   * from silence. Returns false for rates it cannot handle. */
+  bool
+  Configure (Uint32 From, Uint32 To, ResampleQuality Quality)
+  {
+    if (To == 0 || From < To || Quality > RESAMPLE_BEST)
+      {
+        return false;
+      }
+    const ResampleTier &Tier = RESAMPLE_TIERS[Quality];
+    InRate = From;
+    OutRate = To;
+    Phases = Tier.Phases;
+
+    double Ratio = (double)From / To;
+    double HalfWidth = Tier.ZeroCrossings * Ratio; // In input samples
+    Half = (Uint32)ceil (HalfWidth);
+    Taps = (2 * Half + TAP_ALIGN - 1) / TAP_ALIGN * TAP_ALIGN;
+
+    delete[] Table;
+    Table = new float[Phases * Taps];
+    double Cutoff = Tier.Passband * 0.5 / Ratio; // Cycles per input sample
+    double Norm = BesselI0 (Tier.Beta);
+    for (Uint32 p = 0; p < Phases; p++)
+      {
+        float *Row = Table + p * Taps;
+        double Sum = 0;
+        for (Uint32 k = 0; k < Taps; k++)
+          {
+            // Distance from the output position to input sample k
+            double d = (double)k - (Half - 1) - (double)p / Phases;
+            double x = d / HalfWidth;
+            double Window
+                = fabs (x) < 1 ? BesselI0 (Tier.Beta * sqrt (1 - x * x)) / Norm
+                               : 0;
+            double Sinc = d == 0 ? 2 * Cutoff
+                                 : sin (2 * M_PI * Cutoff * d) / (M_PI * d);
+            Row[k] = (float)(Sinc * Window);
+            Sum += Row[k];
+          }
+        // Unity gain at DC for every phase
+        for (Uint32 k = 0; k < Taps; k++)
+          {
+            Row[k] = (float)(Row[k] / Sum);
+          }
+      }
+
+    delete[] Buffer;
+    Capacity = Taps + INPUT_BLOCK;
+    Buffer = new float[Capacity];
+    StepWhole = From / To;
+    StepFraction = From % To;
+    Reset ();
+    return true;
+  }
+
+  /** Drops buffered input and starts again from silence */
+  void
+  Reset ()
+  {
+    // Silence before the first input sample fills the filter's left half
+    Filled = Half - 1;
+    memset (Buffer, 0, Filled * sizeof (float));
+    Next = 0;
+    Fraction = 0;
+  }
+
+  /** Input samples between one arriving and the output it ends */
+  Uint32
+  Latency () const
+  {
+    return Taps - (Half - 1);
+  }
+
+  void
+  Push (const float *In, Uint32 Count)
+  {
+    while (Count)
+      {
+        if (Filled == Capacity)
+          {
+            Compact ();
+          }
+        Uint32 Take = Capacity - Filled < Count ? Capacity - Filled : Count;
+        memcpy (Buffer + Filled, In, Take * sizeof (float));
+        Filled += Take;
+        In += Take;
+        Count -= Take;
+        Drain ();
+      }
+    Flush ();
+  }
+
+  /** AudioSink for a SID; Context is the resampler */
+  static void
+  Sink (void *Context, const float *Samples, Uint32 Count)
+  {
+    ((Resampler *)Context)->Push (Samples, Count);
+  }
+
+  /** Sum of A[i] * B[i]; Count is a multiple of TAP_ALIGN */
+  template <bool Simd>
+  static float
+  Dot (const float *A, const float *B, Uint32 Count)
+  {
+#if defined(__AVX2__)
+    if constexpr (Simd)
+      {
+        __m256 S0 = _mm256_setzero_ps ();
+        __m256 S1 = _mm256_setzero_ps ();
+        for (Uint32 i = 0; i < Count; i += 16)
+          {
+            S0 = _mm256_add_ps (S0, _mm256_mul_ps (_mm256_loadu_ps (A + i),
+                                                   _mm256_loadu_ps (B + i)));
+            S1 = _mm256_add_ps (S1,
+                                _mm256_mul_ps (_mm256_loadu_ps (A + i + 8),
+                                               _mm256_loadu_ps (B + i + 8)));
+          }
+        __m256 S = _mm256_add_ps (S0, S1);
+        return Sum128 (_mm_add_ps (_mm256_castps256_ps128 (S),
+                                   _mm256_extractf128_ps (S, 1)));
+      }
+#elif defined(__SSE2__)
+    if constexpr (Simd)
+      {
+        __m128 S[4] = { _mm_setzero_ps (), _mm_setzero_ps (),
+                        _mm_setzero_ps (), _mm_setzero_ps () };
+        for (Uint32 i = 0; i < Count; i += 16)
+          {
+            for (Uint32 j = 0; j < 4; j++)
+              {
+                S[j] = _mm_add_ps (S[j],
+                                   _mm_mul_ps (_mm_loadu_ps (A + i + 4 * j),
+                                               _mm_loadu_ps (B + i + 4 * j)));
+              }
+          }
+        return Sum128 (
+            _mm_add_ps (_mm_add_ps (S[0], S[1]), _mm_add_ps (S[2], S[3])));
+      }
+#endif
+    float Sum = 0;
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        Sum += A[i] * B[i];
+      }
+    return Sum;
+  }
+
+private:
+  float *Table = nullptr;  // Phases rows of Taps coefficients
+  float *Buffer = nullptr; // Input, from the oldest sample still needed
+  Uint32 Capacity = 0;
+  Uint32 Filled = 0;
+  Uint32 Half = 0; // Taps before the output position, plus one
+
+  // Position of the next output: Next is the buffer index of its first
+  // tap, Fraction / OutRate the distance past it
+  Uint32 Next = 0;
+  Uint32 Fraction = 0;
+  Uint32 StepWhole = 0;
+  Uint32 StepFraction = 0;
+
+  float Pending[OUT_BLOCK];
+  Uint32 PendingCount = 0;
+
+#if defined(__SSE2__)
+  static float
+  Sum128 (__m128 V)
+  {
+    __m128 Pairs = _mm_add_ps (V, _mm_movehl_ps (V, V));
+    return _mm_cvtss_f32 (
+        _mm_add_ss (Pairs, _mm_shuffle_ps (Pairs, Pairs, 1)));
+  }
+#endif
+
+  /** Modified Bessel function of the first kind, order 0 */
+  static double
+  BesselI0 (double x)
+  {
+    double Sum = 1, Term = 1;
+    for (Uint32 k = 1; k < 50 && Term > Sum * 1e-12; k++)
+      {
+        Term *= (x / (2 * k)) * (x / (2 * k));
+        Sum += Term;
+      }
+    return Sum;
+  }
+
+  /** Every output the buffered input covers */
+  void
+  Drain ()
+  {
+    for (;;)
+      {
+        Uint32 Phase = (Uint32)(((Uint64)Fraction * Phases + OutRate / 2)
+                                / OutRate);
+        Uint32 First = Next;
+        if (Phase == Phases)
+          {
+            // Nearer the next input sample
+            Phase = 0;
+            First++;
+          }
+        if (First + Taps > Filled)
+          {
+            return;
+          }
+
+        Pending[PendingCount++]
+            = Dot<true> (Buffer + First, Table + Phase * Taps, Taps);
+        if (PendingCount == OUT_BLOCK)
+          {
+            Flush ();
+          }
+
+        Next += StepWhole;
+        Fraction += StepFraction;
+        if (Fraction >= OutRate)
+          {
+            Fraction -= OutRate;
+            Next++;
+          }
+      }
+  }
+
+  void
+  Flush ()
+  {
+    if (PendingCount && Out)
+      {
+        Out (OutContext, Pending, PendingCount);
+      }
+    PendingCount = 0;
+  }
+
+  /** Moves the input still needed to the front of the buffer */
+  void
+  Compact ()
+  {
+    Filled -= Next;
+    memmove (Buffer, Buffer + Next, Filled * sizeof (float));
+    Next = 0;
+  }
+};
+
+#define RESAMPLE_CPP
+#endif // !RESAMPLE_CPP
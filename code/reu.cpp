@@ -0,0 +1,440 @@
+#ifndef REU_CPP
+
+#include "cpu.cpp"
+#include "scheduler.cpp"
+#include <string.h>
+
+/* RAM Expansion Unit (1700, 1764, 1750)
+ *
+ * The REC chip moves blocks between C64 memory and its own RAM by DMA,
+ * a byte per cycle while the CPU waits; a swap takes two cycles a byte.
+ * Here a transfer runs all at once when it starts, and its cycles are a
+ * blocked window on the global clock from the cycle it was started in.
+ * The run loop applies the window at its next dispatch, so instructions
+ * left in the current slice count their cycles before it.
+ *
+ * Transfers run as bulk copies over runs of bytes that stay within one
+ * C64 page and do not wrap around the expansion RAM. Pages with a
+ * device mapped go a byte at a time through the CPU's read and write
+ * paths, since their registers have side effects. Otherwise C64 reads
+ * see the ROM overlay or RAM, as the CPU would, and writes land in RAM.
+ *
+ * A transfer starts on the command write, or on the next write to $FF00
+ * if the command asks for that; page $FF is mapped to the unit only
+ * while it waits for one.
+ */
+struct REU
+{
+  static constexpr Byte REG_STATUS = 0x00;
+  static constexpr Byte REG_COMMAND = 0x01;
+  static constexpr Byte REG_C64_LO = 0x02;
+  static constexpr Byte REG_C64_HI = 0x03;
+  static constexpr Byte REG_REU_LO = 0x04;
+  static constexpr Byte REG_REU_HI = 0x05;
+  static constexpr Byte REG_REU_BANK = 0x06;
+  static constexpr Byte REG_LENGTH_LO = 0x07;
+  static constexpr Byte REG_LENGTH_HI = 0x08;
+  static constexpr Byte REG_MASK = 0x09;
+  static constexpr Byte REG_CONTROL = 0x0A;
+
+  static constexpr Byte STATUS_IRQ = 0x80;
+  static constexpr Byte STATUS_END = 0x40;
+  static constexpr Byte STATUS_FAULT = 0x20; // Verify mismatch
+  static constexpr Byte STATUS_256K = 0x10;  // 256 Kbit RAM chips
+
+  static constexpr Byte COMMAND_EXECUTE = 0x80;
+  static constexpr Byte COMMAND_AUTOLOAD = 0x20; // Restore the registers
+  static constexpr Byte COMMAND_NO_FF00 = 0x10;  // Start at once
+  static constexpr Byte COMMAND_TYPE = 0x03;
+
+  static constexpr Byte TYPE_STASH = 0;  // C64 to REU
+  static constexpr Byte TYPE_FETCH = 1;  // REU to C64
+  static constexpr Byte TYPE_SWAP = 2;
+  static constexpr Byte TYPE_VERIFY = 3;
+
+  static constexpr Byte MASK_ENABLE = 0x80;
+  static constexpr Byte CONTROL_FIX_C64 = 0x80;
+  static constexpr Byte CONTROL_FIX_REU = 0x40;
+
+  static constexpr Uint32 SIZE_1700 = 128 * 1024;
+  static constexpr Uint32 SIZE_1764 = 256 * 1024;
+  static constexpr Uint32 SIZE_1750 = 512 * 1024;
+  static constexpr Uint32 MAX_SIZE = SIZE_1750;
+
+  Byte Ram[MAX_SIZE] = {};
+  Uint32 Size = SIZE_1750; // A power of two; addresses wrap at it
+
+  Byte Status;
+  Byte Command;
+  Word C64Address;
+  Uint32 ReuAddress; // Bank and offset
+  Word Length;       // 0 moves 64K
+  Byte Mask;
+  Byte Control;
+
+  Uint64 Transfers = 0; // Started since power-on
+  Uint64 BulkBytes = 0; // Moved as bulk copies, the rest byte by byte
+
+  Uint64 (*Now) (void *Context) = nullptr;
+  void *NowContext = nullptr;
+
+  const IOHandler Handler = { ReadRegister, WriteRegister, this };
+  const IOHandler Trigger = { ReadTrigger, WriteTrigger, this };
+
+  /** Clears the registers and attaches the unit at $DF00-$DFFF, where
+   * they repeat every 32 bytes. The RAM keeps its contents. */
+  void
+  Reset (Memory &memory, Scheduler &Queue)
+  {
+    Mem = &memory;
+    Events = &Queue;
+    Status = Size >= SIZE_1764 ? STATUS_256K : 0;
+    Command = COMMAND_NO_FF00;
+    C64Address = 0;
+    ReuAddress = 0;
+    Length = 0xFFFF;
+    Mask = 0;
+    Control = 0;
+    Shadow = { C64Address, ReuAddress, Length };
+    memory.MapIO (0xDF, 0xDF, &Handler);
+    if (memory.IO[0xFF] == &Trigger)
+      {
+        memory.MapIO (0xFF, 0xFF, nullptr);
+      }
+  }
+
+  /** The IRQ output */
+  bool
+  Interrupt () const
+  {
+    return Status & STATUS_IRQ;
+  }
+
+  Byte
+  Read (Word Address)
+  {
+    switch (Address & 0x1F)
+      {
+      case REG_STATUS:
+        {
+          Byte Value = Status;
+          Status &= ~(STATUS_IRQ | STATUS_END | STATUS_FAULT);
+          return Value;
+        }
+      case REG_COMMAND:
+        return Command;
+      case REG_C64_LO:
+        return C64Address & 0xFF;
+      case REG_C64_HI:
+        return C64Address >> 8;
+      case REG_REU_LO:
+        return ReuAddress & 0xFF;
+      case REG_REU_HI:
+        return (ReuAddress >> 8) & 0xFF;
+      case REG_REU_BANK:
+        return (ReuAddress >> 16) | 0xF8;
+      case REG_LENGTH_LO:
+        return Length & 0xFF;
+      case REG_LENGTH_HI:
+        return Length >> 8;
+      case REG_MASK:
+        return Mask | 0x1F;
+      case REG_CONTROL:
+        return Control | 0x3F;
+      default:
+        return 0xFF;
+      }
+  }
+
+  void
+  Write (Word Address, Byte Value)
+  {
+    // The address and length registers write through to their shadows,
+    // which autoload restores
+    switch (Address & 0x1F)
+      {
+      case REG_COMMAND:
+        Command = Value;
+        if (Value & COMMAND_EXECUTE)
+          {
+            if (Value & COMMAND_NO_FF00)
+              {
+                Execute ();
+              }
+            else
+              {
+                Mem->MapIO (0xFF, 0xFF, &Trigger);
+              }
+          }
+        return;
+      case REG_C64_LO:
+        C64Address = (C64Address & 0xFF00) | Value;
+        break;
+      case REG_C64_HI:
+        C64Address = (C64Address & 0x00FF) | (Value << 8);
+        break;
+      case REG_REU_LO:
+        ReuAddress = (ReuAddress & 0x7FF00) | Value;
+        break;
+      case REG_REU_HI:
+        ReuAddress = (ReuAddress & 0x700FF) | (Value << 8);
+        break;
+      case REG_REU_BANK:
+        ReuAddress = (ReuAddress & 0x0FFFF) | ((Value & 0x07) << 16);
+        break;
+      case REG_LENGTH_LO:
+        Length = (Length & 0xFF00) | Value;
+        break;
+      case REG_LENGTH_HI:
+        Length = (Length & 0x00FF) | (Value << 8);
+        break;
+      case REG_MASK:
+        Mask = Value & 0xE0;
+        Raise (0);
+        return;
+      case REG_CONTROL:
+        Control = Value & 0xC0;
+        return;
+      default:
+        return;
+      }
+    Shadow = { C64Address, ReuAddress, Length };
+  }
+
+private:
+  struct Registers
+  {
+    Word C64Address;
+    Uint32 ReuAddress;
+    Word Length;
+  };
+
+  Memory *Mem = nullptr;
+  Scheduler *Events = nullptr;
+  Registers Shadow;
+
+  static Byte
+  ReadRegister (void *Context, Word Address)
+  {
+    return ((REU *)Context)->Read (Address);
+  }
+
+  static void
+  WriteRegister (void *Context, Word Address, Byte Value)
+  {
+    ((REU *)Context)->Write (Address, Value);
+  }
+
+  /* Page $FF while a transfer waits: plain memory, but for the trigger */
+
+  static Byte
+  ReadTrigger (void *Context, Word Address)
+  {
+    return ((REU *)Context)->Mem->Fetch (Address);
+  }
+
+  static void
+  WriteTrigger (void *Context, Word Address, Byte Value)
+  {
+    REU *Unit = (REU *)Context;
+    Unit->Mem->Poke (Address, Value);
+    if (Address == 0xFF00)
+      {
+        Unit->Mem->MapIO (0xFF, 0xFF, nullptr);
+        Unit->Execute ();
+      }
+  }
+
+  /** Sets status bits and the IRQ if they are enabled */
+  void
+  Raise (Byte Bits)
+  {
+    Status |= Bits;
+    if ((Mask & MASK_ENABLE)
+        && (Status & Mask & (STATUS_END | STATUS_FAULT)))
+      {
+        Status |= STATUS_IRQ;
+      }
+  }
+
+  /** Runs the transfer the registers describe */
+  void
+  Execute ()
+  {
+    Byte Type = Command & COMMAND_TYPE;
+    bool FixC64 = Control & CONTROL_FIX_C64;
+    bool FixReu = Control & CONTROL_FIX_REU;
+    Uint32 Left = Length ? Length : 0x10000;
+    Uint32 Moved = 0;
+    bool Mismatch = false;
+    Transfers++;
+
+    while (Moved < Left && !Mismatch)
+      {
+        // A run stays on one C64 page and short of the RAM's end
+        Uint32 Reu = ReuAddress & (Size - 1);
+        Uint32 Run = Left - Moved;
+        Uint32 PageLeft = 0x100 - (C64Address & 0xFF);
+        if (!FixC64 && Run > PageLeft)
+          {
+            Run = PageLeft;
+          }
+        if (!FixReu && Run > Size - Reu)
+          {
+            Run = Size - Reu;
+          }
+        Uint32 Done = Mem->IO[C64Address >> 8] || (FixC64 && FixReu)
+                          ? Bytewise (Type, Run, FixC64, FixReu, Mismatch)
+                          : Bulk (Type, Run, FixC64, FixReu, Mismatch);
+        Moved += Done;
+        if (!FixC64)
+          {
+            C64Address += Done;
+          }
+        if (!FixReu)
+          {
+            ReuAddress = (ReuAddress & ~(Size - 1))
+                         | ((Reu + Done) & (Size - 1));
+          }
+      }
+
+    Uint32 Cycles = Type == TYPE_SWAP ? 2 * Moved : Moved;
+    if (Now && Events)
+      {
+        Events->Block (Now (NowContext), Cycles);
+      }
+
+    // A finished transfer leaves a length of 1
+    Length = Moved == Left ? 1 : (Word)(Left - Moved);
+    if (Command & COMMAND_AUTOLOAD)
+      {
+        C64Address = Shadow.C64Address;
+        ReuAddress = Shadow.ReuAddress;
+        Length = Shadow.Length;
+      }
+    Command = (Command & ~COMMAND_EXECUTE) | COMMAND_NO_FF00;
+    Raise (Mismatch ? STATUS_END | STATUS_FAULT : STATUS_END);
+  }
+
+  /** Up to Count bytes in one go, the C64 side plain memory. Returns the
+   * bytes done, which is fewer when a verify mismatches. */
+  Uint32
+  Bulk (Byte Type, Uint32 Count, bool FixC64, bool FixReu, bool &Mismatch)
+  {
+    Word Address = C64Address;
+    Byte *Ours = Ram + (ReuAddress & (Size - 1));
+    const Byte *Page = Mem->Rom[Address >> 8];
+    const Byte *Seen = Page ? Page + (Address & 0xFF) : Mem->Data + Address;
+    BulkBytes += Count;
+    if (FixC64)
+      {
+        // The same byte over and over
+        switch (Type)
+          {
+          case TYPE_STASH:
+            memset (Ours, *Seen, Count);
+            return Count;
+          case TYPE_FETCH:
+            Mem->Poke (Address, Ours[Count - 1]);
+            return Count;
+          default:
+            BulkBytes -= Count;
+            return Bytewise (Type, Count, FixC64, FixReu, Mismatch);
+          }
+      }
+    if (FixReu)
+      {
+        switch (Type)
+          {
+          case TYPE_STASH:
+            *Ours = Seen[Count - 1];
+            return Count;
+          case TYPE_FETCH:
+            Mem->Fill (Address, *Ours, Count);
+            return Count;
+          default:
+            BulkBytes -= Count;
+            return Bytewise (Type, Count, FixC64, FixReu, Mismatch);
+          }
+      }
+    switch (Type)
+      {
+      case TYPE_STASH:
+        memcpy (Ours, Seen, Count);
+        break;
+      case TYPE_FETCH:
+        Mem->Copy (Address, Ours, Count);
+        break;
+      case TYPE_SWAP:
+        {
+          Byte Saved[0x100];
+          memcpy (Saved, Seen, Count);
+          Mem->Copy (Address, Ours, Count);
+          memcpy (Ours, Saved, Count);
+        }
+        break;
+      default:
+        if (memcmp (Seen, Ours, Count) != 0)
+          {
+            // Stops past the first byte that differs
+            Uint32 i = 0;
+            while (Seen[i] == Ours[i])
+              {
+                i++;
+              }
+            Mismatch = true;
+            BulkBytes -= Count - (i + 1);
+            return i + 1;
+          }
+      }
+    return Count;
+  }
+
+  /** Up to Count bytes through the CPU's access paths, for devices and
+   * the cases Bulk leaves. Returns the bytes done. */
+  Uint32
+  Bytewise (Byte Type, Uint32 Count, bool FixC64, bool FixReu,
+            bool &Mismatch)
+  {
+    Word Address = C64Address;
+    Uint32 Reu = ReuAddress & (Size - 1);
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        Byte &Ours = Ram[Reu];
+        switch (Type)
+          {
+          case TYPE_STASH:
+            Ours = Mem->Read (Address);
+            break;
+          case TYPE_FETCH:
+            Mem->Write (Address, Ours);
+            break;
+          case TYPE_SWAP:
+            {
+              Byte Theirs = Mem->Read (Address);
+              Mem->Write (Address, Ours);
+              Ours = Theirs;
+            }
+            break;
+          default:
+            if (Mem->Read (Address) != Ours)
+              {
+                Mismatch = true;
+                return i + 1;
+              }
+          }
+        if (!FixC64)
+          {
+            Address++;
+          }
+        if (!FixReu)
+          {
+            Reu = (Reu + 1) & (Size - 1);
+          }
+      }
+    return Count;
+  }
+};
+
+#define REU_CPP
+#endif // !REU_CPP
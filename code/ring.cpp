@@ -0,0 +1,59 @@
+#ifndef RING_CPP
+
+#include "cpu.h"
+#include <atomic>
+
+/* Bounded single-producer single-consumer ring.
+ *
+ * One thread pushes and one thread pops; neither ever waits on the
+ * other. Capacity must be a power of two. Head and Tail run freely and
+ * are masked on access, so all Capacity slots are usable.
+ */
+template <typename T, Uint32 Capacity>
+struct SpscRing
+{
+  static_assert ((Capacity & (Capacity - 1)) == 0,
+                 "SpscRing capacity must be a power of two");
+
+  T Items[Capacity];
+  alignas (64) std::atomic<Uint32> Head{ 0 }; // Next slot to pop
+  alignas (64) std::atomic<Uint32> Tail{ 0 }; // Next slot to push
+
+  /** Producer side. Returns false when the ring is full. */
+  bool
+  Push (const T &Item)
+  {
+    Uint32 T0 = Tail.load (std::memory_order_relaxed);
+    if (T0 - Head.load (std::memory_order_acquire) == Capacity)
+      {
+        return false;
+      }
+    Items[T0 & (Capacity - 1)] = Item;
+    Tail.store (T0 + 1, std::memory_order_release);
+    return true;
+  }
+
+  /** Consumer side. Returns false when the ring is empty. */
+  bool
+  Pop (T &Item)
+  {
+    Uint32 H = Head.load (std::memory_order_relaxed);
+    if (H == Tail.load (std::memory_order_acquire))
+      {
+        return false;
+      }
+    Item = Items[H & (Capacity - 1)];
+    Head.store (H + 1, std::memory_order_release);
+    return true;
+  }
+
+  Uint32
+  Size () const
+  {
+    return Tail.load (std::memory_order_acquire)
+           - Head.load (std::memory_order_acquire);
+  }
+};
+
+#define RING_CPP
+#endif // !RING_CPP
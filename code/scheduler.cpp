@@ -0,0 +1,125 @@
+#ifndef SCHEDULER_CPP
+
+#include "cpu.h"
+
+/* Called when an event's time comes up. Time is the cycle the event was
+ * scheduled for, which may be earlier than the clock when the CPU ran
+ * past it. */
+typedef void (*EventHandler) (void *Context, Uint64 Time);
+
+/* Timed events on the global cycle clock.
+ *
+ * The run loop runs the CPU up to the next entry, then dispatches
+ * everything due. Besides events there are blocked windows: cycles in
+ * which another bus master (the VIC-II) holds the bus. Dispatching a
+ * window moves the clock past it, so the CPU's own timing stays a plain
+ * sum of instruction cycles and is only adjusted at window edges. An
+ * instruction that runs into a window finishes its cycles after it.
+ *
+ * Entries are few, so they sit in an array sorted latest first; the next
+ * one due is at the end. Entries with equal times dispatch in the order
+ * they were added.
+ */
+struct Scheduler
+{
+  static constexpr Uint32 MAX_ENTRIES = 64;
+  static constexpr Uint64 NEVER = ~0ull;
+
+  struct Entry
+  {
+    Uint64 Time;
+    Uint32 Blocked; // Cycles the CPU loses; 0 for an event
+    EventHandler Handler;
+    void *Context;
+  };
+
+  Entry Entries[MAX_ENTRIES];
+  Uint32 Count = 0;
+  Uint64 BlockedCycles = 0; // Total cycles lost to blocked windows
+
+  void
+  Clear ()
+  {
+    Count = 0;
+    BlockedCycles = 0;
+  }
+
+  /** Adds an event. Returns false when the queue is full. */
+  bool
+  Schedule (Uint64 Time, EventHandler Handler, void *Context)
+  {
+    return Insert ({ Time, 0, Handler, Context });
+  }
+
+  /** Blocks the CPU for Length cycles starting at Start */
+  bool
+  Block (Uint64 Start, Uint32 Length)
+  {
+    return Length == 0 || Insert ({ Start, Length, nullptr, nullptr });
+  }
+
+  /** Removes every pending event with this handler and context */
+  void
+  Cancel (EventHandler Handler, void *Context)
+  {
+    Uint32 Kept = 0;
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        if (Entries[i].Handler != Handler || Entries[i].Context != Context)
+          {
+            Entries[Kept++] = Entries[i];
+          }
+      }
+    Count = Kept;
+  }
+
+  Uint64
+  NextTime () const
+  {
+    return Count ? Entries[Count - 1].Time : NEVER;
+  }
+
+  /** Dispatches everything due at Clock, including entries that become
+   * due as blocked windows move the clock on. Returns the new clock. */
+  Uint64
+  Dispatch (Uint64 Clock)
+  {
+    while (Count && Entries[Count - 1].Time <= Clock)
+      {
+        Entry Due = Entries[--Count];
+        if (Due.Blocked)
+          {
+            Clock += Due.Blocked;
+            BlockedCycles += Due.Blocked;
+          }
+        else
+          {
+            Due.Handler (Due.Context, Due.Time);
+          }
+      }
+    return Clock;
+  }
+
+private:
+  bool
+  Insert (const Entry &New)
+  {
+    if (Count == MAX_ENTRIES)
+      {
+        return false;
+      }
+    // Behind (earlier in the array than) anything due at the same time
+    Uint32 i = Count;
+    while (i > 0 && Entries[i - 1].Time <= New.Time)
+      {
+        Entries[i] = Entries[i - 1];
+        i--;
+      }
+    Entries[i] = New;
+    Count++;
+    return true;
+  }
+};
+
+#define SCHEDULER_CPP
+#endif // !SCHEDULER_CPP
@@ -0,0 +1,329 @@
+#ifndef SHARE_CPP
+
+#include "cpu.h"
+#include <atomic>
+#include <fcntl.h>
+#include <new>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Frames and audio in a POSIX shared memory segment, for viewers,
+ * encoders and test oracles running as processes of their own.
+ *
+ * The segment starts with a SharedLayout, followed by FRAME_SLOTS frame
+ * slots and an audio ring. Consumers read both in place; the emulation
+ * never waits on them.
+ *
+ * Frames go round the three slots, never into the newest: a consumer
+ * takes the newest slot and has two frame times to use it before it is
+ * written again. Each slot has a sequence number that is odd while it
+ * is written, so a consumer too slow for that sees the number changed
+ * when it checks afterwards. Consumers only read this part, so any
+ * number of them can watch at once.
+ *
+ * Audio is a single producer, single consumer ring of float samples in
+ * [-1, 1]. The producer drops what the ring has no room for and counts
+ * it. The consumer writes AudioHead, so one process at a time takes the
+ * audio.
+ */
+struct SharedLayout
+{
+  static constexpr Uint32 MAGIC = 0x53454243; // "CBES"
+  static constexpr Uint32 VERSION = 1;
+  static constexpr Uint32 FRAME_SLOTS = 3;
+
+  std::atomic<Uint32> Magic; // Stored last, once the rest is set up
+  Uint32 Version;
+  Uint32 Width;         // Frame pixels, 0xAARRGGBB, rows top down
+  Uint32 Height;
+  Uint32 SampleRate;
+  Uint32 AudioCapacity; // Samples, a power of two
+  Uint64 FrameOffset;   // Of slot 0, from the start of the segment
+  Uint64 FrameBytes;    // From one slot to the next
+  Uint64 AudioOffset;
+  Uint64 Size;          // Of the whole segment
+
+  alignas (64) std::atomic<Uint32> Latest; // FRAME_SLOTS before the first
+  std::atomic<Uint64> Frames;              // Published so far
+  std::atomic<Uint64> Sequence[FRAME_SLOTS];
+  std::atomic<Uint64> Frame[FRAME_SLOTS]; // Number of the frame in a slot
+
+  alignas (64) std::atomic<Uint32> AudioTail; // Written by the emulation
+  std::atomic<Uint64> AudioDropped;
+  alignas (64) std::atomic<Uint32> AudioHead; // Written by the consumer
+};
+
+/* The emulation's side: creates the segment and publishes into it */
+struct SharedExport
+{
+  ~SharedExport () { Close (); }
+
+  /** Creates the segment Name ("/cbemu"), replacing a stale one */
+  bool
+  Open (const char *Name, Uint32 Width, Uint32 Height, Uint32 SampleRate,
+        Uint32 AudioCapacity = 1 << 16)
+  {
+    Close ();
+    if ((AudioCapacity & (AudioCapacity - 1)) != 0
+        || strlen (Name) >= sizeof (Path))
+      {
+        return false;
+      }
+    Uint64 FrameOffset = (sizeof (SharedLayout) + 63) & ~(Uint64)63;
+    Uint64 FrameBytes = ((Uint64)Width * Height * 4 + 63) & ~(Uint64)63;
+    Uint64 AudioOffset = FrameOffset + SharedLayout::FRAME_SLOTS * FrameBytes;
+    Uint64 Bytes = AudioOffset + (Uint64)AudioCapacity * sizeof (float);
+
+    shm_unlink (Name);
+    int Fd = shm_open (Name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (Fd < 0)
+      {
+        return false;
+      }
+    void *Mapped = MAP_FAILED;
+    if (ftruncate (Fd, Bytes) == 0)
+      {
+        Mapped = mmap (nullptr, Bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       Fd, 0);
+      }
+    close (Fd);
+    if (Mapped == MAP_FAILED)
+      {
+        shm_unlink (Name);
+        return false;
+      }
+    strcpy (Path, Name);
+    Base = (Byte *)Mapped;
+    Size = Bytes;
+
+    // A fresh segment reads as zeros; only the non-zero fields are set
+    Shared = new (Base) SharedLayout ();
+    Shared->Version = SharedLayout::VERSION;
+    Shared->Width = Width;
+    Shared->Height = Height;
+    Shared->SampleRate = SampleRate;
+    Shared->AudioCapacity = AudioCapacity;
+    Shared->FrameOffset = FrameOffset;
+    Shared->FrameBytes = FrameBytes;
+    Shared->AudioOffset = AudioOffset;
+    Shared->Size = Bytes;
+    Shared->Latest.store (SharedLayout::FRAME_SLOTS,
+                          std::memory_order_relaxed);
+    Shared->Magic.store (SharedLayout::MAGIC, std::memory_order_release);
+    return true;
+  }
+
+  /** Copies a frame into the slot after the newest and makes it the
+   * newest */
+  void
+  Publish (const Uint32 *Pixels, Uint64 Frame)
+  {
+    Uint32 Newest = Shared->Latest.load (std::memory_order_relaxed);
+    Uint32 Slot = Newest + 1 >= SharedLayout::FRAME_SLOTS ? 0 : Newest + 1;
+    std::atomic<Uint64> &Sequence = Shared->Sequence[Slot];
+    Uint64 S = Sequence.load (std::memory_order_relaxed);
+    Sequence.store (S + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence (std::memory_order_release);
+    memcpy (Base + Shared->FrameOffset + Slot * Shared->FrameBytes, Pixels,
+            (size_t)Shared->Width * Shared->Height * 4);
+    Shared->Frame[Slot].store (Frame, std::memory_order_relaxed);
+    Sequence.store (S + 2, std::memory_order_release);
+    Shared->Latest.store (Slot, std::memory_order_release);
+    Shared->Frames.store (Frame + 1, std::memory_order_release);
+  }
+
+  /** Appends what fits of Samples to the audio ring. Returns how many
+   * did. */
+  Uint32
+  PushAudio (const float *Samples, Uint32 Count)
+  {
+    Uint32 Capacity = Shared->AudioCapacity;
+    Uint32 Tail = Shared->AudioTail.load (std::memory_order_relaxed);
+    Uint32 Head = Shared->AudioHead.load (std::memory_order_acquire);
+    Uint32 Room = Capacity - (Tail - Head);
+    Uint32 Taken = Count < Room ? Count : Room;
+    float *Ring = (float *)(Base + Shared->AudioOffset);
+    Uint32 At = Tail & (Capacity - 1);
+    Uint32 First = Taken < Capacity - At ? Taken : Capacity - At;
+    memcpy (Ring + At, Samples, First * sizeof (float));
+    memcpy (Ring, Samples + First, (Taken - First) * sizeof (float));
+    Shared->AudioTail.store (Tail + Taken, std::memory_order_release);
+    if (Taken < Count)
+      {
+        Uint64 Dropped = Shared->AudioDropped.load (std::memory_order_relaxed);
+        Shared->AudioDropped.store (Dropped + Count - Taken,
+                                    std::memory_order_relaxed);
+      }
+    return Taken;
+  }
+
+  /** Unmaps and removes the segment; consumers keep what they mapped */
+  void
+  Close ()
+  {
+    if (!Base)
+      {
+        return;
+      }
+    munmap (Base, Size);
+    shm_unlink (Path);
+    Base = nullptr;
+    Shared = nullptr;
+  }
+
+  /** FrameSink; Context is the export */
+  static void
+  Sink (void *Context, const Uint32 *Pixels, Uint64 Frame)
+  {
+    ((SharedExport *)Context)->Publish (Pixels, Frame);
+  }
+
+  /** AudioSink; Context is the export */
+  static void
+  Sink (void *Context, const float *Samples, Uint32 Count)
+  {
+    ((SharedExport *)Context)->PushAudio (Samples, Count);
+  }
+
+private:
+  char Path[256];
+  Byte *Base = nullptr;
+  SharedLayout *Shared = nullptr;
+  size_t Size = 0;
+};
+
+/* A consumer's side: maps an existing segment and reads it in place */
+struct SharedViewer
+{
+  /* A frame being read, and what Valid checks it against */
+  struct View
+  {
+    const Uint32 *Pixels;
+    Uint64 Frame;
+    Uint32 Slot;
+    Uint64 Sequence;
+  };
+
+  ~SharedViewer () { Detach (); }
+
+  bool
+  Attach (const char *Name)
+  {
+    Detach ();
+    int Fd = shm_open (Name, O_RDWR, 0);
+    if (Fd < 0)
+      {
+        return false;
+      }
+    struct stat Info;
+    void *Mapped = MAP_FAILED;
+    if (fstat (Fd, &Info) == 0 && Info.st_size >= (off_t)sizeof (SharedLayout))
+      {
+        Mapped = mmap (nullptr, Info.st_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, Fd, 0);
+      }
+    close (Fd);
+    if (Mapped == MAP_FAILED)
+      {
+        return false;
+      }
+    Base = (Byte *)Mapped;
+    Size = Info.st_size;
+    Layout = (SharedLayout *)Base;
+    if (Layout->Magic.load (std::memory_order_acquire) != SharedLayout::MAGIC
+        || Layout->Version != SharedLayout::VERSION || Layout->Size > Size)
+      {
+        Detach ();
+        return false;
+      }
+    return true;
+  }
+
+  /** Sizes, rates and counters; null while detached */
+  const SharedLayout *
+  Header () const
+  {
+    return Layout;
+  }
+
+  void
+  Detach ()
+  {
+    if (Base)
+      {
+        munmap (Base, Size);
+      }
+    Base = nullptr;
+    Layout = nullptr;
+  }
+
+  /** The newest frame, in place; false before the first. Check Valid
+   * once done with the pixels. */
+  bool
+  Latest (View &Out) const
+  {
+    for (;;)
+      {
+        Uint32 Slot = Layout->Latest.load (std::memory_order_acquire);
+        if (Slot >= SharedLayout::FRAME_SLOTS)
+          {
+            return false;
+          }
+        Uint64 S = Layout->Sequence[Slot].load (std::memory_order_acquire);
+        if (S & 1)
+          {
+            continue; // Overtaken already; take the one after
+          }
+        Out.Pixels = (const Uint32 *)(Base + Layout->FrameOffset
+                                      + Slot * Layout->FrameBytes);
+        Out.Frame = Layout->Frame[Slot].load (std::memory_order_relaxed);
+        Out.Slot = Slot;
+        Out.Sequence = S;
+        if (Valid (Out))
+          {
+            return true;
+          }
+      }
+  }
+
+  /** Whether the pixels read from a view so far were not overwritten */
+  bool
+  Valid (const View &In) const
+  {
+    std::atomic_thread_fence (std::memory_order_acquire);
+    return Layout->Sequence[In.Slot].load (std::memory_order_relaxed)
+           == In.Sequence;
+  }
+
+  /** The samples waiting that lie in one piece, in place */
+  Uint32
+  PeekAudio (const float *&Samples) const
+  {
+    Uint32 Capacity = Layout->AudioCapacity;
+    Uint32 Head = Layout->AudioHead.load (std::memory_order_relaxed);
+    Uint32 Tail = Layout->AudioTail.load (std::memory_order_acquire);
+    Uint32 At = Head & (Capacity - 1);
+    Uint32 Waiting = Tail - Head;
+    Samples = (const float *)(Base + Layout->AudioOffset) + At;
+    return Waiting < Capacity - At ? Waiting : Capacity - At;
+  }
+
+  /** Hands Count samples from PeekAudio back to the producer */
+  void
+  ConsumeAudio (Uint32 Count)
+  {
+    Uint32 Head = Layout->AudioHead.load (std::memory_order_relaxed);
+    Layout->AudioHead.store (Head + Count, std::memory_order_release);
+  }
+
+private:
+  Byte *Base = nullptr;
+  size_t Size = 0;
+  SharedLayout *Layout = nullptr;
+};
+
+#define SHARE_CPP
+#endif // !SHARE_CPP
@@ -0,0 +1,611 @@
+#ifndef SID_CPP
+
+#include "audio.cpp"
+#include "cpu.cpp"
+#include <math.h>
+#include <string.h>
+
+/* Cycles per envelope step for each attack, decay and release setting */
+static constexpr Uint32 SID_RATE_PERIODS[16] = {
+  9,   32,  63,   95,   149,  220,   267,   313,
+  392, 977, 1954, 3126, 3907, 11720, 19532, 31251,
+};
+
+/* MOS 6581 SID
+ *
+ * The chip is never clocked from the CPU loop. It remembers the cycle it
+ * has synthesized up to and catches up lazily: a register access first
+ * synthesizes up to the cycle of the access (asked of Now), and the
+ * machine flushes it at every frame boundary. Between two accesses only
+ * time passes, so catching up works on blocks of up to BLOCK cycles, one
+ * stage at a time over whole arrays:
+ *
+ *  - accumulators have a closed form, start + frequency * n, unless hard
+ *    sync restarts them;
+ *  - waveforms are branch free functions of the accumulator;
+ *  - envelopes are constant between steps and are filled in runs;
+ *  - the mixer is a weighted sum, and only the filter's two integrators
+ *    carry state from one sample to the next.
+ *
+ * Output is one float sample per cycle, handed to Sink a block at a time.
+ * With no sink, or while Quiet, only the state the registers can show
+ * advances (accumulators, noise and envelopes).
+ */
+struct SID
+{
+  static constexpr Uint32 BLOCK = 256;
+  static constexpr Uint32 ACC_MASK = 0xFFFFFF; // 24-bit accumulators
+  static constexpr Uint32 ACC_MSB = 0x800000;
+  static constexpr Uint32 NOISE_CLOCK = 0x080000; // Accumulator bit 19
+  static constexpr Uint32 NOISE_SEED = 0x7FFFF8;
+
+  // Voice registers, at 7 * voice
+  static constexpr Byte REG_FREQ_LO = 0x00;
+  static constexpr Byte REG_FREQ_HI = 0x01;
+  static constexpr Byte REG_PW_LO = 0x02;
+  static constexpr Byte REG_PW_HI = 0x03;
+  static constexpr Byte REG_CONTROL = 0x04;
+  static constexpr Byte REG_ATTACK_DECAY = 0x05;
+  static constexpr Byte REG_SUSTAIN_RELEASE = 0x06;
+  static constexpr Byte VOICE_REGS = 7;
+
+  static constexpr Byte REG_CUTOFF_LO = 0x15;
+  static constexpr Byte REG_CUTOFF_HI = 0x16;
+  static constexpr Byte REG_RESONANCE = 0x17; // And filter routing
+  static constexpr Byte REG_MODE_VOLUME = 0x18;
+  static constexpr Byte REG_POT_X = 0x19;
+  static constexpr Byte REG_POT_Y = 0x1A;
+  static constexpr Byte REG_OSC3 = 0x1B;
+  static constexpr Byte REG_ENV3 = 0x1C;
+
+  static constexpr Byte CONTROL_GATE = 0x01;
+  static constexpr Byte CONTROL_SYNC = 0x02;
+  static constexpr Byte CONTROL_RING = 0x04;
+  static constexpr Byte CONTROL_TEST = 0x08;
+  static constexpr Byte CONTROL_TRIANGLE = 0x10;
+  static constexpr Byte CONTROL_SAW = 0x20;
+  static constexpr Byte CONTROL_PULSE = 0x40;
+  static constexpr Byte CONTROL_NOISE = 0x80;
+
+  static constexpr Byte MODE_LOWPASS = 0x10;
+  static constexpr Byte MODE_BANDPASS = 0x20;
+  static constexpr Byte MODE_HIGHPASS = 0x40;
+  static constexpr Byte MODE_VOICE3_OFF = 0x80;
+
+  // Three voices at full scale and full volume stay within +-1
+  static constexpr float OUTPUT_SCALE = 1.0f / (2048.0f * 255.0f * 3.0f);
+
+  enum EnvelopeState : Byte
+  {
+    ENV_ATTACK,
+    ENV_DECAY_SUSTAIN,
+    ENV_RELEASE,
+  };
+
+  struct Voice
+  {
+    Uint32 Accumulator; // 24 bits
+    Uint32 Noise;       // 23-bit shift register
+    Uint32 Countdown;   // Cycles to the next envelope step
+    Byte Envelope;
+    Byte State;
+  };
+
+  Byte Reg[0x20];
+  Voice Voices[3];
+  float Low = 0, Band = 0; // Filter integrators
+  Uint32 ClockHz = 985248;
+  Uint64 Time = 0; // Cycle synthesized up to
+
+  // Cycle of the access in progress. Null leaves catching up to the owner.
+  Uint64 (*Now) (void *Context) = nullptr;
+  void *NowContext = nullptr;
+
+  AudioSink Sink = nullptr;
+  void *SinkContext = nullptr;
+  bool Quiet = false; // Skip the output stages
+
+  const IOHandler Handler = { ReadRegister, WriteRegister, this };
+
+  /** Silences the chip, restarts its time at 0 and attaches it to
+   * memory. The clock and sink connections are kept. */
+  void
+  Reset (Memory &memory, Uint32 Clock)
+  {
+    memset (Reg, 0, sizeof (Reg));
+    for (Voice &V : Voices)
+      {
+        V.Accumulator = 0;
+        V.Noise = NOISE_SEED;
+        V.Countdown = SID_RATE_PERIODS[0];
+        V.Envelope = 0;
+        V.State = ENV_RELEASE;
+      }
+    Low = Band = 0;
+    ClockHz = Clock;
+    Time = 0;
+    memory.MapIO (0xD4, 0xD7, &Handler);
+  }
+
+  Byte
+  Read (Word Address)
+  {
+    CatchUp ();
+    switch (Address & 0x1F)
+      {
+      case REG_POT_X:
+      case REG_POT_Y:
+        return 0xFF; // No paddles
+      case REG_OSC3:
+        {
+          Uint32 Acc = Voices[2].Accumulator;
+          Uint32 Source = Voices[SyncSource (2)].Accumulator;
+          Uint32 Noise = NoiseOutput (Voices[2].Noise);
+          Uint32 Out;
+          Waveform (2, &Acc, &Source, &Noise, 1, &Out);
+          return Out >> 4;
+        }
+      case REG_ENV3:
+        return Voices[2].Envelope;
+      default:
+        return 0; // Write only
+      }
+  }
+
+  void
+  Write (Word Address, Byte Value)
+  {
+    CatchUp ();
+    Byte R = Address & 0x1F;
+    if (R >= REG_POT_X)
+      {
+        return;
+      }
+    Byte Old = Reg[R];
+    Reg[R] = Value;
+    if (R >= 3 * VOICE_REGS)
+      {
+        return;
+      }
+
+    Uint32 v = R / VOICE_REGS;
+    Voice &V = Voices[v];
+    switch (R % VOICE_REGS)
+      {
+      case REG_CONTROL:
+        if (Value & CONTROL_TEST)
+          {
+            V.Accumulator = 0;
+            V.Noise = NOISE_SEED;
+          }
+        if ((Value ^ Old) & CONTROL_GATE)
+          {
+            V.State = (Value & CONTROL_GATE) ? ENV_ATTACK : ENV_RELEASE;
+            V.Countdown = EnvelopePeriod (v);
+          }
+        break;
+      case REG_ATTACK_DECAY:
+      case REG_SUSTAIN_RELEASE:
+        {
+          // A shorter period takes effect at once
+          Uint32 Period = EnvelopePeriod (v);
+          if (V.Countdown > Period)
+            {
+              V.Countdown = Period;
+            }
+        }
+        break;
+      }
+  }
+
+  /** Synthesizes up to cycle Until */
+  void
+  Synthesize (Uint64 Until)
+  {
+    while (Time < Until)
+      {
+        Uint32 Count = Until - Time < BLOCK ? (Uint32)(Until - Time) : BLOCK;
+        SynthesizeBlock (Count);
+        Time += Count;
+      }
+  }
+
+private:
+  // Block scratch, per voice
+  Uint32 Acc[3][BLOCK];
+  Uint32 Noise[3][BLOCK];
+  Uint32 Wave[3][BLOCK];
+  Byte Env[3][BLOCK];
+  float Out[BLOCK];
+
+  static Byte
+  ReadRegister (void *Context, Word Address)
+  {
+    return ((SID *)Context)->Read (Address);
+  }
+
+  static void
+  WriteRegister (void *Context, Word Address, Byte Value)
+  {
+    ((SID *)Context)->Write (Address, Value);
+  }
+
+  void
+  CatchUp ()
+  {
+    if (Now)
+      {
+        Synthesize (Now (NowContext));
+      }
+  }
+
+  /** Voice that syncs and ring modulates voice v */
+  static constexpr Uint32
+  SyncSource (Uint32 v)
+  {
+    return (v + 2) % 3;
+  }
+
+  Byte
+  VoiceReg (Uint32 v, Byte R) const
+  {
+    return Reg[v * VOICE_REGS + R];
+  }
+
+  Uint32
+  Frequency (Uint32 v) const
+  {
+    return VoiceReg (v, REG_FREQ_LO) | (VoiceReg (v, REG_FREQ_HI) << 8);
+  }
+
+  Uint32
+  PulseWidth (Uint32 v) const
+  {
+    return VoiceReg (v, REG_PW_LO) | ((VoiceReg (v, REG_PW_HI) & 0x0F) << 8);
+  }
+
+  /** Every voice's block, then the mix. Start values stay in Voices
+   * until all stages are done, since sync, ring modulation and noise
+   * look at the value before each sample. */
+  void
+  SynthesizeBlock (Uint32 Count)
+  {
+    bool Output = Sink && !Quiet;
+    for (Uint32 v = 0; v < 3; v++)
+      {
+        Oscillate (v, Count);
+      }
+    for (Uint32 v = 0; v < 3; v++)
+      {
+        if (VoiceReg (v, REG_CONTROL) & CONTROL_SYNC)
+          {
+            Resync (v, Count);
+          }
+      }
+    for (Uint32 v = 0; v < 3; v++)
+      {
+        bool Heard = Output && (VoiceReg (v, REG_CONTROL) & CONTROL_NOISE);
+        ClockNoise (v, Count, Heard ? Noise[v] : nullptr);
+        RunEnvelope (v, Count, Output ? Env[v] : nullptr);
+      }
+
+    if (Output)
+      {
+        for (Uint32 v = 0; v < 3; v++)
+          {
+            Waveform (v, Acc[v], Acc[SyncSource (v)], Noise[v], Count,
+                      Wave[v]);
+          }
+        Mix (Count);
+        Sink (SinkContext, Out, Count);
+      }
+
+    for (Uint32 v = 0; v < 3; v++)
+      {
+        Voices[v].Accumulator = Acc[v][Count - 1];
+      }
+  }
+
+  void
+  Oscillate (Uint32 v, Uint32 Count)
+  {
+    Uint32 *A = Acc[v];
+    if (VoiceReg (v, REG_CONTROL) & CONTROL_TEST)
+      {
+        memset (A, 0, Count * sizeof (Uint32));
+        return;
+      }
+    Uint32 Start = Voices[v].Accumulator;
+    Uint32 Freq = Frequency (v);
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        A[i] = (Start + Freq * (i + 1)) & ACC_MASK;
+      }
+  }
+
+  /** Hard sync: restarts voice v wherever its source's MSB rises. Each
+   * value depends on the last restart, so this one is scalar. Voices are
+   * synced in order, so when all three sync each other voice 1 sees
+   * voice 3 without its own sync applied. */
+  void
+  Resync (Uint32 v, Uint32 Count)
+  {
+    if (VoiceReg (v, REG_CONTROL) & CONTROL_TEST)
+      {
+        return;
+      }
+    Uint32 s = SyncSource (v);
+    const Uint32 *From = Acc[s];
+    Uint32 Prev = Voices[s].Accumulator;
+    Uint32 Freq = Frequency (v);
+    Uint32 A = Voices[v].Accumulator;
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        A = (A + Freq) & ACC_MASK;
+        if (From[i] & ~Prev & ACC_MSB)
+          {
+            A = 0;
+          }
+        Prev = From[i];
+        Acc[v][i] = A;
+      }
+  }
+
+  static Uint32
+  NextNoise (Uint32 Shift)
+  {
+    Uint32 Bit = ((Shift >> 22) ^ (Shift >> 17)) & 1;
+    return ((Shift << 1) & 0x7FFFFF) | Bit;
+  }
+
+  /** The eight shift register taps on the top of the 12-bit output */
+  static Uint32
+  NoiseOutput (Uint32 Shift)
+  {
+    return ((Shift & 0x100000) >> 9) | ((Shift & 0x040000) >> 8)
+           | ((Shift & 0x004000) >> 5) | ((Shift & 0x000800) >> 3)
+           | ((Shift & 0x000200) >> 2) | ((Shift & 0x000020) << 1)
+           | ((Shift & 0x000004) << 3) | ((Shift & 0x000001) << 4);
+  }
+
+  /** Clocks the noise shift register wherever accumulator bit 19 rises.
+   * Fills Out with the noise output of every cycle, or when it is null
+   * just counts the clocks. */
+  void
+  ClockNoise (Uint32 v, Uint32 Count, Uint32 *Out)
+  {
+    Voice &V = Voices[v];
+    const Uint32 *A = Acc[v];
+    if (!Out)
+      {
+        Uint32 Clocks = ((A[0] & ~V.Accumulator) >> 19) & 1;
+        for (Uint32 i = 1; i < Count; i++)
+          {
+            Clocks += ((A[i] & ~A[i - 1]) >> 19) & 1;
+          }
+        while (Clocks--)
+          {
+            V.Noise = NextNoise (V.Noise);
+          }
+        return;
+      }
+
+    Uint32 Prev = V.Accumulator;
+    Uint32 Value = NoiseOutput (V.Noise);
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        if (A[i] & ~Prev & NOISE_CLOCK)
+          {
+            V.Noise = NextNoise (V.Noise);
+            Value = NoiseOutput (V.Noise);
+          }
+        Out[i] = Value;
+        Prev = A[i];
+      }
+  }
+
+  static Uint32
+  ExponentialDivider (Byte Level)
+  {
+    return Level > 0x5D   ? 1
+           : Level > 0x36 ? 2
+           : Level > 0x1A ? 4
+           : Level > 0x0E ? 8
+           : Level > 0x06 ? 16
+                          : 30;
+  }
+
+  /** Cycles between envelope steps in the voice's current state */
+  Uint32
+  EnvelopePeriod (Uint32 v) const
+  {
+    const Voice &V = Voices[v];
+    Byte AD = VoiceReg (v, REG_ATTACK_DECAY);
+    Byte SR = VoiceReg (v, REG_SUSTAIN_RELEASE);
+    switch (V.State)
+      {
+      case ENV_ATTACK:
+        return SID_RATE_PERIODS[AD >> 4];
+      case ENV_DECAY_SUSTAIN:
+        return SID_RATE_PERIODS[AD & 0x0F] * ExponentialDivider (V.Envelope);
+      default:
+        return SID_RATE_PERIODS[SR & 0x0F] * ExponentialDivider (V.Envelope);
+      }
+  }
+
+  bool
+  Holding (Uint32 v) const
+  {
+    const Voice &V = Voices[v];
+    Byte Sustain = (VoiceReg (v, REG_SUSTAIN_RELEASE) >> 4) * 0x11;
+    return (V.State == ENV_DECAY_SUSTAIN && V.Envelope <= Sustain)
+           || (V.State == ENV_RELEASE && V.Envelope == 0);
+  }
+
+  void
+  StepEnvelope (Uint32 v)
+  {
+    Voice &V = Voices[v];
+    switch (V.State)
+      {
+      case ENV_ATTACK:
+        if (V.Envelope == 0xFF || ++V.Envelope == 0xFF)
+          {
+            V.State = ENV_DECAY_SUSTAIN;
+          }
+        break;
+      case ENV_DECAY_SUSTAIN:
+      case ENV_RELEASE:
+        V.Envelope--; // Holding stops this at the sustain level or 0
+        break;
+      }
+    V.Countdown = EnvelopePeriod (v);
+  }
+
+  /** Advances the envelope Count cycles in runs between steps, filling
+   * Out with its level at every cycle when it is non-null */
+  void
+  RunEnvelope (Uint32 v, Uint32 Count, Byte *Out)
+  {
+    Voice &V = Voices[v];
+    Uint32 i = 0;
+    while (i < Count)
+      {
+        if (Holding (v))
+          {
+            if (Out)
+              {
+                memset (Out + i, V.Envelope, Count - i);
+              }
+            return;
+          }
+        Uint32 Run = V.Countdown < Count - i ? V.Countdown : Count - i;
+        if (Out)
+          {
+            memset (Out + i, V.Envelope, Run);
+          }
+        i += Run;
+        V.Countdown -= Run;
+        if (V.Countdown == 0)
+          {
+            StepEnvelope (v);
+          }
+      }
+  }
+
+  /** 12-bit waveform output of voice v from its accumulators. Combined
+   * waveforms are the AND of their parts. */
+  void
+  Waveform (Uint32 v, const Uint32 *A, const Uint32 *Source,
+            const Uint32 *NoiseOut, Uint32 Count, Uint32 *Out) const
+  {
+    Byte Control = VoiceReg (v, REG_CONTROL);
+    Uint32 Init = (Control & 0xF0) ? 0xFFF : 0;
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        Out[i] = Init;
+      }
+    if (Control & CONTROL_TRIANGLE)
+      {
+        // Ring modulation swaps the fold for the source's MSB
+        Uint32 Ring = (Control & CONTROL_RING) ? ACC_MSB : 0;
+        for (Uint32 i = 0; i < Count; i++)
+          {
+            Uint32 Fold = 0u - (((A[i] ^ (Source[i] & Ring)) & ACC_MSB) >> 23);
+            Out[i] &= ((A[i] ^ Fold) >> 11) & 0xFFF;
+          }
+      }
+    if (Control & CONTROL_SAW)
+      {
+        for (Uint32 i = 0; i < Count; i++)
+          {
+            Out[i] &= A[i] >> 12;
+          }
+      }
+    if ((Control & CONTROL_PULSE) && !(Control & CONTROL_TEST))
+      {
+        Uint32 Width = PulseWidth (v);
+        for (Uint32 i = 0; i < Count; i++)
+          {
+            Out[i] &= (A[i] >> 12) >= Width ? 0xFFF : 0;
+          }
+      }
+    if (Control & CONTROL_NOISE)
+      {
+        for (Uint32 i = 0; i < Count; i++)
+          {
+            Out[i] &= NoiseOut[i];
+          }
+      }
+  }
+
+  /** Voices times envelopes, split into the filtered and direct paths,
+   * then the filter and master volume */
+  void
+  Mix (Uint32 Count)
+  {
+    float Direct[BLOCK];
+    float Filtered[BLOCK];
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        Direct[i] = Filtered[i] = 0;
+      }
+
+    Byte Routing = Reg[REG_RESONANCE] & 0x07;
+    Byte Mode = Reg[REG_MODE_VOLUME];
+    for (Uint32 v = 0; v < 3; v++)
+      {
+        bool Filter = (Routing >> v) & 1;
+        if (v == 2 && (Mode & MODE_VOICE3_OFF) && !Filter)
+          {
+            continue;
+          }
+        float *To = Filter ? Filtered : Direct;
+        const Uint32 *W = Wave[v];
+        const Byte *E = Env[v];
+        for (Uint32 i = 0; i < Count; i++)
+          {
+            To[i] += ((float)W[i] - 2048.0f) * (float)E[i];
+          }
+      }
+
+    RunFilter (Filtered, Count);
+
+    float Gain = (float)(Mode & 0x0F) / 15.0f * OUTPUT_SCALE;
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        Out[i] = (Direct[i] + Filtered[i]) * Gain;
+      }
+  }
+
+  /** State variable filter, in place. The coefficients only change on
+   * register writes, so they are worked out once per block. */
+  void
+  RunFilter (float *Samples, Uint32 Count)
+  {
+    Byte Mode = Reg[REG_MODE_VOLUME];
+    float LowGain = (Mode & MODE_LOWPASS) ? 1.0f : 0.0f;
+    float BandGain = (Mode & MODE_BANDPASS) ? 1.0f : 0.0f;
+    float HighGain = (Mode & MODE_HIGHPASS) ? 1.0f : 0.0f;
+
+    // 30 Hz to 12 kHz over the 11-bit cutoff, roughly as on the 6581
+    Uint32 Cutoff = (Reg[REG_CUTOFF_HI] << 3) | (Reg[REG_CUTOFF_LO] & 0x07);
+    float Hz = 30.0f + (float)Cutoff * (12000.0f - 30.0f) / 2047.0f;
+    float F = 2.0f * sinf (3.14159265f * Hz / (float)ClockHz);
+    float Damping = 1.0f / (0.707f + (float)(Reg[REG_RESONANCE] >> 4) / 15.0f);
+
+    float L = Low, B = Band;
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        L += F * B;
+        float H = Samples[i] - L - Damping * B;
+        B += F * H;
+        Samples[i] = LowGain * L + BandGain * B + HighGain * H;
+      }
+    Low = L;
+    Band = B;
+  }
+};
+
+#define SID_CPP
+#endif // !SID_CPP
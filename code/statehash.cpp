@@ -0,0 +1,215 @@
+#ifndef STATEHASH_CPP
+
+#include "cpu.h"
+#include <string.h>
+#include <sys/mman.h>
+
+/* Incremental hash of the machine state, for search and loop detection.
+ *
+ * Zobrist style: every (address, value) pair has its own 64-bit key and
+ * the memory part of the hash is the XOR of the keys of all 64K bytes.
+ * A write XORs the old byte's key out and the new one's in, so the hash
+ * follows memory at two key computations per write and is read in O(1),
+ * with the registers folded in on reading. Keys are computed by a
+ * SplitMix64 finalizer rather than looked up, as a table for every pair
+ * would take 128 MiB.
+ *
+ * Memory keeps an attached StateHash up to date through Write, Poke,
+ * Copy and Fill; Data and operator[] bypass it like they bypass devices,
+ * so code writing through them calls Rehash afterwards.
+ */
+struct StateHash
+{
+  Uint64 Bytes = 0; // XOR of the keys of all of memory
+
+  static Uint64
+  Mix (Uint64 Value)
+  {
+    Value ^= Value >> 30;
+    Value *= 0xBF58476D1CE4E5B9ull;
+    Value ^= Value >> 27;
+    Value *= 0x94D049BB133111EBull;
+    return Value ^ (Value >> 31);
+  }
+
+  static Uint64
+  Key (Word Address, Byte Value)
+  {
+    return Mix ((((Uint64)Address << 8) | Value) + 0x9E3779B97F4A7C15ull);
+  }
+
+  void
+  Update (Word Address, Byte Old, Byte New)
+  {
+    Bytes ^= Key (Address, Old) ^ Key (Address, New);
+  }
+
+  /** Hashes all of memory from scratch */
+  void
+  Rehash (const Byte *Data)
+  {
+    Bytes = 0;
+    for (Uint32 i = 0; i < 0x10000; i++)
+      {
+        Bytes ^= Key (i, Data[i]);
+      }
+  }
+
+  /** The state hash: memory and the registers of Cpu */
+  template <typename Core>
+  Uint64
+  Value (const Core &Cpu) const
+  {
+    Uint64 Registers = ((Uint64)Cpu.PC << 40) | ((Uint64)Cpu.SP << 32)
+                       | ((Uint64)Cpu.A << 24) | ((Uint64)Cpu.X << 16)
+                       | ((Uint64)Cpu.Y << 8) | (Uint64)Cpu.GetStatus ();
+    return Bytes ^ Mix (Registers ^ 0xD6E8FEB86659FD93ull);
+  }
+};
+
+/* Set of visited state hashes, sized for tens of millions of them.
+ *
+ * Open addressing with linear probing over a flat array of hashes, which
+ * are already well mixed, so the low bits index it directly. 0 marks a
+ * free slot and is tracked on its own. The array is an anonymous mapping
+ * and doubles at 3/4 full; only the touched pages become resident. If it
+ * cannot grow it fills up further, and once full further states are
+ * dropped and counted rather than stored.
+ */
+struct StateSet
+{
+  static constexpr Uint64 MIN_CAPACITY = 1 << 16;
+
+  Uint64 Count = 0;   // Distinct hashes stored
+  Uint64 Dropped = 0; // New hashes turned away when full
+
+  ~StateSet () { Free (); }
+
+  /** Makes room for Expected hashes without growing on the way */
+  bool
+  Reserve (Uint64 Expected)
+  {
+    Uint64 Wanted = MIN_CAPACITY;
+    while (Wanted / 4 * 3 < Expected)
+      {
+        Wanted *= 2;
+      }
+    return Wanted <= Capacity || Grow (Wanted);
+  }
+
+  /** Adds Hash; true when it was not there yet */
+  bool
+  Insert (Uint64 Hash)
+  {
+    if (Hash == 0)
+      {
+        bool New = !HasZero;
+        HasZero = true;
+        Count += New;
+        return New;
+      }
+    if ((Stored + 1) * 4 > Capacity * 3)
+      {
+        Grow (Capacity ? Capacity * 2 : MIN_CAPACITY);
+      }
+    if (Stored + 1 >= Capacity)
+      {
+        Dropped += !Contains (Hash);
+        return false;
+      }
+    Uint64 *Slot = Find (Slots, Capacity - 1, Hash);
+    if (*Slot == Hash)
+      {
+        return false;
+      }
+    *Slot = Hash;
+    Stored++;
+    Count++;
+    return true;
+  }
+
+  bool
+  Contains (Uint64 Hash) const
+  {
+    if (Hash == 0)
+      {
+        return HasZero;
+      }
+    return Slots && *Find (Slots, Capacity - 1, Hash) == Hash;
+  }
+
+  /** Forgets every hash, keeping the memory */
+  void
+  Clear ()
+  {
+    if (Slots)
+      {
+        memset (Slots, 0, Capacity * sizeof (Uint64));
+      }
+    Count = Stored = Dropped = 0;
+    HasZero = false;
+  }
+
+  /** Bytes of the slot array, resident or not */
+  Uint64
+  Footprint () const
+  {
+    return Capacity * sizeof (Uint64);
+  }
+
+private:
+  Uint64 *Slots = nullptr;
+  Uint64 Capacity = 0; // Slots, a power of two
+  Uint64 Stored = 0;   // Nonzero hashes in Slots
+  bool HasZero = false;
+
+  /** The slot holding Hash, or the free one where it would go */
+  static Uint64 *
+  Find (Uint64 *Slots, Uint64 Mask, Uint64 Hash)
+  {
+    Uint64 i = Hash & Mask;
+    while (Slots[i] != 0 && Slots[i] != Hash)
+      {
+        i = (i + 1) & Mask;
+      }
+    return Slots + i;
+  }
+
+  bool
+  Grow (Uint64 Wanted)
+  {
+    void *Mapped = mmap (nullptr, Wanted * sizeof (Uint64),
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+    if (Mapped == MAP_FAILED)
+      {
+        return false;
+      }
+    Uint64 *Bigger = (Uint64 *)Mapped;
+    for (Uint64 i = 0; i < Capacity; i++)
+      {
+        if (Slots[i] != 0)
+          {
+            *Find (Bigger, Wanted - 1, Slots[i]) = Slots[i];
+          }
+      }
+    Free ();
+    Slots = Bigger;
+    Capacity = Wanted;
+    return true;
+  }
+
+  void
+  Free ()
+  {
+    if (Slots)
+      {
+        munmap (Slots, Capacity * sizeof (Uint64));
+      }
+    Slots = nullptr;
+    Capacity = 0;
+  }
+};
+
+#define STATEHASH_CPP
+#endif // !STATEHASH_CPP
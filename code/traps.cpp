@@ -0,0 +1,513 @@
+#ifndef TRAPS_CPP
+
+#include "cpu.cpp"
+#include "disk.cpp"
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+
+/* KERNAL LOAD and SAVE without the serial bus
+ *
+ * The routines behind the $FFD5 and $FFD8 jump table entries are
+ * trapped at their first instruction (see CPU::AddTrap). The trap
+ * serves one device from a D64 image or a host directory of PRG files:
+ * it copies the file straight into or out of memory, leaves the
+ * registers, flags and zero page as the KERNAL would, and returns to
+ * the caller. Other devices, and a device with nothing attached, fall
+ * through to the KERNAL, and so does everything once the traps are
+ * switched off; loaders that need real drive timing want that.
+ *
+ * Names may use the DOS wildcards: ? for any character and * for the
+ * rest of the name. A "0:" drive prefix is ignored. The directory
+ * listing ("$") is not built.
+ */
+struct KernalTraps
+{
+  static constexpr Word LOAD = 0xF49E; // A: verify flag, X/Y: address
+  static constexpr Word SAVE = 0xF5DD; // A: start pointer, X/Y: end
+
+  // KERNAL zero page
+  static constexpr Word STATUS = 0x90;
+  static constexpr Word VERIFY = 0x93;
+  static constexpr Word END_ADDRESS = 0xAE;
+  static constexpr Word NAME_LENGTH = 0xB7;
+  static constexpr Word SECONDARY = 0xB9;
+  static constexpr Word DEVICE = 0xBA;
+  static constexpr Word NAME_ADDRESS = 0xBB;
+  static constexpr Word SAVE_START = 0xC1;
+  static constexpr Word LOAD_ADDRESS = 0xC3;
+
+  static constexpr Byte STATUS_VERIFY = 0x10;
+  static constexpr Byte STATUS_EOI = 0x40;
+
+  static constexpr Byte ERROR_FILE_NOT_FOUND = 4;
+  static constexpr Byte ERROR_DEVICE_NOT_PRESENT = 5;
+  static constexpr Byte ERROR_MISSING_FILE_NAME = 8;
+
+  static constexpr Uint32 MAX_FILE = 2 + 0x10000; // Load address and data
+  static constexpr Uint32 MAX_NAME = 16;
+
+  Byte Device = 8;
+  D64Image *Disk = nullptr;       // Served first, if set
+  const char *Directory = nullptr; // Host directory of PRG files
+
+  Uint64 Loads = 0; // Served so far
+  Uint64 Saves = 0;
+
+  static bool
+  Handles (Word Address)
+  {
+    return Address == LOAD || Address == SAVE;
+  }
+
+  /** Runs the trapped routine at the CPU's PC and returns to its
+   * caller. Returns false, having changed nothing, when the device is
+   * not one it serves. */
+  bool
+  Run (CPU &Cpu, Memory &Mem)
+  {
+    if (!Handles (Cpu.PC) || Mem[DEVICE] != Device || (!Disk && !Directory))
+      {
+        return false;
+      }
+    if (Cpu.PC == LOAD)
+      {
+        Load (Cpu, Mem);
+      }
+    else
+      {
+        Save (Cpu, Mem);
+      }
+    Return (Cpu, Mem);
+    return true;
+  }
+
+  /** DOS name matching, Name padded with $A0 or ended by Length */
+  static bool
+  Matches (const Byte *Pattern, Uint32 PatternLength, const Byte *Name,
+           Uint32 Length)
+  {
+    while (Length && Name[Length - 1] == 0xA0)
+      {
+        Length--;
+      }
+    for (Uint32 i = 0; i < PatternLength; i++)
+      {
+        if (Pattern[i] == '*')
+          {
+            return true;
+          }
+        if (i >= Length || (Pattern[i] != '?' && Pattern[i] != Name[i]))
+          {
+            return false;
+          }
+      }
+    return PatternLength == Length;
+  }
+
+private:
+  Byte File[MAX_FILE];
+
+  void
+  Load (CPU &Cpu, Memory &Mem)
+  {
+    // What the KERNAL stores before dispatching through $0330
+    Mem.Poke (LOAD_ADDRESS, Cpu.X);
+    Mem.Poke (LOAD_ADDRESS + 1, Cpu.Y);
+    Mem.Poke (VERIFY, Cpu.A);
+
+    Byte Name[MAX_NAME];
+    Uint32 NameLength = FileName (Mem, Name);
+    if (NameLength == 0)
+      {
+        Fail (Cpu, ERROR_MISSING_FILE_NAME);
+        return;
+      }
+    Uint32 Size = Disk ? ReadFromDisk (Name, NameLength)
+                       : ReadFromDirectory (Name, NameLength);
+    if (Size < 2)
+      {
+        Fail (Cpu, ERROR_FILE_NOT_FOUND);
+        return;
+      }
+
+    Word Start = Mem[SECONDARY] ? File[0] | (File[1] << 8)
+                                : Cpu.X | (Cpu.Y << 8);
+    bool Verify = Cpu.A != 0;
+    Byte Status = STATUS_EOI;
+    Word At = Start;
+    for (Uint32 i = 2; i < Size; i++, At++)
+      {
+        // Into RAM, as the KERNAL's stores under the ROMs do
+        if (!Verify)
+          {
+            Mem.Poke (At, File[i]);
+          }
+        else if (Mem[At] != File[i])
+          {
+            Status |= STATUS_VERIFY;
+          }
+      }
+
+    Mem.Poke (STATUS, Status);
+    Mem.Poke (END_ADDRESS, At & 0xFF);
+    Mem.Poke (END_ADDRESS + 1, At >> 8);
+    Cpu.X = At & 0xFF;
+    Cpu.Y = At >> 8;
+    Cpu.C = 0;
+    Loads++;
+  }
+
+  void
+  Save (CPU &Cpu, Memory &Mem)
+  {
+    Word Start = Mem[Cpu.A] | (Mem[(Byte)(Cpu.A + 1)] << 8);
+    Word End = Cpu.X | (Cpu.Y << 8);
+    Mem.Poke (SAVE_START, Start & 0xFF);
+    Mem.Poke (SAVE_START + 1, Start >> 8);
+    Mem.Poke (END_ADDRESS, Cpu.X);
+    Mem.Poke (END_ADDRESS + 1, Cpu.Y);
+
+    Byte Name[MAX_NAME];
+    Uint32 NameLength = FileName (Mem, Name);
+    if (NameLength == 0)
+      {
+        Fail (Cpu, ERROR_MISSING_FILE_NAME);
+        return;
+      }
+    Uint32 Size = 2;
+    File[0] = Start & 0xFF;
+    File[1] = Start >> 8;
+    for (Word At = Start; At != End; At++)
+      {
+        File[Size++] = Mem[At];
+      }
+
+    bool Ok = Disk ? WriteToDisk (Name, NameLength, Size)
+                   : WriteToDirectory (Name, NameLength, Size);
+    if (!Ok)
+      {
+        // The KERNAL would only hear of it from the error channel
+        Fail (Cpu, ERROR_DEVICE_NOT_PRESENT);
+        return;
+      }
+    Mem.Poke (STATUS, 0);
+    Cpu.C = 0;
+    Saves++;
+  }
+
+  static void
+  Fail (CPU &Cpu, Byte Error)
+  {
+    Cpu.A = Error;
+    Cpu.C = 1;
+  }
+
+  /** Returns as RTS would */
+  static void
+  Return (CPU &Cpu, Memory &Mem)
+  {
+    Byte Lo = Mem[0x0100 | (Byte)(Cpu.SP + 1)];
+    Byte Hi = Mem[0x0100 | (Byte)(Cpu.SP + 2)];
+    Cpu.SP += 2;
+    Cpu.PC = (Word)((Lo | (Hi << 8)) + 1);
+  }
+
+  /** The file name without a drive prefix; returns its length */
+  static Uint32
+  FileName (const Memory &Mem, Byte *Name)
+  {
+    Uint32 Length = Mem[NAME_LENGTH];
+    Word From = Mem[NAME_ADDRESS] | (Mem[NAME_ADDRESS + 1] << 8);
+    Uint32 Skip = 0;
+    for (Uint32 i = 0; i < Length && i < 3; i++)
+      {
+        if (Mem[(Word)(From + i)] == ':')
+          {
+            Skip = i + 1;
+          }
+      }
+    Length -= Skip;
+    if (Length > MAX_NAME)
+      {
+        Length = MAX_NAME;
+      }
+    for (Uint32 i = 0; i < Length; i++)
+      {
+        Name[i] = Mem[(Word)(From + Skip + i)];
+      }
+    return Length;
+  }
+
+  /* D64 */
+
+  static constexpr Uint32 DIR_TRACK = 18;
+  static constexpr Uint32 ENTRY_SIZE = 32;
+  static constexpr Byte TYPE_PRG = 0x82; // Closed PRG
+  static constexpr Uint32 MAX_CHAIN = 683; // Sectors on a 35 track disk
+
+  /** Finds a directory entry by name. Sets Track/Sector to its sector
+   * and Entry to its offset there. */
+  bool
+  FindEntry (const Byte *Name, Uint32 NameLength, Uint32 &Track,
+             Uint32 &Sector, Uint32 &Entry)
+  {
+    const Byte *Bam = Disk->ReadSector (DIR_TRACK, 0);
+    Track = Bam ? Bam[0] : 0;
+    Sector = Bam ? Bam[1] : 0;
+    for (Uint32 n = 0; n < MAX_CHAIN && Track; n++)
+      {
+        const Byte *Dir = Disk->ReadSector (Track, Sector);
+        if (!Dir)
+          {
+            return false;
+          }
+        for (Entry = 0; Entry < D64Image::SECTOR_SIZE; Entry += ENTRY_SIZE)
+          {
+            if ((Dir[Entry + 2] & 0x80)
+                && Matches (Name, NameLength, Dir + Entry + 5, MAX_NAME))
+              {
+                return true;
+              }
+          }
+        Track = Dir[0];
+        Sector = Dir[1];
+      }
+    return false;
+  }
+
+  Uint32
+  ReadFromDisk (const Byte *Name, Uint32 NameLength)
+  {
+    Uint32 Track, Sector, Entry;
+    if (!FindEntry (Name, NameLength, Track, Sector, Entry))
+      {
+        return 0;
+      }
+    const Byte *Dir = Disk->ReadSector (Track, Sector);
+    Track = Dir[Entry + 3];
+    Sector = Dir[Entry + 4];
+    Uint32 Size = 0;
+    for (Uint32 n = 0; n < MAX_CHAIN && Track; n++)
+      {
+        const Byte *Data = Disk->ReadSector (Track, Sector);
+        if (!Data)
+          {
+            break;
+          }
+        // The last sector's link holds the index of its last byte
+        Uint32 Last = Data[0] ? D64Image::SECTOR_SIZE - 1 : Data[1];
+        for (Uint32 i = 2; i <= Last && Size < MAX_FILE; i++)
+          {
+            File[Size++] = Data[i];
+          }
+        Track = Data[0];
+        Sector = Data[1];
+      }
+    return Size;
+  }
+
+  /** Allocates a free sector in the BAM, from the tracks nearest the
+   * directory outwards like the DOS */
+  bool
+  Allocate (Byte *Bam, Uint32 &Track, Uint32 &Sector)
+  {
+    for (Uint32 Distance = 1; Distance < DIR_TRACK; Distance++)
+      {
+        for (Sint32 Side = -1; Side <= 1; Side += 2)
+          {
+            Sint32 t = (Sint32)DIR_TRACK + Side * (Sint32)Distance;
+            if (t < 1 || t > 35)
+              {
+                continue;
+              }
+            Byte *Entry = Bam + 4 * t;
+            for (Uint32 s = 0; s < D64Image::SectorsIn (t); s++)
+              {
+                if (Entry[1 + s / 8] & (1 << (s % 8)))
+                  {
+                    Entry[1 + s / 8] &= ~(1 << (s % 8));
+                    Entry[0]--;
+                    Track = t;
+                    Sector = s;
+                    return true;
+                  }
+              }
+          }
+      }
+    return false;
+  }
+
+  /** Writes a PRG into the first free directory entry. Fails if the
+   * name exists or the disk or directory is full. */
+  bool
+  WriteToDisk (const Byte *Name, Uint32 NameLength, Uint32 Size)
+  {
+    Uint32 Track, Sector, Entry;
+    if (FindEntry (Name, NameLength, Track, Sector, Entry))
+      {
+        return false;
+      }
+    // A free entry in the existing directory sectors
+    const Byte *Bam = Disk->ReadSector (DIR_TRACK, 0);
+    Track = Bam ? Bam[0] : 0;
+    Sector = Bam ? Bam[1] : 0;
+    bool Found = false;
+    for (Uint32 n = 0; n < MAX_CHAIN && Track && !Found; n++)
+      {
+        const Byte *Dir = Disk->ReadSector (Track, Sector);
+        if (!Dir)
+          {
+            return false;
+          }
+        for (Entry = 0; Entry < D64Image::SECTOR_SIZE && !Found;
+             Entry += ENTRY_SIZE)
+          {
+            Found = Dir[Entry + 2] == 0;
+          }
+        if (Found)
+          {
+            Entry -= ENTRY_SIZE;
+          }
+        else
+          {
+            Track = Dir[0];
+            Sector = Dir[1];
+          }
+      }
+    if (!Found)
+      {
+        return false;
+      }
+
+    Byte NewBam[D64Image::SECTOR_SIZE];
+    memcpy (NewBam, Bam, sizeof (NewBam));
+    Uint32 Blocks = (Size + 253) / 254;
+    Uint32 FirstTrack = 0, FirstSector = 0;
+    Uint32 PrevTrack = 0, PrevSector = 0;
+    Byte Data[D64Image::SECTOR_SIZE];
+    for (Uint32 b = 0; b < Blocks; b++)
+      {
+        Uint32 t, s;
+        if (!Allocate (NewBam, t, s))
+          {
+            // Nothing written is reachable yet; the BAM is untouched
+            return false;
+          }
+        if (b == 0)
+          {
+            FirstTrack = t;
+            FirstSector = s;
+          }
+        else
+          {
+            Data[0] = t;
+            Data[1] = s;
+            Disk->WriteSector (PrevTrack, PrevSector, Data);
+          }
+        Uint32 Offset = b * 254;
+        Uint32 Count = Size - Offset < 254 ? Size - Offset : 254;
+        memset (Data, 0, sizeof (Data));
+        memcpy (Data + 2, File + Offset, Count);
+        Data[0] = 0;
+        Data[1] = Count + 1;
+        PrevTrack = t;
+        PrevSector = s;
+      }
+    Disk->WriteSector (PrevTrack, PrevSector, Data);
+    Disk->WriteSector (DIR_TRACK, 0, NewBam);
+
+    Byte Dir[D64Image::SECTOR_SIZE];
+    memcpy (Dir, Disk->ReadSector (Track, Sector), sizeof (Dir));
+    Byte *E = Dir + Entry;
+    memset (E + 2, 0, ENTRY_SIZE - 2);
+    E[2] = TYPE_PRG;
+    E[3] = FirstTrack;
+    E[4] = FirstSector;
+    memset (E + 5, 0xA0, MAX_NAME);
+    memcpy (E + 5, Name, NameLength);
+    E[30] = Blocks & 0xFF;
+    E[31] = Blocks >> 8;
+    Disk->WriteSector (Track, Sector, Dir);
+    return true;
+  }
+
+  /* Host directory */
+
+  /** Host file name of a DOS name: lower case, with path separators
+   * replaced */
+  static void
+  HostName (const Byte *Name, Uint32 Length, char *Out)
+  {
+    for (Uint32 i = 0; i < Length; i++)
+      {
+        Out[i] = Name[i] == '/' ? '_' : (char)tolower (Name[i]);
+      }
+    Out[Length] = 0;
+  }
+
+  Uint32
+  ReadFromDirectory (const Byte *Name, Uint32 NameLength)
+  {
+    DIR *Dir = opendir (Directory);
+    if (!Dir)
+      {
+        return 0;
+      }
+    char Path[4096];
+    bool Found = false;
+    while (struct dirent *Entry = readdir (Dir))
+      {
+        // NAME.PRG or NAME, compared in upper case
+        Byte Upper[256];
+        Uint32 Length = strlen (Entry->d_name);
+        for (Uint32 i = 0; i < Length && i < sizeof (Upper); i++)
+          {
+            Upper[i] = toupper ((Byte)Entry->d_name[i]);
+          }
+        if (Length > 4 && memcmp (Upper + Length - 4, ".PRG", 4) == 0)
+          {
+            Length -= 4;
+          }
+        if (Length <= MAX_NAME && Matches (Name, NameLength, Upper, Length))
+          {
+            snprintf (Path, sizeof (Path), "%s/%s", Directory, Entry->d_name);
+            Found = true;
+            break;
+          }
+      }
+    closedir (Dir);
+    if (!Found)
+      {
+        return 0;
+      }
+    FILE *In = fopen (Path, "rb");
+    if (!In)
+      {
+        return 0;
+      }
+    Uint32 Size = fread (File, 1, MAX_FILE, In);
+    fclose (In);
+    return Size;
+  }
+
+  bool
+  WriteToDirectory (const Byte *Name, Uint32 NameLength, Uint32 Size)
+  {
+    char Base[MAX_NAME + 1];
+    HostName (Name, NameLength, Base);
+    char Path[4096];
+    snprintf (Path, sizeof (Path), "%s/%s.prg", Directory, Base);
+    FILE *Out = fopen (Path, "wb");
+    if (!Out)
+      {
+        return false;
+      }
+    bool Ok = fwrite (File, 1, Size, Out) == Size;
+    return fclose (Out) == 0 && Ok;
+  }
+};
+
+#define TRAPS_CPP
+#endif // !TRAPS_CPP
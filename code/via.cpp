@@ -0,0 +1,342 @@
+#ifndef VIA_CPP
+
+#include "cpu.cpp"
+#include "scheduler.cpp"
+#include <string.h>
+
+/* MOS 6522 VIA
+ *
+ * Like the CIA, nothing is clocked per cycle. Each timer keeps its value
+ * at a base cycle and the cycle it next underflows; its value is worked
+ * out when read, and underflows that fell due are folded into the
+ * interrupt flags by Settle, which every register access calls first.
+ * The chip has no scheduler of its own, so flags only change when
+ * something looks at them.
+ *
+ * Timer 1 runs one-shot or free-running (reloading from its latch after
+ * counting through $FFFF, a period of latch + 2). Timer 2 is one-shot
+ * only; pulse counting is not emulated, and neither is the shift
+ * register beyond holding its value. CA1 is the only control line.
+ */
+struct VIA
+{
+  static constexpr Byte REG_ORB = 0x00;
+  static constexpr Byte REG_ORA = 0x01;
+  static constexpr Byte REG_DDRB = 0x02;
+  static constexpr Byte REG_DDRA = 0x03;
+  static constexpr Byte REG_T1C_LO = 0x04;
+  static constexpr Byte REG_T1C_HI = 0x05;
+  static constexpr Byte REG_T1L_LO = 0x06;
+  static constexpr Byte REG_T1L_HI = 0x07;
+  static constexpr Byte REG_T2C_LO = 0x08;
+  static constexpr Byte REG_T2C_HI = 0x09;
+  static constexpr Byte REG_SR = 0x0A;
+  static constexpr Byte REG_ACR = 0x0B;
+  static constexpr Byte REG_PCR = 0x0C;
+  static constexpr Byte REG_IFR = 0x0D;
+  static constexpr Byte REG_IER = 0x0E;
+  static constexpr Byte REG_ORA_NH = 0x0F; // Port A without handshake
+
+  static constexpr Byte PORT_B = 0; // Index into Port and Input
+  static constexpr Byte PORT_A = 1;
+
+  static constexpr Byte IFR_CA2 = 0x01;
+  static constexpr Byte IFR_CA1 = 0x02;
+  static constexpr Byte IFR_SR = 0x04;
+  static constexpr Byte IFR_CB2 = 0x08;
+  static constexpr Byte IFR_CB1 = 0x10;
+  static constexpr Byte IFR_T2 = 0x20;
+  static constexpr Byte IFR_T1 = 0x40;
+  static constexpr Byte IFR_ANY = 0x80; // Read: an enabled source fired
+  static constexpr Byte IER_SET = 0x80; // Written: set, else clear bits
+
+  static constexpr Byte ACR_T1_FREE_RUN = 0x40;
+  static constexpr Byte PCR_CA1_RISING = 0x01; // Else falling edges
+
+  struct Timer
+  {
+    Word Latch;
+    Word Count;  // Value at Base
+    Uint64 Base;
+    Uint64 Next; // Cycle of the next underflow that sets the flag
+  };
+
+  Timer T1, T2;
+  Byte Port[4];  // ORB, ORA, DDRB, DDRA
+  Byte Input[2] = { 0xFF, 0xFF }; // Pins as driven from outside, per port
+  Byte Sr;
+  Byte Acr;
+  Byte Pcr;
+  Byte Flags; // Interrupt sources that fired
+  Byte Mask;  // Interrupt sources enabled
+  bool Ca1;   // Level last seen on CA1
+
+  Uint64 (*Now) (void *Context) = nullptr;
+  void *NowContext = nullptr;
+
+  // Supplies a port's input pins instead of Input, for inputs that
+  // change by themselves
+  Byte (*Pins) (void *Context, Byte Which) = nullptr;
+
+  // Called with a port's output lines when they may have changed
+  void (*PortA) (void *Context, Byte Lines) = nullptr;
+  void (*PortB) (void *Context, Byte Lines) = nullptr;
+  void *PortContext = nullptr;
+
+  const IOHandler Handler = { ReadRegister, WriteRegister, this };
+
+  /** Stops the timers and attaches the chip at pages First..Last, where
+   * its registers repeat every 16 bytes. Inputs and connections are
+   * kept. */
+  void
+  Reset (Memory &memory, Byte First, Byte Last)
+  {
+    T1 = { 0xFFFF, 0xFFFF, 0, Scheduler::NEVER };
+    T2 = T1;
+    memset (Port, 0, sizeof (Port));
+    Sr = Acr = Pcr = Flags = Mask = 0;
+    Ca1 = false;
+    memory.MapIO (First, Last, &Handler);
+  }
+
+  /** The IRQ output */
+  bool
+  Interrupt ()
+  {
+    Settle (Time ());
+    return Flags & Mask;
+  }
+
+  /** Drives CA1; the edge PCR selects raises its flag */
+  void
+  SetCa1 (bool Level)
+  {
+    if (Level != Ca1 && Level == (bool)(Pcr & PCR_CA1_RISING))
+      {
+        Flags |= IFR_CA1;
+      }
+    Ca1 = Level;
+  }
+
+  Byte
+  Read (Word Address)
+  {
+    Uint64 T = Time ();
+    Settle (T);
+    Byte R = Address & 0x0F;
+    switch (R)
+      {
+      case REG_ORB:
+        // Output pins read back the output register
+        return (Port[REG_ORB] & Port[REG_DDRB])
+               | (InputPins (PORT_B) & ~Port[REG_DDRB]);
+      case REG_ORA:
+        Flags &= ~(IFR_CA1 | IFR_CA2);
+        return ReadPinsA ();
+      case REG_ORA_NH:
+        return ReadPinsA ();
+      case REG_DDRB:
+      case REG_DDRA:
+        return Port[R];
+      case REG_T1C_LO:
+        Flags &= ~IFR_T1;
+        return Counter1 (T) & 0xFF;
+      case REG_T1C_HI:
+        return Counter1 (T) >> 8;
+      case REG_T1L_LO:
+        return T1.Latch & 0xFF;
+      case REG_T1L_HI:
+        return T1.Latch >> 8;
+      case REG_T2C_LO:
+        Flags &= ~IFR_T2;
+        return Counter2 (T) & 0xFF;
+      case REG_T2C_HI:
+        return Counter2 (T) >> 8;
+      case REG_SR:
+        return Sr;
+      case REG_ACR:
+        return Acr;
+      case REG_PCR:
+        return Pcr;
+      case REG_IFR:
+        return Flags | ((Flags & Mask) ? IFR_ANY : 0);
+      default:
+        return Mask | 0x80;
+      }
+  }
+
+  void
+  Write (Word Address, Byte Value)
+  {
+    Uint64 T = Time ();
+    Settle (T);
+    Byte R = Address & 0x0F;
+    switch (R)
+      {
+      case REG_ORB:
+      case REG_DDRB:
+        Port[R] = Value;
+        if (PortB)
+          {
+            PortB (PortContext, Port[REG_ORB] | ~Port[REG_DDRB]);
+          }
+        break;
+      case REG_ORA:
+      case REG_ORA_NH:
+      case REG_DDRA:
+        if (R == REG_ORA)
+          {
+            Flags &= ~(IFR_CA1 | IFR_CA2);
+          }
+        Port[R == REG_DDRA ? REG_DDRA : REG_ORA] = Value;
+        if (PortA)
+          {
+            PortA (PortContext, Port[REG_ORA] | ~Port[REG_DDRA]);
+          }
+        break;
+      case REG_T1C_LO:
+      case REG_T1L_LO:
+        T1.Latch = (T1.Latch & 0xFF00) | Value;
+        break;
+      case REG_T1C_HI:
+        // Loads the counter from the latch and starts it
+        T1.Latch = (T1.Latch & 0x00FF) | (Value << 8);
+        Flags &= ~IFR_T1;
+        Start (T1, T1.Latch, T);
+        break;
+      case REG_T1L_HI:
+        T1.Latch = (T1.Latch & 0x00FF) | (Value << 8);
+        Flags &= ~IFR_T1;
+        break;
+      case REG_T2C_LO:
+        T2.Latch = (T2.Latch & 0xFF00) | Value;
+        break;
+      case REG_T2C_HI:
+        T2.Latch = (T2.Latch & 0x00FF) | (Value << 8);
+        Flags &= ~IFR_T2;
+        Start (T2, T2.Latch, T);
+        break;
+      case REG_SR:
+        Sr = Value;
+        break;
+      case REG_ACR:
+        if ((Acr ^ Value) & ACR_T1_FREE_RUN)
+          {
+            // Carry on from the current value in the new mode
+            bool Armed = T1.Next != Scheduler::NEVER;
+            Word Count = Counter1 (T);
+            Acr = Value;
+            Start (T1, Count, T);
+            if (!Armed && !(Acr & ACR_T1_FREE_RUN))
+              {
+                T1.Next = Scheduler::NEVER;
+              }
+          }
+        Acr = Value;
+        break;
+      case REG_PCR:
+        Pcr = Value;
+        break;
+      case REG_IFR:
+        Flags &= ~Value;
+        break;
+      default:
+        if (Value & IER_SET)
+          {
+            Mask |= Value & 0x7F;
+          }
+        else
+          {
+            Mask &= ~Value;
+          }
+      }
+  }
+
+  /** Folds the timer underflows due at or before cycle T into Flags */
+  void
+  Settle (Uint64 T)
+  {
+    if (T1.Next <= T)
+      {
+        Flags |= IFR_T1;
+        if (Acr & ACR_T1_FREE_RUN)
+          {
+            Uint64 Period = T1.Latch + 2;
+            T1.Next += ((T - T1.Next) / Period + 1) * Period;
+          }
+        else
+          {
+            T1.Next = Scheduler::NEVER;
+          }
+      }
+    if (T2.Next <= T)
+      {
+        Flags |= IFR_T2;
+        T2.Next = Scheduler::NEVER;
+      }
+  }
+
+private:
+  static Byte
+  ReadRegister (void *Context, Word Address)
+  {
+    return ((VIA *)Context)->Read (Address);
+  }
+
+  static void
+  WriteRegister (void *Context, Word Address, Byte Value)
+  {
+    ((VIA *)Context)->Write (Address, Value);
+  }
+
+  Uint64
+  Time () const
+  {
+    return Now ? Now (NowContext) : 0;
+  }
+
+  /** Port A reads the pins, which the outside can pull low */
+  Byte
+  ReadPinsA () const
+  {
+    return (Port[REG_ORA] | ~Port[REG_DDRA]) & InputPins (PORT_A);
+  }
+
+  Byte
+  InputPins (Byte Which) const
+  {
+    return Pins ? Pins (PortContext, Which) : Input[Which];
+  }
+
+  /** Counts down from Count, underflowing Count + 1 cycles after T */
+  static void
+  Start (Timer &Which, Word Count, Uint64 T)
+  {
+    Which.Count = Count;
+    Which.Base = T;
+    Which.Next = T + Count + 1;
+  }
+
+  /** Timer 1 at cycle T: down to 0, $FFFF for a cycle, then from the
+   * latch again when free-running and on down through $FFFF if not */
+  Word
+  Counter1 (Uint64 T) const
+  {
+    Uint64 Elapsed = T - T1.Base;
+    if (Elapsed <= T1.Count || !(Acr & ACR_T1_FREE_RUN))
+      {
+        return (Word)(T1.Count - Elapsed);
+      }
+    Uint64 Phase = (Elapsed - T1.Count - 1) % (T1.Latch + 2);
+    return Phase == 0 ? 0xFFFF : (Word)(T1.Latch - (Phase - 1));
+  }
+
+  Word
+  Counter2 (Uint64 T) const
+  {
+    return (Word)(T2.Count - (T - T2.Base));
+  }
+};
+
+#define VIA_CPP
+#endif // !VIA_CPP
@@ -0,0 +1,1168 @@
+#ifndef VIC_CPP
+
+#include "cpu.cpp"
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/* CPU clock and raster geometry of a video standard, and the mains
+ * frequency that goes with it */
+struct VideoStandard
+{
+  const char *Name;
+  Uint32 ClockHz;
+  Uint32 CyclesPerLine;
+  Uint32 Lines;
+  Uint32 MainsHz; // Mains frequency, which clocks the CIA TOD
+
+  constexpr Uint32
+  CyclesPerFrame () const
+  {
+    return CyclesPerLine * Lines;
+  }
+};
+
+static constexpr VideoStandard VIDEO_PAL = { "PAL", 985248, 63, 312, 50 };
+static constexpr VideoStandard VIDEO_NTSC = { "NTSC", 1022727, 65, 263, 60 };
+
+/* VIC-II colours as 0xAARRGGBB (the "Pepto" PAL measurements) */
+static constexpr Uint32 VIC_PALETTE[16] = {
+  0xFF000000, 0xFFFFFFFF, 0xFF68372B, 0xFF70A4B2, 0xFF6F3D86, 0xFF588D43,
+  0xFF352879, 0xFFB8C76F, 0xFF6F4F25, 0xFF433900, 0xFF9A6759, 0xFF444444,
+  0xFF6C6C6C, 0xFF9AD284, 0xFF6C5EB5, 0xFF959595,
+};
+
+/* Bit doubling for X-expanded sprites. Hires doubles every bit,
+ * multicolour doubles every two-bit pixel. */
+struct VicDoubleTables
+{
+  Word Hires[256];
+  Word Pairs[256];
+};
+
+static constexpr VicDoubleTables
+MakeVicDoubleTables ()
+{
+  VicDoubleTables T = {};
+  for (Uint32 Value = 0; Value < 256; Value++)
+    {
+      Uint32 Hires = 0;
+      Uint32 Pairs = 0;
+      for (Uint32 Bit = 0; Bit < 8; Bit++)
+        {
+          Hires |= ((Value >> Bit) & 1) * (3u << (Bit * 2));
+        }
+      for (Uint32 Pair = 0; Pair < 4; Pair++)
+        {
+          Uint32 Pixel = (Value >> (Pair * 2)) & 3;
+          Pairs |= (Pixel | (Pixel << 2)) << (Pair * 4);
+        }
+      T.Hires[Value] = (Word)Hires;
+      T.Pairs[Value] = (Word)Pairs;
+    }
+  return T;
+}
+
+static constexpr VicDoubleTables VIC_DOUBLE = MakeVicDoubleTables ();
+
+/* Receives each completed frame, VIC::WIDTH by VIC::HEIGHT 0xAARRGGBB
+ * pixels, with its number from 0 */
+typedef void (*FrameSink) (void *Context, const Uint32 *Pixels, Uint64 Frame);
+
+/* VIC-II video chip.
+ *
+ * Registers sit at $D000-$D3FF (64 bytes, mirrored) through an I/O
+ * mapping; video memory is read straight from RAM, and colour RAM is the
+ * low nibble of $D800-$DBFF.
+ *
+ * Output is rendered a raster line at a time at the end of that line,
+ * so register changes take effect with line granularity. Each line is
+ * built from 8-pixel expand kernels (one graphics byte to eight ARGB
+ * pixels plus a foreground mask) and masked blends for the sprite layer.
+ * The kernels have SSE2 and AVX2 forms; RenderLineScalar runs the same
+ * code with the plain C++ kernels and is the reference the vector paths
+ * are tested against.
+ *
+ * The chip also says which cycles of each line it takes the bus from the
+ * CPU (see Stalls). Which lines are badlines and which carry sprite DMA
+ * is kept in per-line tables rebuilt only when a register they depend on
+ * changes, and the cycle windows for every combination are built once
+ * per video standard.
+ */
+struct VIC
+{
+  static constexpr Uint32 WIDTH = 384;      // 32 pixels of border each side
+  static constexpr Uint32 HEIGHT = 272;     // Raster lines in the frame
+  static constexpr Uint32 FIRST_LINE = 16;  // Raster line of row 0
+  static constexpr Uint32 DISPLAY_X = 32;   // Column 0 without XSCROLL
+  static constexpr Uint32 SPRITE_X = 8;     // Framebuffer x of sprite x 0
+  static constexpr Uint32 FIRST_DMA_LINE = 0x30;
+  static constexpr Uint32 LINE_PIXELS = 576; // Sprite x 511 + 48 pixels
+  static constexpr Uint32 LINE_WORDS = LINE_PIXELS / 64 + 1; // One spare
+  static constexpr Uint32 MAX_LINES = 312;
+  static constexpr Uint32 MAX_CYCLES = 65; // Per line
+  static constexpr Uint32 MAX_STALLS = 6;  // Windows per line
+  static constexpr Uint32 LAST_DMA_LINE = 0xF7;
+
+  static constexpr Byte REG_CONTROL1 = 0x11;
+  static constexpr Byte REG_RASTER = 0x12;
+  static constexpr Byte REG_SPRITE_ENABLE = 0x15;
+  static constexpr Byte REG_CONTROL2 = 0x16;
+  static constexpr Byte REG_SPRITE_EXPAND_Y = 0x17;
+  static constexpr Byte REG_MEMORY = 0x18;
+  static constexpr Byte REG_IRQ = 0x19;
+  static constexpr Byte REG_IRQ_ENABLE = 0x1A;
+  static constexpr Byte REG_SPRITE_PRIORITY = 0x1B;
+  static constexpr Byte REG_SPRITE_MULTI = 0x1C;
+  static constexpr Byte REG_SPRITE_EXPAND_X = 0x1D;
+  static constexpr Byte REG_SPRITE_SPRITE = 0x1E;     // Collisions
+  static constexpr Byte REG_SPRITE_BACKGROUND = 0x1F; // Collisions
+  static constexpr Byte REG_BORDER = 0x20;
+  static constexpr Byte REG_BACKGROUND = 0x21; // Four registers
+  static constexpr Byte REG_SPRITE_MC0 = 0x25;
+  static constexpr Byte REG_SPRITE_MC1 = 0x26;
+  static constexpr Byte REG_SPRITE_COLOR = 0x27; // Eight registers
+
+  static constexpr Byte IRQ_SPRITE_BACKGROUND = 0x02;
+  static constexpr Byte IRQ_SPRITE_SPRITE = 0x04;
+
+  /* Cycles of a raster line in which the CPU is off the bus */
+  struct StallWindow
+  {
+    Byte Start; // Cycle within the line, from 0
+    Byte Length;
+  };
+
+  struct LineStalls
+  {
+    Byte Count;
+    StallWindow Windows[MAX_STALLS];
+  };
+
+  /* Sprites involved in collisions, one bit per sprite */
+  struct Collisions
+  {
+    Byte Sprites;    // Touched another sprite
+    Byte Background; // Touched foreground graphics
+  };
+
+  Byte Reg[0x40];
+  Uint32 Raster = 0;
+  Uint32 Lines = 312;
+
+  const Byte *Ram = nullptr;     // 64K the chip fetches from
+  const Byte *CharRom = nullptr; // 4K, or null to fetch RAM there too
+  Byte Bank = 0;                 // 16K bank, from CIA 2 port A
+
+  Uint32 Frame[HEIGHT * WIDTH]; // 0xAARRGGBB
+
+  const IOHandler Handler = { ReadRegister, WriteRegister, this };
+
+  /** Clears the registers and the picture and attaches the chip to
+   * memory */
+  void
+  Reset (Memory &memory, const VideoStandard &Video)
+  {
+    memset (Reg, 0, sizeof (Reg));
+    memset (Frame, 0, sizeof (Frame));
+    Raster = 0;
+    Lines = Video.Lines;
+    Ram = memory.Data;
+    memory.MapIO (0xD0, 0xD3, &Handler);
+
+    BuildStallPatterns (Video.CyclesPerLine);
+    RebuildBadLines ();
+    RebuildSpriteDma ();
+  }
+
+  Byte
+  Read (Word Address)
+  {
+    Byte R = Address & 0x3F;
+    switch (R)
+      {
+      case REG_SPRITE_SPRITE:
+      case REG_SPRITE_BACKGROUND:
+        {
+          // Cleared by reading
+          Byte Value = Reg[R];
+          Reg[R] = 0;
+          return Value;
+        }
+      case REG_CONTROL1:
+        return (Reg[R] & 0x7F) | ((Raster & 0x100) >> 1);
+      case REG_RASTER:
+        return Raster & 0xFF;
+      case REG_CONTROL2:
+        return Reg[R] | 0xC0;
+      case REG_MEMORY:
+        return Reg[R] | 0x01;
+      case REG_IRQ:
+        return Reg[R] | 0x70;
+      case REG_IRQ_ENABLE:
+        return Reg[R] | 0xF0;
+      default:
+        if (R >= REG_BORDER && R <= 0x2E)
+          {
+            return Reg[R] | 0xF0;
+          }
+        return R > 0x2E ? 0xFF : Reg[R];
+      }
+  }
+
+  void
+  Write (Word Address, Byte Value)
+  {
+    Byte R = Address & 0x3F;
+    switch (R)
+      {
+      case REG_IRQ:
+        // Writing a 1 acknowledges that interrupt
+        Reg[R] &= ~Value & 0x0F;
+        UpdateIrq ();
+        break;
+      case REG_IRQ_ENABLE:
+        Reg[R] = Value & 0x0F;
+        UpdateIrq ();
+        break;
+      case REG_SPRITE_SPRITE:
+      case REG_SPRITE_BACKGROUND:
+        break; // Read only
+      case REG_CONTROL1:
+        {
+          // YSCROLL and DEN decide the badlines
+          bool Changed = (Reg[R] ^ Value) & 0x17;
+          Reg[R] = Value;
+          if (Changed)
+            {
+              RebuildBadLines ();
+            }
+        }
+        break;
+      default:
+        {
+          // So do sprite enables, Y positions and Y expansion for DMA
+          bool Dma = R == REG_SPRITE_ENABLE || R == REG_SPRITE_EXPAND_Y
+                     || (R < 0x10 && (R & 1));
+          bool Changed = Reg[R] != Value;
+          Reg[R] = Value;
+          if (Dma && Changed)
+            {
+              RebuildSpriteDma ();
+            }
+        }
+        break;
+      }
+  }
+
+  /** Cycles of Line the chip takes from the CPU: the character fetches
+   * of a badline and the data fetches of sprites displayed on the line,
+   * each with the three cycles BA is low before them, during which the
+   * CPU stops at its next read. All three count as lost. */
+  const LineStalls &
+  Stalls (Uint32 Line) const
+  {
+    return StallPatterns[BadLines[Line]][SpriteDma[Line]];
+  }
+
+  /** Finishes the current raster line: latches its sprite collisions,
+   * renders it unless Render is false (warp mode) and moves on to the
+   * next */
+  void
+  EndLine (bool Render)
+  {
+    if (Reg[REG_SPRITE_ENABLE])
+      {
+        LatchCollisions (Collide (Raster));
+      }
+    if (Render)
+      {
+        RenderLine (Raster);
+      }
+    Raster = Raster + 1 == Lines ? 0 : Raster + 1;
+  }
+
+  void RenderLine (Uint32 Line) { RenderLineWith<true> (Line); }
+  void RenderLineScalar (Uint32 Line) { RenderLineWith<false> (Line); }
+
+  /** Collisions on Line.
+   *
+   * Every active sprite's opaque pixels become a left aligned 64-bit
+   * mask placed over the one or two line words it covers. Two words per
+   * line word track pixels seen by any sprite and by more than one, so
+   * sprite-sprite collisions come down to an AND with the second;
+   * sprite-background collisions AND against the foreground bits, which
+   * are only fetched when a sprite is active on the line.
+   */
+  Collisions
+  Collide (Uint32 Line) const
+  {
+    Collisions Hit = { 0, 0 };
+    Byte Active = ActiveSprites (Line);
+    if (!Active)
+      {
+        return Hit;
+      }
+
+    Uint64 Occupancy[8][LINE_WORDS] = {};
+    Uint64 Seen[LINE_WORDS] = {};
+    Uint64 Twice[LINE_WORDS] = {};
+    for (Uint32 Sprite = 0; Sprite < 8; Sprite++)
+      {
+        if (!(Active & (1 << Sprite)))
+          {
+            continue;
+          }
+        Byte Bytes[6];
+        Uint32 Count = SpriteBytes (Sprite, Line, Bytes);
+        bool Multi = Reg[REG_SPRITE_MULTI] & (1 << Sprite);
+        Uint64 Opaque = 0;
+        for (Uint32 i = 0; i < Count; i++)
+          {
+            Opaque = (Opaque << 8) | SpriteOpaque (Bytes[i], Multi);
+          }
+
+        Uint32 X = SpriteX (Sprite);
+        Uint64 *Mask = Occupancy[Sprite];
+        PlaceBits (Mask, Opaque << (64 - Count * 8), X);
+        for (Uint32 w = X >> 6; w <= (X >> 6) + 1; w++)
+          {
+            Twice[w] |= Seen[w] & Mask[w];
+            Seen[w] |= Mask[w];
+          }
+      }
+
+    Uint64 Fore[LINE_WORDS];
+    bool HasFore = ForegroundBits (Line, Fore);
+    for (Uint32 Sprite = 0; Sprite < 8; Sprite++)
+      {
+        if (!(Active & (1 << Sprite)))
+          {
+            continue;
+          }
+        Uint32 w = SpriteX (Sprite) >> 6;
+        const Uint64 *Mask = Occupancy[Sprite];
+        if ((Mask[w] & Twice[w]) | (Mask[w + 1] & Twice[w + 1]))
+          {
+            Hit.Sprites |= 1 << Sprite;
+          }
+        if (HasFore && ((Mask[w] & Fore[w]) | (Mask[w + 1] & Fore[w + 1])))
+          {
+            Hit.Background |= 1 << Sprite;
+          }
+      }
+    return Hit;
+  }
+
+  /** Per-pixel reference for Collide */
+  Collisions
+  CollideScalar (Uint32 Line) const
+  {
+    Collisions Hit = { 0, 0 };
+    Byte Active = ActiveSprites (Line);
+    if (!Active)
+      {
+        return Hit;
+      }
+
+    Byte Fore[LINE_PIXELS] = {};
+    Uint32 Row, PixelRow;
+    if (WindowOpen (Line) && TextRow (Line, Row, PixelRow))
+      {
+        Uint32 Start = DISPLAY_X + (Reg[REG_CONTROL2] & 0x07);
+        for (Uint32 Column = 0; Column < 40; Column++)
+          {
+            Cell C = FetchCell (Row, Column, PixelRow, Mode ());
+            ExpandMask<false> (C.Fore, Fore + Start + Column * 8);
+          }
+      }
+
+    Byte Owners[LINE_PIXELS] = {};
+    for (Uint32 Sprite = 0; Sprite < 8; Sprite++)
+      {
+        if (!(Active & (1 << Sprite)))
+          {
+            continue;
+          }
+        Byte Bytes[6];
+        Uint32 Count = SpriteBytes (Sprite, Line, Bytes);
+        bool Multi = Reg[REG_SPRITE_MULTI] & (1 << Sprite);
+        Byte *At = Owners + SpriteX (Sprite);
+        for (Uint32 i = 0; i < Count; i++)
+          {
+            Byte Mask[8];
+            ExpandMask<false> (SpriteOpaque (Bytes[i], Multi), Mask);
+            for (Uint32 k = 0; k < 8; k++)
+              {
+                At[i * 8 + k] |= Mask[k] & (1 << Sprite);
+              }
+          }
+      }
+
+    for (Uint32 x = 0; x < LINE_PIXELS; x++)
+      {
+        Byte Here = Owners[x];
+        if (Here & (Here - 1))
+          {
+            Hit.Sprites |= Here;
+          }
+        if (Fore[x])
+          {
+            Hit.Background |= Here;
+          }
+      }
+    return Hit;
+  }
+
+  const Uint32 *
+  Row (Uint32 Line) const
+  {
+    return Frame + (Line - FIRST_LINE) * WIDTH;
+  }
+
+private:
+  Byte BadLines[MAX_LINES];  // 1 on badlines
+  Byte SpriteDma[MAX_LINES]; // Sprites fetching data on each line
+  LineStalls StallPatterns[2][256]; // By badline and sprite DMA mask
+
+  // Per line scratch, indexed by framebuffer x
+  Byte Foreground[LINE_PIXELS];   // 0xFF on foreground graphics pixels
+  Uint32 SpriteColor[LINE_PIXELS]; // Colour of the frontmost sprite
+  Byte SpriteMask[LINE_PIXELS];   // 0xFF where any sprite is opaque
+  Byte SpriteBehind[LINE_PIXELS]; // 0xFF where it goes behind graphics
+
+  static Byte
+  ReadRegister (void *Context, Word Address)
+  {
+    return ((VIC *)Context)->Read (Address);
+  }
+
+  static void
+  WriteRegister (void *Context, Word Address, Byte Value)
+  {
+    ((VIC *)Context)->Write (Address, Value);
+  }
+
+  /** One byte of the 16K the chip currently sees */
+  Byte
+  Fetch (Word Address) const
+  {
+    Address &= 0x3FFF;
+    if (CharRom && !(Bank & 1) && (Address & 0x3000) == 0x1000)
+      {
+        return CharRom[Address & 0x0FFF];
+      }
+    return Ram[(Bank << 14) | Address];
+  }
+
+  /* One character cell of a display line */
+  struct Cell
+  {
+    Byte Code;  // Screen matrix byte
+    Byte Color; // Colour RAM nibble
+    Byte Bits;  // Graphics byte
+    Byte Fore;  // Which of its pixels are foreground
+  };
+
+  Byte
+  Mode () const
+  {
+    return ((Reg[REG_CONTROL1] & 0x60) | (Reg[REG_CONTROL2] & 0x10)) >> 4;
+  }
+
+  /** True when Line is inside the open display window */
+  bool
+  WindowOpen (Uint32 Line) const
+  {
+    Byte Control1 = Reg[REG_CONTROL1];
+    bool Rows25 = Control1 & 0x08;
+    return (Control1 & 0x10) && Line >= (Rows25 ? 51u : 55u)
+           && Line < (Rows25 ? 251u : 247u);
+  }
+
+  /** Character row shown on Line; false when no row is (idle) */
+  bool
+  TextRow (Uint32 Line, Uint32 &Row, Uint32 &PixelRow) const
+  {
+    Sint32 Offset
+        = (Sint32)Line - FIRST_DMA_LINE - (Reg[REG_CONTROL1] & 0x07);
+    if (Offset < 0 || Offset >= 200)
+      {
+        return false;
+      }
+    Row = Offset >> 3;
+    PixelRow = Offset & 7;
+    return true;
+  }
+
+  Cell
+  FetchCell (Uint32 Row, Uint32 Column, Uint32 PixelRow, Byte Mode) const
+  {
+    Word Screen = (Reg[REG_MEMORY] & 0xF0) << 6;
+    Word Chars = (Reg[REG_MEMORY] & 0x0E) << 10;
+    Word Bitmap = (Reg[REG_MEMORY] & 0x08) << 10;
+
+    Cell C;
+    C.Code = Fetch (Screen + Row * 40 + Column);
+    C.Color = Ram[0xD800 + Row * 40 + Column] & 0x0F;
+    if (Mode & 0x02)
+      {
+        C.Bits = Fetch (Bitmap + Row * 320 + Column * 8 + PixelRow);
+      }
+    else
+      {
+        Byte Char = (Mode & 0x04) ? C.Code & 0x3F : C.Code;
+        C.Bits = Fetch (Chars + Char * 8 + PixelRow);
+      }
+
+    if (Multicolor (C, Mode))
+      {
+        // Pixel pairs: 00 and 01 are background, 10 and 11 foreground
+        Byte High = C.Bits & 0xAA;
+        C.Fore = High | (High >> 1);
+      }
+    else
+      {
+        C.Fore = C.Bits;
+      }
+    return C;
+  }
+
+  static bool
+  Multicolor (const Cell &C, Byte Mode)
+  {
+    return (Mode & 0x01) && ((Mode & 0x02) || (C.Color & 0x08));
+  }
+
+  /** Sprites whose display covers Line */
+  Byte
+  ActiveSprites (Uint32 Line) const
+  {
+    return Line < MAX_LINES ? SpriteDma[Line] : 0;
+  }
+
+  void
+  RebuildBadLines ()
+  {
+    memset (BadLines, 0, sizeof (BadLines));
+    if (!(Reg[REG_CONTROL1] & 0x10))
+      {
+        return;
+      }
+    Byte YScroll = Reg[REG_CONTROL1] & 0x07;
+    for (Uint32 Line = FIRST_DMA_LINE; Line <= LAST_DMA_LINE; Line++)
+      {
+        BadLines[Line] = (Line & 7) == YScroll;
+      }
+  }
+
+  void
+  RebuildSpriteDma ()
+  {
+    memset (SpriteDma, 0, sizeof (SpriteDma));
+    Byte Enable = Reg[REG_SPRITE_ENABLE];
+    for (Uint32 Sprite = 0; Enable; Sprite++, Enable >>= 1)
+      {
+        if (!(Enable & 1))
+          {
+            continue;
+          }
+        Uint32 Y = Reg[Sprite * 2 + 1];
+        bool TallY = Reg[REG_SPRITE_EXPAND_Y] & (1 << Sprite);
+        Uint32 End = Y + (TallY ? 42 : 21);
+        for (Uint32 Line = Y; Line < End && Line < MAX_LINES; Line++)
+          {
+            SpriteDma[Line] |= 1 << Sprite;
+          }
+      }
+  }
+
+  /** Stall windows for every badline/sprite DMA combination. Cycle 0 is
+   * the first cycle of the line. A badline's BA goes low at cycle 11 and
+   * its 40 character fetches end at 54. Each sprite's two data fetches
+   * follow the previous sprite's, starting six cycles before the end of
+   * the line; the last sprites wrap round to its start. */
+  void
+  BuildStallPatterns (Uint32 CyclesPerLine)
+  {
+    Uint32 FirstSprite = CyclesPerLine - 6;
+    for (Uint32 Bad = 0; Bad < 2; Bad++)
+      {
+        for (Uint32 Dma = 0; Dma < 256; Dma++)
+          {
+            bool Blocked[MAX_CYCLES] = {};
+            if (Bad)
+              {
+                for (Uint32 Cycle = 11; Cycle < 54; Cycle++)
+                  {
+                    Blocked[Cycle] = true;
+                  }
+              }
+            for (Uint32 Sprite = 0; Sprite < 8; Sprite++)
+              {
+                if (!(Dma & (1 << Sprite)))
+                  {
+                    continue;
+                  }
+                Uint32 Fetch = FirstSprite + Sprite * 2;
+                for (Uint32 Cycle = Fetch - 3; Cycle < Fetch + 2; Cycle++)
+                  {
+                    Blocked[Cycle % CyclesPerLine] = true;
+                  }
+              }
+
+            LineStalls &S = StallPatterns[Bad][Dma];
+            S.Count = 0;
+            for (Uint32 Cycle = 0; Cycle < CyclesPerLine; Cycle++)
+              {
+                if (!Blocked[Cycle])
+                  {
+                    continue;
+                  }
+                if (Cycle > 0 && Blocked[Cycle - 1])
+                  {
+                    S.Windows[S.Count - 1].Length++;
+                  }
+                else
+                  {
+                    S.Windows[S.Count++] = { (Byte)Cycle, 1 };
+                  }
+              }
+          }
+      }
+  }
+
+  /** Framebuffer x of a sprite's first pixel */
+  Uint32
+  SpriteX (Uint32 Sprite) const
+  {
+    return SPRITE_X + (Reg[Sprite * 2] | ((Reg[0x10] >> Sprite) & 1) << 8);
+  }
+
+  /** Graphics bytes of an active sprite on Line, bit doubled when it is
+   * X-expanded. Returns the byte count, 3 or 6. */
+  Uint32
+  SpriteBytes (Uint32 Sprite, Uint32 Line, Byte Bytes[6]) const
+  {
+    Byte Bit = 1 << Sprite;
+    Uint32 Y = Reg[Sprite * 2 + 1];
+    Uint32 SpriteRow
+        = (Reg[REG_SPRITE_EXPAND_Y] & Bit) ? (Line - Y) >> 1 : Line - Y;
+    Word Pointers = ((Reg[REG_MEMORY] & 0xF0) << 6) + 0x3F8;
+    Word Data = Fetch (Pointers + Sprite) * 64 + SpriteRow * 3;
+    bool Multi = Reg[REG_SPRITE_MULTI] & Bit;
+
+    if (!(Reg[REG_SPRITE_EXPAND_X] & Bit))
+      {
+        for (Uint32 i = 0; i < 3; i++)
+          {
+            Bytes[i] = Fetch (Data + i);
+          }
+        return 3;
+      }
+    for (Uint32 i = 0; i < 3; i++)
+      {
+        Byte Bits = Fetch (Data + i);
+        Word Doubled = Multi ? VIC_DOUBLE.Pairs[Bits] : VIC_DOUBLE.Hires[Bits];
+        Bytes[i * 2] = Doubled >> 8;
+        Bytes[i * 2 + 1] = Doubled & 0xFF;
+      }
+    return 6;
+  }
+
+  /** Opaque pixels of a sprite graphics byte; multicolour pair 00 is
+   * transparent */
+  static Byte
+  SpriteOpaque (Byte Bits, bool Multi)
+  {
+    if (!Multi)
+      {
+        return Bits;
+      }
+    Byte Set = (Bits | (Bits >> 1)) & 0x55;
+    return Set | (Set << 1);
+  }
+
+  template <bool Simd>
+  void
+  RenderLineWith (Uint32 Line)
+  {
+    if (Line < FIRST_LINE || Line >= FIRST_LINE + HEIGHT)
+      {
+        return;
+      }
+    Uint32 *Out = Frame + (Line - FIRST_LINE) * WIDTH;
+    Uint32 Border = VIC_PALETTE[Reg[REG_BORDER] & 0x0F];
+
+    bool Columns40 = Reg[REG_CONTROL2] & 0x08;
+    Uint32 Left = Columns40 ? DISPLAY_X : DISPLAY_X + 7;
+    Uint32 Right = Columns40 ? DISPLAY_X + 320 : DISPLAY_X + 311;
+
+    if (!WindowOpen (Line))
+      {
+        Fill<Simd> (Out, Border, WIDTH);
+        return;
+      }
+
+    RenderGraphics<Simd> (Out, Line, Left);
+    if (RenderSprites<Simd> (Line))
+      {
+        BlendSprites<Simd> (Out + Left, SpriteColor + Left,
+                            SpriteMask + Left, SpriteBehind + Left,
+                            Foreground + Left, Right - Left);
+      }
+    Fill<Simd> (Out, Border, Left);
+    Fill<Simd> (Out + Right, Border, WIDTH - Right);
+  }
+
+  /** Background graphics of one line into Out and Foreground */
+  template <bool Simd>
+  void
+  RenderGraphics (Uint32 *Out, Uint32 Line, Uint32 Left)
+  {
+    Uint32 Start = DISPLAY_X + (Reg[REG_CONTROL2] & 0x07);
+    Uint32 Background[4];
+    for (Uint32 i = 0; i < 4; i++)
+      {
+        Background[i] = VIC_PALETTE[Reg[REG_BACKGROUND + i] & 0x0F];
+      }
+
+    // Pixels XSCROLL uncovers on the left show the background
+    if (Start > Left)
+      {
+        Fill<Simd> (Out + Left, Background[0], Start - Left);
+        memset (Foreground + Left, 0, Start - Left);
+      }
+
+    Uint32 Row, PixelRow;
+    if (!TextRow (Line, Row, PixelRow))
+      {
+        Fill<Simd> (Out + Start, Background[0], 320);
+        memset (Foreground + Start, 0, 320);
+        return;
+      }
+
+    Byte Mode = this->Mode ();
+    for (Uint32 Column = 0; Column < 40; Column++)
+      {
+        Cell C = FetchCell (Row, Column, PixelRow, Mode);
+        Uint32 *Pixels = Out + Start + Column * 8;
+        ExpandMask<Simd> (C.Fore, Foreground + Start + Column * 8);
+
+        switch (Mode)
+          {
+          case 0: // Standard text
+            ExpandHires<Simd> (C.Bits, VIC_PALETTE[C.Color], Background[0],
+                               Pixels);
+            break;
+          case 1: // Multicolour text
+            if (Multicolor (C, Mode))
+              {
+                Uint32 Colors[4] = { Background[0], Background[1],
+                                     Background[2],
+                                     VIC_PALETTE[C.Color & 7] };
+                ExpandPairs<Simd> (C.Bits, Colors, Pixels);
+              }
+            else
+              {
+                ExpandHires<Simd> (C.Bits, VIC_PALETTE[C.Color & 7],
+                                   Background[0], Pixels);
+              }
+            break;
+          case 2: // Standard bitmap
+            ExpandHires<Simd> (C.Bits, VIC_PALETTE[C.Code >> 4],
+                               VIC_PALETTE[C.Code & 0x0F], Pixels);
+            break;
+          case 3: // Multicolour bitmap
+            {
+              Uint32 Colors[4] = { Background[0], VIC_PALETTE[C.Code >> 4],
+                                   VIC_PALETTE[C.Code & 0x0F],
+                                   VIC_PALETTE[C.Color] };
+              ExpandPairs<Simd> (C.Bits, Colors, Pixels);
+            }
+            break;
+          case 4: // Extended background colour text
+            ExpandHires<Simd> (C.Bits, VIC_PALETTE[C.Color],
+                               Background[C.Code >> 6], Pixels);
+            break;
+          default:
+            // Invalid modes show black but still collide
+            Fill<Simd> (Pixels, VIC_PALETTE[0], 8);
+            break;
+          }
+      }
+  }
+
+  /** Composes the sprites visible on Line into the sprite layer. Returns
+   * false when there are none. */
+  template <bool Simd>
+  bool
+  RenderSprites (Uint32 Line)
+  {
+    Byte Active = ActiveSprites (Line);
+    if (!Active)
+      {
+        return false;
+      }
+    memset (SpriteMask, 0, sizeof (SpriteMask));
+    memset (SpriteBehind, 0, sizeof (SpriteBehind));
+
+    // Back to front, so sprite 0 ends up on top
+    for (Sint32 Sprite = 7; Sprite >= 0; Sprite--)
+      {
+        Byte Bit = 1 << Sprite;
+        if (!(Active & Bit))
+          {
+            continue;
+          }
+
+        Byte Bytes[6];
+        Uint32 Count = SpriteBytes (Sprite, Line, Bytes);
+        bool Multi = Reg[REG_SPRITE_MULTI] & Bit;
+        Uint32 Color = VIC_PALETTE[Reg[REG_SPRITE_COLOR + Sprite] & 0x0F];
+
+        Uint32 Pixels[48];
+        Byte Mask[48];
+        Uint32 Colors[4] = { 0, VIC_PALETTE[Reg[REG_SPRITE_MC0] & 0x0F], Color,
+                             VIC_PALETTE[Reg[REG_SPRITE_MC1] & 0x0F] };
+        for (Uint32 i = 0; i < Count; i++)
+          {
+            ExpandMask<Simd> (SpriteOpaque (Bytes[i], Multi), Mask + i * 8);
+            if (Multi)
+              {
+                ExpandPairs<Simd> (Bytes[i], Colors, Pixels + i * 8);
+              }
+            else
+              {
+                ExpandHires<Simd> (Bytes[i], Color, 0, Pixels + i * 8);
+              }
+          }
+
+        Uint32 At = SpriteX (Sprite);
+        Byte Behind = (Reg[REG_SPRITE_PRIORITY] & Bit) ? 0xFF : 0x00;
+        Blend<Simd> (SpriteColor + At, Pixels, Mask, Count * 8);
+        MergeMask<Simd> (SpriteMask + At, SpriteBehind + At, Mask, Behind,
+                         Count * 8);
+      }
+    return true;
+  }
+
+  /** Foreground graphics of Line as bits, most significant first, one
+   * word per 64 framebuffer pixels. False when the line has none. */
+  bool
+  ForegroundBits (Uint32 Line, Uint64 Bits[LINE_WORDS]) const
+  {
+    Uint32 Row, PixelRow;
+    if (!WindowOpen (Line) || !TextRow (Line, Row, PixelRow))
+      {
+        return false;
+      }
+
+    memset (Bits, 0, LINE_WORDS * sizeof (Uint64));
+    Uint32 Start = DISPLAY_X + (Reg[REG_CONTROL2] & 0x07);
+    Byte Mode = this->Mode ();
+    for (Uint32 Column = 0; Column < 40; Column++)
+      {
+        Uint64 Fore = FetchCell (Row, Column, PixelRow, Mode).Fore;
+        PlaceBits (Bits, Fore << 56, Start + Column * 8);
+      }
+    return true;
+  }
+
+  /** ORs left aligned Value into Bits starting at pixel X */
+  static void
+  PlaceBits (Uint64 *Bits, Uint64 Value, Uint32 X)
+  {
+    Uint32 Shift = X & 63;
+    Bits[X >> 6] |= Value >> Shift;
+    if (Shift)
+      {
+        Bits[(X >> 6) + 1] |= Value << (64 - Shift);
+      }
+  }
+
+  void
+  LatchCollisions (const Collisions &Hit)
+  {
+    // The interrupt only fires for the first collision since the last
+    // read of the register
+    if (Hit.Sprites)
+      {
+        if (!Reg[REG_SPRITE_SPRITE])
+          {
+            Reg[REG_IRQ] |= IRQ_SPRITE_SPRITE;
+          }
+        Reg[REG_SPRITE_SPRITE] |= Hit.Sprites;
+      }
+    if (Hit.Background)
+      {
+        if (!Reg[REG_SPRITE_BACKGROUND])
+          {
+            Reg[REG_IRQ] |= IRQ_SPRITE_BACKGROUND;
+          }
+        Reg[REG_SPRITE_BACKGROUND] |= Hit.Background;
+      }
+    UpdateIrq ();
+  }
+
+  void
+  UpdateIrq ()
+  {
+    if (Reg[REG_IRQ] & Reg[REG_IRQ_ENABLE] & 0x0F)
+      {
+        Reg[REG_IRQ] |= 0x80;
+      }
+    else
+      {
+        Reg[REG_IRQ] &= 0x0F;
+      }
+  }
+
+  /* Kernels. Each has a plain form, used by the reference path and on
+   * hosts without SSE2, and vector forms. */
+
+  template <bool Simd>
+  static void
+  Fill (Uint32 *Out, Uint32 Color, Uint32 Count)
+  {
+    Uint32 i = 0;
+#if defined(__AVX2__)
+    if constexpr (Simd)
+      {
+        __m256i C = _mm256_set1_epi32 (Color);
+        for (; i + 8 <= Count; i += 8)
+          {
+            _mm256_storeu_si256 ((__m256i *)(Out + i), C);
+          }
+      }
+#elif defined(__SSE2__)
+    if constexpr (Simd)
+      {
+        __m128i C = _mm_set1_epi32 (Color);
+        for (; i + 4 <= Count; i += 4)
+          {
+            _mm_storeu_si128 ((__m128i *)(Out + i), C);
+          }
+      }
+#endif
+    for (; i < Count; i++)
+      {
+        Out[i] = Color;
+      }
+  }
+
+  /** Eight pixels from one byte, most significant bit first */
+  template <bool Simd>
+  static void
+  ExpandHires (Byte Bits, Uint32 Fg, Uint32 Bg, Uint32 *Out)
+  {
+#if defined(__AVX2__)
+    if constexpr (Simd)
+      {
+        const __m256i Select
+            = _mm256_setr_epi32 (0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+        __m256i Set = _mm256_cmpeq_epi32 (
+            _mm256_and_si256 (_mm256_set1_epi32 (Bits), Select), Select);
+        _mm256_storeu_si256 ((__m256i *)Out,
+                             _mm256_blendv_epi8 (_mm256_set1_epi32 (Bg),
+                                                 _mm256_set1_epi32 (Fg), Set));
+        return;
+      }
+#elif defined(__SSE2__)
+    if constexpr (Simd)
+      {
+        const __m128i High = _mm_setr_epi32 (0x80, 0x40, 0x20, 0x10);
+        const __m128i Low = _mm_setr_epi32 (0x08, 0x04, 0x02, 0x01);
+        __m128i Value = _mm_set1_epi32 (Bits);
+        __m128i F = _mm_set1_epi32 (Fg);
+        __m128i B = _mm_set1_epi32 (Bg);
+        __m128i SetHigh = _mm_cmpeq_epi32 (_mm_and_si128 (Value, High), High);
+        __m128i SetLow = _mm_cmpeq_epi32 (_mm_and_si128 (Value, Low), Low);
+        _mm_storeu_si128 ((__m128i *)Out, Select128 (SetHigh, F, B));
+        _mm_storeu_si128 ((__m128i *)(Out + 4), Select128 (SetLow, F, B));
+        return;
+      }
+#endif
+    for (Uint32 i = 0; i < 8; i++)
+      {
+        Out[i] = (Bits & (0x80 >> i)) ? Fg : Bg;
+      }
+  }
+
+  /** Eight pixels from four two-bit colour indexes, each shown twice */
+  template <bool Simd>
+  static void
+  ExpandPairs (Byte Bits, const Uint32 Colors[4], Uint32 *Out)
+  {
+#if defined(__AVX2__)
+    if constexpr (Simd)
+      {
+        const __m256i Shift = _mm256_setr_epi32 (6, 6, 4, 4, 2, 2, 0, 0);
+        __m256i Index = _mm256_and_si256 (
+            _mm256_srlv_epi32 (_mm256_set1_epi32 (Bits), Shift),
+            _mm256_set1_epi32 (3));
+        __m256i Table = _mm256_castsi128_si256 (
+            _mm_loadu_si128 ((const __m128i *)Colors));
+        _mm256_storeu_si256 ((__m256i *)Out,
+                             _mm256_permutevar8x32_epi32 (Table, Index));
+        return;
+      }
+#elif defined(__SSE2__)
+    if constexpr (Simd)
+      {
+        __m128i Four = _mm_setr_epi32 (Colors[Bits >> 6], Colors[(Bits >> 4) & 3],
+                                       Colors[(Bits >> 2) & 3], Colors[Bits & 3]);
+        _mm_storeu_si128 ((__m128i *)Out, _mm_unpacklo_epi32 (Four, Four));
+        _mm_storeu_si128 ((__m128i *)(Out + 4), _mm_unpackhi_epi32 (Four, Four));
+        return;
+      }
+#endif
+    for (Uint32 i = 0; i < 4; i++)
+      {
+        Out[i * 2] = Out[i * 2 + 1] = Colors[(Bits >> (6 - i * 2)) & 3];
+      }
+  }
+
+  /** Eight mask bytes, 0xFF for each set bit */
+  template <bool Simd>
+  static void
+  ExpandMask (Byte Bits, Byte *Out)
+  {
+#if defined(__SSE2__)
+    if constexpr (Simd)
+      {
+        const __m128i Select
+            = _mm_setr_epi8 ((char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02,
+                             0x01, 0, 0, 0, 0, 0, 0, 0, 0);
+        __m128i Set = _mm_cmpeq_epi8 (
+            _mm_and_si128 (_mm_set1_epi8 ((char)Bits), Select), Select);
+        _mm_storel_epi64 ((__m128i *)Out, Set);
+        return;
+      }
+#endif
+    for (Uint32 i = 0; i < 8; i++)
+      {
+        Out[i] = (Bits & (0x80 >> i)) ? 0xFF : 0x00;
+      }
+  }
+
+  /** Dst = Src where Mask is set */
+  template <bool Simd>
+  static void
+  Blend (Uint32 *Dst, const Uint32 *Src, const Byte *Mask, Uint32 Count)
+  {
+    Uint32 i = 0;
+#if defined(__SSE2__)
+    if constexpr (Simd)
+      {
+        for (; i + 16 <= Count; i += 16)
+          {
+            Blend16 (Dst + i, Src + i,
+                     _mm_loadu_si128 ((const __m128i *)(Mask + i)));
+          }
+      }
+#endif
+    for (; i < Count; i++)
+      {
+        if (Mask[i])
+          {
+            Dst[i] = Src[i];
+          }
+      }
+  }
+
+  /** Adds one sprite's pixels to the layer masks */
+  template <bool Simd>
+  static void
+  MergeMask (Byte *Opaque, Byte *Behind, const Byte *Mask, Byte Priority,
+             Uint32 Count)
+  {
+    Uint32 i = 0;
+#if defined(__SSE2__)
+    if constexpr (Simd)
+      {
+        __m128i P = _mm_set1_epi8 ((char)Priority);
+        for (; i + 16 <= Count; i += 16)
+          {
+            __m128i M = _mm_loadu_si128 ((const __m128i *)(Mask + i));
+            __m128i O = _mm_loadu_si128 ((const __m128i *)(Opaque + i));
+            __m128i B = _mm_loadu_si128 ((const __m128i *)(Behind + i));
+            _mm_storeu_si128 ((__m128i *)(Opaque + i), _mm_or_si128 (O, M));
+            _mm_storeu_si128 ((__m128i *)(Behind + i), Select128 (M, P, B));
+          }
+      }
+#endif
+    for (; i < Count; i++)
+      {
+        Opaque[i] |= Mask[i];
+        Behind[i] = (Behind[i] & ~Mask[i]) | (Priority & Mask[i]);
+      }
+  }
+
+  /** Draws the sprite layer over the graphics. A sprite pixel with the
+   * priority bit set only shows over background pixels. */
+  template <bool Simd>
+  static void
+  BlendSprites (Uint32 *Dst, const Uint32 *Src, const Byte *Opaque,
+                const Byte *Behind, const Byte *Fore, Uint32 Count)
+  {
+    Uint32 i = 0;
+#if defined(__SSE2__)
+    if constexpr (Simd)
+      {
+        for (; i + 16 <= Count; i += 16)
+          {
+            __m128i O = _mm_loadu_si128 ((const __m128i *)(Opaque + i));
+            __m128i B = _mm_loadu_si128 ((const __m128i *)(Behind + i));
+            __m128i F = _mm_loadu_si128 ((const __m128i *)(Fore + i));
+            __m128i Shown = _mm_andnot_si128 (_mm_and_si128 (B, F), O);
+            if (_mm_movemask_epi8 (Shown))
+              {
+                Blend16 (Dst + i, Src + i, Shown);
+              }
+          }
+      }
+#endif
+    for (; i < Count; i++)
+      {
+        if (Opaque[i] & ~(Behind[i] & Fore[i]))
+          {
+            Dst[i] = Src[i];
+          }
+      }
+  }
+
+#if defined(__SSE2__)
+  static __m128i
+  Select128 (__m128i Mask, __m128i IfSet, __m128i IfClear)
+  {
+    return _mm_or_si128 (_mm_and_si128 (Mask, IfSet),
+                         _mm_andnot_si128 (Mask, IfClear));
+  }
+
+  /** Sixteen pixels of Dst = Src under a byte mask */
+  static void
+  Blend16 (Uint32 *Dst, const Uint32 *Src, __m128i Mask)
+  {
+    __m128i Low = _mm_unpacklo_epi8 (Mask, Mask);
+    __m128i High = _mm_unpackhi_epi8 (Mask, Mask);
+    __m128i Lanes[4] = { _mm_unpacklo_epi16 (Low, Low),
+                         _mm_unpackhi_epi16 (Low, Low),
+                         _mm_unpacklo_epi16 (High, High),
+                         _mm_unpackhi_epi16 (High, High) };
+    for (Uint32 i = 0; i < 4; i++)
+      {
+        __m128i S = _mm_loadu_si128 ((const __m128i *)(Src + i * 4));
+        __m128i D = _mm_loadu_si128 ((const __m128i *)(Dst + i * 4));
+        _mm_storeu_si128 ((__m128i *)(Dst + i * 4), Select128 (Lanes[i], S, D));
+      }
+  }
+#endif
+};
+
+#define VIC_CPP
+#endif // !VIC_CPP
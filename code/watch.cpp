@@ -0,0 +1,155 @@
+#ifndef WATCH_CPP
+
+#include "cpu.h"
+#include <string.h>
+
+/* Breakpoints and watchpoints.
+ *
+ * Like debug registers on real hardware there is a fixed number of slots.
+ * Each slot covers an address range and any mix of execute, read and
+ * write. A 256-entry page filter holds the OR of the kinds set on each
+ * page, so an access to an unwatched page costs one byte load; the exact
+ * slot lookup only runs on pages that have something set.
+ */
+struct Watchpoints
+{
+  static constexpr Byte WATCH_EXEC = 0x01;
+  static constexpr Byte WATCH_READ = 0x02;
+  static constexpr Byte WATCH_WRITE = 0x04;
+
+  static constexpr Uint32 MAX_WATCHES = 64;
+
+  struct Slot
+  {
+    Word First;
+    Word Last;
+    Byte Kinds;
+  };
+
+  Slot Slots[MAX_WATCHES];
+  Uint32 Count = 0;
+  Uint32 Breakpoints = 0; // Slots with WATCH_EXEC set
+  Byte PageFilter[256] = {};
+
+  // Last hit, valid after the CPU stopped on a watchpoint
+  Word HitAddress = 0;
+  Byte HitKind = 0;
+
+  /** Adds a watch over First..Last inclusive. Returns false when all
+   * slots are in use. */
+  bool
+  Add (Word First, Word Last, Byte Kinds)
+  {
+    if (Count == MAX_WATCHES || First > Last || Kinds == 0)
+      {
+        return false;
+      }
+
+    Slots[Count++] = { First, Last, Kinds };
+    if (Kinds & WATCH_EXEC)
+      {
+        Breakpoints++;
+      }
+    for (Uint32 Page = First >> 8; Page <= (Uint32)(Last >> 8); Page++)
+      {
+        PageFilter[Page] |= Kinds;
+      }
+    return true;
+  }
+
+  bool AddBreakpoint (Word Address) { return Add (Address, Address, WATCH_EXEC); }
+
+  /** Removes one slot exactly matching First..Last and Kinds */
+  void
+  Remove (Word First, Word Last, Byte Kinds)
+  {
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        const Slot &S = Slots[i];
+        if (S.First == First && S.Last == Last && S.Kinds == Kinds)
+          {
+            Slots[i] = Slots[--Count];
+            break;
+          }
+      }
+    RebuildFilter ();
+  }
+
+  void
+  Clear ()
+  {
+    Count = 0;
+    RebuildFilter ();
+  }
+
+  bool HasBreakpoints () const { return Breakpoints != 0; }
+
+  /** Exact check of one access. Sets HitAddress/HitKind on a hit. */
+  bool
+  Check (Word Address, Byte Kind)
+  {
+    if (!(PageFilter[Address >> 8] & Kind))
+      {
+        return false;
+      }
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        const Slot &S = Slots[i];
+        if ((S.Kinds & Kind) && Address >= S.First && Address <= S.Last)
+          {
+            HitAddress = Address;
+            HitKind = Kind;
+            return true;
+          }
+      }
+    return false;
+  }
+
+  /** True if any breakpoint lies within First..Last */
+  bool
+  AnyBreakpointIn (Word First, Word Last) const
+  {
+    bool OnPage = false;
+    for (Uint32 Page = First >> 8; Page <= (Uint32)(Last >> 8); Page++)
+      {
+        OnPage |= (PageFilter[Page] & WATCH_EXEC) != 0;
+      }
+    if (!OnPage)
+      {
+        return false;
+      }
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        const Slot &S = Slots[i];
+        if ((S.Kinds & WATCH_EXEC) && S.First <= Last && S.Last >= First)
+          {
+            return true;
+          }
+      }
+    return false;
+  }
+
+private:
+  void
+  RebuildFilter ()
+  {
+    memset (PageFilter, 0, sizeof (PageFilter));
+    Breakpoints = 0;
+    for (Uint32 i = 0; i < Count; i++)
+      {
+        const Slot &S = Slots[i];
+        if (S.Kinds & WATCH_EXEC)
+          {
+            Breakpoints++;
+          }
+        for (Uint32 Page = S.First >> 8; Page <= (Uint32)(S.Last >> 8);
+             Page++)
+          {
+            PageFilter[Page] |= S.Kinds;
+          }
+      }
+  }
+};
+
+#define WATCH_CPP
+#endif // !WATCH_CPP
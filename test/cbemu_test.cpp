@@ -1,11 +1,22 @@
+#include "../code/analyze.cpp"
+#include "../code/audio.cpp"
+#include "../code/basic.cpp"
+#include "../code/capture.cpp"
 #include "../code/cpu.cpp"
+#include "../code/machine.cpp"
+#include "../code/pacer.cpp"
+#include "../code/pool.cpp"
+#include "../code/prg.cpp"
+#include "../code/resample.cpp"
+#include "../code/share.cpp"
 #include <gtest/gtest.h>
 
+template <typename Variant>
 class cbemuTest : public testing::Test
 {
 public:
   Memory mem;
-  CPU cpu;
+  CPUCore<Variant> cpu;
 
   virtual void
   SetUp ()
@@ -18,8 +29,13 @@ public:
   }
 };
 
+// Every instruction test runs against each CPU variant
+typedef testing::Types<NMOS6502, MOS6510, CMOS65C02> CPUVariants;
+TYPED_TEST_SUITE (cbemuTest, CPUVariants);
+
+template <typename Variant>
 static void
-VerifyUnmodifiedFlags (CPU cpu, CPU cpuCopy)
+VerifyUnmodifiedFlags (CPUCore<Variant> cpu, CPUCore<Variant> cpuCopy)
 {
   EXPECT_EQ (cpu.V, cpuCopy.V);
   EXPECT_EQ (cpu.D, cpuCopy.D);
@@ -28,13 +44,15 @@ VerifyUnmodifiedFlags (CPU cpu, CPU cpuCopy)
   EXPECT_EQ (cpu.B, cpuCopy.B);
 }
 
-TEST_F (cbemuTest, LDAImmediate)
+TYPED_TEST (cbemuTest, LDAImmediate)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   mem[0xFFFC] = INS_LDA_IM;
   mem[0xFFFD] = 0x77;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
   constexpr Sint32 EXPECTED_CYCLES = 2;
 
   // when:
@@ -47,14 +65,16 @@ TEST_F (cbemuTest, LDAImmediate)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDAZeroPage)
+TYPED_TEST (cbemuTest, LDAZeroPage)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   mem[0xFFFC] = INS_LDA_ZP;
   mem[0xFFFD] = 0x42;
   mem[0x0042] = 0x37;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
   constexpr Sint32 EXPECTED_CYCLES = 3;
 
   // when:
@@ -68,15 +88,17 @@ TEST_F (cbemuTest, LDAZeroPage)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDAZeroPageX)
+TYPED_TEST (cbemuTest, LDAZeroPageX)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.X = 0x02;
   mem[0xFFFC] = INS_LDA_ZPX;
   mem[0xFFFD] = 0x04;
   mem[0x0006] = 0x37;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
   constexpr Sint32 EXPECTED_CYCLES = 4;
 
   // when:
@@ -89,15 +111,17 @@ TEST_F (cbemuTest, LDAZeroPageX)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDAZeroPageXBoundaryCheck)
+TYPED_TEST (cbemuTest, LDAZeroPageXBoundaryCheck)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.X = 0xFF;
   mem[0xFFFC] = INS_LDA_ZPX;
   mem[0xFFFD] = 0x80;
   mem[0x007F] = 0x37;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
   constexpr Sint32 EXPECTED_CYCLES = 4;
 
   // when:
@@ -110,14 +134,16 @@ TEST_F (cbemuTest, LDAZeroPageXBoundaryCheck)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDAImmediateZeroValue)
+TYPED_TEST (cbemuTest, LDAImmediateZeroValue)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.A = 0x44;
   mem[0xFFFC] = INS_LDA_IM;
   mem[0xFFFD] = 0x0;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
   constexpr Sint32 EXPECTED_CYCLES = 2;
 
   // when:
@@ -131,8 +157,10 @@ TEST_F (cbemuTest, LDAImmediateZeroValue)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDAAbsolute)
+TYPED_TEST (cbemuTest, LDAAbsolute)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   mem[0xFFFC] = INS_LDA_ABS;
@@ -140,7 +168,7 @@ TEST_F (cbemuTest, LDAAbsolute)
   mem[0xFFFE] = 0x44; // 0x4480
   mem[0x4480] = 0x77;
   constexpr Sint32 EXPECTED_CYCLES = 4;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
   //
   // when:
   Sint32 CyclesUsed = cpu.Execute (mem);
@@ -151,8 +179,10 @@ TEST_F (cbemuTest, LDAAbsolute)
   EXPECT_FALSE (cpu.N);
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
-TEST_F (cbemuTest, LDAAbsoluteX)
+TYPED_TEST (cbemuTest, LDAAbsoluteX)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.X = 1;
@@ -161,7 +191,7 @@ TEST_F (cbemuTest, LDAAbsoluteX)
   mem[0xFFFE] = 0x44; // 0x4480
   mem[0x4481] = 0x77;
   constexpr Sint32 EXPECTED_CYCLES = 4;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
 
   // when:
   Sint32 CyclesUsed = cpu.Execute (mem);
@@ -174,8 +204,10 @@ TEST_F (cbemuTest, LDAAbsoluteX)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDAAbsoluteXBoundary)
+TYPED_TEST (cbemuTest, LDAAbsoluteXBoundary)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.X = 0xFF;
@@ -184,7 +216,7 @@ TEST_F (cbemuTest, LDAAbsoluteXBoundary)
   mem[0xFFFE] = 0x44; // 0x4480
   mem[0x457F] = 0x77;
   constexpr Sint32 EXPECTED_CYCLES = 5;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
 
   // when:
   Sint32 CyclesUsed = cpu.Execute (mem);
@@ -197,8 +229,10 @@ TEST_F (cbemuTest, LDAAbsoluteXBoundary)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDAAbsoluteY)
+TYPED_TEST (cbemuTest, LDAAbsoluteY)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.Y = 1;
@@ -207,7 +241,7 @@ TEST_F (cbemuTest, LDAAbsoluteY)
   mem[0xFFFE] = 0x44; // 0x4480
   mem[0x4481] = 0x77;
   constexpr Sint32 EXPECTED_CYCLES = 4;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
 
   // when:
   Sint32 CyclesUsed = cpu.Execute (mem);
@@ -220,8 +254,10 @@ TEST_F (cbemuTest, LDAAbsoluteY)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDAAbsoluteYBoundary)
+TYPED_TEST (cbemuTest, LDAAbsoluteYBoundary)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.Y = 0xFF;
@@ -230,7 +266,7 @@ TEST_F (cbemuTest, LDAAbsoluteYBoundary)
   mem[0xFFFE] = 0x44; // 0x4480
   mem[0x457F] = 0x77;
   constexpr Sint32 EXPECTED_CYCLES = 5;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
 
   // when:
   Sint32 CyclesUsed = cpu.Execute (mem);
@@ -243,8 +279,10 @@ TEST_F (cbemuTest, LDAAbsoluteYBoundary)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDAIndirectX)
+TYPED_TEST (cbemuTest, LDAIndirectX)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.X = 4;
@@ -254,7 +292,7 @@ TEST_F (cbemuTest, LDAIndirectX)
   mem[0x0007] = 0x80;
   mem[0x8000] = 0x77;
   constexpr Sint32 EXPECTED_CYCLES = 6;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
 
   // when:
   Sint32 CyclesUsed = cpu.Execute (mem);
@@ -267,8 +305,10 @@ TEST_F (cbemuTest, LDAIndirectX)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDAIndirectY)
+TYPED_TEST (cbemuTest, LDAIndirectY)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.Y = 0x04;
@@ -278,7 +318,7 @@ TEST_F (cbemuTest, LDAIndirectY)
   mem[0x0003] = 0x80;
   mem[0x8004] = 0x77;
   constexpr Sint32 EXPECTED_CYCLES = 5;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
 
   // when:
   Sint32 CyclesUsed = cpu.Execute (mem);
@@ -291,8 +331,10 @@ TEST_F (cbemuTest, LDAIndirectY)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDAAIndirectYBoundary)
+TYPED_TEST (cbemuTest, LDAAIndirectYBoundary)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.Y = 0xFF;
@@ -302,7 +344,7 @@ TEST_F (cbemuTest, LDAAIndirectYBoundary)
   mem[0x0003] = 0x44;
   mem[0x457F] = 0x77;
   constexpr Sint32 EXPECTED_CYCLES = 6;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
 
   // when:
   Sint32 CyclesUsed = cpu.Execute (mem);
@@ -315,13 +357,15 @@ TEST_F (cbemuTest, LDAAIndirectYBoundary)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDXImmediate)
+TYPED_TEST (cbemuTest, LDXImmediate)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   mem[0xFFFC] = INS_LDX_IM;
   mem[0xFFFD] = 0x77;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
   constexpr Sint32 EXPECTED_CYCLES = 2;
 
   // when:
@@ -334,14 +378,16 @@ TEST_F (cbemuTest, LDXImmediate)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDXZeroPage)
+TYPED_TEST (cbemuTest, LDXZeroPage)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   mem[0xFFFC] = INS_LDX_ZP;
   mem[0xFFFD] = 0x42;
   mem[0x0042] = 0x37;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
   constexpr Sint32 EXPECTED_CYCLES = 3;
 
   // when:
@@ -355,15 +401,17 @@ TEST_F (cbemuTest, LDXZeroPage)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDXZeroPageY)
+TYPED_TEST (cbemuTest, LDXZeroPageY)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.Y = 0x04;
   mem[0xFFFC] = INS_LDX_ZPY;
   mem[0xFFFD] = 0x06;
   mem[0x000A] = 0x37;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
   constexpr Sint32 EXPECTED_CYCLES = 4;
 
   // when:
@@ -376,15 +424,17 @@ TEST_F (cbemuTest, LDXZeroPageY)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDXZeroPageYBoundaryCheck)
+TYPED_TEST (cbemuTest, LDXZeroPageYBoundaryCheck)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.Y = 0xFF;
   mem[0xFFFC] = INS_LDX_ZPY;
   mem[0xFFFD] = 0x80;
   mem[0x007F] = 0x37;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
   constexpr Sint32 EXPECTED_CYCLES = 4;
 
   // when:
@@ -397,8 +447,10 @@ TEST_F (cbemuTest, LDXZeroPageYBoundaryCheck)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDXAbsolute)
+TYPED_TEST (cbemuTest, LDXAbsolute)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   mem[0xFFFC] = INS_LDX_ABS;
@@ -406,7 +458,7 @@ TEST_F (cbemuTest, LDXAbsolute)
   mem[0xFFFE] = 0x44; // 0x4480
   mem[0x4480] = 0x77;
   constexpr Sint32 EXPECTED_CYCLES = 4;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
   //
   // when:
   Sint32 CyclesUsed = cpu.Execute (mem);
@@ -418,8 +470,10 @@ TEST_F (cbemuTest, LDXAbsolute)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDXAbsoluteY)
+TYPED_TEST (cbemuTest, LDXAbsoluteY)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.Y = 1;
@@ -428,7 +482,7 @@ TEST_F (cbemuTest, LDXAbsoluteY)
   mem[0xFFFE] = 0x44; // 0x4480
   mem[0x4481] = 0x77;
   constexpr Sint32 EXPECTED_CYCLES = 4;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
 
   // when:
   Sint32 CyclesUsed = cpu.Execute (mem);
@@ -441,8 +495,10 @@ TEST_F (cbemuTest, LDXAbsoluteY)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDXAbsoluteYBoundary)
+TYPED_TEST (cbemuTest, LDXAbsoluteYBoundary)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.Y = 0xFF;
@@ -451,7 +507,7 @@ TEST_F (cbemuTest, LDXAbsoluteYBoundary)
   mem[0xFFFE] = 0x44; // 0x4480
   mem[0x457F] = 0x77;
   constexpr Sint32 EXPECTED_CYCLES = 5;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
 
   // when:
   Sint32 CyclesUsed = cpu.Execute (mem);
@@ -463,13 +519,15 @@ TEST_F (cbemuTest, LDXAbsoluteYBoundary)
   EXPECT_FALSE (cpu.N);
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
-TEST_F (cbemuTest, LDYImmediate)
+TYPED_TEST (cbemuTest, LDYImmediate)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   mem[0xFFFC] = INS_LDY_IM;
   mem[0xFFFD] = 0x77;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
   constexpr Sint32 EXPECTED_CYCLES = 2;
 
   // when:
@@ -482,14 +540,16 @@ TEST_F (cbemuTest, LDYImmediate)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDYZeroPage)
+TYPED_TEST (cbemuTest, LDYZeroPage)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   mem[0xFFFC] = INS_LDY_ZP;
   mem[0xFFFD] = 0x42;
   mem[0x0042] = 0x37;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
   constexpr Sint32 EXPECTED_CYCLES = 3;
 
   // when:
@@ -503,15 +563,17 @@ TEST_F (cbemuTest, LDYZeroPage)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDYZeroPageX)
+TYPED_TEST (cbemuTest, LDYZeroPageX)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.X = 0x04;
   mem[0xFFFC] = INS_LDY_ZPX;
   mem[0xFFFD] = 0x06;
   mem[0x000A] = 0x37;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
   constexpr Sint32 EXPECTED_CYCLES = 4;
 
   // when:
@@ -524,15 +586,17 @@ TEST_F (cbemuTest, LDYZeroPageX)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDYZeroPageXBoundaryCheck)
+TYPED_TEST (cbemuTest, LDYZeroPageXBoundaryCheck)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.X = 0xFF;
   mem[0xFFFC] = INS_LDY_ZPX;
   mem[0xFFFD] = 0x80;
   mem[0x007F] = 0x37;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
   constexpr Sint32 EXPECTED_CYCLES = 4;
 
   // when:
@@ -545,8 +609,10 @@ TEST_F (cbemuTest, LDYZeroPageXBoundaryCheck)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDYAbsolute)
+TYPED_TEST (cbemuTest, LDYAbsolute)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   mem[0xFFFC] = INS_LDY_ABS;
@@ -554,7 +620,7 @@ TEST_F (cbemuTest, LDYAbsolute)
   mem[0xFFFE] = 0x44; // 0x4480
   mem[0x4480] = 0x77;
   constexpr Sint32 EXPECTED_CYCLES = 4;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
   //
   // when:
   Sint32 CyclesUsed = cpu.Execute (mem);
@@ -566,8 +632,10 @@ TEST_F (cbemuTest, LDYAbsolute)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDYAbsoluteX)
+TYPED_TEST (cbemuTest, LDYAbsoluteX)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.X = 1;
@@ -576,7 +644,7 @@ TEST_F (cbemuTest, LDYAbsoluteX)
   mem[0xFFFE] = 0x44; // 0x4480
   mem[0x4481] = 0x77;
   constexpr Sint32 EXPECTED_CYCLES = 4;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
 
   // when:
   Sint32 CyclesUsed = cpu.Execute (mem);
@@ -589,8 +657,10 @@ TEST_F (cbemuTest, LDYAbsoluteX)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, LDYAbsoluteXBoundary)
+TYPED_TEST (cbemuTest, LDYAbsoluteXBoundary)
 {
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
 
   // given:
   cpu.X = 0xFF;
@@ -599,7 +669,7 @@ TEST_F (cbemuTest, LDYAbsoluteXBoundary)
   mem[0xFFFE] = 0x44; // 0x4480
   mem[0x457F] = 0x77;
   constexpr Sint32 EXPECTED_CYCLES = 5;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
 
   // when:
   Sint32 CyclesUsed = cpu.Execute (mem);
@@ -612,7 +682,125 @@ TEST_F (cbemuTest, LDYAbsoluteXBoundary)
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
 
-TEST_F (cbemuTest, JMPAbsolutePCContainsAddress){
+TYPED_TEST (cbemuTest, STAZeroPage)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+
+  // given:
+  cpu.A = 0x2F;
+  mem[0xFFFC] = INS_STA_ZP;
+  mem[0xFFFD] = 0x42;
+  CPUCore<TypeParam> cpuCopy = cpu;
+  constexpr Sint32 EXPECTED_CYCLES = 3;
+
+  // when:
+  Sint32 CyclesUsed = cpu.Execute (mem);
+
+  // then:
+  EXPECT_EQ (mem[0x0042], 0x2F);
+  EXPECT_EQ (CyclesUsed, EXPECTED_CYCLES);
+  EXPECT_EQ (cpu.Z, cpuCopy.Z);
+  EXPECT_EQ (cpu.N, cpuCopy.N);
+  VerifyUnmodifiedFlags (cpu, cpuCopy);
+}
+
+TYPED_TEST (cbemuTest, STAAbsoluteXAlwaysTakesFiveCycles)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+
+  // given:
+  cpu.A = 0x37;
+  cpu.X = 0x01;
+  mem[0xFFFC] = INS_STA_ABX;
+  mem[0xFFFD] = 0x80;
+  mem[0xFFFE] = 0x44;
+  CPUCore<TypeParam> cpuCopy = cpu;
+  constexpr Sint32 EXPECTED_CYCLES = 5;
+
+  // when:
+  Sint32 CyclesUsed = cpu.Execute (mem);
+
+  // then:
+  EXPECT_EQ (mem[0x4481], 0x37);
+  EXPECT_EQ (CyclesUsed, EXPECTED_CYCLES);
+  EXPECT_EQ (cpu.PageCrossCycles, 0u);
+  VerifyUnmodifiedFlags (cpu, cpuCopy);
+}
+
+TYPED_TEST (cbemuTest, STAIndirectY)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+
+  // given:
+  cpu.A = 0x37;
+  cpu.Y = 0xFF;
+  mem[0xFFFC] = INS_STA_IDY;
+  mem[0xFFFD] = 0x02;
+  mem[0x0002] = 0x02;
+  mem[0x0003] = 0x80;
+  CPUCore<TypeParam> cpuCopy = cpu;
+  constexpr Sint32 EXPECTED_CYCLES = 6;
+
+  // when:
+  Sint32 CyclesUsed = cpu.Execute (mem);
+
+  // then:
+  EXPECT_EQ (mem[0x8101], 0x37);
+  EXPECT_EQ (CyclesUsed, EXPECTED_CYCLES);
+  VerifyUnmodifiedFlags (cpu, cpuCopy);
+}
+
+TYPED_TEST (cbemuTest, STXZeroPageYWraps)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+
+  // given:
+  cpu.X = 0x42;
+  cpu.Y = 0xFF;
+  mem[0xFFFC] = INS_STX_ZPY;
+  mem[0xFFFD] = 0x80;
+  CPUCore<TypeParam> cpuCopy = cpu;
+  constexpr Sint32 EXPECTED_CYCLES = 4;
+
+  // when:
+  Sint32 CyclesUsed = cpu.Execute (mem);
+
+  // then:
+  EXPECT_EQ (mem[0x007F], 0x42);
+  EXPECT_EQ (CyclesUsed, EXPECTED_CYCLES);
+  VerifyUnmodifiedFlags (cpu, cpuCopy);
+}
+
+TYPED_TEST (cbemuTest, STYAbsolute)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+
+  // given:
+  cpu.Y = 0x99;
+  mem[0xFFFC] = INS_STY_ABS;
+  mem[0xFFFD] = 0x80;
+  mem[0xFFFE] = 0x44;
+  CPUCore<TypeParam> cpuCopy = cpu;
+  constexpr Sint32 EXPECTED_CYCLES = 4;
+
+  // when:
+  Sint32 CyclesUsed = cpu.Execute (mem);
+
+  // then:
+  EXPECT_EQ (mem[0x4480], 0x99);
+  EXPECT_EQ (CyclesUsed, EXPECTED_CYCLES);
+  VerifyUnmodifiedFlags (cpu, cpuCopy);
+}
+
+TYPED_TEST (cbemuTest, JMPAbsolutePCContainsAddress)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
   // given:
   cpu.A = 0x0;
   mem[0xFFFC] = INS_JMP_ABS;
@@ -624,7 +812,7 @@ TEST_F (cbemuTest, JMPAbsolutePCContainsAddress){
   mem[0x8044] = 0x77;
 
   constexpr Sint32 EXPECTED_CYCLES = 7;
-  CPU cpuCopy = cpu;
+  CPUCore<TypeParam> cpuCopy = cpu;
 
   // when:
   Sint32 CyclesUsed = cpu.Execute (mem);
@@ -637,3 +825,3243 @@ TEST_F (cbemuTest, JMPAbsolutePCContainsAddress){
   EXPECT_FALSE (cpu.N);
   VerifyUnmodifiedFlags (cpu, cpuCopy);
 }
+
+TYPED_TEST (cbemuTest, JMPIndirect)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+
+  // given:
+  mem[0xFFFC] = INS_JMP_IND;
+  mem[0xFFFD] = 0x20;
+  mem[0xFFFE] = 0x30; // 0x3020
+  mem[0x3020] = 0x80;
+  mem[0x3021] = 0x44;
+  constexpr Sint32 EXPECTED_CYCLES = TypeParam::JmpIndirectWraps ? 5 : 6;
+
+  // when:
+  Sint32 CyclesUsed = cpu.Execute (mem);
+
+  // then:
+  EXPECT_EQ (cpu.PC, 0x4480);
+  EXPECT_EQ (CyclesUsed, EXPECTED_CYCLES);
+  EXPECT_EQ (CyclesUsed, cpu.Opcodes[INS_JMP_IND].Cycles);
+}
+
+TYPED_TEST (cbemuTest, JMPIndirectPageBoundary)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+
+  // given:
+  mem[0xFFFC] = INS_JMP_IND;
+  mem[0xFFFD] = 0xFF;
+  mem[0xFFFE] = 0x30; // 0x30FF
+  mem[0x30FF] = 0x80;
+  mem[0x3000] = 0x12; // High byte on NMOS parts
+  mem[0x3100] = 0x44; // High byte on the 65C02
+
+  // when:
+  cpu.Execute (mem);
+
+  // then:
+  EXPECT_EQ (cpu.PC, TypeParam::JmpIndirectWraps ? 0x1280 : 0x4480);
+}
+
+TYPED_TEST (cbemuTest, JSRAndRTSReturnThroughTheStackPage)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+
+  // given:
+  mem[0xFFFC] = INS_JSR;
+  mem[0xFFFD] = 0x80;
+  mem[0xFFFE] = 0x44;
+  mem[0x4480] = INS_RTS;
+
+  // when:
+  Sint32 CallCycles = cpu.Execute (mem);
+  Byte Pushed[2] = { mem[0x01FF], mem[0x01FE] };
+  Byte CalledSP = cpu.SP;
+  Sint32 ReturnCycles = cpu.Execute (mem);
+
+  // then: the return address less one, high byte first
+  EXPECT_EQ (Pushed[0], 0xFF);
+  EXPECT_EQ (Pushed[1], 0xFE);
+  EXPECT_EQ (CalledSP, 0xFD);
+  EXPECT_EQ (cpu.SP, 0xFF);
+  EXPECT_EQ (cpu.PC, 0xFFFF);
+  EXPECT_EQ (CallCycles, 6);
+  EXPECT_EQ (ReturnCycles, 6);
+  EXPECT_EQ (ReturnCycles, cpu.Opcodes[INS_RTS].Cycles);
+}
+
+TYPED_TEST (cbemuTest, RTIPullsTheStatusThenTheReturnAddress)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+
+  // given: an interrupt's frame, status on top
+  cpu.SP = 0xFC;
+  mem[0x01FD] = 0xC3; // N V - - - - Z C
+  mem[0x01FE] = 0x34;
+  mem[0x01FF] = 0x12;
+  mem[0xFFFC] = INS_RTI;
+
+  // when:
+  Sint32 Cycles = cpu.Execute (mem);
+
+  // then: to the address as pulled, not one past it
+  EXPECT_EQ (cpu.PC, 0x1234);
+  EXPECT_EQ (cpu.SP, 0xFF);
+  EXPECT_EQ (cpu.GetStatus (), 0xC3 | 0x20);
+  EXPECT_EQ (Cycles, 6);
+  EXPECT_EQ (Cycles, cpu.Opcodes[INS_RTI].Cycles);
+}
+
+TYPED_TEST (cbemuTest, ADCImmediateOverflow)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+
+  // given:
+  cpu.A = 0x50;
+  mem[0xFFFC] = INS_ADC_IM;
+  mem[0xFFFD] = 0x50;
+  constexpr Sint32 EXPECTED_CYCLES = 2;
+
+  // when:
+  Sint32 CyclesUsed = cpu.Execute (mem);
+
+  // then:
+  EXPECT_EQ (cpu.A, 0xA0);
+  EXPECT_EQ (CyclesUsed, EXPECTED_CYCLES);
+  EXPECT_TRUE (cpu.V);
+  EXPECT_TRUE (cpu.N);
+  EXPECT_FALSE (cpu.C);
+  EXPECT_FALSE (cpu.Z);
+}
+
+TYPED_TEST (cbemuTest, SBCZeroPageBorrow)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+
+  // given:
+  cpu.A = 0x10;
+  cpu.C = 1;
+  mem[0xFFFC] = INS_SBC_ZP;
+  mem[0xFFFD] = 0x42;
+  mem[0x0042] = 0x20;
+  constexpr Sint32 EXPECTED_CYCLES = 3;
+
+  // when:
+  Sint32 CyclesUsed = cpu.Execute (mem);
+
+  // then:
+  EXPECT_EQ (cpu.A, 0xF0);
+  EXPECT_EQ (CyclesUsed, EXPECTED_CYCLES);
+  EXPECT_FALSE (cpu.C);
+  EXPECT_FALSE (cpu.V);
+  EXPECT_TRUE (cpu.N);
+}
+
+TYPED_TEST (cbemuTest, ADCDecimalMode)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+
+  // given: 99 + 01 = 00, carry out
+  cpu.A = 0x99;
+  cpu.D = 1;
+  mem[0xFFFC] = INS_ADC_ABS;
+  mem[0xFFFD] = 0x80;
+  mem[0xFFFE] = 0x44;
+  mem[0x4480] = 0x01;
+  constexpr bool CMOS = TypeParam::DecimalFlagsValid;
+
+  // when:
+  Sint32 CyclesUsed = cpu.Execute (mem);
+
+  // then:
+  EXPECT_EQ (cpu.A, 0x00);
+  EXPECT_TRUE (cpu.C);
+  EXPECT_EQ (CyclesUsed, CMOS ? 5 : 4);
+  // NMOS flags come from the binary sum ($9A) and uncorrected digits
+  EXPECT_EQ (cpu.Z, CMOS ? 1 : 0);
+  EXPECT_EQ (cpu.N, CMOS ? 0 : 1);
+}
+
+TYPED_TEST (cbemuTest, SBCDecimalMode)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+
+  // given: 00 - 01 = 99, borrow out
+  cpu.A = 0x00;
+  cpu.C = 1;
+  cpu.D = 1;
+  mem[0xFFFC] = INS_SBC_IM;
+  mem[0xFFFD] = 0x01;
+  constexpr bool CMOS = TypeParam::DecimalFlagsValid;
+
+  // when:
+  Sint32 CyclesUsed = cpu.Execute (mem);
+
+  // then:
+  EXPECT_EQ (cpu.A, 0x99);
+  EXPECT_FALSE (cpu.C);
+  EXPECT_TRUE (cpu.N);
+  EXPECT_FALSE (cpu.Z);
+  EXPECT_EQ (CyclesUsed, CMOS ? 3 : 2);
+}
+
+TYPED_TEST (cbemuTest, LAXZeroPageUndocumented)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+
+  // given:
+  mem[0xFFFC] = INS_LAX_ZP;
+  mem[0xFFFD] = 0x42;
+  mem[0x0042] = 0x37;
+
+  // when:
+  Sint32 CyclesUsed = cpu.Execute (mem);
+
+  // then:
+  if (TypeParam::Undocumented)
+    {
+      EXPECT_EQ (cpu.A, 0x37);
+      EXPECT_EQ (cpu.X, 0x37);
+      EXPECT_EQ (cpu.PC, 0xFFFE);
+      EXPECT_EQ (CyclesUsed, 3);
+    }
+  else
+    {
+      EXPECT_EQ (cpu.A, 0x00);
+      EXPECT_EQ (cpu.X, 0x00);
+      EXPECT_EQ (cpu.PC, 0xFFFD);
+      EXPECT_EQ (CyclesUsed, 1);
+    }
+}
+
+TYPED_TEST (cbemuTest, ProcessorPortOnlyOn6510)
+{
+  Memory &mem = this->mem;
+
+  // then:
+  EXPECT_EQ (mem[0x0001], TypeParam::HasIOPort ? 0x07 : 0x00);
+}
+
+TYPED_TEST (cbemuTest, CoverageMarksExecutedAndReadAddresses)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+  // given:
+  Coverage cov;
+  cov.Clear ();
+  cpu.Hooks.Cov = &cov;
+  mem[0xFFFC] = INS_JMP_ABS;
+  mem[0xFFFD] = 0x80;
+  mem[0xFFFE] = 0x44;
+  mem[0x4480] = INS_LDA_ABS;
+  mem[0x4481] = 0x44;
+  mem[0x4482] = 0x80;
+  mem[0x8044] = 0x77;
+
+  // when:
+  cpu.Execute (mem);
+  cpu.Execute (mem);
+
+  // then:
+  EXPECT_EQ (cpu.A, 0x77);
+  EXPECT_TRUE (cov.WasExecuted (0xFFFC));
+  EXPECT_TRUE (cov.WasExecuted (0x4480));
+  EXPECT_FALSE (cov.WasExecuted (0x4481));
+  EXPECT_TRUE (cov.WasRead (0x8044));
+  EXPECT_FALSE (cov.WasRead (0x4480));
+  EXPECT_FALSE (cov.WasWritten (0x8044));
+}
+
+TYPED_TEST (cbemuTest, CoverageWritesRangeListing)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+  // given:
+  Coverage cov;
+  cov.Clear ();
+  cpu.Hooks.Cov = &cov;
+  cpu.X = 0x01;
+  mem[0xFFFC] = INS_LDA_ABX;
+  mem[0xFFFD] = 0x80;
+  mem[0xFFFE] = 0x44;
+  mem[0x4481] = 0x77;
+
+  // when:
+  cpu.Execute (mem);
+  cov.MarkRead (0x4482);
+  cov.MarkRead (0x4483);
+  char Listing[256] = { 0 };
+  FILE *File = tmpfile ();
+  ASSERT_NE (File, nullptr);
+  cov.WriteRanges (File);
+  rewind (File);
+  fread (Listing, 1, sizeof (Listing) - 1, File);
+  fclose (File);
+
+  // then:
+  EXPECT_STREQ (Listing, "X FFFC-FFFC\nR 4481-4483\n");
+}
+
+static void
+LoadLoopProgram (Memory &mem)
+{
+  // JMP $4480; $4480: LDA #$01; LDX #$02; LDY #$03; JMP $4480
+  mem[0xFFFC] = INS_JMP_ABS;
+  mem[0xFFFD] = 0x80;
+  mem[0xFFFE] = 0x44;
+  mem[0x4480] = INS_LDA_IM;
+  mem[0x4481] = 0x01;
+  mem[0x4482] = INS_LDX_IM;
+  mem[0x4483] = 0x02;
+  mem[0x4484] = INS_LDY_IM;
+  mem[0x4485] = 0x03;
+  mem[0x4486] = INS_JMP_ABS;
+  mem[0x4487] = 0x80;
+  mem[0x4488] = 0x44;
+}
+
+TYPED_TEST (cbemuTest, RunWithoutHooksStopsOnBudget)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+  // given:
+  LoadLoopProgram (mem);
+
+  // when:
+  Sint32 CyclesUsed = cpu.Run (mem, 100);
+
+  // then:
+  EXPECT_GE (CyclesUsed, 100);
+  EXPECT_EQ (cpu.Stop, STOP_BUDGET);
+  EXPECT_EQ (cpu.Y, 0x03);
+}
+
+TYPED_TEST (cbemuTest, BreakpointInsideBlockStopsBeforeInstruction)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+  // given:
+  Watchpoints watch;
+  watch.AddBreakpoint (0x4484);
+  cpu.Hooks.Watch = &watch;
+  LoadLoopProgram (mem);
+
+  // when:
+  cpu.Run (mem, 1000);
+
+  // then:
+  EXPECT_EQ (cpu.Stop, STOP_BREAKPOINT);
+  EXPECT_EQ (cpu.PC, 0x4484);
+  EXPECT_EQ (cpu.A, 0x01);
+  EXPECT_EQ (cpu.X, 0x02);
+  EXPECT_EQ (cpu.Y, 0x00);
+
+  // and resuming steps over the breakpoint until it comes round again
+  cpu.Run (mem, 1000);
+  EXPECT_EQ (cpu.Stop, STOP_BREAKPOINT);
+  EXPECT_EQ (cpu.PC, 0x4484);
+  EXPECT_EQ (cpu.Y, 0x03);
+}
+
+TYPED_TEST (cbemuTest, TrapStopsRunWithoutHooksAndBeforeBreakpoints)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+  // given:
+  LoadLoopProgram (mem);
+  EXPECT_TRUE (cpu.AddTrap (0x4484));
+
+  // when:
+  cpu.Run (mem, 1000);
+
+  // then: no hooks needed
+  EXPECT_FALSE (cpu.Hooks.Active ());
+  EXPECT_EQ (cpu.Stop, STOP_TRAP);
+  EXPECT_EQ (cpu.PC, 0x4484);
+  EXPECT_EQ (cpu.Y, 0x00);
+
+  // and resuming steps over it until it comes round again
+  cpu.Run (mem, 1000);
+  EXPECT_EQ (cpu.Stop, STOP_TRAP);
+  EXPECT_EQ (cpu.PC, 0x4484);
+  EXPECT_EQ (cpu.Y, 0x03);
+
+  // when: a breakpoint at the same address, and one past it
+  Watchpoints watch;
+  watch.AddBreakpoint (0x4484);
+  watch.AddBreakpoint (0x4486);
+  cpu.Hooks.Watch = &watch;
+  cpu.Run (mem, 1000);
+  StopReason Passed = cpu.Stop;
+  Word PassedAt = cpu.PC;
+  cpu.Run (mem, 1000);
+
+  // then: the trap comes first
+  EXPECT_EQ (Passed, STOP_BREAKPOINT);
+  EXPECT_EQ (PassedAt, 0x4486);
+  EXPECT_EQ (cpu.Stop, STOP_TRAP);
+  EXPECT_EQ (cpu.PC, 0x4484);
+
+  // when: removed
+  cpu.RemoveTrap (0x4484);
+  cpu.Hooks.Watch = nullptr;
+  cpu.Run (mem, 1000);
+
+  // then:
+  EXPECT_EQ (cpu.Stop, STOP_BUDGET);
+  EXPECT_EQ (cpu.TrapCount, 0u);
+}
+
+TYPED_TEST (cbemuTest, ReadWatchpointStopsRunWithReason)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+  // given:
+  Watchpoints watch;
+  watch.Add (0x8040, 0x8047, Watchpoints::WATCH_READ);
+  cpu.Hooks.Watch = &watch;
+  mem[0xFFFC] = INS_LDA_ABS;
+  mem[0xFFFD] = 0x44;
+  mem[0xFFFE] = 0x80;
+  mem[0x8044] = 0x77;
+
+  // when:
+  cpu.Run (mem, 1000);
+
+  // then:
+  EXPECT_EQ (cpu.Stop, STOP_READ_WATCH);
+  EXPECT_EQ (watch.HitAddress, 0x8044);
+  EXPECT_EQ (cpu.A, 0x77);
+}
+
+TYPED_TEST (cbemuTest, BreakpointAfterWatchpointStopFiresOnResume)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+  // given: LDA $8044 at $4480, then INX and JMP $4483
+  Watchpoints watch;
+  watch.Add (0x8044, 0x8044, Watchpoints::WATCH_READ);
+  watch.AddBreakpoint (0x4483);
+  cpu.Hooks.Watch = &watch;
+  mem[0xFFFC] = INS_JMP_ABS;
+  mem[0xFFFD] = 0x80;
+  mem[0xFFFE] = 0x44;
+  mem[0x4480] = INS_LDA_ABS;
+  mem[0x4481] = 0x44;
+  mem[0x4482] = 0x80;
+  mem[0x4483] = INS_INX;
+  mem[0x4484] = INS_JMP_ABS;
+  mem[0x4485] = 0x83;
+  mem[0x4486] = 0x44;
+
+  // when:
+  cpu.Run (mem, 1000);
+  StopReason First = cpu.Stop;
+  Word FirstAt = cpu.PC;
+  cpu.Run (mem, 1000);
+
+  // then: the watchpoint left PC on the breakpoint, which still fires
+  EXPECT_EQ (First, STOP_READ_WATCH);
+  EXPECT_EQ (FirstAt, 0x4483);
+  EXPECT_EQ (cpu.Stop, STOP_BREAKPOINT);
+  EXPECT_EQ (cpu.PC, 0x4483);
+  EXPECT_EQ (cpu.X, 0x00);
+}
+
+TYPED_TEST (cbemuTest, BreakpointAtThePCOfTheFirstRunFires)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+  // given:
+  Watchpoints watch;
+  watch.AddBreakpoint (0xFFFC);
+  cpu.Hooks.Watch = &watch;
+  mem[0xFFFC] = INS_JMP_ABS;
+  mem[0xFFFD] = 0x00;
+  mem[0xFFFE] = 0x10;
+
+  // when:
+  cpu.Run (mem, 100);
+
+  // then:
+  EXPECT_EQ (cpu.Stop, STOP_BREAKPOINT);
+  EXPECT_EQ (cpu.PC, 0xFFFC);
+
+  // and a trap there fires first, without hooks too
+  cpu.Hooks.Watch = nullptr;
+  cpu.Stop = STOP_NONE;
+  cpu.AddTrap (0xFFFC);
+  cpu.Run (mem, 100);
+  EXPECT_EQ (cpu.Stop, STOP_TRAP);
+  EXPECT_EQ (cpu.PC, 0xFFFC);
+}
+
+TYPED_TEST (cbemuTest, WatchpointOnSamePageOnlyHitsExactRange)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+  // given:
+  Watchpoints watch;
+  watch.Add (0x8050, 0x8050, Watchpoints::WATCH_READ);
+  cpu.Hooks.Watch = &watch;
+  mem[0xFFFC] = INS_LDA_ABS;
+  mem[0xFFFD] = 0x44;
+  mem[0xFFFE] = 0x80;
+
+  // when:
+  cpu.Execute (mem);
+
+  // then:
+  EXPECT_EQ (cpu.Stop, STOP_NONE);
+}
+
+static int
+ConnectMonitor (const char *Path)
+{
+  int Fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un Addr = {};
+  Addr.sun_family = AF_UNIX;
+  strcpy (Addr.sun_path, Path);
+  if (connect (Fd, (sockaddr *)&Addr, sizeof (Addr)) < 0)
+    {
+      close (Fd);
+      return -1;
+    }
+  return Fd;
+}
+
+static void
+SendMonitorRequest (int Fd, Byte Command, Uint32 Id, const Byte *Body,
+                    Uint32 Length)
+{
+  Byte Header[11] = { MON_STX, MON_API_VERSION };
+  for (int i = 0; i < 4; i++)
+    {
+      Header[2 + i] = (Byte)(Length >> (i * 8));
+      Header[6 + i] = (Byte)(Id >> (i * 8));
+    }
+  Header[10] = Command;
+  send (Fd, Header, sizeof (Header), 0);
+  send (Fd, Body, Length, 0);
+}
+
+struct MonitorResponse
+{
+  Byte Type;
+  Byte Error;
+  Uint32 Id;
+  Uint32 Length;
+  Byte Body[256];
+};
+
+static bool
+ReadMonitorResponse (int Fd, MonitorResponse &Response)
+{
+  Byte Header[12];
+  if (recv (Fd, Header, sizeof (Header), MSG_WAITALL) != sizeof (Header))
+    {
+      return false;
+    }
+  Response.Length = Header[2] | (Header[3] << 8) | (Header[4] << 16)
+                    | (Header[5] << 24);
+  Response.Type = Header[6];
+  Response.Error = Header[7];
+  Response.Id = Header[8] | (Header[9] << 8) | (Header[10] << 16)
+                | ((Uint32)Header[11] << 24);
+  return Response.Length <= sizeof (Response.Body)
+         && recv (Fd, Response.Body, Response.Length, MSG_WAITALL)
+                == (ssize_t)Response.Length;
+}
+
+TEST (MonitorTest, ServesMemoryAndRegistersFromFrameSnapshot)
+{
+  // given:
+  Machine *machine = new Machine;
+  Monitor *mon = new Monitor;
+  char Path[64];
+  snprintf (Path, sizeof (Path), "/tmp/cbemu_test_%d.sock", getpid ());
+  machine->Reset ();
+  LoadLoopProgram (machine->Mem);
+  machine->Mem[0x8044] = 0x77;
+  machine->Mon = mon;
+  ASSERT_TRUE (mon->Start (Path));
+
+  // when:
+  std::atomic<bool> Done{ false };
+  MonitorResponse Memory = {}, Registers = {};
+  std::thread Client ([&] {
+    int Fd = ConnectMonitor (Path);
+    const Byte Get[8] = { 0, 0x44, 0x80, 0x45, 0x80, 0, 0, 0 };
+    SendMonitorRequest (Fd, MON_CMD_MEMORY_GET, 7, Get, sizeof (Get));
+    ReadMonitorResponse (Fd, Memory);
+    const Byte Space[1] = { 0 };
+    SendMonitorRequest (Fd, MON_CMD_REGISTERS_GET, 8, Space, 1);
+    ReadMonitorResponse (Fd, Registers);
+    close (Fd);
+    Done.store (true);
+  });
+  while (!Done.load ())
+    {
+      machine->RunFrame ();
+    }
+  Client.join ();
+  mon->Stop ();
+
+  // then:
+  EXPECT_EQ (Memory.Type, MON_CMD_MEMORY_GET);
+  EXPECT_EQ (Memory.Error, MON_OK);
+  EXPECT_EQ (Memory.Id, 7u);
+  ASSERT_EQ (Memory.Length, 4u);
+  EXPECT_EQ (Memory.Body[0], 2);
+  EXPECT_EQ (Memory.Body[2], 0x77);
+  EXPECT_EQ (Memory.Body[3], 0x00);
+
+  EXPECT_EQ (Registers.Error, MON_OK);
+  ASSERT_EQ (Registers.Length, 2u + 6 * 4);
+  EXPECT_EQ (Registers.Body[0], 6);
+  EXPECT_EQ (Registers.Body[2 + 2 * 4 + 1], MON_REG_Y);
+  EXPECT_EQ (Registers.Body[2 + 2 * 4 + 2], 0x03);
+
+  delete mon;
+  delete machine;
+}
+
+TEST (MonitorTest, QueuedCheckpointStopsRunLoop)
+{
+  // given:
+  Machine *machine = new Machine;
+  Monitor *mon = new Monitor;
+  char Path[64];
+  snprintf (Path, sizeof (Path), "/tmp/cbemu_test_cp_%d.sock", getpid ());
+  machine->Reset ();
+  LoadLoopProgram (machine->Mem);
+  machine->Mon = mon;
+  ASSERT_TRUE (mon->Start (Path));
+
+  // when:
+  std::atomic<bool> Done{ false };
+  MonitorResponse Info = {}, Stopped = {}, Exit = {};
+  std::thread Client ([&] {
+    int Fd = ConnectMonitor (Path);
+    const Byte Set[8] = { 0x84, 0x44, 0x84, 0x44, 1, 1, MON_OP_EXEC, 0 };
+    SendMonitorRequest (Fd, MON_CMD_CHECKPOINT_SET, 1, Set, sizeof (Set));
+    ReadMonitorResponse (Fd, Info);
+    ReadMonitorResponse (Fd, Stopped);
+    SendMonitorRequest (Fd, MON_CMD_EXIT, 2, nullptr, 0);
+    ReadMonitorResponse (Fd, Exit);
+    close (Fd);
+    Done.store (true);
+  });
+  while (!Done.load ())
+    {
+      machine->RunFrame ();
+    }
+  Client.join ();
+  mon->Stop ();
+
+  // then:
+  EXPECT_EQ (Info.Type, MON_RESPONSE_CHECKPOINT_INFO);
+  EXPECT_EQ (Info.Error, MON_OK);
+  EXPECT_EQ (Stopped.Type, MON_RESPONSE_STOPPED);
+  EXPECT_EQ (Stopped.Id, MON_EVENT_ID);
+  EXPECT_EQ (Stopped.Body[0] | (Stopped.Body[1] << 8), 0x4484);
+  EXPECT_EQ (Exit.Error, MON_OK);
+
+  delete mon;
+  delete machine;
+}
+
+TYPED_TEST (cbemuTest, PageCrossPenaltyCyclesAreCounted)
+{
+  Memory &mem = this->mem;
+  CPUCore<TypeParam> &cpu = this->cpu;
+  // given:
+  cpu.X = 0xFF;
+  mem[0xFFFC] = INS_LDA_ABX;
+  mem[0xFFFD] = 0x80;
+  mem[0xFFFE] = 0x44;
+
+  // when:
+  cpu.Execute (mem);
+
+  // then:
+  EXPECT_EQ (cpu.Instructions, 1u);
+  EXPECT_EQ (cpu.PageCrossCycles, 1u);
+}
+
+/* Runs the program at $1000 to the JMP-to-self at End twice: through
+ * Run in Slice cycle budgets, which may finish loops natively, and one
+ * instruction at a time, which never does. Expects the same memory,
+ * registers, flags and counters. Returns the loops run natively. */
+template <typename Variant>
+static Uint64
+ExpectLoopsMatchInterpreter (void (*Load) (Memory &), Word End,
+                             Sint32 Slice)
+{
+  Memory *Fast = new Memory;
+  Memory *Slow = new Memory;
+  CPUCore<Variant> *Native = new CPUCore<Variant>;
+  CPUCore<Variant> *Stepped = new CPUCore<Variant>;
+  Native->Reset (*Fast);
+  Stepped->Reset (*Slow);
+  Load (*Fast);
+  Load (*Slow);
+  (*Fast)[End] = (*Slow)[End] = INS_JMP_ABS;
+  (*Fast)[End + 1] = (*Slow)[End + 1] = End & 0xFF;
+  (*Fast)[End + 2] = (*Slow)[End + 2] = End >> 8;
+  Native->PC = Stepped->PC = 0x1000;
+
+  for (Uint32 i = 0; i < 100000 && Native->PC != End; i++)
+    {
+      Native->Run (*Fast, Slice);
+    }
+  for (Uint32 i = 0; i < 1000000 && Stepped->PC != End; i++)
+    {
+      Stepped->Execute (*Slow);
+    }
+
+  // Run may have gone round the JMP at End a few times; catch up
+  EXPECT_EQ (Native->PC, End);
+  EXPECT_EQ (Stepped->PC, End);
+  while (Stepped->Instructions < Native->Instructions)
+    {
+      Stepped->Execute (*Slow);
+    }
+  EXPECT_EQ (Native->Instructions, Stepped->Instructions);
+  EXPECT_EQ (Native->RetiredCycles, Stepped->RetiredCycles);
+  EXPECT_EQ (Native->PageCrossCycles, Stepped->PageCrossCycles);
+  EXPECT_EQ (Native->A, Stepped->A);
+  EXPECT_EQ (Native->X, Stepped->X);
+  EXPECT_EQ (Native->Y, Stepped->Y);
+  EXPECT_EQ (Native->GetStatus (), Stepped->GetStatus ());
+  EXPECT_EQ (memcmp (Fast->Data, Slow->Data, Memory::MAX_MEM), 0);
+  EXPECT_EQ (Stepped->BulkLoops, 0u);
+
+  Uint64 Loops = Native->BulkLoops;
+  delete Native;
+  delete Stepped;
+  delete Fast;
+  delete Slow;
+  return Loops;
+}
+
+/* Copies $80 bytes from $20F0 (crossing a page) with a DEX loop, then
+ * $100 bytes from page $40 to $0400 with an INY loop whose branch back
+ * crosses a page */
+static void
+LoadCopyLoops (Memory &mem)
+{
+  for (Uint32 i = 0; i < 0x300; i++)
+    {
+      mem[0x2000 + i] = (Byte)(i * 11 + 1);
+      mem[0x4000 + i] = (Byte)(i * 5 + 3);
+    }
+  Byte Program[] = { INS_LDX_IM, 0x80,
+                     INS_LDA_ABX, 0xF0, 0x20,
+                     INS_STA_ABX, 0x00, 0x30,
+                     INS_DEX,
+                     INS_BNE, (Byte)-9,
+                     INS_LDY_IM, 0x00,
+                     INS_JMP_ABS, 0xFA, 0x10 };
+  memcpy (&mem[0x1000], Program, sizeof (Program));
+  Byte Crossing[] = { INS_LDA_ABY, 0x00, 0x40,
+                      INS_STA_ABY, 0x00, 0x04,
+                      INS_INY,
+                      INS_BNE, (Byte)-9,
+                      INS_JMP_ABS, 0x00, 0x12 };
+  memcpy (&mem[0x10FA], Crossing, sizeof (Crossing));
+}
+
+static Byte
+IgnoredRead (void *, Word)
+{
+  return 0;
+}
+
+static void
+IgnoredWrite (void *, Word, Byte)
+{
+}
+
+static const IOHandler IGNORED_DEVICE = { IgnoredRead, IgnoredWrite, nullptr };
+
+/* Clears a screen with four stores per INX, then fills device registers,
+ * which has to be interpreted */
+static void
+LoadFillLoops (Memory &mem)
+{
+  mem.MapIO (0xDE, 0xDE, &IGNORED_DEVICE);
+  Byte Program[] = { INS_LDA_IM, 0x20,
+                     INS_LDX_IM, 0x00,
+                     INS_STA_ABX, 0x00, 0x04,
+                     INS_STA_ABX, 0x00, 0x05,
+                     INS_STA_ABX, 0x00, 0x06,
+                     INS_STA_ABX, 0xE8, 0x06,
+                     INS_INX,
+                     INS_BNE, (Byte)-15,
+                     INS_LDA_IM, 0xEA,
+                     INS_LDX_IM, 0x08,
+                     INS_STA_ABX, 0x00, 0xDE,
+                     INS_DEX,
+                     INS_BNE, (Byte)-6,
+                     INS_JMP_ABS, 0x00, 0x20 };
+  memcpy (&mem[0x1000], Program, sizeof (Program));
+}
+
+TYPED_TEST (cbemuTest, CopyLoopsRunNativelyAsTheyWouldInterpreted)
+{
+  // when:
+  Uint64 Loops = ExpectLoopsMatchInterpreter<TypeParam> (LoadCopyLoops,
+                                                         0x1200, 100000);
+  Uint64 Sliced = ExpectLoopsMatchInterpreter<TypeParam> (LoadCopyLoops,
+                                                          0x1200, 63);
+
+  // then: one go per loop, or some goes per raster line
+  EXPECT_EQ (Loops, 2u);
+  EXPECT_GT (Sliced, 4u);
+}
+
+TYPED_TEST (cbemuTest, FillLoopsRunNativelyUnlessTheyStoreToDevices)
+{
+  // when:
+  Uint64 Loops = ExpectLoopsMatchInterpreter<TypeParam> (LoadFillLoops,
+                                                         0x2000, 100000);
+
+  // then: the screen clear only
+  EXPECT_EQ (Loops, 1u);
+}
+
+TYPED_TEST (cbemuTest, StateHashFollowsEveryWriteIncludingNativeLoops)
+{
+  // given:
+  Memory *mem = new Memory;
+  CPUCore<TypeParam> *cpu = new CPUCore<TypeParam>;
+  StateHash Hash;
+  mem->AttachHash (&Hash);
+  cpu->Reset (*mem);
+  LoadCopyLoops (*mem);
+  (*mem)[0x1200] = INS_JMP_ABS;
+  (*mem)[0x1201] = 0x00;
+  (*mem)[0x1202] = 0x12;
+  mem->AttachHash (&Hash); // The loader wrote through operator[]
+  cpu->PC = 0x1000;
+  Uint64 Before = Hash.Value (*cpu);
+
+  // when:
+  for (Uint32 i = 0; i < 1000 && cpu->PC != 0x1200; i++)
+    {
+      cpu->Run (*mem, 100000);
+    }
+
+  // then: the same as hashing memory afresh
+  StateHash Fresh;
+  Fresh.Rehash (mem->Data);
+  EXPECT_GT (cpu->BulkLoops, 0u);
+  EXPECT_EQ (Hash.Bytes, Fresh.Bytes);
+  EXPECT_NE (Hash.Value (*cpu), Before);
+
+  // when: a byte changes and changes back
+  Uint64 After = Hash.Value (*cpu);
+  Byte Old = (*mem)[0x0400];
+  mem->Write (0x0400, Old ^ 0x01);
+  Uint64 Changed = Hash.Value (*cpu);
+  mem->Write (0x0400, Old);
+
+  // then:
+  EXPECT_NE (Changed, After);
+  EXPECT_EQ (Hash.Value (*cpu), After);
+  cpu->X ^= 1;
+  EXPECT_NE (Hash.Value (*cpu), After);
+
+  // when: A has its top bit set, and only PC changes
+  cpu->A = 0x80;
+  Uint64 AtOnePC = Hash.Value (*cpu);
+  cpu->PC ^= 0x0101;
+
+  // then: the registers below PC do not spill into it
+  EXPECT_NE (Hash.Value (*cpu), AtOnePC);
+  delete cpu;
+  delete mem;
+}
+
+TEST (ProfileTest, AttributesCyclesToRoutinesAndCallPaths)
+{
+  // given: two calls of outer, which calls leaf, and one of leaf
+  Memory *mem = new Memory;
+  CPU *cpu = new CPU;
+  cpu->Reset (*mem);
+  Byte Main[] = { INS_JSR, 0x00, 0x11,            // $1000
+                  INS_JSR, 0x00, 0x11,            // $1003
+                  INS_JSR, 0x00, 0x12,            // $1006
+                  INS_JMP_ABS, 0x09, 0x10 };      // $1009
+  Byte Outer[] = { INS_JSR, 0x00, 0x12,           // $1100
+                   INS_RTS };
+  Byte Leaf[] = { INS_LDX_IM, 0x05,               // $1200
+                  INS_DEX,
+                  INS_BNE, (Byte)-3,
+                  INS_RTS };
+  memcpy (&(*mem)[0x1000], Main, sizeof (Main));
+  memcpy (&(*mem)[0x1100], Outer, sizeof (Outer));
+  memcpy (&(*mem)[0x1200], Leaf, sizeof (Leaf));
+  cpu->PC = 0x1000;
+  char Path[64];
+  snprintf (Path, sizeof (Path), "/tmp/cbemu_test_%d.lbl", getpid ());
+  FILE *Labels = fopen (Path, "w");
+  fputs ("al C:1100 .outer\nal 1200 .leaf\nnot a label\n", Labels);
+  fclose (Labels);
+  Profiler *Prof = new Profiler;
+  ASSERT_TRUE (Prof->LoadLabels (Path));
+  unlink (Path);
+  cpu->Hooks.Prof = Prof;
+
+  // when:
+  while (cpu->PC != 0x1009)
+    {
+      cpu->Execute (*mem);
+    }
+
+  // then: leaf takes 2 + 4 * 5 + 4 + 6, outer a JSR and an RTS
+  EXPECT_EQ (Prof->Calls[0x1100], 2u);
+  EXPECT_EQ (Prof->Calls[0x1200], 3u);
+  EXPECT_EQ (Prof->Exclusive[0x1200], 3u * 32);
+  EXPECT_EQ (Prof->Inclusive[0x1200], 3u * 32);
+  EXPECT_EQ (Prof->Exclusive[0x1100], 2u * 12);
+  EXPECT_EQ (Prof->Inclusive[0x1100], 2u * 44);
+  EXPECT_EQ (Prof->Total, cpu->RetiredCycles);
+  EXPECT_EQ (Prof->Total, 3u * 6 + 2 * 12 + 3 * 32);
+
+  char *Text = nullptr;
+  size_t Size = 0;
+  FILE *Out = open_memstream (&Text, &Size);
+  Prof->WriteCollapsed (Out);
+  fclose (Out);
+  EXPECT_STREQ (Text, "[top] 18\nouter 24\nouter;leaf 64\nleaf 32\n");
+  free (Text);
+  delete Prof;
+  delete cpu;
+  delete mem;
+}
+
+TEST (AnalyzeTest, BlocksAndRoutinesCostWhatTheCoreWouldCharge)
+{
+  // given: a copy loop and a call, and a branch back to another page
+  Memory *mem = new Memory;
+  mem->Initialize ();
+  Byte Main[] = { INS_LDX_IM, 0x08,               // $1000
+                  INS_LDA_ABX, 0xF8, 0x20,        // $1002 X unknown here
+                  INS_STA_ABX, 0x00, 0x04,        // $1005
+                  INS_DEX,                        // $1008
+                  INS_BNE, (Byte)-9,              // $1009 to $1002
+                  INS_JSR, 0x20, 0x10,            // $100B
+                  INS_RTS };                      // $100E
+  Byte Callee[] = { INS_LDY_IM, 0x00,             // $1020
+                    INS_LDA_IDY, 0xFB,            // $1022 Y is 0
+                    INS_LDX_IM, 0x10,             // $1024
+                    INS_LDA_ABX, 0xF8, 0x20,      // $1026 crosses
+                    INS_LDA_ABX, 0x00, 0x21,      // $1029 does not
+                    INS_RTS };                    // $102C
+  Byte Far[] = { INS_LDX_IM, 0x01,                // $30FD
+                 INS_BNE, (Byte)-0x11,            // $30FF to $30F0
+                 INS_RTS };                       // $3101
+  memcpy (&(*mem)[0x1000], Main, sizeof (Main));
+  memcpy (&(*mem)[0x1020], Callee, sizeof (Callee));
+  memcpy (&(*mem)[0x30FD], Far, sizeof (Far));
+  (*mem)[0x30F0] = INS_RTS;
+  Word Entries[] = { 0x1000, 0x30FD };
+  CodeAnalysis *Analysis = new CodeAnalysis;
+
+  // when:
+  Analysis->Analyze (*mem, Entries, 2);
+
+  // then: LDX | loop | JSR | RTS, the callee, and three far blocks
+  EXPECT_EQ (Analysis->BlockCount, 8u);
+  EXPECT_EQ (Analysis->RoutineCount, 3u);
+  const CodeAnalysis::Block &Loop
+      = Analysis->Blocks[Analysis->BlockAt[0x1002]];
+  EXPECT_EQ (Loop.Last, 0x1009);
+  EXPECT_EQ (Loop.Instructions, 4u);
+  EXPECT_EQ (Loop.End, END_BRANCH);
+  EXPECT_EQ (Loop.MinCycles, 4u + 5 + 2 + 2);
+  EXPECT_EQ (Loop.Crossings, 1u);
+  EXPECT_EQ (Loop.Taken, 1u);
+  EXPECT_EQ (Analysis->Blocks[Loop.Target].Start, 0x1002);
+  EXPECT_EQ (Analysis->Blocks[Loop.Next].Start, 0x100B);
+
+  const CodeAnalysis::Block &Called
+      = Analysis->Blocks[Analysis->BlockAt[0x1020]];
+  EXPECT_EQ (Called.MinCycles, 2u + 5 + 2 + 4 + 4 + 6);
+  EXPECT_EQ (Called.Penalty, 1u);
+  EXPECT_EQ (Called.Crossings, 1u);
+  EXPECT_EQ (Called.End, END_RETURN);
+
+  const CodeAnalysis::Routine &Sub
+      = Analysis->Routines[Analysis->RoutineAt[0x1020]];
+  EXPECT_EQ (Sub.MinCycles, 23u);
+  EXPECT_EQ (Sub.MaxCycles, 24u);
+  EXPECT_FALSE (Sub.Loops);
+  const CodeAnalysis::Routine &Top
+      = Analysis->Routines[Analysis->RoutineAt[0x1000]];
+  EXPECT_EQ (Top.MinCycles, 2u + 13 + 6 + 23 + 6);
+  EXPECT_EQ (Top.MaxCycles, 2u + 14 + 6 + 24 + 6);
+  EXPECT_TRUE (Top.Loops);
+  EXPECT_FALSE (Top.Open);
+
+  const CodeAnalysis::Block &Branch
+      = Analysis->Blocks[Analysis->BlockAt[0x30FD]];
+  EXPECT_EQ (Branch.Taken, 2u);
+  const CodeAnalysis::Routine &Across
+      = Analysis->Routines[Analysis->RoutineAt[0x30FD]];
+  EXPECT_EQ (Across.MinCycles, 4u + 6);
+  EXPECT_EQ (Across.MaxCycles, 4u + 2 + 6);
+  delete Analysis;
+  delete mem;
+}
+
+TEST (AnalyzeTest, JumpsIntoCodeSplitBlocksAndOpenPathsAreFlagged)
+{
+  // given: a JMP into the middle of a block ending in JMP (ind), a call
+  // that never returns, and a routine calling itself
+  Memory *mem = new Memory;
+  mem->Initialize ();
+  Byte Code[] = { INS_LDA_IM, 0x01,               // $2000
+                  INS_LDA_IM, 0x02,               // $2002
+                  INS_JMP_IND, 0x00, 0x03 };      // $2004
+  Byte Tail[] = { INS_JMP_ABS, 0x02, 0x20 };      // $2020
+  Byte Stuck[] = { INS_JSR, 0x30, 0x20,           // $2028
+                   INS_RTS };
+  Byte Spin[] = { INS_JMP_ABS, 0x30, 0x20 };      // $2030
+  Byte Self[] = { INS_JSR, 0x40, 0x20,            // $2040
+                  INS_RTS };
+  memcpy (&(*mem)[0x2000], Code, sizeof (Code));
+  memcpy (&(*mem)[0x2020], Tail, sizeof (Tail));
+  memcpy (&(*mem)[0x2028], Stuck, sizeof (Stuck));
+  memcpy (&(*mem)[0x2030], Spin, sizeof (Spin));
+  memcpy (&(*mem)[0x2040], Self, sizeof (Self));
+  Word Entries[] = { 0x2000, 0x2020, 0x2028, 0x2040 };
+  CodeAnalysis *Analysis = new CodeAnalysis;
+
+  // when:
+  Analysis->Analyze (*mem, Entries, 4);
+
+  // then:
+  ASSERT_NE (Analysis->BlockAt[0x2002], CodeAnalysis::NONE);
+  EXPECT_EQ (Analysis->Blocks[Analysis->BlockAt[0x2000]].End, END_FALL);
+  EXPECT_EQ (Analysis->Blocks[Analysis->BlockAt[0x2002]].End, END_INDIRECT);
+  const CodeAnalysis::Routine *R = Analysis->Routines;
+  const Uint32 *At = Analysis->RoutineAt;
+  EXPECT_EQ (R[At[0x2000]].MinCycles, 2u + 2 + 5);
+  EXPECT_TRUE (R[At[0x2000]].Open);
+  EXPECT_EQ (R[At[0x2020]].MaxCycles, 3u + 2 + 5);
+  EXPECT_EQ (R[At[0x2030]].MinCycles, CodeAnalysis::NEVER);
+  EXPECT_TRUE (R[At[0x2030]].Loops);
+  EXPECT_EQ (R[At[0x2028]].MinCycles, CodeAnalysis::NEVER);
+  EXPECT_EQ (R[At[0x2040]].MinCycles, 6u + 6);
+  EXPECT_TRUE (R[At[0x2040]].Open);
+  delete Analysis;
+  delete mem;
+}
+
+TEST (StateSetTest, InsertsOnceAndGrowsPastItsFirstCapacity)
+{
+  // given:
+  StateSet *Set = new StateSet;
+  const Uint64 Count = 3 * StateSet::MIN_CAPACITY;
+
+  // when:
+  Uint64 Added = 0;
+  for (Uint64 i = 0; i < Count; i++)
+    {
+      Added += Set->Insert (StateHash::Mix (i + 1));
+    }
+  Added += Set->Insert (0);
+
+  // then:
+  EXPECT_EQ (Added, Count + 1);
+  EXPECT_EQ (Set->Count, Count + 1);
+  EXPECT_FALSE (Set->Insert (StateHash::Mix (Count / 2)));
+  EXPECT_FALSE (Set->Insert (0));
+  EXPECT_TRUE (Set->Contains (StateHash::Mix (Count)));
+  EXPECT_FALSE (Set->Contains (StateHash::Mix (Count + 1)));
+  EXPECT_GE (Set->Footprint (), Count * 4 / 3 * sizeof (Uint64));
+  EXPECT_EQ (Set->Dropped, 0u);
+
+  // when:
+  Set->Clear ();
+
+  // then:
+  EXPECT_EQ (Set->Count, 0u);
+  EXPECT_FALSE (Set->Contains (StateHash::Mix (1)));
+  EXPECT_TRUE (Set->Insert (StateHash::Mix (1)));
+  delete Set;
+}
+
+TEST (PerfTest, FramesPublishCountersAndPrometheusText)
+{
+  // given:
+  Machine *machine = new Machine;
+  machine->Reset ();
+  LoadLoopProgram (machine->Mem);
+  char Path[64];
+  snprintf (Path, sizeof (Path), "/tmp/cbemu_test_%d.prom", getpid ());
+
+  // when:
+  machine->RunFrame ();
+  machine->RunFrame ();
+  PerfSnapshot S = machine->Perf.Read ();
+  bool Written
+      = machine->Perf.WritePrometheus (Path, "test", Machine::PAL_CLOCK_HZ);
+
+  // then:
+  EXPECT_EQ (S.Frames, 2u);
+  EXPECT_GE (S.Cycles, 2u * Machine::PAL_CYCLES_PER_FRAME);
+  EXPECT_EQ (S.Instructions, machine->Cpu.Instructions);
+  EXPECT_GT (S.Ipc (), 0.0);
+  EXPECT_GT (S.FrameHostNs, 0u);
+  ASSERT_TRUE (Written);
+
+  char Text[4096] = { 0 };
+  FILE *File = fopen (Path, "r");
+  ASSERT_NE (File, nullptr);
+  fread (Text, 1, sizeof (Text) - 1, File);
+  fclose (File);
+  unlink (Path);
+  EXPECT_NE (strstr (Text, "# TYPE cbemu_cycles_total counter\n"), nullptr);
+  EXPECT_NE (strstr (Text, "cbemu_frames_total{instance=\"test\"} 2\n"),
+             nullptr);
+
+  delete machine;
+}
+
+TEST (PacerTest, FrameDeadlinesDoNotDrift)
+{
+  // given:
+  Pacer pacer;
+  pacer.Start (VIDEO_PAL.ClockHz, VIDEO_PAL.CyclesPerFrame ());
+
+  // then: ClockHz frames take exactly CyclesPerFrame seconds
+  Uint64 Count = VIDEO_PAL.ClockHz;
+  EXPECT_EQ (pacer.FrameOffset (Count),
+             VIDEO_PAL.CyclesPerFrame () * 1000000000ull);
+  EXPECT_EQ (pacer.FrameOffset (1), 19950306u);
+}
+
+TEST (PacerTest, PacesFramesAndLeavingWarpReanchors)
+{
+  // given:
+  Pacer pacer;
+  pacer.Start (VIDEO_PAL.ClockHz, VIDEO_PAL.CyclesPerFrame ());
+
+  // when:
+  Uint64 Start = HostNanoseconds ();
+  for (int i = 0; i < 5; i++)
+    {
+      pacer.FrameDone ();
+    }
+  Uint64 Paced = HostNanoseconds () - Start;
+
+  pacer.SetWarp (true);
+  Start = HostNanoseconds ();
+  for (int i = 0; i < 1000; i++)
+    {
+      pacer.FrameDone ();
+    }
+  Uint64 Warped = HostNanoseconds () - Start;
+  pacer.SetWarp (false);
+
+  // then:
+  EXPECT_GE (Paced, pacer.FrameOffset (5));
+  EXPECT_LT (Warped, pacer.FrameOffset (1));
+  EXPECT_EQ (pacer.Frames, 0u);
+  EXPECT_GE (pacer.Origin, Start + Warped);
+}
+
+/* Standard text screen at $0400 with the character set at $1000 */
+static void
+LoadTextScreen (Memory &mem, VIC &vic)
+{
+  vic.Write (0xD011, 0x1B);
+  vic.Write (0xD016, 0x08);
+  vic.Write (0xD018, 0x14);
+  vic.Write (0xD020, 0x0E);
+  vic.Write (0xD021, 0x06);
+  mem[0x0400] = 0x01;
+  mem[0x1008] = 0x81; // Top row of character 1
+  mem[0xD800] = 0x02;
+}
+
+TEST (VicTest, TextModeDrawsCharacterInsideBorder)
+{
+  // given:
+  Memory mem;
+  mem.Initialize ();
+  VIC *vic = new VIC;
+  vic->Reset (mem, VIDEO_PAL);
+  LoadTextScreen (mem, *vic);
+
+  // when: 51 is the first line of character row 0 with YSCROLL 3
+  vic->RenderLine (51);
+
+  // then:
+  const Uint32 *Row = vic->Row (51);
+  EXPECT_EQ (Row[0], VIC_PALETTE[0x0E]);
+  EXPECT_EQ (Row[VIC::DISPLAY_X - 1], VIC_PALETTE[0x0E]);
+  EXPECT_EQ (Row[VIC::DISPLAY_X], VIC_PALETTE[0x02]);
+  EXPECT_EQ (Row[VIC::DISPLAY_X + 1], VIC_PALETTE[0x06]);
+  EXPECT_EQ (Row[VIC::DISPLAY_X + 7], VIC_PALETTE[0x02]);
+  EXPECT_EQ (Row[VIC::DISPLAY_X + 8], VIC_PALETTE[0x06]);
+  EXPECT_EQ (Row[VIC::DISPLAY_X + 320], VIC_PALETTE[0x0E]);
+
+  // and blanking the screen leaves only the border
+  vic->Write (0xD011, 0x0B);
+  vic->RenderLine (51);
+  EXPECT_EQ (Row[VIC::DISPLAY_X], VIC_PALETTE[0x0E]);
+
+  delete vic;
+}
+
+TEST (VicTest, SpriteBehindForegroundOnlyCoversBackground)
+{
+  // given: sprite 0 solid on its top row, over the text of row 0
+  Memory mem;
+  mem.Initialize ();
+  VIC *vic = new VIC;
+  vic->Reset (mem, VIDEO_PAL);
+  LoadTextScreen (mem, *vic);
+  mem[0x07F8] = 0x20; // Sprite 0 data at $0800
+  mem[0x0800] = 0xFF;
+  mem[0x0801] = 0xFF;
+  mem[0x0802] = 0xFF;
+  vic->Write (0xD000, 24); // Left edge of the display window
+  vic->Write (0xD001, 51);
+  vic->Write (0xD015, 0x01);
+  vic->Write (0xD01B, 0x01);
+  vic->Write (0xD027, 0x07);
+
+  // when:
+  vic->RenderLine (51);
+
+  // then:
+  const Uint32 *Row = vic->Row (51);
+  EXPECT_EQ (Row[VIC::DISPLAY_X], VIC_PALETTE[0x02]);
+  EXPECT_EQ (Row[VIC::DISPLAY_X + 1], VIC_PALETTE[0x07]);
+  EXPECT_EQ (Row[VIC::DISPLAY_X + 23], VIC_PALETTE[0x07]);
+  EXPECT_EQ (Row[VIC::DISPLAY_X + 24], VIC_PALETTE[0x06]);
+
+  delete vic;
+}
+
+TEST (VicTest, VectorKernelsMatchScalarReference)
+{
+  // given: random video memory, then every display mode and a spread of
+  // scroll, border and sprite settings
+  Memory mem;
+  VIC *vic = new VIC;
+  vic->Reset (mem, VIDEO_PAL);
+  Uint32 Seed = 12345;
+  auto Random = [&Seed] () {
+    Seed = Seed * 1103515245 + 12345;
+    return (Byte)(Seed >> 16);
+  };
+  for (Uint32 i = 0; i < Memory::MAX_MEM; i++)
+    {
+      mem.Data[i] = Random ();
+    }
+
+  Uint32 *Expected = new Uint32[VIC::HEIGHT * VIC::WIDTH];
+  for (Uint32 Mode = 0; Mode < 8; Mode++)
+    {
+      for (Uint32 Setup = 0; Setup < 4; Setup++)
+        {
+          for (Byte R = 0; R < 0x2F; R++)
+            {
+              vic->Write (0xD000 + R, Random ());
+            }
+          vic->Write (0xD011,
+                      ((Mode & 6) << 4) | 0x10 | (Random () & 0x0F));
+          vic->Write (0xD016, ((Mode & 1) << 4) | (Random () & 0x0F));
+          vic->Write (0xD015, 0xFF);
+          vic->Write (0xD001 + Setup * 2, 60); // At least one on screen
+
+          // when:
+          for (Uint32 Line = 0; Line < VIDEO_PAL.Lines; Line++)
+            {
+              vic->RenderLineScalar (Line);
+            }
+          memcpy (Expected, vic->Frame, sizeof (vic->Frame));
+          for (Uint32 Line = 0; Line < VIDEO_PAL.Lines; Line++)
+            {
+              vic->RenderLine (Line);
+            }
+
+          // then:
+          ASSERT_EQ (memcmp (Expected, vic->Frame, sizeof (vic->Frame)), 0)
+              << "mode " << Mode << " setup " << Setup;
+        }
+    }
+
+  delete[] Expected;
+  delete vic;
+}
+
+TEST (VicTest, CollisionMasksMatchPerPixelReference)
+{
+  // given: random video memory and registers with every sprite enabled
+  Memory mem;
+  VIC *vic = new VIC;
+  vic->Reset (mem, VIDEO_PAL);
+  Uint32 Seed = 4242;
+  auto Random = [&Seed] () {
+    Seed = Seed * 1103515245 + 12345;
+    return (Byte)(Seed >> 16);
+  };
+  for (Uint32 i = 0; i < Memory::MAX_MEM; i++)
+    {
+      mem.Data[i] = Random () & Random (); // Sparse enough to miss
+    }
+
+  Uint32 Hits = 0;
+  for (Uint32 Setup = 0; Setup < 64; Setup++)
+    {
+      for (Byte R = 0; R < 0x2F; R++)
+        {
+          vic->Write (0xD000 + R, Random ());
+        }
+      vic->Write (0xD011, (Random () & 0x6F) | 0x10);
+      vic->Write (0xD015, 0xFF);
+      for (Uint32 Sprite = 0; Sprite < 8; Sprite++)
+        {
+          vic->Write (0xD001 + Sprite * 2, 40 + (Random () & 0x7F));
+        }
+
+      for (Uint32 Line = 0; Line < VIDEO_PAL.Lines; Line++)
+        {
+          // when:
+          VIC::Collisions Fast = vic->Collide (Line);
+          VIC::Collisions Reference = vic->CollideScalar (Line);
+
+          // then:
+          ASSERT_EQ (Fast.Sprites, Reference.Sprites)
+              << "setup " << Setup << " line " << Line;
+          ASSERT_EQ (Fast.Background, Reference.Background)
+              << "setup " << Setup << " line " << Line;
+          Hits += (Fast.Sprites != 0) + (Fast.Background != 0);
+        }
+    }
+  EXPECT_GT (Hits, 0u);
+
+  delete vic;
+}
+
+TEST (VicTest, CollisionRegistersLatchUntilRead)
+{
+  // given: sprites 0 and 1 overlapping on their top row, clear of any
+  // text
+  Memory mem;
+  mem.Initialize ();
+  VIC *vic = new VIC;
+  vic->Reset (mem, VIDEO_PAL);
+  LoadTextScreen (mem, *vic);
+  mem[0x07F8] = 0x20;
+  mem[0x07F9] = 0x20;
+  mem[0x0800] = 0x80;
+  vic->Write (0xD000, 100);
+  vic->Write (0xD001, 100);
+  vic->Write (0xD002, 100);
+  vic->Write (0xD003, 100);
+  vic->Write (0xD015, 0x03);
+  vic->Write (0xD01A, VIC::IRQ_SPRITE_SPRITE);
+
+  // when:
+  for (Uint32 Line = 0; Line < VIDEO_PAL.Lines; Line++)
+    {
+      vic->EndLine (false);
+    }
+
+  // then:
+  EXPECT_EQ (vic->Read (0xD019), 0xF4);
+  EXPECT_EQ (vic->Read (0xD01E), 0x03);
+  EXPECT_EQ (vic->Read (0xD01E), 0x00);
+  EXPECT_EQ (vic->Read (0xD01F), 0x00);
+  vic->Write (0xD019, VIC::IRQ_SPRITE_SPRITE);
+  EXPECT_EQ (vic->Read (0xD019), 0x70);
+
+  delete vic;
+}
+
+TEST (VicTest, StallTablesFollowControlAndSpriteRegisters)
+{
+  // given:
+  Memory mem;
+  VIC *vic = new VIC;
+  vic->Reset (mem, VIDEO_PAL);
+
+  // when: screen on with YSCROLL 3
+  vic->Write (0xD011, 0x1B);
+
+  // then: BA from cycle 11 to the last character fetch at 53
+  ASSERT_EQ (vic->Stalls (0x33).Count, 1);
+  EXPECT_EQ (vic->Stalls (0x33).Windows[0].Start, 11);
+  EXPECT_EQ (vic->Stalls (0x33).Windows[0].Length, 43);
+  EXPECT_EQ (vic->Stalls (0x34).Count, 0);
+
+  // and a new YSCROLL moves the badlines
+  vic->Write (0xD011, 0x1C);
+  EXPECT_EQ (vic->Stalls (0x33).Count, 0);
+  EXPECT_EQ (vic->Stalls (0x34).Count, 1);
+
+  // and eight sprites take 19 cycles on the lines they are shown
+  vic->Write (0xD011, 0x0B);
+  for (Uint32 Sprite = 0; Sprite < 8; Sprite++)
+    {
+      vic->Write (0xD001 + Sprite * 2, 100);
+    }
+  vic->Write (0xD015, 0xFF);
+  const VIC::LineStalls &Sprites = vic->Stalls (100);
+  Uint32 Stolen = 0;
+  for (Uint32 i = 0; i < Sprites.Count; i++)
+    {
+      Stolen += Sprites.Windows[i].Length;
+    }
+  EXPECT_EQ (Stolen, 19u);
+  EXPECT_EQ (vic->Stalls (121).Count, 0);
+
+  delete vic;
+}
+
+TEST (VicTest, BadlinesBlockTheCpuForTheirWindows)
+{
+  // given:
+  Machine *machine = new Machine;
+  machine->Reset ();
+  LoadLoopProgram (machine->Mem);
+  machine->Vic.Write (0xD011, 0x1B);
+
+  // when:
+  machine->RunFrame ();
+
+  // then: 25 character rows, 43 cycles each
+  EXPECT_EQ (machine->Events.BlockedCycles, 25u * 43);
+  EXPECT_GE (machine->Clock, (Uint64)Machine::PAL_CYCLES_PER_FRAME);
+  EXPECT_EQ (machine->Vic.Raster, 0u);
+
+  delete machine;
+}
+
+TEST (VicTest, SteppingAcrossBadlinesMatchesRunFrame)
+{
+  // given: two machines with the screen on
+  Machine *Run = new Machine;
+  Machine *Stepped = new Machine;
+  for (Machine *machine : { Run, Stepped })
+    {
+      machine->Reset ();
+      LoadLoopProgram (machine->Mem);
+      machine->Vic.Write (0xD011, 0x1B);
+    }
+
+  // when: one runs the frame, the other steps through it
+  Run->RunFrame ();
+  while (Stepped->Clock < Stepped->FrameEnd)
+    {
+      Stepped->Step (1);
+    }
+
+  // then: the same stalls, at the same instructions
+  EXPECT_EQ (Stepped->Events.BlockedCycles, 25u * 43);
+  EXPECT_EQ (Stepped->Events.BlockedCycles, Run->Events.BlockedCycles);
+  EXPECT_EQ (Stepped->Clock, Run->Clock);
+  EXPECT_EQ (Stepped->Cpu.Instructions, Run->Cpu.Instructions);
+  EXPECT_EQ (Stepped->Cpu.PC, Run->Cpu.PC);
+  EXPECT_EQ (Stepped->Vic.Raster, Run->Vic.Raster);
+
+  delete Stepped;
+  delete Run;
+}
+
+TEST (VicTest, MachineRendersLinesUnlessWarping)
+{
+  // given: a store to the border colour, then an endless loop
+  Machine *machine = new Machine;
+  machine->Reset ();
+  LoadLoopProgram (machine->Mem);
+  machine->Mem[0xFFFC] = INS_LDA_IM;
+  machine->Mem[0xFFFD] = 0x05;
+  machine->Mem[0xFFFE] = INS_STA_ABS;
+  machine->Mem[0xFFFF] = 0x20;
+  machine->Mem[0x0000] = 0xD0;
+  machine->Mem[0x0001] = INS_JMP_ABS;
+  machine->Mem[0x0002] = 0x80;
+  machine->Mem[0x0003] = 0x44;
+
+  // when:
+  machine->Warp = true;
+  machine->RunFrame ();
+  bool Untouched = machine->Vic.Row (VIC::FIRST_LINE)[0] == 0;
+  machine->Warp = false;
+  machine->RunFrame ();
+
+  // then:
+  EXPECT_TRUE (Untouched);
+  EXPECT_EQ (machine->Vic.Reg[0x20], 0x05);
+  EXPECT_EQ (machine->Vic.Raster, 0u);
+  EXPECT_EQ (machine->Vic.Row (VIC::FIRST_LINE)[0], VIC_PALETTE[0x05]);
+  EXPECT_EQ (machine->Vic.Row (VIC::FIRST_LINE + VIC::HEIGHT - 1)[0],
+             VIC_PALETTE[0x05]);
+
+  delete machine;
+}
+
+static void
+RecordFrame (void *Context, const Uint32 *Pixels, Uint64 Frame)
+{
+  Uint64 *Log = (Uint64 *)Context;
+  Log[0]++;
+  Log[1] = Frame;
+  Log[2] = Pixels[0];
+}
+
+TEST (VicTest, VideoSinkGetsRenderedFramesEvenWhileWarping)
+{
+  // given: the border set to colour 5, warp mode
+  Machine *machine = new Machine;
+  machine->Reset ();
+  LoadLoopProgram (machine->Mem);
+  machine->Vic.Write (0xD020, 0x05);
+  Uint64 Log[3] = { 0 };
+  machine->VideoSink = RecordFrame;
+  machine->VideoSinkContext = Log;
+  machine->Warp = true;
+
+  // when:
+  machine->RunFrame ();
+  machine->RunFrame ();
+
+  // then:
+  EXPECT_EQ (Log[0], 2u);
+  EXPECT_EQ (Log[1], 1u);
+  EXPECT_EQ (Log[2], VIC_PALETTE[0x05]);
+
+  delete machine;
+}
+
+static void
+RecordEvent (void *Context, Uint64 Time)
+{
+  Uint64 *Log = (Uint64 *)Context;
+  Log[++Log[0]] = Time;
+}
+
+TEST (SchedulerTest, DispatchesInTimeOrderAndSkipsBlockedWindows)
+{
+  // given:
+  Scheduler events;
+  Uint64 Log[8] = { 0 };
+  events.Schedule (30, RecordEvent, Log);
+  events.Schedule (10, RecordEvent, Log);
+  events.Block (20, 5);
+  events.Schedule (40, RecordEvent, Log);
+
+  // when:
+  Uint64 Clock = events.Dispatch (12);
+  Uint64 First = Log[0];
+  Clock = events.Dispatch (22);
+
+  // then: a window that has begun moves the clock past its end
+  EXPECT_EQ (First, 1u);
+  EXPECT_EQ (Clock, 27u);
+  EXPECT_EQ (events.BlockedCycles, 5u);
+  EXPECT_EQ (Log[0], 1u);
+  EXPECT_EQ (events.NextTime (), 30u);
+
+  Clock = events.Dispatch (35);
+  EXPECT_EQ (Log[0], 2u);
+  EXPECT_EQ (Log[2], 30u);
+
+  events.Cancel (RecordEvent, Log);
+  EXPECT_EQ (events.NextTime (), Scheduler::NEVER);
+}
+
+struct AudioCapture
+{
+  static constexpr Uint32 MAX_SAMPLES = 1 << 16;
+  float Samples[MAX_SAMPLES];
+  Uint32 Count = 0;
+};
+
+static void
+CaptureAudio (void *Context, const float *Samples, Uint32 Count)
+{
+  AudioCapture *Capture = (AudioCapture *)Context;
+  for (Uint32 i = 0; i < Count; i++)
+    {
+      if (Capture->Count < AudioCapture::MAX_SAMPLES)
+        {
+          Capture->Samples[Capture->Count++] = Samples[i];
+        }
+    }
+}
+
+static Uint64
+TestClock (void *Context)
+{
+  return *(Uint64 *)Context;
+}
+
+static void
+AttachSid (SID *sid, Memory &mem, Uint64 *Clock, AudioCapture *Capture)
+{
+  sid->Reset (mem, VIDEO_PAL.ClockHz);
+  sid->Now = TestClock;
+  sid->NowContext = Clock;
+  sid->Sink = Capture ? CaptureAudio : nullptr;
+  sid->SinkContext = Capture;
+}
+
+TEST (SidTest, WritesTakeEffectAtTheirCycle)
+{
+  // given:
+  Memory mem;
+  SID *sid = new SID;
+  AudioCapture *Capture = new AudioCapture;
+  Uint64 Clock = 0;
+  AttachSid (sid, mem, &Clock, Capture);
+  mem.Write (0xD418, 0x0F);
+  mem.Write (0xD401, 0x10);
+  mem.Write (0xD406, 0xF0);
+
+  // when:
+  Clock = 1000;
+  mem.Write (0xD404, SID::CONTROL_SAW | SID::CONTROL_GATE);
+  Clock = 4000;
+  sid->Synthesize (Clock);
+
+  // then: silent up to the gate, sounding from the first envelope step
+  ASSERT_EQ (Capture->Count, 4000u);
+  float Before = 0, After = 0;
+  for (Uint32 i = 0; i < 1000; i++)
+    {
+      Before = fmaxf (Before, fabsf (Capture->Samples[i]));
+    }
+  for (Uint32 i = 1000; i < 1100; i++)
+    {
+      After = fmaxf (After, fabsf (Capture->Samples[i]));
+    }
+  EXPECT_EQ (Before, 0.0f);
+  EXPECT_GT (After, 0.0f);
+  EXPECT_EQ (sid->Time, 4000u);
+
+  delete Capture;
+  delete sid;
+}
+
+TEST (SidTest, Voice3RegistersCatchUpWithoutOutput)
+{
+  // given: no sink, so only the observable state is advanced
+  Memory mem;
+  SID *sid = new SID;
+  Uint64 Clock = 0;
+  AttachSid (sid, mem, &Clock, nullptr);
+  mem.Write (0xD40F, 0x01);
+  mem.Write (0xD414, 0x80);
+  mem.Write (0xD412, SID::CONTROL_SAW | SID::CONTROL_GATE);
+
+  // when:
+  Clock = 1000;
+  Byte Attacking = mem.Read (0xD41C);
+  Clock = 5000;
+  Byte Sustaining = mem.Read (0xD41C);
+  Byte Osc3 = mem.Read (0xD41B);
+
+  // then: 9 cycles per attack step, decay stops at sustain 8
+  EXPECT_EQ (Attacking, 1000 / 9);
+  EXPECT_EQ (Sustaining, 0x88);
+  EXPECT_EQ (Osc3, (5000 * 0x100) >> 16);
+  EXPECT_EQ (mem.Read (0xD419), 0xFF);
+
+  delete sid;
+}
+
+TEST (SidTest, OutputDoesNotDependOnWhereCatchUpSplits)
+{
+  // given: every stage in use, including sync, ring and noise
+  static const Word Writes[][3] = {
+    { 0, 0xD418, 0x1F },   { 0, 0xD417, 0xF3 },   { 0, 0xD416, 0x40 },
+    { 0, 0xD401, 0x22 },   { 0, 0xD405, 0x11 },   { 0, 0xD406, 0xA4 },
+    { 0, 0xD408, 0x31 },   { 0, 0xD40A, 0x00 },   { 0, 0xD40B, 0x08 },
+    { 0, 0xD40D, 0xF0 },   { 0, 0xD40F, 0x07 },   { 0, 0xD414, 0xF0 },
+    { 10, 0xD404, 0x23 },  { 20, 0xD40B, 0x41 },  { 30, 0xD412, 0x15 },
+    { 3000, 0xD404, 0x22 }, { 5000, 0xD412, 0x81 }, { 7000, 0xD418, 0x6F },
+  };
+  Memory memA, memB;
+  SID *sidA = new SID, *sidB = new SID;
+  AudioCapture *CaptureA = new AudioCapture, *CaptureB = new AudioCapture;
+  Uint64 ClockA = 0, ClockB = 0;
+  AttachSid (sidA, memA, &ClockA, CaptureA);
+  AttachSid (sidB, memB, &ClockB, CaptureB);
+
+  // when: A only catches up at writes, B also every 37 cycles
+  for (const Word *W : Writes)
+    {
+      ClockA = W[0];
+      memA.Write (W[1], (Byte)W[2]);
+      while (ClockB + 37 < W[0])
+        {
+          ClockB += 37;
+          sidB->Synthesize (ClockB);
+        }
+      ClockB = W[0];
+      memB.Write (W[1], (Byte)W[2]);
+    }
+  sidA->Synthesize (10000);
+  for (ClockB = 7000; ClockB < 10000; ClockB += 37)
+    {
+      sidB->Synthesize (ClockB);
+    }
+  sidB->Synthesize (10000);
+
+  // then:
+  ASSERT_EQ (CaptureA->Count, 10000u);
+  ASSERT_EQ (CaptureB->Count, 10000u);
+  Uint32 Mismatches = 0;
+  float Peak = 0;
+  for (Uint32 i = 0; i < 10000; i++)
+    {
+      Mismatches += CaptureA->Samples[i] != CaptureB->Samples[i];
+      Peak = fmaxf (Peak, fabsf (CaptureA->Samples[i]));
+    }
+  EXPECT_EQ (Mismatches, 0u);
+  EXPECT_GT (Peak, 0.01f);
+  EXPECT_EQ (memA.Read (0xD41C), memB.Read (0xD41C));
+
+  delete CaptureA;
+  delete CaptureB;
+  delete sidA;
+  delete sidB;
+}
+
+TEST (SidTest, MachineTimestampsCpuWritesAndFlushesAtFrameEnd)
+{
+  // given: a loop that sets up voice 1 and keeps it gated
+  Machine *machine = new Machine;
+  AudioCapture *Capture = new AudioCapture;
+  machine->Reset ();
+  machine->Sid.Sink = CaptureAudio;
+  machine->Sid.SinkContext = Capture;
+  static const Byte Program[] = {
+    INS_LDA_IM, 0x0F, INS_STA_ABS, 0x18, 0xD4, // Volume
+    INS_LDA_IM, 0x10, INS_STA_ABS, 0x01, 0xD4, // Frequency
+    INS_LDA_IM, 0xF0, INS_STA_ABS, 0x06, 0xD4, // Sustain
+    INS_LDA_IM, 0x21, INS_STA_ABS, 0x04, 0xD4, // Saw, gate
+    INS_JMP_ABS, 0x80, 0x44,
+  };
+  machine->Mem[0xFFFC] = INS_JMP_ABS;
+  machine->Mem[0xFFFD] = 0x80;
+  machine->Mem[0xFFFE] = 0x44;
+  memcpy (&machine->Mem.Data[0x4480], Program, sizeof (Program));
+
+  // when:
+  machine->RunFrame ();
+  Uint64 FirstFrame = machine->Clock;
+  Uint32 Heard = Capture->Count;
+  float Peak = 0;
+  for (Uint32 i = 0; i < Heard; i++)
+    {
+      Peak = fmaxf (Peak, fabsf (Capture->Samples[i]));
+    }
+  machine->Warp = true;
+  machine->RunFrame ();
+
+  // then: the SID is caught up to the clock, but quiet in warp
+  EXPECT_EQ (machine->Cpu.RetiredCycles + machine->Events.BlockedCycles,
+             machine->Clock);
+  EXPECT_EQ (Heard, FirstFrame);
+  EXPECT_GT (Peak, 0.1f);
+  EXPECT_EQ (machine->Sid.Time, machine->Clock);
+  EXPECT_EQ (Capture->Count, Heard);
+
+  delete Capture;
+  delete machine;
+}
+
+TEST (AudioTest, ResampledWavHasHeaderAndOneSecondOfSamples)
+{
+  // given:
+  char Path[64];
+  snprintf (Path, sizeof (Path), "/tmp/cbemu_test_%d.wav", getpid ());
+  WavWriter *Wav = new WavWriter;
+  Resampler *Resample = new Resampler;
+  ASSERT_TRUE (Wav->Open (Path, 44100));
+  ASSERT_TRUE (Resample->Configure (VIDEO_PAL.ClockHz, 44100, RESAMPLE_FAST));
+  Resample->Out = WavWriter::Sink;
+  Resample->OutContext = Wav;
+  float Block[1000];
+  for (float &Sample : Block)
+    {
+      Sample = 0.5f;
+    }
+
+  // when: one second at the SID's rate, plus the filter's latency
+  Uint32 Left = VIDEO_PAL.ClockHz + Resample->Latency ();
+  while (Left)
+    {
+      Uint32 Count = Left < 1000 ? Left : 1000;
+      Resampler::Sink (Resample, Block, Count);
+      Left -= Count;
+    }
+  ASSERT_TRUE (Wav->Close ());
+
+  // then: 0.5 all through, once the filter has filled
+  Byte Header[44] = { 0 };
+  Sint16 Samples[44100];
+  FILE *File = fopen (Path, "rb");
+  ASSERT_NE (File, nullptr);
+  fread (Header, 1, sizeof (Header), File);
+  size_t Read = fread (Samples, sizeof (Sint16), 44100, File);
+  fseek (File, 0, SEEK_END);
+  long Size = ftell (File);
+  fclose (File);
+  unlink (Path);
+  EXPECT_EQ (memcmp (Header, "RIFF", 4), 0);
+  EXPECT_EQ (memcmp (Header + 8, "WAVEfmt ", 8), 0);
+  EXPECT_EQ (Header[24] | (Header[25] << 8), 44100);
+  EXPECT_EQ (memcmp (Header + 36, "data", 4), 0);
+  EXPECT_EQ (Size, 44 + 2 * (44100 + 1));
+  ASSERT_EQ (Read, 44100u);
+  EXPECT_NEAR (Samples[44099], 16384, 2);
+
+  delete Resample;
+  delete Wav;
+}
+
+struct ResampleCapture
+{
+  static constexpr Uint32 MAX_SAMPLES = 1 << 17;
+  float Samples[MAX_SAMPLES];
+  Uint32 Count = 0;
+};
+
+static void
+CaptureResampled (void *Context, const float *Samples, Uint32 Count)
+{
+  ResampleCapture *Capture = (ResampleCapture *)Context;
+  for (Uint32 i = 0; i < Count && Capture->Count < ResampleCapture::MAX_SAMPLES;
+       i++)
+    {
+      Capture->Samples[Capture->Count++] = Samples[i];
+    }
+}
+
+/* Amplitude of the Hz component of Samples at Rate (Goertzel). Exact for
+ * whole Hz over whole seconds. */
+static double
+ToneAmplitude (const float *Samples, Uint32 Count, double Hz, Uint32 Rate)
+{
+  double Coefficient = 2 * cos (2 * M_PI * Hz / Rate);
+  double S1 = 0, S2 = 0;
+  for (Uint32 i = 0; i < Count; i++)
+    {
+      double S0 = Samples[i] + Coefficient * S1 - S2;
+      S2 = S1;
+      S1 = S0;
+    }
+  double Power = S1 * S1 + S2 * S2 - Coefficient * S1 * S2;
+  return 2 * sqrt (Power) / Count;
+}
+
+/* One second of a 1 kHz tone plus a 30 kHz one that folds to 14.1 kHz
+ * at 44.1 kHz, resampled from the PAL clock */
+static void
+ResampleReferenceTone (ResampleQuality Quality, double &Passed,
+                       double &Aliased)
+{
+  Resampler *Resample = new Resampler;
+  ResampleCapture *Capture = new ResampleCapture;
+  Resample->Configure (VIDEO_PAL.ClockHz, 44100, Quality);
+  Resample->Out = CaptureResampled;
+  Resample->OutContext = Capture;
+
+  const Uint32 Rate = VIDEO_PAL.ClockHz;
+  float Block[4096];
+  for (Uint32 Done = 0; Done < Rate + Rate / 10;)
+    {
+      Uint32 Count = 0;
+      for (; Count < 4096; Count++, Done++)
+        {
+          double t = (double)Done / Rate;
+          Block[Count] = (float)(0.5 * sin (2 * M_PI * 1000 * t)
+                                 + 0.5 * sin (2 * M_PI * 30000 * t));
+        }
+      Resample->Push (Block, Count);
+    }
+
+  // Skip the start, where the filter runs into silence
+  const float *Second = Capture->Samples + 4410;
+  Passed = ToneAmplitude (Second, 44100, 1000, 44100);
+  Aliased = ToneAmplitude (Second, 44100, 14100, 44100);
+
+  delete Capture;
+  delete Resample;
+}
+
+TEST (ResampleTest, PassesReferenceToneAndRejectsItsAlias)
+{
+  static const double MinRejectionDb[] = { 60, 90, 110 };
+  for (Byte q = RESAMPLE_FAST; q <= RESAMPLE_BEST; q++)
+    {
+      // when:
+      double Passed, Aliased;
+      ResampleReferenceTone ((ResampleQuality)q, Passed, Aliased);
+
+      // then:
+      double RejectionDb = 20 * log10 (Passed / Aliased);
+      EXPECT_NEAR (Passed, 0.5, 0.005) << RESAMPLE_TIERS[q].Name;
+      EXPECT_GT (RejectionDb, MinRejectionDb[q]) << RESAMPLE_TIERS[q].Name;
+    }
+}
+
+TEST (ResampleTest, StreamingDoesNotDependOnBlockSizes)
+{
+  // given:
+  Resampler *Whole = new Resampler, *Pieces = new Resampler;
+  ResampleCapture *A = new ResampleCapture, *B = new ResampleCapture;
+  Whole->Configure (VIDEO_PAL.ClockHz, 48000, RESAMPLE_MEDIUM);
+  Pieces->Configure (VIDEO_PAL.ClockHz, 48000, RESAMPLE_MEDIUM);
+  Whole->Out = Pieces->Out = CaptureResampled;
+  Whole->OutContext = A;
+  Pieces->OutContext = B;
+  static float Input[20000];
+  for (Uint32 i = 0; i < 20000; i++)
+    {
+      Input[i] = (float)sin (i * 0.001) * ((i / 700) & 1 ? 1.0f : -0.5f);
+    }
+
+  // when:
+  Whole->Push (Input, 20000);
+  for (Uint32 Done = 0, Size = 1; Done < 20000; Size = Size * 3 % 997 + 1)
+    {
+      Uint32 Count = 20000 - Done < Size ? 20000 - Done : Size;
+      Pieces->Push (Input + Done, Count);
+      Done += Count;
+    }
+
+  // then: every output whose filter the input covers is out
+  Uint32 Expected = (20000 - Whole->Latency ()) * 48000ull
+                    / VIDEO_PAL.ClockHz + 1;
+  EXPECT_EQ (A->Count, Expected);
+  ASSERT_EQ (A->Count, B->Count);
+  EXPECT_EQ (memcmp (A->Samples, B->Samples, A->Count * sizeof (float)), 0);
+
+  delete A;
+  delete B;
+  delete Whole;
+  delete Pieces;
+}
+
+TEST (ResampleTest, VectorDotMatchesScalarReference)
+{
+  // given:
+  float X[96], Y[96];
+  for (Uint32 i = 0; i < 96; i++)
+    {
+      X[i] = (float)sin (i * 0.7);
+      Y[i] = (float)cos (i * 0.3) / (i + 1);
+    }
+
+  // when:
+  float Vector = Resampler::Dot<true> (X + 1, Y, 80);
+  float Scalar = Resampler::Dot<false> (X + 1, Y, 80);
+
+  // then:
+  EXPECT_NEAR (Vector, Scalar, 1e-5f);
+}
+
+static void
+AttachCia (CIA *cia, Memory &mem, Scheduler &events, Uint64 *Clock)
+{
+  cia->Now = TestClock;
+  cia->NowContext = Clock;
+  cia->Reset (mem, 0xDC, VIDEO_PAL.ClockHz, VIDEO_PAL.MainsHz, events);
+}
+
+TEST (CiaTest, TimerIsComputedOnReadAndUnderflowsAsAnEvent)
+{
+  // given:
+  Memory mem;
+  Scheduler events;
+  CIA *cia = new CIA;
+  Uint64 Clock = 0;
+  AttachCia (cia, mem, events, &Clock);
+  mem.Write (0xDC0D, CIA::ICR_SET | CIA::ICR_TA);
+  mem.Write (0xDC04, 100);
+  mem.Write (0xDC05, 0);
+
+  // when:
+  mem.Write (0xDC0E, CIA::CR_START);
+  Clock = 30;
+  Byte Running = mem.Read (0xDC04);
+  Uint64 Due = events.NextTime ();
+  events.Dispatch (101);
+
+  // then: 100 down to 0, reload on the cycle after
+  EXPECT_EQ (Running, 70);
+  EXPECT_EQ (Due, 101u);
+  EXPECT_TRUE (cia->Interrupt ());
+  Clock = 111;
+  EXPECT_EQ (mem.Read (0xDC04), 90);
+  EXPECT_EQ (mem.Read (0xDC0D), 0x81);
+  EXPECT_EQ (mem.Read (0xDC0D), 0x00);
+  EXPECT_FALSE (cia->Interrupt ());
+  EXPECT_EQ (events.NextTime (), 202u);
+
+  delete cia;
+}
+
+TEST (CiaTest, ReadsSettleUnderflowsTheRunLoopHasNotDispatched)
+{
+  // given: a one-shot timer whose event is still queued
+  Memory mem;
+  Scheduler events;
+  CIA *cia = new CIA;
+  Uint64 Clock = 0;
+  AttachCia (cia, mem, events, &Clock);
+  mem.Write (0xDC04, 10);
+  mem.Write (0xDC05, 0);
+  mem.Write (0xDC0E, CIA::CR_START | CIA::CR_ONE_SHOT);
+
+  // when: an instruction runs three cycles past the underflow
+  Clock = 14;
+  Byte Icr = mem.Read (0xDC0D);
+
+  // then: stopped and reloaded, and nothing left to dispatch
+  EXPECT_EQ (Icr, CIA::ICR_TA);
+  EXPECT_EQ (mem.Read (0xDC0E) & CIA::CR_START, 0);
+  EXPECT_EQ (mem.Read (0xDC04), 10);
+  events.Dispatch (1000);
+  EXPECT_EQ (mem.Read (0xDC0D), 0x00);
+
+  delete cia;
+}
+
+TEST (CiaTest, CascadedTimerBCountsTimerAUnderflows)
+{
+  // given:
+  Memory mem;
+  Scheduler events;
+  CIA *cia = new CIA;
+  Uint64 Clock = 0;
+  AttachCia (cia, mem, events, &Clock);
+  mem.Write (0xDC04, 9);
+  mem.Write (0xDC05, 0);
+  mem.Write (0xDC06, 2);
+  mem.Write (0xDC07, 0);
+  mem.Write (0xDC0F, CIA::CRB_CASCADE | CIA::CR_START);
+  mem.Write (0xDC0E, CIA::CR_START);
+
+  // when: timer A underflows at 10, 20 and 30
+  Clock = events.Dispatch (25);
+  Byte Counted = mem.Read (0xDC06);
+  Byte Before = mem.Read (0xDC0D);
+  Clock = events.Dispatch (30);
+
+  // then: B goes 2, 1, 0 and underflows on the third
+  EXPECT_EQ (Counted, 0);
+  EXPECT_EQ (Before, CIA::ICR_TA);
+  EXPECT_EQ (mem.Read (0xDC0D), CIA::ICR_TA | CIA::ICR_TB);
+  EXPECT_EQ (mem.Read (0xDC06), 2);
+
+  delete cia;
+}
+
+TEST (CiaTest, TodCountsTenthsLatchesOnHoursAndRaisesAlarm)
+{
+  // given: 50 Hz mains, alarm at 1:00:01.5
+  Memory mem;
+  Scheduler events;
+  CIA *cia = new CIA;
+  Uint64 Clock = 0;
+  AttachCia (cia, mem, events, &Clock);
+  mem.Write (0xDC0E, CIA::CRA_TOD_50HZ);
+  mem.Write (0xDC0D, CIA::ICR_SET | CIA::ICR_ALARM);
+  mem.Write (0xDC0F, CIA::CRB_ALARM);
+  mem.Write (0xDC0B, 0x01);
+  mem.Write (0xDC0A, 0x00);
+  mem.Write (0xDC09, 0x01);
+  mem.Write (0xDC08, 0x05);
+  mem.Write (0xDC0F, 0);
+  const Uint64 Tenth = VIDEO_PAL.ClockHz / 10; // Whole cycles short
+
+  // when:
+  Clock = 12 * Tenth + 100;
+  Byte Hours = mem.Read (0xDC0B);
+  Clock = 14 * Tenth + 100;
+  Byte Seconds = mem.Read (0xDC09);
+  Byte Tenths = mem.Read (0xDC08);
+  Byte Unlatched = mem.Read (0xDC08);
+
+  // then:
+  EXPECT_EQ (Hours, 0x01);
+  EXPECT_EQ (Seconds, 0x01);
+  EXPECT_EQ (Tenths, 2);
+  EXPECT_EQ (Unlatched, 4);
+  EXPECT_EQ (events.NextTime (), 1477872u); // 1.5 s of the PAL clock
+  EXPECT_FALSE (cia->Interrupt ());
+  events.Dispatch (events.NextTime ());
+  EXPECT_TRUE (cia->Interrupt ());
+  Clock = 1477872;
+  EXPECT_EQ (mem.Read (0xDC0D), CIA::ICR_SET | CIA::ICR_ALARM);
+  EXPECT_EQ (mem.Read (0xDC08), 5);
+
+  delete cia;
+}
+
+TEST (CiaTest, MachineRunsTimersAndCia2SelectsVicBank)
+{
+  // given:
+  Machine *machine = new Machine;
+  machine->Reset ();
+  LoadLoopProgram (machine->Mem);
+
+  // when:
+  machine->Mem.Write (0xDD02, 0x03);
+  machine->Mem.Write (0xDD00, 0x01);
+  machine->Mem.Write (0xDC04, 0x25);
+  machine->Mem.Write (0xDC05, 0x40); // The KERNAL's 1/60 s
+  machine->Mem.Write (0xDC0E, CIA::CR_START | CIA::CR_LOAD);
+  machine->RunFrame ();
+
+  // then: one underflow per 0x4026 cycles
+  EXPECT_EQ (machine->Vic.Bank, 2);
+  EXPECT_EQ (machine->Mem.Read (0xDC0D), CIA::ICR_TA);
+  Word Expected = 0x4025 - (machine->Clock - 0x4026) % 0x4026;
+  EXPECT_EQ (machine->Mem.Read (0xDC04) | (machine->Mem.Read (0xDC05) << 8),
+             Expected);
+
+  delete machine;
+}
+
+static void
+AttachVia (VIA *via, Memory &mem, Uint64 *Clock)
+{
+  via->Now = TestClock;
+  via->NowContext = Clock;
+  via->Reset (mem, 0x18, 0x1B);
+}
+
+TEST (ViaTest, TimerOneFreeRunsAndFlagsUnderflowsWhenRead)
+{
+  // given:
+  Memory mem;
+  VIA *via = new VIA;
+  Uint64 Clock = 0;
+  AttachVia (via, mem, &Clock);
+  mem.Write (0x180B, VIA::ACR_T1_FREE_RUN);
+  mem.Write (0x1806, 10);
+
+  // when:
+  mem.Write (0x1805, 0);
+  Clock = 4;
+  Byte Running = mem.Read (0x1804);
+  Clock = 11;
+  Byte Underflowed = mem.Read (0x1805);
+  Clock = 12;
+  Byte Flags = mem.Read (0x180D);
+  Byte Reloaded = mem.Read (0x1804);
+  Clock = 30;
+  Byte Again = mem.Read (0x180D);
+  Byte Later = mem.Read (0x1804);
+
+  // then: 10 down to 0, $FFFF, then from the latch every 12 cycles
+  EXPECT_EQ (Running, 6);
+  EXPECT_EQ (Underflowed, 0xFF);
+  EXPECT_EQ (Flags, VIA::IFR_T1);
+  EXPECT_EQ (Reloaded, 10);
+  EXPECT_EQ (Again, VIA::IFR_T1);
+  EXPECT_EQ (Later, 4);
+
+  // when: one-shot
+  mem.Write (0x180B, 0);
+  Clock = 100;
+  mem.Write (0x1806, 5);
+  mem.Write (0x1805, 0);
+  Clock = 106;
+  Byte Once = mem.Read (0x180D);
+  mem.Read (0x1804);
+  Clock = 200;
+
+  // then: flags once and keeps counting down
+  EXPECT_EQ (Once, VIA::IFR_T1);
+  EXPECT_EQ (mem.Read (0x180D), 0);
+  EXPECT_EQ (mem.Read (0x1804), (Byte)(5 - 100));
+
+  delete via;
+}
+
+TEST (ViaTest, PortsReadPinsAndCa1RaisesItsFlag)
+{
+  // given:
+  Memory mem;
+  VIA *via = new VIA;
+  Uint64 Clock = 0;
+  AttachVia (via, mem, &Clock);
+  via->Input[VIA::PORT_B] = 0x0F;
+  via->Input[VIA::PORT_A] = 0xFE;
+
+  // when:
+  mem.Write (0x1802, 0xF0);
+  mem.Write (0x1800, 0xA5);
+  mem.Write (0x1803, 0xFF);
+  mem.Write (0x1801, 0x03);
+  mem.Write (0x180C, VIA::PCR_CA1_RISING);
+  mem.Write (0x180E, VIA::IER_SET | VIA::IFR_CA1);
+  via->SetCa1 (true);
+
+  // then: port B outputs read back their register, port A its pins
+  EXPECT_EQ (mem.Read (0x1800), 0xAF);
+  EXPECT_EQ (mem.Read (0x180D), VIA::IFR_ANY | VIA::IFR_CA1);
+  EXPECT_TRUE (via->Interrupt ());
+  EXPECT_EQ (mem.Read (0x1801), 0x02);
+  EXPECT_EQ (mem.Read (0x180D), 0);
+  via->SetCa1 (false);
+  EXPECT_EQ (mem.Read (0x180D), 0);
+
+  delete via;
+}
+
+/* Drive program: answers ATN by pulling DATA (acknowledging it through
+ * ATNA) and otherwise pulls CLK, through a table indexed by port B */
+static void
+LoadDriveEcho (Drive1541 *drive)
+{
+  Memory &mem = drive->Mem;
+  const Byte Program[] = {
+    INS_LDA_IM,  0x1A,                // Outputs: DATA, CLK, ATNA
+    INS_STA_ABS, 0x02, 0x18,          // DDRB
+    INS_LDX_ABS, 0x00, 0x18,          // Loop: port B
+    INS_LDA_ABX, 0x00, 0x06,          // Table
+    INS_STA_ABS, 0x00, 0x18,
+    INS_JMP_ABS, 0x05, 0x05,
+  };
+  memcpy (mem.Data + 0x0500, Program, sizeof (Program));
+  for (Uint32 In = 0; In < 256; In++)
+    {
+      mem[0x0600 + In] = (In & Drive1541::PB_ATN_IN)
+                             ? Drive1541::PB_DATA_OUT | Drive1541::PB_ATN_ACK
+                             : Drive1541::PB_CLK_OUT;
+    }
+  drive->Cpu.PC = 0x0500;
+}
+
+TEST (DriveTest, AcknowledgesAtnOneWindowLater)
+{
+  // given:
+  Drive1541 *drive = new Drive1541;
+  drive->Reset (VIDEO_PAL.ClockHz);
+  drive->Mem.Write (0x1802, Drive1541::PB_DATA_OUT | Drive1541::PB_CLK_OUT
+                                | Drive1541::PB_ATN_ACK);
+  drive->Mem.Write (0x180C, VIA::PCR_CA1_RISING);
+  drive->Mem[0x0200] = INS_JMP_ABS;
+  drive->Mem[0x0201] = 0x00;
+  drive->Mem[0x0202] = 0x02;
+  drive->Cpu.PC = 0x0200;
+
+  // when: the host pulls ATN from the end of window 0
+  Byte Before = drive->EndWindow (IEC_ATN);
+  Byte After = drive->EndWindow (IEC_ATN);
+  Byte Port = drive->Mem.Read (0x1800);
+  Byte Flags = drive->Mem.Read (0x180D);
+  drive->Mem.Write (0x1800, Drive1541::PB_ATN_ACK);
+  Byte Acknowledged = drive->EndWindow (IEC_ATN);
+
+  // then: the drive pulls DATA by itself until ATNA matches
+  EXPECT_EQ (Before, 0);
+  EXPECT_EQ (After, IEC_DATA);
+  EXPECT_EQ (Port & (Drive1541::PB_ATN_IN | Drive1541::PB_DATA_IN),
+             Drive1541::PB_ATN_IN | Drive1541::PB_DATA_IN);
+  EXPECT_EQ (Flags, VIA::IFR_CA1);
+  EXPECT_EQ (Acknowledged, 0);
+  EXPECT_EQ (drive->Windows (), 3u);
+  // then: at 1 MHz, to within the instruction that crosses the window
+  Uint64 Due = 3 * drive->Window * Drive1541::CLOCK_HZ / VIDEO_PAL.ClockHz;
+  EXPECT_GE (drive->Cpu.RetiredCycles, Due);
+  EXPECT_LT (drive->Cpu.RetiredCycles, Due + 3);
+
+  delete drive;
+}
+
+/* Host program: toggles ATN every 16 samples of CIA 2 port A, stored
+ * from $4000 */
+static void
+RunSerialProgram (Machine *machine, bool Threaded)
+{
+  Drive1541 *drive = new Drive1541;
+  machine->Drive = drive;
+  machine->Reset ();
+  LoadDriveEcho (drive);
+
+  Memory &mem = machine->Mem;
+  Word At = 0x1000;
+  const Byte Setup[] = { INS_LDA_IM, 0x3F, INS_STA_ABS, 0x02, 0xDD };
+  memcpy (mem.Data + At, Setup, sizeof (Setup));
+  At += sizeof (Setup);
+  for (Uint32 i = 0; i < 256; i++)
+    {
+      Word To = 0x4000 + i;
+      const Byte Sample[] = {
+        INS_LDA_IM,  (Byte)((i / 16) % 2 ? 0x0B : 0x03),
+        INS_STA_ABS, 0x00,
+        0xDD,        INS_LDA_ABS,
+        0x00,        0xDD,
+        INS_STA_ABS, (Byte)(To & 0xFF),
+        (Byte)(To >> 8),
+      };
+      memcpy (mem.Data + At, Sample, sizeof (Sample));
+      At += sizeof (Sample);
+    }
+  mem[At] = INS_JMP_ABS;
+  mem[At + 1] = At & 0xFF;
+  mem[At + 2] = At >> 8;
+  machine->Cpu.PC = 0x1000;
+
+  if (Threaded)
+    {
+      drive->Start ();
+    }
+  machine->RunFrame ();
+  machine->RunFrame ();
+  drive->Stop ();
+}
+
+TEST (DriveTest, ThreadedRunMatchesInterleavedRun)
+{
+  // given:
+  Machine *Interleaved = new Machine;
+  Machine *Threaded = new Machine;
+
+  // when:
+  RunSerialProgram (Interleaved, false);
+  RunSerialProgram (Threaded, true);
+  Drive1541 *A = Interleaved->Drive;
+  Drive1541 *B = Threaded->Drive;
+  while (A->Windows () < B->Windows ())
+    {
+      A->RunWindow ();
+    }
+
+  // then: the drive answered ATN within each group of samples
+  for (Uint32 Group = 0; Group < 16; Group++)
+    {
+      Byte Last = Interleaved->Mem[0x4000 + Group * 16 + 15];
+      EXPECT_EQ (Last & 0xC0, Group % 2 ? 0x40 : 0x80) << Group;
+    }
+
+  // then: and both runs agree on every cycle's worth of state
+  EXPECT_EQ (Interleaved->Clock, Threaded->Clock);
+  EXPECT_EQ (Interleaved->Cpu.PC, Threaded->Cpu.PC);
+  EXPECT_EQ (memcmp (Interleaved->Mem.Data, Threaded->Mem.Data,
+                     Memory::MAX_MEM),
+             0);
+  EXPECT_EQ (A->Windows (), B->Windows ());
+  EXPECT_EQ (A->Cpu.RetiredCycles, B->Cpu.RetiredCycles);
+  EXPECT_EQ (A->Cpu.PC, B->Cpu.PC);
+  EXPECT_EQ (A->Cpu.X, B->Cpu.X);
+  EXPECT_EQ (memcmp (A->Mem.Data, B->Mem.Data, Memory::MAX_MEM), 0);
+
+  delete A;
+  delete B;
+  delete Interleaved;
+  delete Threaded;
+}
+
+/* A 35 track image whose every sector holds its track and sector
+ * numbers, with disk ID "AB" */
+static void
+WriteTestDisk (const char *Path)
+{
+  FILE *File = fopen (Path, "wb");
+  ASSERT_NE (File, nullptr);
+  for (Uint32 t = 1; t <= 35; t++)
+    {
+      for (Uint32 s = 0; s < D64Image::SectorsIn (t); s++)
+        {
+          Byte Sector[D64Image::SECTOR_SIZE];
+          for (Uint32 i = 0; i < sizeof (Sector); i++)
+            {
+              Sector[i] = (Byte)(t * 7 + s * 3 + i);
+            }
+          if (t == 18 && s == 0)
+            {
+              Sector[0xA2] = 'A';
+              Sector[0xA3] = 'B';
+            }
+          fwrite (Sector, 1, sizeof (Sector), File);
+        }
+    }
+  fclose (File);
+}
+
+/* Decodes the data block of a sector from an encoded track */
+static void
+DecodeSectorFromTrack (const Byte *Gcr, Uint32 Sector, Byte *Out)
+{
+  Uint32 PerSector = 2 * D64Image::SYNC_BYTES + D64Image::HEADER_GCR
+                     + D64Image::HEADER_GAP + D64Image::DATA_GCR
+                     + D64Image::SECTOR_GAP;
+  const Byte *Block = Gcr + Sector * PerSector + 2 * D64Image::SYNC_BYTES
+                      + D64Image::HEADER_GCR + D64Image::HEADER_GAP;
+  Byte Decoded[260];
+  for (Uint32 i = 0; i < D64Image::DATA_GCR / 5; i++)
+    {
+      D64Image::DecodeGcr (Block + 5 * i, Decoded + 4 * i);
+    }
+  EXPECT_EQ (Decoded[0], D64Image::DATA_ID);
+  memcpy (Out, Decoded + 1, D64Image::SECTOR_SIZE);
+}
+
+TEST (DiskTest, EncodesTracksOnFirstReadAndWritesSectorsBackOnFlush)
+{
+  // given:
+  char Path[64];
+  snprintf (Path, sizeof (Path), "/tmp/cbemu_test_%d.d64", getpid ());
+  WriteTestDisk (Path);
+  D64Image *Disk = new D64Image;
+
+  // when:
+  ASSERT_TRUE (Disk->Open (Path, true));
+  bool EncodedOnOpen = Disk->Encoded (1);
+  Uint32 Length = 0;
+  const Byte *Gcr = Disk->ReadTrack (1, Length);
+  Byte Sector[D64Image::SECTOR_SIZE];
+  DecodeSectorFromTrack (Gcr, 5, Sector);
+
+  // then: only the track read is encoded, and decodes to its sectors
+  EXPECT_EQ (Disk->Tracks (), 35u);
+  EXPECT_FALSE (EncodedOnOpen);
+  EXPECT_TRUE (Disk->Encoded (1));
+  EXPECT_FALSE (Disk->Encoded (2));
+  EXPECT_EQ (Length, 7692u);
+  EXPECT_EQ (memcmp (Sector, Disk->ReadSector (1, 5), sizeof (Sector)), 0);
+  EXPECT_EQ (Gcr[0], 0xFF);
+  EXPECT_EQ (Gcr[D64Image::SYNC_BYTES], 0x52); // Header block ID $08
+
+  // when: a sector changes
+  Byte Changed[D64Image::SECTOR_SIZE];
+  memset (Changed, 0xA5, sizeof (Changed));
+  Disk->WriteSector (1, 5, Changed);
+  bool EncodedAfterWrite = Disk->Encoded (1);
+  Gcr = Disk->ReadTrack (1, Length);
+  DecodeSectorFromTrack (Gcr, 5, Sector);
+  FILE *File = fopen (Path, "rb");
+  Byte OnDisk[D64Image::SECTOR_SIZE];
+  fseek (File, 5 * D64Image::SECTOR_SIZE, SEEK_SET);
+  fread (OnDisk, 1, sizeof (OnDisk), File);
+  fclose (File);
+  EXPECT_TRUE (Disk->Flush ());
+  Byte Flushed[D64Image::SECTOR_SIZE];
+  File = fopen (Path, "rb");
+  fseek (File, 5 * D64Image::SECTOR_SIZE, SEEK_SET);
+  fread (Flushed, 1, sizeof (Flushed), File);
+  fclose (File);
+
+  // then: re-encoded on the next read, written to the file on flush
+  EXPECT_FALSE (EncodedAfterWrite);
+  EXPECT_EQ (memcmp (Sector, Changed, sizeof (Sector)), 0);
+  EXPECT_EQ (OnDisk[0], (Byte)(1 * 7 + 5 * 3));
+  EXPECT_EQ (memcmp (Flushed, Changed, sizeof (Flushed)), 0);
+  EXPECT_EQ (memcmp (Disk->ReadSector (1, 5), Changed, sizeof (Changed)), 0);
+
+  delete Disk;
+  unlink (Path);
+}
+
+TEST (DiskTest, HeadWritesDecodeBackIntoSectors)
+{
+  // given:
+  char Path[64];
+  snprintf (Path, sizeof (Path), "/tmp/cbemu_test_%d.d64", getpid ());
+  WriteTestDisk (Path);
+  D64Image *Disk = new D64Image;
+  ASSERT_TRUE (Disk->Open (Path, false));
+  Byte Before[D64Image::SECTOR_SIZE];
+  memcpy (Before, Disk->ReadSector (20, 2), sizeof (Before));
+
+  // when: the head rewrites one data block and garbles another
+  Byte Block[260] = { D64Image::DATA_ID };
+  for (Uint32 i = 1; i <= D64Image::SECTOR_SIZE; i++)
+    {
+      Block[i] = (Byte)i;
+      Block[257] ^= Block[i];
+    }
+  Uint32 Length = 0;
+  Byte *Gcr = Disk->WriteTrack (20, Length);
+  Uint32 PerSector = 2 * D64Image::SYNC_BYTES + D64Image::HEADER_GCR
+                     + D64Image::HEADER_GAP + D64Image::DATA_GCR
+                     + D64Image::SECTOR_GAP;
+  Uint32 Data = 2 * D64Image::SYNC_BYTES + D64Image::HEADER_GCR
+                + D64Image::HEADER_GAP;
+  D64Image::EncodeBlock (Block, sizeof (Block), Gcr + PerSector + Data);
+  Gcr[2 * PerSector + Data + 100] ^= 0x01;
+
+  // then: the good block reaches its sector, the bad one is ignored
+  const Byte *Sector = Disk->ReadSector (20, 1);
+  EXPECT_EQ (memcmp (Sector, Block + 1, D64Image::SECTOR_SIZE), 0);
+  EXPECT_EQ (memcmp (Disk->ReadSector (20, 2), Before, sizeof (Before)), 0);
+  EXPECT_FALSE (Disk->Flush ()); // Opened read-only
+
+  delete Disk;
+  unlink (Path);
+}
+
+TEST (DriveTest, HeadStepsAndReadsSyncAndGcrAsTheDiskTurns)
+{
+  // given:
+  char Path[64];
+  snprintf (Path, sizeof (Path), "/tmp/cbemu_test_%d.d64", getpid ());
+  WriteTestDisk (Path);
+  D64Image *Disk = new D64Image;
+  ASSERT_TRUE (Disk->Open (Path, false));
+  Drive1541 *drive = new Drive1541;
+  drive->Reset (VIDEO_PAL.ClockHz);
+  drive->Disk = Disk;
+  Memory &mem = drive->Mem;
+
+  // when: motor on, then two half steps out from track 18
+  mem.Write (0x1C02, Drive1541::PB_STEPPER | Drive1541::PB_MOTOR);
+  Uint32 Stepped = drive->HalfTrack;
+  mem.Write (0x1C00, Drive1541::PB_MOTOR | 3);
+  mem.Write (0x1C00, Drive1541::PB_MOTOR | 2);
+  mem.Write (0x1C00, Drive1541::PB_MOTOR | 1);
+  Uint32 Track = drive->HalfTrack / 2;
+  bool EncodedBeforeRead = Disk->Encoded (17);
+  drive->Cpu.RetiredCycles = 2 * 26; // Byte 2: sync
+  Byte Sync = mem.Read (0x1C00) & Drive1541::PB_SYNC;
+  drive->Cpu.RetiredCycles = 5 * 26 + 25; // Byte 5: header
+  Byte Header = mem.Read (0x1C01);
+  Byte NoSync = mem.Read (0x1C00) & Drive1541::PB_SYNC;
+
+  // then:
+  EXPECT_EQ (Stepped, 37u); // Port B floated high, phase 3 to 0 is in
+  EXPECT_EQ (Track, 17u);
+  EXPECT_FALSE (EncodedBeforeRead);
+  EXPECT_EQ (Sync, 0);
+  EXPECT_EQ (Header, 0x52);
+  EXPECT_EQ (NoSync, Drive1541::PB_SYNC);
+  EXPECT_TRUE (Disk->Encoded (17));
+  EXPECT_FALSE (Disk->Encoded (18));
+
+  delete drive;
+  delete Disk;
+  unlink (Path);
+}
+
+/* An empty, formatted disk: the BAM with every sector outside the
+ * directory track free, and one empty directory sector */
+static void
+FormatTestDisk (const char *Path, D64Image *Disk)
+{
+  FILE *File = fopen (Path, "wb");
+  ASSERT_NE (File, nullptr);
+  Byte Zero[D64Image::SECTOR_SIZE] = {};
+  for (Uint32 s = 0; s < 683; s++)
+    {
+      fwrite (Zero, 1, sizeof (Zero), File);
+    }
+  fclose (File);
+  ASSERT_TRUE (Disk->Open (Path, true));
+
+  Byte Bam[D64Image::SECTOR_SIZE] = { 18, 1, 0x41 };
+  for (Uint32 t = 1; t <= 35; t++)
+    {
+      Uint32 Sectors = t == 18 ? 0 : D64Image::SectorsIn (t);
+      Bam[4 * t] = Sectors;
+      for (Uint32 s = 0; s < Sectors; s++)
+        {
+          Bam[4 * t + 1 + s / 8] |= 1 << (s % 8);
+        }
+    }
+  Disk->WriteSector (18, 0, Bam);
+  Byte Dir[D64Image::SECTOR_SIZE] = { 0, 0xFF };
+  Disk->WriteSector (18, 1, Dir);
+}
+
+/* Points the KERNAL's file name at Name, for device 8 */
+static void
+SetFileName (Memory &mem, const char *Name, Byte Secondary)
+{
+  Uint32 Length = strlen (Name);
+  memcpy (&mem[0x0340], Name, Length);
+  mem[KernalTraps::NAME_LENGTH] = Length;
+  mem[KernalTraps::NAME_ADDRESS] = 0x40;
+  mem[KernalTraps::NAME_ADDRESS + 1] = 0x03;
+  mem[KernalTraps::SECONDARY] = Secondary;
+  mem[KernalTraps::DEVICE] = 8;
+}
+
+/* At At: LDA #A; LDX #X; LDY #Y; JSR Routine; then loop. Returns the
+ * loop's address. */
+static Word
+LoadKernalCall (Memory &mem, Word At, Byte A, Word XY, Word Routine)
+{
+  Byte Program[] = { INS_LDA_IM, A,
+                     INS_LDX_IM, (Byte)(XY & 0xFF),
+                     INS_LDY_IM, (Byte)(XY >> 8),
+                     INS_JSR, (Byte)(Routine & 0xFF), (Byte)(Routine >> 8),
+                     INS_JMP_ABS, (Byte)((At + 9) & 0xFF),
+                     (Byte)((At + 9) >> 8) };
+  memcpy (&mem[At], Program, sizeof (Program));
+  return At + 9;
+}
+
+TEST (TrapsTest, SaveThenLoadRoundTripsThroughTheDisk)
+{
+  // given:
+  char Path[64];
+  snprintf (Path, sizeof (Path), "/tmp/cbemu_test_%d.d64", getpid ());
+  D64Image *Disk = new D64Image;
+  FormatTestDisk (Path, Disk);
+  Machine *machine = new Machine;
+  machine->Traps.Disk = Disk;
+  machine->Reset ();
+  machine->SetTraps (true);
+  Memory &mem = machine->Mem;
+  for (Uint32 i = 0; i < 0x300; i++)
+    {
+      mem[0x1000 + i] = (Byte)(i * 13);
+    }
+
+  // when: SAVE "DEMO" from $1000-$12FF, clear it, LOAD "0:DE*",8,1
+  mem[0xFB] = 0x00;
+  mem[0xFC] = 0x10;
+  SetFileName (mem, "DEMO", 1);
+  Word SaveDone = LoadKernalCall (mem, 0xC000, 0xFB, 0x1300,
+                                  KernalTraps::SAVE);
+  machine->Cpu.PC = 0xC000;
+  machine->RunFrame ();
+  Word SavedAt = machine->Cpu.PC;
+  bool SaveFailed = machine->Cpu.C;
+  memset (&mem[0x1000], 0, 0x300);
+  SetFileName (mem, "0:DE*", 1);
+  Word LoadDone = LoadKernalCall (mem, 0xC100, 0, 0x2000,
+                                  KernalTraps::LOAD);
+  machine->Cpu.PC = 0xC100;
+  machine->RunFrame ();
+
+  // then: four blocks on the disk, back at $1000 where they came from
+  const Byte *Dir = Disk->ReadSector (18, 1);
+  EXPECT_EQ (SavedAt, SaveDone);
+  EXPECT_FALSE (SaveFailed);
+  EXPECT_EQ (Dir[2], 0x82);
+  EXPECT_EQ (memcmp (Dir + 5, "DEMO\xA0", 5), 0);
+  EXPECT_EQ (Dir[30], 4);
+  EXPECT_EQ (Disk->ReadSector (18, 0)[4 * 17], D64Image::SectorsIn (17) - 4);
+  EXPECT_EQ (machine->Cpu.PC, LoadDone);
+  EXPECT_FALSE (machine->Cpu.C);
+  EXPECT_EQ (machine->Cpu.X | (machine->Cpu.Y << 8), 0x1300);
+  EXPECT_EQ (mem[KernalTraps::STATUS], KernalTraps::STATUS_EOI);
+  EXPECT_EQ (mem[0x1000], 0);
+  EXPECT_EQ (mem[0x12FF], (Byte)(0x2FF * 13));
+  EXPECT_EQ (mem[0x1300], 0);
+  EXPECT_EQ (machine->Traps.Saves, 1u);
+  EXPECT_EQ (machine->Traps.Loads, 1u);
+  EXPECT_FALSE (machine->Paused);
+
+  delete machine;
+  delete Disk;
+  unlink (Path);
+}
+
+TEST (TrapsTest, HostDirectoryLoadsOnlyWhileTrapsAreOn)
+{
+  // given: DEMO.PRG for $0801, and a KERNAL LOAD that never returns
+  char Directory[64], Path[96];
+  snprintf (Directory, sizeof (Directory), "/tmp/cbemu_test_%d", getpid ());
+  ASSERT_EQ (mkdir (Directory, 0700), 0);
+  snprintf (Path, sizeof (Path), "%s/demo.prg", Directory);
+  FILE *File = fopen (Path, "wb");
+  ASSERT_NE (File, nullptr);
+  Byte Prg[] = { 0x01, 0x08, 0xAA, 0xBB, 0xCC };
+  fwrite (Prg, 1, sizeof (Prg), File);
+  fclose (File);
+  Machine *machine = new Machine;
+  machine->Traps.Directory = Directory;
+  machine->Reset ();
+  Memory &mem = machine->Mem;
+  mem[KernalTraps::LOAD] = INS_JMP_ABS;
+  mem[KernalTraps::LOAD + 1] = KernalTraps::LOAD & 0xFF;
+  mem[KernalTraps::LOAD + 2] = KernalTraps::LOAD >> 8;
+  SetFileName (mem, "DEMO", 0);
+  Word Done = LoadKernalCall (mem, 0xC000, 0, 0x4000, KernalTraps::LOAD);
+
+  // when:
+  machine->SetTraps (true);
+  machine->SetTraps (false);
+  machine->Cpu.PC = 0xC000;
+  machine->RunFrame ();
+  Word PCOff = machine->Cpu.PC;
+  Byte LoadedOff = mem[0x4000];
+  machine->SetTraps (true);
+  machine->Cpu.PC = 0xC000;
+  machine->RunFrame ();
+
+  // then: off, the KERNAL has it; on, secondary 0 loads to X/Y
+  EXPECT_EQ (PCOff, KernalTraps::LOAD);
+  EXPECT_EQ (LoadedOff, 0);
+  EXPECT_EQ (machine->Cpu.PC, Done);
+  EXPECT_EQ (mem[0x4000], 0xAA);
+  EXPECT_EQ (mem[0x4002], 0xCC);
+  EXPECT_EQ (mem[0x0801], 0);
+  EXPECT_EQ (machine->Cpu.X | (machine->Cpu.Y << 8), 0x4003);
+  EXPECT_EQ (machine->Traps.Loads, 1u);
+  EXPECT_EQ (machine->Cpu.TrapCount, 2u);
+  EXPECT_EQ (machine->Watch.Count, 0u);
+  EXPECT_FALSE (machine->Cpu.Hooks.Active ()); // Traps leave it unhooked
+
+  // when: stepped onto the trap, past LDA, LDX, LDY and the JSR
+  machine->Cpu.PC = 0xC000;
+  machine->Step (4);
+  Word SteppedTo = machine->Cpu.PC;
+  machine->Step (1);
+
+  // then: the step serves it
+  EXPECT_EQ (SteppedTo, KernalTraps::LOAD);
+  EXPECT_EQ (machine->Cpu.PC, Done);
+  EXPECT_EQ (machine->Traps.Loads, 2u);
+
+  delete machine;
+  unlink (Path);
+  rmdir (Directory);
+}
+
+/* A CRT image of Banks 8K banks at $8000, each filled with its number
+ * unless Bank0 gives bank 0's first bytes */
+static void
+WriteTestCrt (const char *Path, Word Type, Byte Exrom, Byte Game,
+              Uint32 Banks, const Byte *Bank0 = nullptr, Uint32 Length = 0)
+{
+  FILE *File = fopen (Path, "wb");
+  ASSERT_NE (File, nullptr);
+  Byte Header[0x40] = {};
+  memcpy (Header, "C64 CARTRIDGE   ", 16);
+  Header[0x13] = 0x40;
+  Header[0x14] = 0x01;
+  Header[0x16] = Type >> 8;
+  Header[0x17] = Type & 0xFF;
+  Header[0x18] = Exrom;
+  Header[0x19] = Game;
+  memcpy (Header + 0x20, "TEST", 4);
+  fwrite (Header, 1, sizeof (Header), File);
+  for (Uint32 b = 0; b < Banks; b++)
+    {
+      Byte Chip[0x10] = { 'C', 'H', 'I', 'P', 0, 0, 0x20, 0x10 };
+      Chip[0x0B] = b;
+      Chip[0x0C] = 0x80;
+      Chip[0x0E] = 0x20;
+      fwrite (Chip, 1, sizeof (Chip), File);
+      Byte Rom[Cartridge::BANK_SIZE];
+      memset (Rom, b, sizeof (Rom));
+      if (b == 0 && Bank0)
+        {
+          memcpy (Rom, Bank0, Length);
+        }
+      fwrite (Rom, 1, sizeof (Rom), File);
+    }
+  fclose (File);
+}
+
+TEST (CartridgeTest, MagicDeskSwitchesBanksByRepointingPages)
+{
+  // given:
+  char Path[64];
+  snprintf (Path, sizeof (Path), "/tmp/cbemu_test_%d.crt", getpid ());
+  WriteTestCrt (Path, Cartridge::TYPE_MAGIC_DESK, 0, 1, 3);
+  Cartridge *Cart = new Cartridge;
+  ASSERT_TRUE (Cart->Open (Path));
+  Memory mem;
+  mem.Initialize ();
+  Cart->Reset (mem);
+
+  // when:
+  Byte First = mem.Read (0x8000);
+  mem.Write (0x9FFF, 0x55); // Reaches the RAM below
+  mem.Write (0xDE00, 2);
+  Byte Switched = mem.Read (0x9FFF);
+  const Byte *Page = mem.Rom[0x9F];
+  mem.Write (0xDE00, Cartridge::MAGIC_DESK_OFF);
+  Byte Off = mem.Read (0x9FFF);
+
+  // then: bank 2 is read in place from the mapping
+  EXPECT_EQ (Cart->Banks, 3u);
+  EXPECT_STREQ (Cart->Name, "TEST");
+  EXPECT_EQ (First, 0);
+  EXPECT_EQ (Switched, 2);
+  EXPECT_EQ (Page, Cart->Lo[2] + 0x1F00);
+  EXPECT_EQ (Off, 0x55);
+  EXPECT_EQ (mem.Rom[0x80], nullptr);
+  EXPECT_EQ (mem.Rom[0xA0], nullptr);
+  EXPECT_EQ (Cart->Switches, 2u);
+
+  Cart->Close ();
+  EXPECT_EQ (mem.IO[0xDE], nullptr);
+  delete Cart;
+  unlink (Path);
+}
+
+TEST (CartridgeTest, MachineColdStartsThroughTheCbm80Vector)
+{
+  // given: $8009: LDA #$42; JMP $800B
+  char Path[64];
+  snprintf (Path, sizeof (Path), "/tmp/cbemu_test_%d.crt", getpid ());
+  Byte Rom[] = { 0x09, 0x80, 0x09, 0x80, 0xC3, 0xC2, 0xCD, 0x38, 0x30,
+                 INS_LDA_IM, 0x42, INS_JMP_ABS, 0x0B, 0x80 };
+  WriteTestCrt (Path, Cartridge::TYPE_NORMAL, 0, 1, 1, Rom, sizeof (Rom));
+  Cartridge *Cart = new Cartridge;
+  ASSERT_TRUE (Cart->Open (Path));
+  Machine *machine = new Machine;
+  machine->Cart = Cart;
+
+  // when:
+  machine->Reset ();
+  Word Started = machine->Cpu.PC;
+  machine->RunFrame ();
+
+  // then:
+  EXPECT_EQ (Started, 0x8009);
+  EXPECT_EQ (machine->Cpu.A, 0x42);
+  EXPECT_EQ (machine->Cpu.PC, 0x800B);
+  EXPECT_EQ (machine->Mem[0x8009], 0); // RAM is untouched
+
+  delete Cart; // Detaches from the machine's memory
+  delete machine;
+  unlink (Path);
+}
+
+TEST (CartridgeTest, LoadPrgCopiesToItsLoadAddress)
+{
+  // given:
+  char Path[64];
+  snprintf (Path, sizeof (Path), "/tmp/cbemu_test_%d.prg", getpid ());
+  FILE *File = fopen (Path, "wb");
+  ASSERT_NE (File, nullptr);
+  Byte Prg[] = { 0xFE, 0xFF, 0x11, 0x22, 0x33 };
+  fwrite (Prg, 1, sizeof (Prg), File);
+  fclose (File);
+  Memory mem;
+  mem.Initialize ();
+  Word Start = 0, End = 0;
+
+  // when:
+  bool Loaded = LoadPrg (mem, Path, Start, End);
+
+  // then: the byte past $FFFF is dropped
+  EXPECT_TRUE (Loaded);
+  EXPECT_EQ (Start, 0xFFFE);
+  EXPECT_EQ (End, 0x0000);
+  EXPECT_EQ (mem[0xFFFE], 0x11);
+  EXPECT_EQ (mem[0xFFFF], 0x22);
+  EXPECT_EQ (mem[0x0000], 0);
+  EXPECT_FALSE (LoadPrg (mem, "/nonexistent.prg", Start, End));
+
+  unlink (Path);
+}
+
+TEST (BasicTest, InjectBasicStoresTokenizedLinesAndPointers)
+{
+  // given:
+  Memory mem;
+  mem.Initialize ();
+  Word End = 0;
+
+  // when:
+  bool Injected = InjectBasic (mem, "10 PRINT \"HI\":GOTO 10\n", End);
+
+  // then: the line links to the null link closing the program
+  ASSERT_TRUE (Injected);
+  const Byte Expected[] = { 0x11, 0x08, 0x0A, 0x00, 0x99, 0x20, 0x22,
+                            0x48, 0x49, 0x22, 0x3A, 0x89, 0x20, 0x31,
+                            0x30, 0x00, 0x00, 0x00 };
+  for (Uint32 i = 0; i < sizeof (Expected); i++)
+    {
+      EXPECT_EQ (mem[BASIC_START + i], Expected[i]) << "at " << i;
+    }
+  EXPECT_EQ (End, 0x0813);
+  EXPECT_EQ (mem[BASIC_TXTTAB] | (mem[BASIC_TXTTAB + 1] << 8), 0x0801);
+  EXPECT_EQ (mem[BASIC_VARTAB] | (mem[BASIC_VARTAB + 1] << 8), 0x0813);
+  EXPECT_EQ (mem[BASIC_ARYTAB] | (mem[BASIC_ARYTAB + 1] << 8), 0x0813);
+  EXPECT_EQ (mem[BASIC_STREND] | (mem[BASIC_STREND + 1] << 8), 0x0813);
+}
+
+TEST (BasicTest, TokenizeBasicLeavesStringsRemarksAndDataAlone)
+{
+  // given: lower case, '?', and keywords inside strings, REM and DATA
+  const char *Text = "5 if peek(1)>0 then ?\"for\"\r\n"
+                     "\n"
+                     "7 data to,or:rem go on\n";
+  Byte Out[64];
+  Uint32 Length = 0;
+
+  // when:
+  bool Tokenized = TokenizeBasic (Text, 0x1000, Out, sizeof (Out), Length);
+
+  // then:
+  ASSERT_TRUE (Tokenized);
+  const Byte Expected[] = {
+    0x16, 0x10, 0x05, 0x00, 0x8B, 0x20, 0xC2, 0x28, 0x31, 0x29, 0xB1, 0x30,
+    0x20, 0xA7, 0x20, 0x99, 0x22, 0x46, 0x4F, 0x52, 0x22, 0x00,
+    0x2A, 0x10, 0x07, 0x00, 0x83, 0x20, 0x54, 0x4F, 0x2C, 0x4F, 0x52, 0x3A,
+    0x8F, 0x20, 0x47, 0x4F, 0x20, 0x4F, 0x4E, 0x00,
+    0x00, 0x00,
+  };
+  ASSERT_EQ (Length, sizeof (Expected));
+  for (Uint32 i = 0; i < Length; i++)
+    {
+      EXPECT_EQ (Out[i], Expected[i]) << "at " << i;
+    }
+  EXPECT_FALSE (TokenizeBasic ("20 END\n10 END\n", 0x0801, Out,
+                               sizeof (Out), Length));
+  EXPECT_FALSE (TokenizeBasic ("PRINT\n", 0x0801, Out, sizeof (Out), Length));
+  EXPECT_FALSE (TokenizeBasic ("10 PRINT\n", 0x0801, Out, 7, Length));
+}
+
+TEST (BasicTest, TypeKeysFillsTheKeyboardBufferUpToItsSize)
+{
+  // given: two keys already waiting
+  Memory mem;
+  mem.Initialize ();
+  TypeKeys (mem, "ab");
+
+  // when:
+  Uint32 Queued = TypeKeys (mem, "run\n12345678");
+
+  // then:
+  EXPECT_EQ (Queued, 8u);
+  EXPECT_EQ (mem[KEYBOARD_COUNT], 10);
+  const char Expected[] = "ABRUN\r1234";
+  for (Uint32 i = 0; i < 10; i++)
+    {
+      EXPECT_EQ (mem[KEYBOARD_BUFFER + i], (Byte)Expected[i]) << "at " << i;
+    }
+  EXPECT_EQ (TypeKeys (mem, "x"), 0u);
+}
+
+TEST (CaptureTest, FrameHashIsXxh64InAnyChunks)
+{
+  // given:
+  Byte Data[100];
+  for (Uint32 i = 0; i < sizeof (Data); i++)
+    {
+      Data[i] = i * 7 + 3;
+    }
+  FrameHash Hash;
+
+  // when: fed in pieces that straddle the 32-byte stripes
+  const Uint32 Pieces[] = { 1, 30, 2, 33, 34 };
+  const Byte *At = Data;
+  for (Uint32 Size : Pieces)
+    {
+      Hash.Update (At, Size);
+      At += Size;
+    }
+
+  // then:
+  EXPECT_EQ (Hash.Digest (), 0xA61F8D4C170FE531ull);
+  EXPECT_EQ (FrameHash::Of (Data, sizeof (Data)), 0xA61F8D4C170FE531ull);
+  EXPECT_EQ (FrameHash::Of ("", 0), 0xEF46DB3751D8E999ull);
+  EXPECT_EQ (FrameHash::Of ("abc", 3), 0x44BC2CF5AD770999ull);
+}
+
+TEST (CaptureTest, Y4mWriterWritesEveryQueuedFrameAsYuv)
+{
+  // given: three 4x2 frames, white, black, then white again
+  char Path[64];
+  snprintf (Path, sizeof (Path), "/tmp/cbemu_test_%d.y4m", getpid ());
+  Y4mWriter *Capture = new Y4mWriter;
+  ASSERT_TRUE (Capture->Open (Path, 4, 2, 985248, 19656));
+  Uint32 White[8], Black[8];
+  for (Uint32 i = 0; i < 8; i++)
+    {
+      White[i] = 0xFFFFFFFF;
+      Black[i] = 0xFF000000;
+    }
+
+  // when:
+  EXPECT_TRUE (Capture->Push (White));
+  EXPECT_TRUE (Capture->Push (Black));
+  EXPECT_TRUE (Capture->Push (White));
+  EXPECT_TRUE (Capture->Close ());
+
+  // then: Y, U and V planes, full size, in studio range
+  EXPECT_EQ (Capture->Dropped, 0u);
+  FILE *File = fopen (Path, "rb");
+  ASSERT_NE (File, nullptr);
+  char Header[64];
+  ASSERT_NE (fgets (Header, sizeof (Header), File), nullptr);
+  EXPECT_STREQ (Header, "YUV4MPEG2 W4 H2 F13684:273 Ip A1:1 C444\n");
+  const Byte Luma[] = { 235, 16, 235 };
+  for (Byte Y : Luma)
+    {
+      char Frame[8];
+      Byte Planes[24];
+      ASSERT_NE (fgets (Frame, sizeof (Frame), File), nullptr);
+      EXPECT_STREQ (Frame, "FRAME\n");
+      ASSERT_EQ (fread (Planes, 1, sizeof (Planes), File), sizeof (Planes));
+      EXPECT_EQ (Planes[0], Y);
+      EXPECT_EQ (Planes[7], Y);
+      EXPECT_EQ (Planes[8], 128);
+      EXPECT_EQ (Planes[23], 128);
+    }
+  EXPECT_EQ (fgetc (File), EOF);
+  fclose (File);
+
+  delete Capture;
+  unlink (Path);
+}
+
+TEST (ShareTest, ViewerReadsTheNewestFrameAndTheAudioInPlace)
+{
+  // given: a 4x2 segment with room for 8 samples
+  char Name[64];
+  snprintf (Name, sizeof (Name), "/cbemu_test_%d", getpid ());
+  SharedExport *Share = new SharedExport;
+  ASSERT_TRUE (Share->Open (Name, 4, 2, 44100, 8));
+  SharedViewer *Viewer = new SharedViewer;
+  ASSERT_TRUE (Viewer->Attach (Name));
+  SharedViewer::View Seen;
+  bool SeenEarly = Viewer->Latest (Seen);
+  Uint32 Pixels[8] = { 0 };
+
+  // when: four frames, wrapping round the three slots
+  for (Uint32 Frame = 0; Frame < 4; Frame++)
+    {
+      Pixels[0] = Frame;
+      Share->Publish (Pixels, Frame);
+    }
+
+  // then: the newest, valid until the producer comes round to its slot
+  EXPECT_FALSE (SeenEarly);
+  ASSERT_TRUE (Viewer->Latest (Seen));
+  EXPECT_EQ (Seen.Frame, 3u);
+  EXPECT_EQ (Seen.Pixels[0], 3u);
+  EXPECT_EQ (Viewer->Header ()->Frames.load (), 4u);
+  Share->Publish (Pixels, 4);
+  Share->Publish (Pixels, 5);
+  EXPECT_TRUE (Viewer->Valid (Seen));
+  Share->Publish (Pixels, 6);
+  EXPECT_FALSE (Viewer->Valid (Seen));
+
+  // when: audio fills the ring past its end
+  const float Samples[] = { 0.1f, 0.2f, 0.3f, 0.4f, 0.5f, 0.6f, 0.7f };
+  EXPECT_EQ (Share->PushAudio (Samples, 5), 5u);
+  const float *Waiting;
+  ASSERT_EQ (Viewer->PeekAudio (Waiting), 5u);
+  EXPECT_EQ (Waiting[0], 0.1f);
+  Viewer->ConsumeAudio (3);
+  EXPECT_EQ (Share->PushAudio (Samples, 7), 6u);
+
+  // then: what lies in one piece, then the rest from the ring's start
+  ASSERT_EQ (Viewer->PeekAudio (Waiting), 5u);
+  EXPECT_EQ (Waiting[0], 0.4f);
+  EXPECT_EQ (Waiting[4], 0.3f);
+  Viewer->ConsumeAudio (5);
+  ASSERT_EQ (Viewer->PeekAudio (Waiting), 3u);
+  EXPECT_EQ (Waiting[2], 0.6f);
+  EXPECT_EQ (Viewer->Header ()->AudioDropped.load (), 1u);
+
+  delete Share; // Removes the name; the viewer keeps its mapping
+  SharedViewer *Late = new SharedViewer;
+  EXPECT_FALSE (Late->Attach (Name));
+  EXPECT_EQ (Viewer->Header ()->Width, 4u);
+
+  delete Late;
+  delete Viewer;
+}
+
+static void
+AttachReu (REU *reu, Memory &mem, Scheduler &Events, Uint64 *Clock)
+{
+  reu->Now = TestClock;
+  reu->NowContext = Clock;
+  reu->Reset (mem, Events);
+}
+
+/* Sets up a transfer and writes the command */
+static void
+StartReuTransfer (Memory &mem, Word C64, Uint32 Reu, Word Length,
+                  Byte Command)
+{
+  mem.Write (0xDF02, C64 & 0xFF);
+  mem.Write (0xDF03, C64 >> 8);
+  mem.Write (0xDF04, Reu & 0xFF);
+  mem.Write (0xDF05, (Reu >> 8) & 0xFF);
+  mem.Write (0xDF06, Reu >> 16);
+  mem.Write (0xDF07, Length & 0xFF);
+  mem.Write (0xDF08, Length >> 8);
+  mem.Write (0xDF01, Command);
+}
+
+TEST (ReuTest, StashAndFetchCopyBlocksAndHoldTheCpu)
+{
+  // given:
+  Memory mem;
+  mem.Initialize ();
+  Scheduler Events;
+  Uint64 Clock = 100;
+  REU *reu = new REU;
+  AttachReu (reu, mem, Events, &Clock);
+  for (Uint32 i = 0; i < 0x300; i++)
+    {
+      mem[0x2080 + i] = (Byte)(i * 7);
+    }
+  Byte Run = REU::COMMAND_EXECUTE | REU::COMMAND_NO_FF00;
+
+  // when: stash across four C64 pages, then fetch it back with autoload
+  StartReuTransfer (mem, 0x2080, 0x10000, 0x300, Run | REU::TYPE_STASH);
+  Word C64After = mem.Read (0xDF02) | (mem.Read (0xDF03) << 8);
+  Byte BankAfter = mem.Read (0xDF06);
+  Word LengthAfter = mem.Read (0xDF07) | (mem.Read (0xDF08) << 8);
+  Byte Status = mem.Read (0xDF00);
+  Byte StatusCleared = mem.Read (0xDF00);
+  StartReuTransfer (mem, 0x5000, 0x10000, 0x300,
+                    Run | REU::COMMAND_AUTOLOAD | REU::TYPE_FETCH);
+  Uint64 Resumed = Events.Dispatch (Clock);
+
+  // then: a byte per cycle, all of it in bulk
+  EXPECT_EQ (memcmp (&reu->Ram[0x10000], &mem[0x2080], 0x300), 0);
+  EXPECT_EQ (memcmp (&mem[0x5000], &mem[0x2080], 0x300), 0);
+  EXPECT_EQ (C64After, 0x2380);
+  EXPECT_EQ (BankAfter, 0xF9);
+  EXPECT_EQ (LengthAfter, 1);
+  EXPECT_EQ (Status, REU::STATUS_END | REU::STATUS_256K);
+  EXPECT_EQ (StatusCleared, REU::STATUS_256K);
+  EXPECT_EQ (mem.Read (0xDF03), 0x50); // Autoloaded
+  EXPECT_EQ (mem.Read (0xDF08), 0x03);
+  EXPECT_EQ (Resumed, 100u + 2 * 0x300);
+  EXPECT_EQ (reu->BulkBytes, 2u * 0x300);
+
+  delete reu;
+}
+
+static Uint32 ReuTestWrites = 0;
+static Byte ReuTestLast = 0;
+
+static Byte
+ReuTestRead (void *, Word)
+{
+  return 0;
+}
+
+static void
+ReuTestWrite (void *, Word, Byte Value)
+{
+  ReuTestWrites++;
+  ReuTestLast = Value;
+}
+
+TEST (ReuTest, Ff00TriggersVerifyStopsOnMismatchAndDevicesGoBytewise)
+{
+  // given:
+  Memory mem;
+  mem.Initialize ();
+  Scheduler Events;
+  Uint64 Clock = 0;
+  REU *reu = new REU;
+  AttachReu (reu, mem, Events, &Clock);
+  const IOHandler Device = { ReuTestRead, ReuTestWrite, nullptr };
+  mem.MapIO (0xDE, 0xDE, &Device);
+  for (Uint32 i = 0; i < 16; i++)
+    {
+      mem[0x3000 + i] = (Byte)(0xA0 + i);
+    }
+
+  // when: a stash waiting for $FF00
+  StartReuTransfer (mem, 0x3000, 0x100, 16, REU::COMMAND_EXECUTE);
+  Uint64 Waiting = reu->Transfers;
+  mem.Write (0xFF00, 0x12);
+  Uint64 Triggered = reu->Transfers;
+  // A verify against changed memory
+  mem[0x3005] ^= 0xFF;
+  StartReuTransfer (mem, 0x3000, 0x100, 16,
+                    REU::COMMAND_EXECUTE | REU::COMMAND_NO_FF00
+                        | REU::TYPE_VERIFY);
+  Byte Status = mem.Read (0xDF00);
+  Word Stopped = mem.Read (0xDF02) | (mem.Read (0xDF03) << 8);
+  Byte Left = mem.Read (0xDF07);
+  // A fetch into one device register
+  Uint64 Bulk = reu->BulkBytes;
+  mem.Write (0xDF0A, REU::CONTROL_FIX_C64);
+  StartReuTransfer (mem, 0xDE00, 0x100, 4,
+                    REU::COMMAND_EXECUTE | REU::COMMAND_NO_FF00
+                        | REU::TYPE_FETCH);
+
+  // then:
+  EXPECT_EQ (Waiting, 0u);
+  EXPECT_EQ (Triggered, 1u);
+  EXPECT_EQ (mem[0xFF00], 0x12);
+  EXPECT_EQ (mem.IO[0xFF], nullptr);
+  EXPECT_EQ (reu->Ram[0x10F], 0xAF);
+  EXPECT_EQ (Status & (REU::STATUS_END | REU::STATUS_FAULT),
+             REU::STATUS_END | REU::STATUS_FAULT);
+  EXPECT_EQ (Stopped, 0x3006);
+  EXPECT_EQ (Left, 10);
+  EXPECT_EQ (ReuTestWrites, 4u);
+  EXPECT_EQ (ReuTestLast, 0xA3);
+  EXPECT_EQ (reu->BulkBytes, Bulk);
+
+  delete reu;
+}
+
+TEST (PoolTest, CarvesInstancesFromArenasAndRecyclesThemReset)
+{
+  // given:
+  InstancePool *Pool = new InstancePool;
+  const Uint32 Count = 40; // More than one 2 MiB arena holds
+  InstancePool::Instance *Taken[Count];
+
+  // when:
+  for (Uint32 i = 0; i < Count; i++)
+    {
+      Taken[i] = Pool->Acquire ();
+      ASSERT_NE (Taken[i], nullptr);
+    }
+  LoadLoopProgram (Taken[7]->Mem);
+  Taken[7]->Cpu.Run (Taken[7]->Mem, 1000);
+
+  // then:
+  InstancePool::Stats S = Pool->GetStats ();
+  EXPECT_EQ (S.Arenas, 2u);
+  EXPECT_EQ (S.Live, Count);
+  EXPECT_EQ (S.Idle, 0u);
+  EXPECT_GE (S.ResidentBytes, Count * sizeof (Memory));
+  EXPECT_LE (S.ResidentBytes, 2 * InstancePool::ARENA_SIZE);
+  EXPECT_EQ (Taken[7]->Cpu.A, 0x01);
+  for (Uint32 i = 1; i < Count; i++)
+    {
+      Byte *Previous = (Byte *)Taken[i - 1];
+      Byte *This = (Byte *)Taken[i];
+      EXPECT_TRUE (This >= Previous + sizeof (InstancePool::Instance)
+                   || Previous >= This + sizeof (InstancePool::Instance));
+    }
+
+  // when:
+  Pool->Release (Taken[7]);
+  InstancePool::Instance *Again = Pool->Acquire ();
+
+  // then: the same slot, reset, and no new arena
+  EXPECT_EQ (Again, Taken[7]);
+  EXPECT_EQ (Again->Mem[0x4480], 0);
+  EXPECT_EQ (Again->Cpu.PC, 0xFFFC);
+  EXPECT_EQ (Again->Cpu.RetiredCycles, 0u);
+  EXPECT_EQ (Pool->GetStats ().Arenas, 2u);
+  EXPECT_EQ (Pool->GetStats ().Live, Count);
+  delete Pool;
+}
@@ -0,0 +1,60 @@
+#include "../code/resample.cpp"
+#include "../code/vic.cpp"
+#include <time.h>
+
+/* Resampler throughput per quality tier: ten seconds of noise at the PAL
+ * clock down to 44.1 and 48 kHz */
+
+static void
+Discard (void *, const float *, Uint32)
+{
+}
+
+static double
+Seconds ()
+{
+  timespec Now;
+  clock_gettime (CLOCK_MONOTONIC, &Now);
+  return Now.tv_sec + Now.tv_nsec / 1e9;
+}
+
+int
+main ()
+{
+  static const Uint32 OutRates[] = { 44100, 48000 };
+  static float Input[4096];
+  Uint32 Seed = 1;
+  for (float &Sample : Input)
+    {
+      Seed = Seed * 1103515245 + 12345;
+      Sample = (float)(Seed >> 8) / (1 << 23) - 1.0f;
+    }
+
+  const Uint32 Rate = VIDEO_PAL.ClockHz;
+  const Uint32 Emulated = 10;
+  for (Uint32 OutRate : OutRates)
+    {
+      for (Byte q = RESAMPLE_FAST; q <= RESAMPLE_BEST; q++)
+        {
+          static Resampler Resample;
+          Resample.Configure (Rate, OutRate, (ResampleQuality)q);
+          Resample.Out = Discard;
+
+          double Start = Seconds ();
+          for (Uint64 Done = 0; Done < (Uint64)Rate * Emulated;)
+            {
+              Resample.Push (Input, 4096);
+              Done += 4096;
+            }
+          double Elapsed = Seconds () - Start;
+
+          printf ("%-6s -> %5u Hz: %4u taps, %4u phases, latency %3.0f us,"
+                  " %6.2f ms per second, %5.1f ns per output\n",
+                  RESAMPLE_TIERS[q].Name, OutRate, Resample.Taps,
+                  Resample.Phases, Resample.Latency () * 1e6 / Rate,
+                  Elapsed * 1000 / Emulated,
+                  Elapsed * 1e9 / ((double)OutRate * Emulated));
+        }
+    }
+  return 0;
+}